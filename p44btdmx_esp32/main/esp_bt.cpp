@@ -49,9 +49,37 @@ BtAdvertisements& BtAdvertisements::sharedInstance()
 }
 
 
+// advertising interval limits (in 0.625mS units)
+#define ADV_INTERVAL_DEFAULT 0x20 // 20mS
+#define ADV_INTERVAL_MIN 0x20 // 20mS, minimum for non-connectable advertising
+#define ADV_INTERVAL_MAX 0x2000 // 5.12S, so twice that is still within the 10.24S allowed for legacy advertising
+
+
 BtAdvertisements::BtAdvertisements() :
-  mBTInitialized(false)
+  mBTInitialized(false),
+  mAdvInterval(ADV_INTERVAL_DEFAULT)
 {
+  #if BT_EXTENDED_ADVERTISING
+  for (int i=0; i<cNumAdvSets; i++) mAdvParamsSet[i] = false;
+  #endif
+  for (int i=0; i<cNumPipelines; i++) {
+    AdvPipeline& p = mPipelines[i];
+    p.numSets = 0;
+    p.nextSet = 0;
+    p.busy = false;
+    p.restarting = false;
+    p.pending = false;
+    p.pendingLen = 0;
+    p.updateLen = 0;
+    p.updateStarted = Never;
+    p.updateTime = 0;
+    for (int s=0; s<cMaxAdvSets; s++) {
+      p.onAirSince[s] = Never;
+      p.setInterval[s] = 0;
+    }
+    p.holdOffTimer = NULL;
+  }
+  mPipelineMutex = xSemaphoreCreateMutex();
 }
 
 BtAdvertisements::~BtAdvertisements()
@@ -61,6 +89,67 @@ BtAdvertisements::~BtAdvertisements()
 }
 
 
+#if BT_EXTENDED_ADVERTISING
+
+// BLE 5 stack: legacy advertisements are sent as advertising sets with legacy PDUs,
+// extended advertisements as sets with the AD data in AUX_ADV_IND on a secondary channel.
+// Up to cMaxAdvSets sets of each type advertise concurrently, with slightly different intervals.
+// Updating the data of one set stops only that set, the others stay on air meanwhile.
+// Scanning receives both, as extended advertising reports.
+
+static esp_ble_ext_scan_params_t ble_ext_scan_params = {
+  .own_addr_type          = BLE_ADDR_TYPE_PUBLIC,
+  .filter_policy          = BLE_SCAN_FILTER_ALLOW_ALL,
+  .scan_duplicate         = BLE_SCAN_DUPLICATE_DISABLE, // link layer reports all packets, including duplicates
+  .cfg_mask               = ESP_BLE_GAP_EXT_SCAN_CFG_UNCODE_MASK,
+  .uncoded_cfg            = { BLE_SCAN_TYPE_PASSIVE, 0x20, 0x18 }, // same interval/window as legacy scanning
+  .coded_cfg              = { BLE_SCAN_TYPE_PASSIVE, 0x20, 0x18 }
+};
+
+
+// interval offset between advertising sets (in 0.625mS units), so concurrent sets do not stay in lockstep
+#define ADV_SET_INTERVAL_STAGGER 3
+
+// parameter templates, interval and SID are adjusted per advertising set
+static const esp_ble_gap_ext_adv_params_t ble_ext_adv_params[2] = {
+  {
+    // legacy advertisement, non-connectable
+    .type               = ESP_BLE_GAP_SET_EXT_ADV_PROP_LEGACY_NONCONN,
+    .interval_min       = 0x20,
+    .interval_max       = 0x40,
+    .channel_map        = ADV_CHNL_ALL,
+    .own_addr_type      = BLE_ADDR_TYPE_PUBLIC,
+    .peer_addr_type     = BLE_ADDR_TYPE_PUBLIC,
+    .peer_addr          = { 0, 0, 0, 0, 0, 0 },
+    .filter_policy      = ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY,
+    .tx_power           = EXT_ADV_TX_PWR_NO_PREFERENCE,
+    .primary_phy        = ESP_BLE_GAP_PHY_1M,
+    .max_skip           = 0,
+    .secondary_phy      = ESP_BLE_GAP_PHY_1M,
+    .sid                = 0, // set per advertising set
+    .scan_req_notif     = false,
+  },
+  {
+    // extended advertisement, non-connectable, non-scannable
+    .type               = ESP_BLE_GAP_SET_EXT_ADV_PROP_NONCONN_NONSCANNABLE_UNDIRECTED,
+    .interval_min       = 0x20,
+    .interval_max       = 0x40,
+    .channel_map        = ADV_CHNL_ALL,
+    .own_addr_type      = BLE_ADDR_TYPE_PUBLIC,
+    .peer_addr_type     = BLE_ADDR_TYPE_PUBLIC,
+    .peer_addr          = { 0, 0, 0, 0, 0, 0 },
+    .filter_policy      = ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY,
+    .tx_power           = EXT_ADV_TX_PWR_NO_PREFERENCE,
+    .primary_phy        = ESP_BLE_GAP_PHY_1M,
+    .max_skip           = 0,
+    .secondary_phy      = ESP_BLE_GAP_PHY_1M, // not 2M, receivers might not support it
+    .sid                = 0, // set per advertising set
+    .scan_req_notif     = false,
+  }
+};
+
+#else // BT_EXTENDED_ADVERTISING
+
 static esp_ble_scan_params_t ble_scan_params = {
   .scan_type              = BLE_SCAN_TYPE_PASSIVE, // we don't send scan requests
   .own_addr_type          = BLE_ADDR_TYPE_PUBLIC,
@@ -80,6 +169,8 @@ static esp_ble_adv_params_t ble_adv_params = {
   .adv_filter_policy = ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY,
 };
 
+#endif // !BT_EXTENDED_ADVERTISING
+
 
 void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param)
 {
@@ -92,7 +183,76 @@ void BtAdvertisements::gapCBHandler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb
   ErrorPtr err;
   FOCUSLOG("esp_gap_cb: event=%d", event);
   switch (event) {
+    #if BT_EXTENDED_ADVERTISING
+    case ESP_GAP_BLE_EXT_ADV_SET_PARAMS_COMPLETE_EVT: {
+      err = EspError::err(param->ext_adv_set_params.status, "BLE advertising set params failed: ");
+      break;
+    }
+    case ESP_GAP_BLE_EXT_ADV_DATA_SET_COMPLETE_EVT: {
+      err = EspError::err(param->ext_adv_data_set.status, "BLE advertisement data set failed: ");
+      AdvPipeline* p = pipelineFor(param->ext_adv_data_set.instance);
+      if (p) {
+        // pipelined update: data replaced in place is on air now, otherwise the set needs to be started
+        if (p->restarting && Error::isOK(err)) {
+          esp_ble_gap_ext_adv_t adv = { .instance = param->ext_adv_data_set.instance, .duration = 0, .max_events = 0 };
+          err = EspError::err(esp_ble_gap_ext_adv_start(1, &adv), "starting advertising set: ");
+          if (Error::isOK(err)) return;
+        }
+        pipelineUpdateDone(*p, err);
+        return;
+      }
+      if (Error::isOK(err)) {
+        esp_ble_gap_ext_adv_t adv = { .instance = param->ext_adv_data_set.instance, .duration = 0, .max_events = 0 };
+        esp_ble_gap_ext_adv_start(1, &adv);
+        return;
+      }
+      advertisingStarted(param->ext_adv_data_set.instance, err);
+      return;
+    }
+    case ESP_GAP_BLE_EXT_ADV_START_COMPLETE_EVT: {
+      err = EspError::err(param->ext_adv_start.status, "BLE advertisement start failed: ");
+      for (int i=0; i<param->ext_adv_start.instance_num; i++) {
+        AdvPipeline* p = pipelineFor(param->ext_adv_start.instance[i]);
+        if (p) pipelineUpdateDone(*p, err);
+        else advertisingStarted(param->ext_adv_start.instance[i], err);
+      }
+      return;
+    }
+    case ESP_GAP_BLE_EXT_ADV_STOP_COMPLETE_EVT: {
+      err = EspError::err(param->ext_adv_stop.status, "BLE advertisement stop failed: ");
+      break;
+    }
+    case ESP_GAP_BLE_SET_EXT_SCAN_PARAMS_COMPLETE_EVT: {
+      esp_ble_gap_start_ext_scan(mScanTime*100, 0); // ext scan duration is in 10mS units
+      break;
+    }
+    case ESP_GAP_BLE_EXT_SCAN_START_COMPLETE_EVT: {
+      err = EspError::err(param->ext_scan_start.status, "BLE scan start failed: ");
+      break;
+    }
+    case ESP_GAP_BLE_EXT_SCAN_STOP_COMPLETE_EVT: {
+      err = EspError::err(param->ext_scan_stop.status, "BLE scan stop failed: ");
+      break;
+    }
+    case ESP_GAP_BLE_EXT_ADV_REPORT_EVT: {
+      // legacy or extended advertisement received
+      if (param->ext_adv_report.params.data_status==ESP_BLE_GAP_EXT_ADV_DATA_COMPLETE) {
+        string advData;
+        advData.assign((const char *)param->ext_adv_report.params.adv_data, (size_t)param->ext_adv_report.params.adv_data_len);
+        deliverAdvertisement(ErrorPtr(), advData);
+      }
+      return; // done
+    }
+    #else // BT_EXTENDED_ADVERTISING
     case ESP_GAP_BLE_ADV_DATA_RAW_SET_COMPLETE_EVT: {
+      AdvPipeline* p = pipelineFor(0);
+      if (p && !p->restarting) {
+        // pipelined update with the data replaced in place, already on air
+        pipelineUpdateDone(*p, EspError::err(param->adv_data_raw_cmpl.status, "BLE advertisement data set failed: "));
+        return;
+      }
+      ble_adv_params.adv_int_min = mAdvInterval;
+      ble_adv_params.adv_int_max = 2*mAdvInterval;
       esp_ble_gap_start_advertising(&ble_adv_params);
       break;
     }
@@ -108,6 +268,11 @@ void BtAdvertisements::gapCBHandler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb
     case ESP_GAP_BLE_ADV_START_COMPLETE_EVT: {
       // adv start complete event to indicate adv start successfully or failed
       err = EspError::err(param->adv_start_cmpl.status, "BLE advertisement start failed: ");
+      AdvPipeline* p = pipelineFor(0);
+      if (p) {
+        pipelineUpdateDone(*p, err);
+        return;
+      }
       if (mAdvertisingStartedCB) {
         Application::sharedApplication()->mainLoop().executeNowFromForeignTask(
           boost::bind(&BtAdvertisements::startedCallback, mAdvertisingStartedCB, err)
@@ -140,6 +305,7 @@ void BtAdvertisements::gapCBHandler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb
       }
       break;
     }
+    #endif // !BT_EXTENDED_ADVERTISING
     default:
       break;
   }
@@ -155,17 +321,18 @@ void BtAdvertisements::deliverAdvertisement(ErrorPtr aError, const string aAdvDa
   if (mAdvertisementCB) {
     FOCUSLOG("posting Advertisement handler execution from mainloop@%p", &MainLoop::currentMainLoop());
     // make sure this executes on the main thread
+    // - timestamp now, the mainloop might be busy for a while
     Application::sharedApplication()->mainLoop().executeNowFromForeignTask(
-      boost::bind(&BtAdvertisements::deliveryCallback, mAdvertisementCB, aError, aAdvData)
+      boost::bind(&BtAdvertisements::deliveryCallback, mAdvertisementCB, aError, aAdvData, MainLoop::now())
     );
   }
 }
 
 
-void BtAdvertisements::deliveryCallback(BTAdvertisementCB aCallback, ErrorPtr aError, const string aAdvData)
+void BtAdvertisements::deliveryCallback(BTAdvertisementCB aCallback, ErrorPtr aError, const string aAdvData, MLMicroSeconds aReceivedAt)
 {
   FOCUSLOG("calling Advertisement handler in mainloop@%p", &MainLoop::currentMainLoop());
-  aCallback(aError, aAdvData);
+  aCallback(aError, aAdvData, aReceivedAt);
 }
 
 
@@ -176,6 +343,21 @@ void BtAdvertisements::startedCallback(StatusCB aCallback, ErrorPtr aError)
 }
 
 
+#if BT_EXTENDED_ADVERTISING
+
+void BtAdvertisements::advertisingStarted(int aAdvSet, ErrorPtr aError)
+{
+  if (aAdvSet<0 || aAdvSet>=cNumAdvSets) return;
+  if (mAdvertisingStartedCB[aAdvSet]) {
+    Application::sharedApplication()->mainLoop().executeNowFromForeignTask(
+      boost::bind(&BtAdvertisements::startedCallback, mAdvertisingStartedCB[aAdvSet], aError)
+    );
+  }
+}
+
+#endif // BT_EXTENDED_ADVERTISING
+
+
 
 ErrorPtr BtAdvertisements::initBLE()
 {
@@ -213,7 +395,11 @@ ErrorPtr BtAdvertisements::startScanning(BTAdvertisementCB aAdvertisementCB, uin
   ErrorPtr err = initBLE();
   // now set up scanning for advertisements
   if (Error::isOK(err)) {
+    #if BT_EXTENDED_ADVERTISING
+    esp_ble_gap_set_ext_scan_params(&ble_ext_scan_params);
+    #else
     esp_ble_gap_set_scan_params(&ble_scan_params);
+    #endif
   }
   return err;
 }
@@ -222,19 +408,78 @@ ErrorPtr BtAdvertisements::startScanning(BTAdvertisementCB aAdvertisementCB, uin
 void BtAdvertisements::stopScanning()
 {
   mAdvertisementCB = NULL;
+  #if BT_EXTENDED_ADVERTISING
+  esp_ble_gap_stop_ext_scan();
+  #else
   esp_ble_gap_stop_scanning();
+  #endif
 }
 
 
 
-ErrorPtr BtAdvertisements::startAdvertising(StatusCB aAdvertisingCB, const string aAdvData)
+ErrorPtr BtAdvertisements::startAdvertising(StatusCB aAdvertisingCB, const string aAdvData, bool aExtended, int aAdvSet)
+{
+  return startAdvertising(aAdvertisingCB, (const uint8_t*)aAdvData.c_str(), aAdvData.size(), aExtended, aAdvSet);
+}
+
+
+#if BT_EXTENDED_ADVERTISING
+
+ErrorPtr BtAdvertisements::startAdvertising(StatusCB aAdvertisingCB, const uint8_t* aAdvData, size_t aAdvDataLen, bool aExtended, int aAdvSet)
+{
+  if (aAdvSet<0 || aAdvSet>=cMaxAdvSets) return TextError::err("invalid advertising set %d", aAdvSet);
+  ErrorPtr err = initBLE();
+  // now set up advertising
+  if (Error::isOK(err)) {
+    uint8_t advSet = aAdvSet + (aExtended ? cMaxAdvSets : 0);
+    // stop this set only, the others keep advertising
+    mAdvertisingStartedCB[advSet] = NULL;
+    esp_ble_gap_ext_adv_stop(1, &advSet);
+    mAdvertisingStartedCB[advSet] = aAdvertisingCB;
+    err = configureAdvSet(advSet, aExtended);
+    if (Error::isOK(err)) {
+      // advertising set starts when data is set, see ESP_GAP_BLE_EXT_ADV_DATA_SET_COMPLETE_EVT
+      err = EspError::err(esp_ble_gap_config_ext_adv_data_raw(advSet, aAdvDataLen, aAdvData), "setting advertisement raw data: ");
+    }
+  }
+  return err;
+}
+
+
+ErrorPtr BtAdvertisements::configureAdvSet(uint8_t aAdvSet, bool aExtended)
+{
+  ErrorPtr err;
+  if (!mAdvParamsSet[aAdvSet]) {
+    esp_ble_gap_ext_adv_params_t params = ble_ext_adv_params[aExtended ? 1 : 0];
+    params.interval_min = mAdvInterval + aAdvSet*ADV_SET_INTERVAL_STAGGER;
+    params.interval_max = 2*mAdvInterval + aAdvSet*ADV_SET_INTERVAL_STAGGER;
+    params.sid = aAdvSet;
+    err = EspError::err(esp_ble_gap_ext_adv_set_params(aAdvSet, &params), "setting advertising set params: ");
+    mAdvParamsSet[aAdvSet] = Error::isOK(err);
+  }
+  return err;
+}
+
+
+void BtAdvertisements::stopAdvertising()
+{
+  stopPipelines();
+  for (int i=0; i<cNumAdvSets; i++) mAdvertisingStartedCB[i] = NULL;
+  esp_ble_gap_ext_adv_stop_all();
+}
+
+#else // BT_EXTENDED_ADVERTISING
+
+ErrorPtr BtAdvertisements::startAdvertising(StatusCB aAdvertisingCB, const uint8_t* aAdvData, size_t aAdvDataLen, bool aExtended, int aAdvSet)
 {
+  if (aExtended) return TextError::err("extended advertisements need a BLE 5 stack");
+  if (aAdvSet!=0) return TextError::err("multiple advertising sets need a BLE 5 stack");
   ErrorPtr err = initBLE();
   // now set up advertising
   if (Error::isOK(err)) {
     stopAdvertising();
     mAdvertisingStartedCB = aAdvertisingCB;
-    ErrorPtr err = EspError::err(esp_ble_gap_config_adv_data_raw((uint8_t*)aAdvData.c_str(), aAdvData.size()), "setting advertisement raw data: ");
+    ErrorPtr err = EspError::err(esp_ble_gap_config_adv_data_raw((uint8_t*)aAdvData, aAdvDataLen), "setting advertisement raw data: ");
   }
   return err;
 }
@@ -242,15 +487,248 @@ ErrorPtr BtAdvertisements::startAdvertising(StatusCB aAdvertisingCB, const strin
 
 void BtAdvertisements::stopAdvertising()
 {
+  stopPipelines();
   mAdvertisingStartedCB = NULL;
   esp_ble_gap_stop_advertising();
 }
 
+#endif // !BT_EXTENDED_ADVERTISING
+
+
+void BtAdvertisements::setAdvertisingInterval(int aIntervalMs)
+{
+  int interval = aIntervalMs*8/5; // 0.625mS units
+  if (interval<ADV_INTERVAL_MIN) interval = ADV_INTERVAL_MIN;
+  else if (interval>ADV_INTERVAL_MAX) interval = ADV_INTERVAL_MAX;
+  if (interval==mAdvInterval) return;
+  FOCUSLOG("advertising interval changes to %d..%dmS", interval*5/8, interval*5/4);
+  mAdvInterval = interval;
+  #if BT_EXTENDED_ADVERTISING
+  // new params are set when the sets are stopped for their next update
+  for (int i=0; i<cNumAdvSets; i++) mAdvParamsSet[i] = false;
+  #endif
+}
+
+
+// MARK: - pipelined advertising
+
+// Pipelined advertisement updates
+// - the pipeline holds the data of the update in progress plus the next data queued by the mainloop, so
+//   generating the next packet overlaps with the update in the BT stack.
+// - the GAP event completing an update directly starts the next update with the queued data from the BT task,
+//   the mainloop is only called to queue more data.
+// - a set that has been on air for its max advertising interval plus advDelay has sent its data at least once,
+//   so its data is just replaced in place (one HCI command, the set's advertising events continue undisturbed).
+// - otherwise, or when the advertising interval has changed, the set is stopped and restarted with the new data,
+//   which sends the first advertising event right away. A set that just went on air is held off for a few mS
+//   before restarting it, so it gets that first event.
+// - data replaced in place only goes on air with the set's next advertising event. When the interval changes to
+//   busy before that, the set is restarted anyway: that data was generated at the relaxed interval (no backlog)
+//   and may get lost, but the changes that caused the switch are not delayed by up to a relaxed interval.
+
+#define PIPELINE_MIN_ON_AIR (5*MilliSecond) // time a (re)started set needs to send its first advertising event
+#define ADV_DELAY_MAX (10*MilliSecond) // max random advDelay the controller adds to every advertising interval
+
+
+ErrorPtr BtAdvertisements::startPipeline(StatusCB aReadyCB, bool aExtended, int aNumSets)
+{
+  if (aExtended && !BT_EXTENDED_ADVERTISING) return TextError::err("extended advertisements need a BLE 5 stack");
+  if (aNumSets<1 || aNumSets>(BT_EXTENDED_ADVERTISING ? cMaxAdvSets : 1)) return TextError::err("invalid number of advertising sets %d", aNumSets);
+  ErrorPtr err = initBLE();
+  if (Error::isOK(err)) {
+    AdvPipeline& p = mPipelines[aExtended ? 1 : 0];
+    if (!p.holdOffTimer) {
+      esp_timer_create_args_t timerArgs = {};
+      timerArgs.callback = &BtAdvertisements::holdOffTimerCallback;
+      timerArgs.arg = &p;
+      timerArgs.dispatch_method = ESP_TIMER_TASK;
+      timerArgs.name = "adv hold off";
+      err = EspError::err(esp_timer_create(&timerArgs, &p.holdOffTimer), "creating hold off timer: ");
+    }
+    if (Error::isOK(err)) {
+      xSemaphoreTake(mPipelineMutex, portMAX_DELAY);
+      p.readyCB = aReadyCB;
+      p.numSets = aNumSets;
+      p.nextSet = 0;
+      p.pending = false;
+      xSemaphoreGive(mPipelineMutex);
+    }
+  }
+  return err;
+}
+
+
+void BtAdvertisements::stopPipelines()
+{
+  for (int i=0; i<cNumPipelines; i++) {
+    AdvPipeline& p = mPipelines[i];
+    if (p.holdOffTimer) esp_timer_stop(p.holdOffTimer);
+    xSemaphoreTake(mPipelineMutex, portMAX_DELAY);
+    p.readyCB = NULL;
+    p.numSets = 0;
+    p.busy = false; // events of an update still in progress are ignored from now on
+    p.pending = false;
+    for (int s=0; s<cMaxAdvSets; s++) p.onAirSince[s] = Never;
+    xSemaphoreGive(mPipelineMutex);
+  }
+}
+
+
+ErrorPtr BtAdvertisements::queueAdvertisement(const uint8_t* aAdvData, size_t aAdvDataLen, bool aExtended)
+{
+  if (aExtended && !BT_EXTENDED_ADVERTISING) return TextError::err("extended advertisements need a BLE 5 stack");
+  if (aAdvDataLen>(aExtended ? cMaxAdvDataLen : 31)) return TextError::err("advertisement data too long (%d bytes)", (int)aAdvDataLen);
+  AdvPipeline& p = mPipelines[aExtended ? 1 : 0];
+  ErrorPtr err;
+  xSemaphoreTake(mPipelineMutex, portMAX_DELAY);
+  if (p.numSets==0) {
+    err = TextError::err("advertisement pipeline not started");
+  }
+  else if (p.pending) {
+    err = TextError::err("advertisement pipeline full");
+  }
+  else {
+    memcpy(p.pendingData, aAdvData, aAdvDataLen);
+    p.pendingLen = aAdvDataLen;
+    p.pending = true;
+  }
+  xSemaphoreGive(mPipelineMutex);
+  // start updating right away if the pipeline is idle
+  if (Error::isOK(err) && claimPipeline(p)) pipelineUpdate(p);
+  return err;
+}
+
+
+MLMicroSeconds BtAdvertisements::pipelineUpdateTime(bool aExtended)
+{
+  if (aExtended && !BT_EXTENDED_ADVERTISING) return 0;
+  return mPipelines[aExtended ? 1 : 0].updateTime;
+}
+
+
+BtAdvertisements::AdvPipeline* BtAdvertisements::pipelineFor(int aAdvSet)
+{
+  #if BT_EXTENDED_ADVERTISING
+  if (aAdvSet<0 || aAdvSet>=cNumAdvSets) return NULL;
+  AdvPipeline* p = &mPipelines[aAdvSet/cMaxAdvSets];
+  if (p->busy && aAdvSet%cMaxAdvSets==p->nextSet) return p;
+  #else
+  if (mPipelines[0].busy) return &mPipelines[0];
+  #endif
+  return NULL;
+}
+
+
+bool BtAdvertisements::claimPipeline(AdvPipeline& aPipeline)
+{
+  StatusCB readyCB;
+  bool claimed = false;
+  xSemaphoreTake(mPipelineMutex, portMAX_DELAY);
+  if (aPipeline.numSets>0 && !aPipeline.busy && aPipeline.pending) {
+    // caller owns the pipeline now and must call pipelineUpdate()
+    aPipeline.busy = true;
+    aPipeline.pending = false;
+    memcpy(aPipeline.updateData, aPipeline.pendingData, aPipeline.pendingLen);
+    aPipeline.updateLen = aPipeline.pendingLen;
+    readyCB = aPipeline.readyCB;
+    claimed = true;
+  }
+  xSemaphoreGive(mPipelineMutex);
+  if (readyCB) {
+    // room for the next data
+    Application::sharedApplication()->mainLoop().executeNowFromForeignTask(
+      boost::bind(&BtAdvertisements::startedCallback, readyCB, ErrorPtr())
+    );
+  }
+  return claimed;
+}
+
+
+void BtAdvertisements::holdOffTimerCallback(void* aPipeline)
+{
+  sharedInstance().pipelineUpdate(*static_cast<AdvPipeline*>(aPipeline));
+}
+
+
+void BtAdvertisements::pipelineUpdate(AdvPipeline& aPipeline)
+{
+  int set = aPipeline.nextSet;
+  #if BT_EXTENDED_ADVERTISING
+  bool extended = &aPipeline==&mPipelines[1];
+  uint8_t advSet = set + (extended ? cMaxAdvSets : 0);
+  int maxInterval = 2*aPipeline.setInterval[set] + advSet*ADV_SET_INTERVAL_STAGGER;
+  #else
+  int maxInterval = 2*aPipeline.setInterval[set];
+  #endif
+  MLMicroSeconds now = MainLoop::now();
+  MLMicroSeconds onAir = aPipeline.onAirSince[set]==Never ? 0 : now-aPipeline.onAirSince[set];
+  MLMicroSeconds fullInterval = maxInterval*5*MilliSecond/8+ADV_DELAY_MAX; // interval is in 0.625mS units
+  aPipeline.restarting = onAir<fullInterval || aPipeline.setInterval[set]!=mAdvInterval;
+  if (aPipeline.restarting && aPipeline.onAirSince[set]!=Never && onAir<PIPELINE_MIN_ON_AIR) {
+    // set might not have sent its first advertising event yet, update it a bit later
+    esp_timer_start_once(aPipeline.holdOffTimer, PIPELINE_MIN_ON_AIR-onAir);
+    return;
+  }
+  FOCUSLOG("pipelined update of advertising set %d: %s", set, aPipeline.restarting ? "restart" : "in place");
+  aPipeline.updateStarted = now;
+  ErrorPtr err;
+  #if BT_EXTENDED_ADVERTISING
+  if (aPipeline.restarting) {
+    if (aPipeline.onAirSince[set]!=Never) esp_ble_gap_ext_adv_stop(1, &advSet);
+    aPipeline.onAirSince[set] = Never;
+    aPipeline.setInterval[set] = mAdvInterval;
+    err = configureAdvSet(advSet, extended);
+  }
+  if (Error::isOK(err)) {
+    // restarted set starts when data is set, see ESP_GAP_BLE_EXT_ADV_DATA_SET_COMPLETE_EVT
+    err = EspError::err(esp_ble_gap_config_ext_adv_data_raw(advSet, aPipeline.updateLen, aPipeline.updateData), "setting advertisement raw data: ");
+  }
+  #else
+  if (aPipeline.restarting) {
+    if (aPipeline.onAirSince[set]!=Never) esp_ble_gap_stop_advertising();
+    aPipeline.onAirSince[set] = Never;
+    aPipeline.setInterval[set] = mAdvInterval;
+  }
+  // restarted advertising starts when data is set, see ESP_GAP_BLE_ADV_DATA_RAW_SET_COMPLETE_EVT
+  err = EspError::err(esp_ble_gap_config_adv_data_raw(aPipeline.updateData, aPipeline.updateLen), "setting advertisement raw data: ");
+  #endif
+  if (Error::notOK(err)) pipelineUpdateDone(aPipeline, err);
+}
+
+
+void BtAdvertisements::pipelineUpdateDone(AdvPipeline& aPipeline, ErrorPtr aError)
+{
+  MLMicroSeconds now = MainLoop::now();
+  StatusCB errorCB;
+  xSemaphoreTake(mPipelineMutex, portMAX_DELAY);
+  int set = aPipeline.nextSet;
+  if (Error::isOK(aError)) {
+    aPipeline.onAirSince[set] = now;
+    aPipeline.updateTime += (now-aPipeline.updateStarted-aPipeline.updateTime)/16;
+  }
+  else {
+    aPipeline.onAirSince[set] = Never; // restart next time
+    aPipeline.pending = false; // discard, caller decides when to try again
+    errorCB = aPipeline.readyCB;
+  }
+  aPipeline.nextSet = aPipeline.numSets>0 ? (set+1)%aPipeline.numSets : 0;
+  aPipeline.busy = false;
+  xSemaphoreGive(mPipelineMutex);
+  if (errorCB) {
+    Application::sharedApplication()->mainLoop().executeNowFromForeignTask(
+      boost::bind(&BtAdvertisements::startedCallback, errorCB, aError)
+    );
+  }
+  // continue with the next queued data, if any
+  if (claimPipeline(aPipeline)) pipelineUpdate(aPipeline);
+}
+
 
 // MARK: - Advertisement decoding utilities
 
 // - BT Advertisement data (AdvData) consists of 0..31 bytes (plus header containing randomized BT address)
 //   See BT core specs 2.3.1 "Advertisement PDUs"
+// - BLE 5 extended advertisements carry up to 251 bytes in a single AUX_ADV_IND PDU, same AD structure format
 
 // - AdvData (0..31 bytes) data format consists of one or multiple "AD Structures" (BT core specs, 11, figure 11.1)
 
@@ -260,14 +738,13 @@ void BtAdvertisements::stopAdvertising()
 // - The AD types are described in the BT core spec supplement, chapter 1.
 
 
-bool BtAdvertisements::findADStruct(const uint8_t* aAdvData, uint8_t aType, const uint8_t* &aStructData, uint8_t &aStructLen)
+bool BtAdvertisements::findADStruct(const uint8_t* aAdvData, size_t aAdvDataLen, uint8_t aType, const uint8_t* &aStructData, uint8_t &aStructLen)
 {
-  const uint8_t maxAdvDataLen = 31;
-  uint8_t idx = 0;
-  while (idx<maxAdvDataLen) {
+  size_t idx = 0;
+  while (idx<aAdvDataLen) {
     // length byte
     uint8_t ln = aAdvData[idx];
-    if (ln<1 || idx+ln>maxAdvDataLen) break; // invalid
+    if (ln<1 || idx+ln>=aAdvDataLen) break; // invalid
     idx++;
     // type byte
     if (aAdvData[idx]==aType) {
@@ -277,6 +754,7 @@ bool BtAdvertisements::findADStruct(const uint8_t* aAdvData, uint8_t aType, cons
       aStructData = aAdvData+idx;
       return true;
     }
+    idx += ln; // skip to next structure
   }
   return false; // not found
 }
@@ -34,24 +34,71 @@
 #include "esp_bt_main.h"
 #include "esp_bt_defs.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
 #include "esp_err.h"
 
+#if CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+  #define BT_EXTENDED_ADVERTISING 1 // BLE 5 stack, using advertising sets for both legacy and extended advertisements
+#else
+  #define BT_EXTENDED_ADVERTISING 0 // BLE 4.2 stack, legacy advertisements only
+#endif
+
 
 using namespace std;
 
 namespace p44 {
 
 
-  typedef boost::function<void (ErrorPtr aError, const string aAdvData)> BTAdvertisementCB;
+  /// callback for received advertisements
+  /// @param aError error, if any
+  /// @param aAdvData the advertisement data
+  /// @param aReceivedAt time the advertisement was received (in the BT task, before being passed to the mainloop)
+  typedef boost::function<void (ErrorPtr aError, const string aAdvData, MLMicroSeconds aReceivedAt)> BTAdvertisementCB;
 
   class BtAdvertisements : public P44LoggingObj
   {
+  public:
+
+    static const int cMaxAdvSets = 4; ///< max number of concurrently advertised sets, per advertisement type (needs BLE 5 stack for more than one)
+    static const int cMaxAdvDataLen = 251; ///< max advertisement data size (extended advertisements, legacy is 31)
+
+  private:
+
+    /// pipelined updates of advertising sets
+    typedef struct {
+      StatusCB readyCB; ///< called from mainloop whenever the pipeline has room for the next advertisement data
+      int numSets; ///< number of advertising sets updated round robin, 0 = pipeline not started
+      int nextSet; ///< the set to update next
+      bool busy; ///< an update is in progress (or held off), owned by whoever set this flag
+      bool restarting; ///< the update in progress stops and restarts the set, rather than replacing its data in place
+      bool pending; ///< pendingData is queued for the next update
+      size_t pendingLen;
+      uint8_t pendingData[cMaxAdvDataLen];
+      size_t updateLen;
+      uint8_t updateData[cMaxAdvDataLen]; ///< data of the update in progress
+      MLMicroSeconds updateStarted; ///< when the update in progress was started
+      MLMicroSeconds updateTime; ///< average time an update takes in the BT stack
+      MLMicroSeconds onAirSince[cMaxAdvSets]; ///< when the set's current data went on air, Never = set not advertising
+      uint16_t setInterval[cMaxAdvSets]; ///< advertising interval the set was started with
+      esp_timer_handle_t holdOffTimer; ///< delays restarting a set that just went on air
+    } AdvPipeline;
 
     bool mBTInitialized;
     BTAdvertisementCB mAdvertisementCB;
     uint32_t mScanTime; // how long to keep scanning, 0=forever
+    uint16_t mAdvInterval; ///< min advertising interval in 0.625mS units, max is twice that
 
+    #if BT_EXTENDED_ADVERTISING
+    static const int cNumAdvSets = 2*cMaxAdvSets; ///< advertising sets 0..cMaxAdvSets-1 for legacy, the others for extended advertisements
+    StatusCB mAdvertisingStartedCB[cNumAdvSets];
+    bool mAdvParamsSet[cNumAdvSets];
+    #else
     StatusCB mAdvertisingStartedCB;
+    #endif
+    static const int cNumPipelines = BT_EXTENDED_ADVERTISING ? 2 : 1; ///< legacy and extended advertisements
+    AdvPipeline mPipelines[cNumPipelines];
+    SemaphoreHandle_t mPipelineMutex; ///< protects the pipelines' state between mainloop, BT and timer tasks
 
     BtAdvertisements();
     virtual ~BtAdvertisements();
@@ -72,25 +119,73 @@ namespace p44 {
     void stopScanning();
 
     /// start advertising specified aAdvData
-    /// @note will stop previous advertisement
+    /// @note will stop previous advertisement of the same set
     /// @param aAdvertisingCB is called with advertising has started (or could not start due to error)
-    /// @param aAdvData advertisement data binary string, max 31 bytes
+    /// @param aAdvData advertisement data binary string, max 31 bytes (max 251 bytes for extended advertisements)
+    /// @param aExtended if set, send as BLE 5 extended advertisement (in parallel to the legacy advertisement)
+    /// @param aAdvSet advertising set 0..cMaxAdvSets-1 to use, sets advertise concurrently, each with its own data and interval
     /// @return NULL if ok or error
-    ErrorPtr startAdvertising(StatusCB aAdvertisingCB, const string aAdvData);
+    ErrorPtr startAdvertising(StatusCB aAdvertisingCB, const string aAdvData, bool aExtended = false, int aAdvSet = 0);
 
-    /// stop advertising
+    /// start advertising specified aAdvData
+    /// @note will stop previous advertisement of the same set
+    /// @param aAdvertisingCB is called with advertising has started (or could not start due to error)
+    /// @param aAdvData pointer to advertisement data (copied by the BT stack, buffer can be reused after the call)
+    /// @param aAdvDataLen size of advertisement data, max 31 bytes (max 251 bytes for extended advertisements)
+    /// @param aExtended if set, send as BLE 5 extended advertisement (in parallel to the legacy advertisement)
+    /// @param aAdvSet advertising set 0..cMaxAdvSets-1 to use, sets advertise concurrently, each with its own data and interval
+    /// @return NULL if ok or error
+    ErrorPtr startAdvertising(StatusCB aAdvertisingCB, const uint8_t* aAdvData, size_t aAdvDataLen, bool aExtended = false, int aAdvSet = 0);
+
+    /// stop advertising (all sets, legacy and extended, including pipelines)
     void stopAdvertising();
 
+    /// start pipelined advertising
+    /// @note while one update of an advertising set is in progress in the BT stack, the next advertisement data
+    ///   can already be queued with queueAdvertisement(). The BT task takes it over directly from the GAP event
+    ///   completing the update in progress, without a round trip through the mainloop. Where possible, the data of
+    ///   a running set is replaced in place, otherwise the set is stopped and restarted with the new data.
+    /// @note the pipeline's advertising sets must not be used with startAdvertising() at the same time
+    /// @param aReadyCB is called from mainloop whenever the pipeline has room for the next advertisement data,
+    ///   or with an error when an update failed (data queued at that time is discarded)
+    /// @param aExtended if set, pipeline BLE 5 extended advertisements (in parallel to the legacy advertisement)
+    /// @param aNumSets number of advertising sets 1..cMaxAdvSets to update round robin
+    /// @return NULL if ok or error
+    ErrorPtr startPipeline(StatusCB aReadyCB, bool aExtended = false, int aNumSets = 1);
+
+    /// queue the next advertisement data for a pipeline
+    /// @param aAdvData pointer to advertisement data (copied, buffer can be reused after the call)
+    /// @param aAdvDataLen size of advertisement data, max 31 bytes (max 251 bytes for extended advertisements)
+    /// @param aExtended if set, queue for the extended advertisement pipeline
+    /// @return NULL if ok, error if the pipeline is not started or has no room (wait for the ready callback)
+    ErrorPtr queueAdvertisement(const uint8_t* aAdvData, size_t aAdvDataLen, bool aExtended = false);
+
+    /// @param aExtended if set, get the time for the extended advertisement pipeline
+    /// @return average time a pipelined update takes in the BT stack
+    MLMicroSeconds pipelineUpdateTime(bool aExtended = false);
+
+    /// set the advertising interval
+    /// @param aIntervalMs min advertising interval in milliseconds (20..10240), the max interval is twice that
+    /// @note takes effect for each advertising set at its next startAdvertising() or pipelined restart
+    void setAdvertisingInterval(int aIntervalMs);
+
+    /// @return current min advertising interval in milliseconds
+    int getAdvertisingInterval() { return mAdvInterval*5/8; };
+
+    /// @return true if extended advertisements can be sent and received
+    static bool extendedAdvertising() { return BT_EXTENDED_ADVERTISING; }
+
     /// @return prefix for log messages
     virtual string logContextPrefix() P44_OVERRIDE { return "BT Advertisement Receiver"; };
 
     /// utility for dissecting BT advertisements
     /// @param aAdvData pointer to advertisement data
+    /// @param aAdvDataLen size of advertisement data (31 for legacy, up to 251 for extended advertisements)
     /// @param aType the type of AD struct to find
     /// @param aStructData receives pointer to structure data when function returns true
     /// @param aStructLen receives the length of the structure data (w/o type) when function returns true
     /// @return true if AD struct found
-    static bool findADStruct(const uint8_t* aAdvData, uint8_t aType, const uint8_t* &aStructData, uint8_t &aStructLen);
+    static bool findADStruct(const uint8_t* aAdvData, size_t aAdvDataLen, uint8_t aType, const uint8_t* &aStructData, uint8_t &aStructLen);
 
     void gapCBHandler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param); /// semantically privat
 
@@ -98,8 +193,18 @@ namespace p44 {
 
     ErrorPtr initBLE();
     void deliverAdvertisement(ErrorPtr aError, const string aAdvData);
-    static void deliveryCallback(BTAdvertisementCB aCallback, ErrorPtr aError, const string aAdvData);
+    static void deliveryCallback(BTAdvertisementCB aCallback, ErrorPtr aError, const string aAdvData, MLMicroSeconds aReceivedAt);
     static void startedCallback(StatusCB aCallback, ErrorPtr aError);
+    #if BT_EXTENDED_ADVERTISING
+    void advertisingStarted(int aAdvSet, ErrorPtr aError);
+    ErrorPtr configureAdvSet(uint8_t aAdvSet, bool aExtended);
+    #endif
+    void stopPipelines();
+    AdvPipeline* pipelineFor(int aAdvSet);
+    bool claimPipeline(AdvPipeline& aPipeline);
+    void pipelineUpdate(AdvPipeline& aPipeline);
+    void pipelineUpdateDone(AdvPipeline& aPipeline, ErrorPtr aError);
+    static void holdOffTimerCallback(void* aPipeline);
 
   };
 
@@ -25,9 +25,17 @@
 // - set FOCUSLOGLEVEL to non-zero log level (usually, 5,6, or 7==LOG_DEBUG) to get focus (extensive logging) for this file
 //   Note: must be before including "logger.hpp" (or anything that includes "logger.hpp")
 #define FOCUSLOGLEVEL 7
+// - set VERIFY_AGE_INDEX to 1 to cross-check the sender's age index against a full universe scan after every packet
+#define VERIFY_AGE_INDEX 0
 
 #include "p44btdmx.hpp"
 
+#include <math.h>
+
+#if ESP_PLATFORM
+  #include "nvs.h"
+#endif
+
 #ifdef CONFIG_P44BTDMX_SYSTEM_KEY
   #define DEFAULT_P44BTDMX_SYSTEM_KEY_INPUT CONFIG_P44BTDMX_SYSTEM_KEY
 #else
@@ -86,13 +94,88 @@ uint16_t P44BTDMXbase::crc16(uint16_t aCRC16, uint8_t aByteToAdd)
 }
 
 
+// Scene store
+// - scenes are kept in memory, and persisted in NVS on ESP32 (other platforms only have the in-memory scenes)
+// - scenes are loaded from NVS on demand
+
+#define SCENE_STORE_NAMESPACE "p44btdmx"
+
+bool P44BTDMXbase::loadScene(uint8_t aSceneNo, string &aSceneData)
+{
+  SceneMap::iterator pos = mScenes.find(aSceneNo);
+  if (pos!=mScenes.end()) {
+    aSceneData = pos->second;
+    return true;
+  }
+  #if ESP_PLATFORM
+  nvs_handle_t h;
+  if (nvs_open(SCENE_STORE_NAMESPACE, NVS_READONLY, &h)==ESP_OK) {
+    string key = string_format("%s%d", sceneKeyPrefix(), aSceneNo);
+    size_t sz = 0;
+    bool found = false;
+    if (nvs_get_blob(h, key.c_str(), NULL, &sz)==ESP_OK && sz>0) {
+      aSceneData.resize(sz);
+      found = nvs_get_blob(h, key.c_str(), &aSceneData[0], &sz)==ESP_OK;
+    }
+    nvs_close(h);
+    if (found) {
+      mScenes[aSceneNo] = aSceneData;
+      return true;
+    }
+  }
+  #endif
+  return false;
+}
+
+
+void P44BTDMXbase::saveScene(uint8_t aSceneNo, const string &aSceneData)
+{
+  string old;
+  if (loadScene(aSceneNo, old) && old==aSceneData) return; // unchanged, do not wear flash (scene commands are repeated)
+  mScenes[aSceneNo] = aSceneData;
+  #if ESP_PLATFORM
+  nvs_handle_t h;
+  esp_err_t err = nvs_open(SCENE_STORE_NAMESPACE, NVS_READWRITE, &h);
+  if (err==ESP_OK) {
+    string key = string_format("%s%d", sceneKeyPrefix(), aSceneNo);
+    err = nvs_set_blob(h, key.c_str(), aSceneData.c_str(), aSceneData.size());
+    if (err==ESP_OK) err = nvs_commit(h);
+    nvs_close(h);
+  }
+  if (err!=ESP_OK) {
+    OLOG(LOG_ERR, "cannot save scene %d: error 0x%x", aSceneNo, err);
+  }
+  #endif
+}
+
+
 // MARK: - plan44 DMX over Bluetooth receiver
 
 P44BTDMXreceiver::P44BTDMXreceiver() :
   mFirstLightNumber(0),
+  mPage(0),
   mlastNativeData(Never),
-  mIsLogger(false)
+  mIsLogger(false),
+  mFineChannels(0),
+  mSource(-1),
+  mHtpChannels(0x04), // brightness
+  mFecSource(-1),
+  mFecGroup(-1),
+  mFecReceived(0),
+  mFecCount(0),
+  mNumClockSamples(0),
+  mNextClockSample(0),
+  mClockLocal(Never),
+  mClockOffset(0),
+  mClockDrift(0),
+  mDriftValid(false),
+  mDriftLocal(Never),
+  mDriftOffset(0),
+  mPacketTime(Never),
+  mTimeBaseSource(-1)
 {
+  memset(&mSeqStats, 0, sizeof(mSeqStats));
+  for (int i=0; i<cMaxSources; i++) mSources[i].used = false;
 }
 
 P44BTDMXreceiver::~P44BTDMXreceiver()
@@ -119,6 +202,12 @@ P44BTDMXreceiver::~P44BTDMXreceiver()
 //    - use first byte as a subtype (of Bluekitchen/plan44 manufacturer specific packets)
 //      - 0x44 = subtype p44DMX
 //    - rest of payload == 26 bytes p44DMX data
+// 3) for BLE 5 capable senders and receivers (ESP32-C3/S3...)
+//    - same as 2), but in an extended advertisement with up to 251 bytes AdvData, and subtype 0x45
+//    - senders send it in parallel to 2) on a separate advertising set, each with its own scheduling,
+//      so legacy receivers still get everything via 2)
+//    - receivers seeing both prefer 3), and ignore 2) for a while after receiving 3). Mixing both streams
+//      would break deltas and fades, which refer to what the same stream has sent before.
 
 // 4C 00 02 15 B1 6F C6 BB D1 D1 42 8A 8C 03 55 BA D7 F7 04 81 00 FE FE 00 C5
 
@@ -127,76 +216,144 @@ P44BTDMXreceiver::~P44BTDMXreceiver()
 #define BT_COMPANY_ID_BLUEKITCHEN 0x048F
 
 #define PLAN44_SUBTYPE_P44BTDMX 0x44
+#define PLAN44_SUBTYPE_P44BTDMX_EXT 0x45
 #define APPLE_SUBTYPE_IBEACON 0x02
 
-bool P44BTDMXreceiver::processBTAdvMfgData(const string aAdvMfgData)
+bool P44BTDMXreceiver::processBTAdvMfgData(const string aAdvMfgData, MLMicroSeconds aReceivedAt)
 {
   FOCUSLOG("Got advMfgData: %s", binaryToHexString(aAdvMfgData,' ').c_str());
   // check if its one of our recognized formats
   if (aAdvMfgData.size()<4) return false;
-  uint16_t companyBTId = aAdvMfgData[0]+(aAdvMfgData[1]<<8);
+  const uint8_t* mfgData = (const uint8_t*)aAdvMfgData.c_str(); // bytes, not (possibly signed) chars
+  uint16_t companyBTId = mfgData[0]+(mfgData[1]<<8);
   if (companyBTId==BT_COMPANY_ID_PLAN44 || companyBTId==BT_COMPANY_ID_BLUEKITCHEN) {
     // raw p44BTDMX
-    if (aAdvMfgData[2]==PLAN44_SUBTYPE_P44BTDMX) {
-      return processP44BTDMXpayload(aAdvMfgData.substr(3), true);
+    if (mfgData[2]==PLAN44_SUBTYPE_P44BTDMX) {
+      return processP44BTDMXpayload(aAdvMfgData.substr(3), true, false, aReceivedAt);
+    }
+    // raw p44BTDMX in extended advertisement
+    if (mfgData[2]==PLAN44_SUBTYPE_P44BTDMX_EXT) {
+      return processP44BTDMXpayload(aAdvMfgData.substr(3), true, true, aReceivedAt);
     }
   }
   if (companyBTId==BT_COMPANY_ID_APPLE) {
     // check for p44BTDMX disguised as Apple iBeacon
-    if (aAdvMfgData[2]==APPLE_SUBTYPE_IBEACON) {
-      return processP44BTDMXpayload(aAdvMfgData.substr(4,(size_t)aAdvMfgData[3]), false);
+    if (mfgData[2]==APPLE_SUBTYPE_IBEACON) {
+      return processP44BTDMXpayload(aAdvMfgData.substr(4,(size_t)mfgData[3]), false, false, aReceivedAt);
     }
   }
   return false;
 }
 
 
-// p44DMX data format (21..27 bytes)
+// p44DMX data format (21..27 bytes, up to 247 bytes in extended advertisements)
 // - pairing based on a "system key" = 32 bytes random key
 // - key is xored with the payload to obfuscate it
 // - last two bytes of the payload are a CRC16 of the bytes preceeding them
-// - this leaves 21-4..27-4 = 17..23 effective p44DMX data bytes
+// - this leaves 21-4..27-4 = 17..23 effective p44DMX data bytes (243 in extended advertisements)
 // - p44DMX data consists of delta update commands
 
 #define NOT_NATIVE_LOCKOUT_PERIOD (10*Second)
-
-bool P44BTDMXreceiver::processP44BTDMXpayload(const string aP44BTDMXData, bool aNative)
+#define NOT_EXTENDED_LOCKOUT_PERIOD (2*Second)
+
+// p44DMX extended commands (following the 0xFF lead-in)
+#define P44DMX_EXTCMD_FADE 0x01 ///< fade: lightnumber, channelindex, target value, time in P44DMX_FADE_TIME_UNIT_MS
+#define P44DMX_EXTCMD_RANGE 0x02 ///< range set: first lightnumber, last lightnumber, channelindex, value
+#define P44DMX_EXTCMD_GROUP 0x03 ///< group set: first lightnumber, mask size, light mask, channelindex, value
+#define P44DMX_EXTCMD_GROUP_HSB 0x04 ///< group HSB set: first lightnumber, mask size, light mask, H, S, B
+#define P44DMX_EXTCMD_SCENE_STORE 0x05 ///< store current state of the lights as scene: scene number
+#define P44DMX_EXTCMD_SCENE_RECALL 0x06 ///< recall scene: scene number, fade time in P44DMX_FADE_TIME_UNIT_MS
+#define P44DMX_EXTCMD_KEYFRAME 0x07 ///< keyframe: lightnumber, channel mask, one value per channel in the mask
+#define P44DMX_EXTCMD_DELTA 0x08 ///< deltas: first lightnumber, number of lights, channel mask, 4-bit signed deltas per light and channel in the mask
+#define P44DMX_EXTCMD_PAGE 0x09 ///< page select: page number for the rest of the packet
+#define P44DMX_EXTCMD_FEC_DATA 0x0A ///< FEC data packet trailer: group number, index of the packet in the group
+#define P44DMX_EXTCMD_FEC_PARITY 0x0B ///< FEC parity packet: group number, number of data packets, XOR of their command bytes
+#define P44DMX_EXTCMD_SEQUENCE 0x0C ///< sequence number: rolling packet number, always first in the payload
+#define P44DMX_EXTCMD_TIMEBASE 0x0D ///< time base: sender time in mS, 32 bit MSB first, always at the end of the packet
+#define P44DMX_EXTCMD_SOURCE 0x0E ///< source ID: identifies the sender, always first in the payload
+#define P44DMX_EXTCMD_NOP 0xFF ///< no operation, used as fill
+#define P44DMX_DELTA_MIN -8 ///< smallest delta a delta command can carry
+#define P44DMX_DELTA_MAX 7 ///< largest delta a delta command can carry
+#define P44DMX_MAX_DELTA_RUN 4 ///< max number of deltas in a row before a channel is sent as an absolute value again
+#define P44DMX_GROUP_MAX_MASK_BYTES ((cNumLights+7)/8) ///< max group mask size, covering the entire universe
+#define P44DMX_FADE_TIME_UNIT_MS 20 ///< unit for the fade time, max fade time is 255 units
+#define P44DMX_FEC_HEADER_BYTES 4 ///< size of the FEC data trailer and the parity packet header
+#define P44DMX_SEQUENCE_BYTES 3 ///< size of the sequence command
+#define P44DMX_SEQUENCE_WINDOW 32 ///< number of recent sequence numbers checked for duplicates and late packets
+#define P44DMX_SEQUENCE_MAX_GAP 64 ///< larger jumps ahead in the sequence are not counted as losses
+#define P44DMX_TIMEBASE_BYTES 6 ///< size of the time base command
+#define P44DMX_SOURCE_BYTES 3 ///< size of the source ID command
+#define P44DMX_SOURCE_TIMEOUT (10*Second) ///< sources not sent anything for this long no longer take part in merging
+#define P44DMX_TIMEBASE_MAX_JUMP (1*Second) ///< time base deviating more from the expected time restarts the clock discipline
+#define P44DMX_TIMEBASE_DRIFT_PERIOD (30*Second) ///< min time between drift measurements
+#define P44DMX_TIMEBASE_MAX_DRIFT 500E-6 ///< max drift between sender and receiver clocks (crystals are within +/-50ppm)
+
+bool P44BTDMXreceiver::processP44BTDMXpayload(const string aP44BTDMXData, bool aNative, bool aExtended, MLMicroSeconds aReceivedAt)
 {
   FOCUSLOG("Got p44BTDMX payload: %s", binaryToHexString(aP44BTDMXData,' ').c_str());
-  // FIXME: for the iOS app, we don't want MainLoop pulled in, so only checking iBeacon lockout on ESP32 for now
+  if (aP44BTDMXData.size()<2) return false; // not even a CRC
+  // decode from system key and verify CRC
+  const uint8_t* data = (const uint8_t*)aP44BTDMXData.c_str(); // bytes, not (possibly signed) chars
+  uint16_t crc = 0;
+  string decoded;
+  int i;
+  for (i=0; i<aP44BTDMXData.size()-2; i++) {
+    uint8_t b = data[i] ^ systemKeyByte(i);
+    crc = crc16(crc, b);
+    decoded.append(1, b);
+  }
+  uint16_t recCrc =
+    ((data[i] ^ systemKeyByte(i)) << 8) |
+    (data[i+1] ^ systemKeyByte(i+1));
+  if (recCrc!=crc) {
+    FOCUSLOG("- p44BTDMX CRC error: received = 0x%04hX, expected=0x%04hX", recCrc, crc);
+    return false;
+  }
+  // valid p44BTDMX data
+  int sourceId = cNoSourceId;
+  if (decoded.size()>=P44DMX_SOURCE_BYTES && (uint8_t)decoded[0]==0xFF && (uint8_t)decoded[1]==P44DMX_EXTCMD_SOURCE) {
+    sourceId = (uint8_t)decoded[2];
+    decoded.erase(0, P44DMX_SOURCE_BYTES);
+  }
+  // FIXME: for the iOS app, we don't want MainLoop pulled in, so only checking lockouts on ESP32 for now
   #if ESP_PLATFORM
   MLMicroSeconds now = MainLoop::now();
-  if (aNative || now-mlastNativeData>NOT_NATIVE_LOCKOUT_PERIOD)
-  #else
-  MLMicroSeconds now = 0;
-  if (true)
-  #endif
-  {
+  if (aReceivedAt==Never) aReceivedAt = now;
+  if (sourceId==cNoSourceId) {
+    // without source IDs, senders cannot be told apart: native senders lock out iBeacons (iOS devices)
     if (aNative) mlastNativeData = now;
-    // decode from system key and verify CRC
-    uint16_t crc = 0;
-    string decoded;
-    int i;
-    for (i=0; i<aP44BTDMXData.size()-2; i++) {
-      uint8_t b = aP44BTDMXData[i] ^ systemKeyByte(i);
-      crc = crc16(crc, b);
-      decoded.append(1, b);
-    }
-    uint16_t recCrc =
-      ((aP44BTDMXData[i] ^ systemKeyByte(i)) << 8) |
-      (aP44BTDMXData[i+1] ^ systemKeyByte(i+1));
-    if (recCrc==crc) {
-      // valid p44BTDMX data
-      return processP44DMX(decoded);
-    }
-    else {
-      FOCUSLOG("- p44BTDMX CRC error: received = 0x%04hX, expected=0x%04hX", recCrc, crc)
+    else if (now-mlastNativeData<=NOT_NATIVE_LOCKOUT_PERIOD) {
+      FOCUSLOG("- not handling non-native data arriving less than %lld seconds after native data", NOT_NATIVE_LOCKOUT_PERIOD/Second);
+      return false;
     }
   }
-  else {
-    FOCUSLOG("- not handling non-native data arriving less than %lld seconds after native data", NOT_NATIVE_LOCKOUT_PERIOD/Second);
+  #else
+  MLMicroSeconds now = Never;
+  #endif
+  bool released;
+  int src = sourceFor(sourceId, now, released);
+  bool anyChanges = released && mergeAll(); // remaining sources take over
+  Source& source = mSources[src];
+  #if ESP_PLATFORM
+  if (!aExtended && source.lastExtended!=Never && now-source.lastExtended<=NOT_EXTENDED_LOCKOUT_PERIOD) {
+    FOCUSLOG("- not handling legacy data arriving less than %lld seconds after extended data", NOT_EXTENDED_LOCKOUT_PERIOD/Second);
+    return anyChanges;
   }
-  return false;
+  if (aExtended) source.lastExtended = now;
+  #endif
+  source.lastSeen = now;
+  mSource = src;
+  if (decoded.size()>=P44DMX_SEQUENCE_BYTES && (uint8_t)decoded[0]==0xFF && (uint8_t)decoded[1]==P44DMX_EXTCMD_SEQUENCE) {
+    if (!sequenceReceived(decoded[2])) {
+      mSource = -1;
+      return anyChanges; // duplicate, already processed
+    }
+    decoded.erase(0, P44DMX_SEQUENCE_BYTES);
+  }
+  mPacketTime = aReceivedAt;
+  if (processP44DMX(decoded)) anyChanges = true;
+  mSource = -1; // commands not from a payload are not merged
+  return anyChanges;
 }
 
 
@@ -210,9 +367,34 @@ bool P44BTDMXreceiver::processP44DMX(const string aP44BTDMXCmds)
   //   - 0=brightness (B channel), 1 data byte
   //   - 1=HSB, 3 data bytes
   //   - 2=other channel: channelindex/value, 2 data bytes
+  // - extended commands:
+  //   - P44DMX_EXTCMD_FADE: lightnumber, channelindex, target value, fade time, 4 data bytes
+  //   - P44DMX_EXTCMD_RANGE: first lightnumber, last lightnumber, channelindex, value, 4 data bytes
+  //   - P44DMX_EXTCMD_GROUP: first lightnumber, mask size n, n mask bytes (LSBit of first = first light), channelindex, value, 4+n data bytes
+  //   - P44DMX_EXTCMD_GROUP_HSB: first lightnumber, mask size n, n mask bytes, H, S, B, 5+n data bytes
+  //   - P44DMX_EXTCMD_SCENE_STORE: scene number, 1 data byte
+  //   - P44DMX_EXTCMD_SCENE_RECALL: scene number, fade time, 2 data bytes
+  //   - P44DMX_EXTCMD_KEYFRAME: lightnumber, channel mask, n channel values, 2+n data bytes
+  //   - P44DMX_EXTCMD_DELTA: first lightnumber, number of lights n, channel mask with m channels,
+  //     n*m 4-bit deltas (first in the high nibble, light by light), 3+(n*m+1)/2 data bytes
+  //   - P44DMX_EXTCMD_PAGE: page number for the following commands in the packet, 1 data byte
+  //   - P44DMX_EXTCMD_FEC_DATA: group number, packet index, 2 data bytes, always at the end of the packet,
+  //     the bytes before it are the packet's contribution to the group's parity
+  //   - P44DMX_EXTCMD_FEC_PARITY: group number, number of data packets n, XOR of the data packets'
+  //     contributions, rest of the packet
+  //   - P44DMX_EXTCMD_SEQUENCE: sequence number, 1 data byte, first in the payload and normally
+  //     consumed by processP44BTDMXpayload()
+  //   - P44DMX_EXTCMD_TIMEBASE: sender time in mS, 4 data bytes MSB first, always at the end of the packet
+  //   - P44DMX_EXTCMD_SOURCE: source ID, 1 data byte, first in the payload (before the sequence number)
+  //     and normally consumed by processP44BTDMXpayload()
+  //   - P44DMX_EXTCMD_NOP: no data bytes
+  // - every packet starts at page 0
   int i = 0;
   int ln = (int)aP44BTDMXCmds.size();
   bool anyChanges = false;
+  // commands for other pages address no light number of ours
+  int firstLightNumber = mPage==0 ? mFirstLightNumber : cOtherPage;
+  int page = 0;
   while (i<ln) {
     uint8_t addrCmd = aP44BTDMXCmds[i];
     if (addrCmd==0xFF) {
@@ -222,8 +404,221 @@ bool P44BTDMXreceiver::processP44DMX(const string aP44BTDMXCmds)
         // get extended command byte
         uint8_t extendedCmd = aP44BTDMXCmds[i++];
         switch (extendedCmd) {
-          case 0xFF: break; // NOP command
-          default: break;
+          case P44DMX_EXTCMD_NOP: break;
+          case P44DMX_EXTCMD_FADE: {
+            if (i+4>ln) return anyChanges; // error, not enough data
+            int lightIndex = (uint8_t)aP44BTDMXCmds[i++];
+            uint8_t cidx = aP44BTDMXCmds[i++];
+            uint8_t value = aP44BTDMXCmds[i++];
+            MLMicroSeconds fadeTime = (uint8_t)aP44BTDMXCmds[i++]*P44DMX_FADE_TIME_UNIT_MS*MilliSecond;
+            if (mIsLogger) {
+              LOG(LOG_NOTICE, "L#%03d:     channel#%1d fades to %03d in %lld mS", lightIndex, cidx, value, fadeTime/MilliSecond);
+            }
+            else {
+              lightIndex -= firstLightNumber;
+              if (lightIndex>=0 && lightIndex<mLights.size()) {
+                FOCUSLOG("- local Light #%d (global #%d): fade %02X %02X %lld", lightIndex, lightIndex+firstLightNumber, cidx, value, fadeTime);
+                setLightChannel(lightIndex, cidx, value, fadeTime);
+                if (mLights[lightIndex]->applyChannels()) anyChanges = true;
+              }
+            }
+            break;
+          }
+          case P44DMX_EXTCMD_RANGE: {
+            if (i+4>ln) return anyChanges; // error, not enough data
+            int firstLight = (uint8_t)aP44BTDMXCmds[i++];
+            int lastLight = (uint8_t)aP44BTDMXCmds[i++];
+            uint8_t cidx = aP44BTDMXCmds[i++];
+            uint8_t value = aP44BTDMXCmds[i++];
+            if (mIsLogger) {
+              LOG(LOG_NOTICE, "L#%03d..L#%03d: channel#%1d=%03d", firstLight, lastLight, cidx, value);
+            }
+            else {
+              // only lights within our range
+              firstLight -= firstLightNumber;
+              lastLight -= firstLightNumber;
+              if (firstLight<0) firstLight = 0;
+              if (lastLight>=(int)mLights.size()) lastLight = (int)mLights.size()-1;
+              for (int l=firstLight; l<=lastLight; l++) {
+                setLightChannel(l, cidx, value);
+                if (mLights[l]->applyChannels()) anyChanges = true;
+              }
+            }
+            break;
+          }
+          case P44DMX_EXTCMD_GROUP:
+          case P44DMX_EXTCMD_GROUP_HSB: {
+            if (i+2>ln) return anyChanges; // error, not enough data
+            int firstLight = (uint8_t)aP44BTDMXCmds[i++];
+            int maskBytes = (uint8_t)aP44BTDMXCmds[i++];
+            int numValues = extendedCmd==P44DMX_EXTCMD_GROUP_HSB ? 3 : 2;
+            if (i+maskBytes+numValues>ln) return anyChanges; // error, not enough data
+            const char* mask = aP44BTDMXCmds.c_str()+i;
+            i += maskBytes;
+            uint8_t v1 = aP44BTDMXCmds[i++];
+            uint8_t v2 = aP44BTDMXCmds[i++];
+            uint8_t v3 = numValues>2 ? aP44BTDMXCmds[i++] : 0;
+            if (mIsLogger) {
+              string m = binaryToHexString(string(mask, maskBytes));
+              if (numValues>2) LOG(LOG_NOTICE, "L#%03d+%s: V=%03d H=%03d S=%03d", firstLight, m.c_str(), v3, v1, v2);
+              else LOG(LOG_NOTICE, "L#%03d+%s: channel#%1d=%03d", firstLight, m.c_str(), v1, v2);
+            }
+            else {
+              // only lights within our range, mask bit n is light firstLight+n
+              int from = firstLightNumber>firstLight ? firstLightNumber : firstLight;
+              int to = firstLight+8*maskBytes;
+              if (to>firstLightNumber+(int)mLights.size()) to = firstLightNumber+(int)mLights.size();
+              for (int l=from; l<to; l++) {
+                int bit = l-firstLight;
+                if ((mask[bit>>3] & (1<<(bit & 0x07)))==0) continue;
+                int lightIndex = l-firstLightNumber;
+                if (numValues>2) {
+                  setLightChannel(lightIndex, 0, v1);
+                  setLightChannel(lightIndex, 1, v2);
+                  setLightChannel(lightIndex, 2, v3);
+                }
+                else {
+                  setLightChannel(lightIndex, v1, v2);
+                }
+                if (mLights[lightIndex]->applyChannels()) anyChanges = true;
+              }
+            }
+            break;
+          }
+          case P44DMX_EXTCMD_SCENE_STORE: {
+            if (i+1>ln) return anyChanges; // error, not enough data
+            uint8_t sceneNo = aP44BTDMXCmds[i++];
+            if (mIsLogger) {
+              LOG(LOG_NOTICE, "store scene %d", sceneNo);
+            }
+            else if (page==mPage) {
+              storeScene(sceneNo);
+            }
+            break;
+          }
+          case P44DMX_EXTCMD_SCENE_RECALL: {
+            if (i+2>ln) return anyChanges; // error, not enough data
+            uint8_t sceneNo = aP44BTDMXCmds[i++];
+            MLMicroSeconds fadeTime = (uint8_t)aP44BTDMXCmds[i++]*P44DMX_FADE_TIME_UNIT_MS*MilliSecond;
+            if (mIsLogger) {
+              LOG(LOG_NOTICE, "recall scene %d in %lld mS", sceneNo, fadeTime/MilliSecond);
+            }
+            else if (page==mPage) {
+              if (recallScene(sceneNo, fadeTime)) anyChanges = true;
+            }
+            break;
+          }
+          case P44DMX_EXTCMD_KEYFRAME: {
+            if (i+2>ln) return anyChanges; // error, not enough data
+            int lightIndex = (uint8_t)aP44BTDMXCmds[i++];
+            uint8_t mask = aP44BTDMXCmds[i++];
+            if (i+__builtin_popcount(mask)>ln) return anyChanges; // error, not enough data
+            uint8_t values[cLightChannels];
+            for (int cidx=0; cidx<cLightChannels; cidx++) {
+              if (mask & (1<<cidx)) values[cidx] = aP44BTDMXCmds[i++];
+            }
+            if (mIsLogger) {
+              string v;
+              for (int cidx=0; cidx<cLightChannels; cidx++) {
+                if (mask & (1<<cidx)) string_format_append(v, " channel#%1d=%03d", cidx, values[cidx]);
+              }
+              LOG(LOG_NOTICE, "L#%03d: keyframe%s", lightIndex, v.c_str());
+            }
+            else {
+              lightIndex -= firstLightNumber;
+              if (lightIndex>=0 && lightIndex<mLights.size()) {
+                FOCUSLOG("- local Light #%d (global #%d): keyframe %02X", lightIndex, lightIndex+firstLightNumber, mask);
+                P44DMXLightPtr light = mLights[lightIndex];
+                for (int cidx=0; cidx<cLightChannels; cidx++) {
+                  if (mask & (1<<cidx)) setLightChannel(lightIndex, cidx, values[cidx]);
+                }
+                if (light->applyChannels()) anyChanges = true; // all channels of the keyframe at once
+              }
+            }
+            break;
+          }
+          case P44DMX_EXTCMD_DELTA: {
+            if (i+3>ln) return anyChanges; // error, not enough data
+            int firstLight = (uint8_t)aP44BTDMXCmds[i++];
+            int numLights = (uint8_t)aP44BTDMXCmds[i++];
+            uint8_t mask = aP44BTDMXCmds[i++];
+            int numDeltas = numLights*__builtin_popcount(mask);
+            if (i+(numDeltas+1)/2>ln) return anyChanges; // error, not enough data
+            const uint8_t* deltas = (const uint8_t*)aP44BTDMXCmds.c_str()+i;
+            i += (numDeltas+1)/2;
+            if (mIsLogger) {
+              LOG(LOG_NOTICE, "L#%03d..L#%03d: deltas for channels %02X: %s", firstLight, firstLight+numLights-1, mask, binaryToHexString(string((const char*)deltas, (numDeltas+1)/2)).c_str());
+            }
+            else {
+              int d = 0; // delta index
+              for (int l=firstLight; l<firstLight+numLights; l++) {
+                int lightIndex = l-firstLightNumber;
+                P44DMXLightPtr light;
+                if (lightIndex>=0 && lightIndex<mLights.size()) light = mLights[lightIndex];
+                for (int cidx=0; cidx<cLightChannels; cidx++) {
+                  if ((mask & (1<<cidx))==0) continue;
+                  int delta = (d & 1) ? deltas[d>>1] & 0x0F : deltas[d>>1]>>4;
+                  delta = (delta ^ 0x08)-0x08; // sign extend
+                  d++;
+                  if (light && delta!=0) {
+                    int v = getLightChannel(lightIndex, cidx)+delta;
+                    setLightChannel(lightIndex, cidx, v<0 ? 0 : (v>255 ? 255 : v));
+                  }
+                }
+                if (light && light->applyChannels()) anyChanges = true;
+              }
+            }
+            break;
+          }
+          case P44DMX_EXTCMD_PAGE: {
+            if (i+1>ln) return anyChanges; // error, not enough data
+            page = (uint8_t)aP44BTDMXCmds[i++];
+            firstLightNumber = page==mPage ? mFirstLightNumber : cOtherPage;
+            if (mIsLogger) {
+              LOG(LOG_NOTICE, "page %d", page);
+            }
+            break;
+          }
+          case P44DMX_EXTCMD_SEQUENCE: {
+            if (i+1>ln) return anyChanges; // error, not enough data
+            i++; // sequence number, not checked here
+            break;
+          }
+          case P44DMX_EXTCMD_SOURCE: {
+            if (i+1>ln) return anyChanges; // error, not enough data
+            i++; // source ID, not checked here
+            break;
+          }
+          case P44DMX_EXTCMD_TIMEBASE: {
+            if (i+4>ln) return anyChanges; // error, not enough data
+            uint32_t ms = 0;
+            for (int k=0; k<4; k++) ms = (ms<<8) | (uint8_t)aP44BTDMXCmds[i++];
+            timeBaseReceived(ms);
+            break;
+          }
+          case P44DMX_EXTCMD_FEC_DATA: {
+            if (i+2>ln) return anyChanges; // error, not enough data
+            string data = aP44BTDMXCmds.substr(0, i-2); // everything before the trailer
+            uint8_t group = aP44BTDMXCmds[i++];
+            uint8_t index = aP44BTDMXCmds[i++];
+            if (mIsLogger) {
+              LOG(LOG_NOTICE, "FEC group %d data #%d", group, index);
+            }
+            if (fecDataReceived(group, index, data)) anyChanges = true;
+            break;
+          }
+          case P44DMX_EXTCMD_FEC_PARITY: {
+            if (i+2>ln) return anyChanges; // error, not enough data
+            uint8_t group = aP44BTDMXCmds[i++];
+            uint8_t count = aP44BTDMXCmds[i++];
+            if (mIsLogger) {
+              LOG(LOG_NOTICE, "FEC group %d parity for %d data packets", group, count);
+            }
+            if (fecParityReceived(group, count, aP44BTDMXCmds.substr(i))) anyChanges = true;
+            return anyChanges; // parity is the rest of the packet
+          }
+          default:
+            return anyChanges; // unknown extended command, length of its data is unknown
         }
       }
       continue;
@@ -232,7 +627,7 @@ bool P44BTDMXreceiver::processP44DMX(const string aP44BTDMXCmds)
     FOCUSLOG("Command for Global Light #%d (DMX: %d)", lightIndex, lightIndex*cLightChannels+1);
     uint8_t cmd = addrCmd - 3*lightIndex; // modulo 3
     if (!mIsLogger) {
-      lightIndex -= mFirstLightNumber;
+      lightIndex -= firstLightNumber;
       if (lightIndex>=mLights.size()) lightIndex = -1; // not one of our lights
     }
     if (i++>=ln) return anyChanges; // error, not enough data: all commands have at least one byte
@@ -244,10 +639,9 @@ bool P44BTDMXreceiver::processP44DMX(const string aP44BTDMXCmds)
           LOG(LOG_NOTICE, "L#%03d: V=%03d", lightIndex, b);
         }
         else if (lightIndex>=0) {
-          FOCUSLOG("- local Light #%d (global #%d): Cmd%d %02X", lightIndex, lightIndex+mFirstLightNumber, cmd, b);
-          P44DMXLightPtr light = mLights[lightIndex];
-          light->setChannel(2,b);
-          if (light->applyChannels()) anyChanges = true;
+          FOCUSLOG("- local Light #%d (global #%d): Cmd%d %02X", lightIndex, lightIndex+firstLightNumber, cmd, b);
+          setLightChannel(lightIndex, 2, b);
+          if (mLights[lightIndex]->applyChannels()) anyChanges = true;
         }
         break;
       }
@@ -261,12 +655,11 @@ bool P44BTDMXreceiver::processP44DMX(const string aP44BTDMXCmds)
           LOG(LOG_NOTICE, "L#%03d: V=%03d H=%03d S=%03d", lightIndex, b, h, s);
         }
         else if (lightIndex>=0) {
-          FOCUSLOG("- local Light #%d (global #%d): Cmd%d %02X %02X %02X", lightIndex, lightIndex+mFirstLightNumber, cmd, h, s, b);
-          P44DMXLightPtr light = mLights[lightIndex];
-          light->setChannel(0,h);
-          light->setChannel(1,s);
-          light->setChannel(2,b);
-          if (light->applyChannels()) anyChanges = true;
+          FOCUSLOG("- local Light #%d (global #%d): Cmd%d %02X %02X %02X", lightIndex, lightIndex+firstLightNumber, cmd, h, s, b);
+          setLightChannel(lightIndex, 0, h);
+          setLightChannel(lightIndex, 1, s);
+          setLightChannel(lightIndex, 2, b);
+          if (mLights[lightIndex]->applyChannels()) anyChanges = true;
         }
         break;
       }
@@ -279,10 +672,9 @@ bool P44BTDMXreceiver::processP44DMX(const string aP44BTDMXCmds)
           LOG(LOG_NOTICE, "L#%03d:     channel#%1d=%03d", lightIndex, cidx, value);
         }
         else if (lightIndex>=0) {
-          FOCUSLOG("- local Light #%d (global #%d): Cmd%d %02X %02X", lightIndex, lightIndex+mFirstLightNumber, cmd, cidx, value);
-          P44DMXLightPtr light = mLights[lightIndex];
-          light->setChannel(cidx,value);
-          if (light->applyChannels()) anyChanges = true;
+          FOCUSLOG("- local Light #%d (global #%d): Cmd%d %02X %02X", lightIndex, lightIndex+firstLightNumber, cmd, cidx, value);
+          setLightChannel(lightIndex, cidx, value);
+          if (mLights[lightIndex]->applyChannels()) anyChanges = true;
         }
         break;
       }
@@ -294,9 +686,43 @@ bool P44BTDMXreceiver::processP44DMX(const string aP44BTDMXCmds)
 }
 
 
-void P44BTDMXreceiver::setAddressingInfo(int aFirstLightNumber)
+void P44BTDMXreceiver::storeScene(uint8_t aSceneNo)
+{
+  // scene data is the channel values of our lights
+  string sceneData;
+  for (int l=0; l<mLights.size(); l++) {
+    for (int cidx=0; cidx<cLightChannels; cidx++) {
+      sceneData.append(1, mLights[l]->getChannel(cidx));
+    }
+  }
+  FOCUSLOG("- storing scene %d for %d local lights", aSceneNo, (int)mLights.size());
+  saveScene(aSceneNo, sceneData);
+}
+
+
+bool P44BTDMXreceiver::recallScene(uint8_t aSceneNo, MLMicroSeconds aFadeTime)
+{
+  string sceneData;
+  if (!loadScene(aSceneNo, sceneData)) {
+    FOCUSLOG("- unknown scene %d", aSceneNo);
+    return false;
+  }
+  FOCUSLOG("- recalling scene %d in %lld mS", aSceneNo, aFadeTime/MilliSecond);
+  bool anyChanges = false;
+  for (int l=0; l<mLights.size() && (l+1)*cLightChannels<=sceneData.size(); l++) {
+    for (int cidx=0; cidx<cLightChannels; cidx++) {
+      setLightChannel(l, cidx, sceneData[l*cLightChannels+cidx], aFadeTime);
+    }
+    if (mLights[l]->applyChannels()) anyChanges = true;
+  }
+  return anyChanges;
+}
+
+
+void P44BTDMXreceiver::setAddressingInfo(int aFirstLightNumber, int aPage)
 {
   mFirstLightNumber = aFirstLightNumber;
+  mPage = aPage;
 }
 
 
@@ -304,7 +730,13 @@ void P44BTDMXreceiver::addLight(P44DMXLightPtr aLight)
 {
   aLight->mGlobalLightOffset = mFirstLightNumber;
   aLight->mLocalLightNumber = mLights.size();
+  aLight->mReceiver = this;
+  aLight->setFineChannels(mFineChannels);
   mLights.push_back(aLight);
+  mOwner.resize(mLights.size()*cLightChannels, 0xFF);
+  for (int i=0; i<cMaxSources; i++) {
+    if (mSources[i].used) mSources[i].values.resize(mLights.size()*cLightChannels, -1);
+  }
   aLight->applyChannels(); // set initial state
 }
 
@@ -312,266 +744,2760 @@ void P44BTDMXreceiver::addLight(P44DMXLightPtr aLight)
 
 
 
-// MARK: - plan44 DMX Light base class
+void P44BTDMXreceiver::setFineChannels(uint8_t aFineChannels)
+{
+  mFineChannels = aFineChannels;
+  for (LightsVector::iterator pos = mLights.begin(); pos!=mLights.end(); ++pos) {
+    (*pos)->setFineChannels(aFineChannels);
+    (*pos)->applyChannels();
+  }
+}
 
-P44DMXLight::P44DMXLight() :
-  mLocalLightNumber(0),
-  mGlobalLightOffset(0)
+
+
+
+
+// MARK: - receiver multiple senders
+
+// - senders can start every payload with a source ID. The receiver keeps the values each source has set
+//   for the channels of its lights (up to cMaxSources sources), and merges them:
+//   - highest takes precedence (HTP) for the channel indices in mHtpChannels (default: brightness):
+//     the highest value of all sources applies
+//   - latest takes precedence (LTP) for all others: the value of the source that changed the channel last
+//     applies. Values merely refreshed (or sent for the first time by a new source) do not take over.
+//   - fine channels follow their coarse channel's source, and HTP compares the 16-bit values
+// - fades and scene recalls fade only when their source wins, otherwise the value of the winning source is set.
+// - a source sending nothing for P44DMX_SOURCE_TIMEOUT is dropped, and the remaining sources take over.
+// - payloads without source ID count as one more source. For these (only), native payloads still lock out
+//   iBeacons from iOS devices for NOT_NATIVE_LOCKOUT_PERIOD. The preference for extended over legacy
+//   advertisements, sequence numbers, FEC groups and the time base are tracked per source.
+// - with a single source, all values pass through unchanged.
+
+int P44BTDMXreceiver::sourceFor(int aSourceId, MLMicroSeconds aNow, bool &aReleased)
 {
-  for (int i=0; i<cNumChannels; i++) {
-    channels[i].current = 1; // to trigger an initial update
-    channels[i].pending = 0;
+  aReleased = false;
+  int src = -1;
+  int oldest = -1;
+  for (int i=0; i<cMaxSources; i++) {
+    Source& s = mSources[i];
+    #if ESP_PLATFORM
+    if (s.used && s.id!=aSourceId && aNow-s.lastSeen>P44DMX_SOURCE_TIMEOUT) {
+      OLOG(LOG_NOTICE, "source %d timed out", s.id);
+      releaseSource(i);
+      aReleased = true;
+    }
+    #endif
+    if (s.used && s.id==aSourceId) src = i;
+    else if (oldest<0 || !s.used || (mSources[oldest].used && s.lastSeen<mSources[oldest].lastSeen)) {
+      if (oldest<0 || mSources[oldest].used) oldest = i;
+    }
+  }
+  if (src<0) {
+    // new source
+    src = oldest;
+    if (mSources[src].used) {
+      OLOG(LOG_NOTICE, "too many sources, source %d replaced", mSources[src].id);
+      releaseSource(src);
+      aReleased = true;
+    }
+    Source& s = mSources[src];
+    s.used = true;
+    s.id = aSourceId;
+    s.lastSeen = aNow;
+    s.lastExtended = Never;
+    s.seqValid = false;
+    s.values.assign(mLights.size()*cLightChannels, -1);
+    OLOG(LOG_INFO, "new source %d", aSourceId);
   }
+  return src;
 }
 
 
-P44DMXLight::~P44DMXLight()
+void P44BTDMXreceiver::releaseSource(int aSource)
 {
+  mSources[aSource].used = false;
+  mSources[aSource].values.clear();
+  if (mTimeBaseSource==aSource) mTimeBaseSource = -1;
+  if (mFecSource==aSource) mFecGroup = -1;
 }
 
 
-/// set single light channel
-void P44DMXLight::setChannel(uint8_t aChannelIndex, uint8_t aValue)
+int P44BTDMXreceiver::mergedSource(int aLightIndex, uint8_t aChannelIndex)
 {
-  if (aChannelIndex>=cNumChannels) return;
-  channels[aChannelIndex].pending = aValue;
+  P44DMXLightPtr light = mLights[aLightIndex];
+  if (aChannelIndex>0 && light->isFineChannel(aChannelIndex)) return mergedSource(aLightIndex, aChannelIndex-1);
+  int k = aLightIndex*cLightChannels+aChannelIndex;
+  int best = -1;
+  if (mHtpChannels & (1<<aChannelIndex)) {
+    // highest takes precedence
+    bool fine = aChannelIndex+1<cLightChannels && light->isFineChannel(aChannelIndex+1);
+    int bestValue = -1;
+    for (int i=0; i<cMaxSources; i++) {
+      Source& s = mSources[i];
+      if (!s.used || s.values[k]<0) continue;
+      int v = s.values[k];
+      if (fine) v = (v<<8) | (s.values[k+1]<0 ? v : s.values[k+1]);
+      if (v>bestValue || (v==bestValue && i==mOwner[k])) {
+        best = i;
+        bestValue = v;
+      }
+    }
+    return best;
+  }
+  // latest takes precedence
+  int owner = mOwner[k];
+  if (owner<cMaxSources && mSources[owner].used && mSources[owner].values[k]>=0) return owner;
+  // owner gone: most recently seen source having a value
+  for (int i=0; i<cMaxSources; i++) {
+    Source& s = mSources[i];
+    if (!s.used || s.values[k]<0) continue;
+    if (best<0 || s.lastSeen>mSources[best].lastSeen) best = i;
+  }
+  return best;
 }
 
 
-bool P44DMXLight::applyChannels()
+void P44BTDMXreceiver::mergeChannel(int aLightIndex, uint8_t aChannelIndex, int aWriter, MLMicroSeconds aFadeTime)
+{
+  P44DMXLightPtr light = mLights[aLightIndex];
+  // coarse channel and its fine channel are merged together
+  uint8_t cidx = aChannelIndex>0 && light->isFineChannel(aChannelIndex) ? aChannelIndex-1 : aChannelIndex;
+  int n = cidx+1<cLightChannels && light->isFineChannel(cidx+1) ? 2 : 1;
+  int src = mergedSource(aLightIndex, cidx);
+  if (src<0) return;
+  for (int i=cidx; i<cidx+n; i++) {
+    int v = mSources[src].values[aLightIndex*cLightChannels+i];
+    if (v<0) continue;
+    if (src==aWriter && i==aChannelIndex) {
+      // the channel just written, from the winning source
+      if (aFadeTime>0) light->fadeChannel(i, v, aFadeTime);
+      else light->setChannel(i, v);
+    }
+    else if (light->getChannel(i)!=v) {
+      light->setChannel(i, v);
+    }
+  }
+}
+
+
+bool P44BTDMXreceiver::mergeAll()
 {
-  // confirm all channels applied
   bool anyChanges = false;
-  for (int i=0; i<cNumChannels; i++) {
-    if (channels[i].current!=channels[i].pending) {
-      OLOG(LOG_INFO,"Channel #%d changed from %d to %d", i, channels[i].current, channels[i].pending);
-      channels[i].current = channels[i].pending;
-      anyChanges = true;
+  for (int l=0; l<mLights.size(); l++) {
+    for (int cidx=0; cidx<cLightChannels; cidx++) {
+      if (cidx>0 && mLights[l]->isFineChannel(cidx)) continue; // merged with its coarse channel
+      mergeChannel(l, cidx, -1, 0);
     }
+    if (mLights[l]->applyChannels()) anyChanges = true;
   }
   return anyChanges;
 }
 
 
+void P44BTDMXreceiver::setLightChannel(int aLightIndex, uint8_t aChannelIndex, uint8_t aValue, MLMicroSeconds aFadeTime)
+{
+  if (aChannelIndex>=cLightChannels) return;
+  if (mSource<0) {
+    // not from a payload, no merging
+    if (aFadeTime>0) mLights[aLightIndex]->fadeChannel(aChannelIndex, aValue, aFadeTime);
+    else mLights[aLightIndex]->setChannel(aChannelIndex, aValue);
+    return;
+  }
+  int k = aLightIndex*cLightChannels+aChannelIndex;
+  int16_t prev = mSources[mSource].values[k];
+  mSources[mSource].values[k] = aValue;
+  if (
+    (prev>=0 && prev!=aValue) || // changed: latest takes precedence
+    mOwner[k]>=cMaxSources || !mSources[mOwner[k]].used // no owner (any more)
+  ) {
+    mOwner[k] = mSource;
+  }
+  mergeChannel(aLightIndex, aChannelIndex, mSource, aFadeTime);
+}
 
-// MARK: - plan44 DMX over Bluetooth sender
 
-P44BTDMXsender::P44BTDMXsender() :
-  mInitialRepeatCount(3),
-  mRefreshUniverse(false)
+uint8_t P44BTDMXreceiver::getLightChannel(int aLightIndex, uint8_t aChannelIndex)
 {
-  for (int i=0; i<cUniverseSize; i++) {
-    mUniverse[i].pending = 0;
-    mUniverse[i].current = 0;
-    mUniverse[i].age = 0; // assume channels all sent out at start
+  if (aChannelIndex>=cLightChannels) return 0;
+  if (mSource>=0) {
+    // relative to what the same source has set
+    int16_t v = mSources[mSource].values[aLightIndex*cLightChannels+aChannelIndex];
+    if (v>=0) return v;
   }
+  return mLights[aLightIndex]->getChannel(aChannelIndex);
 }
 
 
-P44BTDMXsender::~P44BTDMXsender()
+// MARK: - receiver sequence numbers
+
+// - senders can start every payload with a rolling 1-byte sequence number
+// - the receiver keeps track (per source) of the highest sequence number and which of the P44DMX_SEQUENCE_WINDOW
+//   numbers below it were received, to recognize duplicates (advertisements are usually received
+//   several times) and late packets (multiple advertising sets on air at the same time)
+// - numbers skipped count as lost, unless they arrive late (within the window, and only those of the
+//   same source that were counted as lost). Jumps larger than P44DMX_SEQUENCE_MAX_GAP ahead,
+//   or back beyond the window, are taken as a new sequence (sender restart, switch between carriers)
+
+/// @return false if aSeq is a duplicate
+bool P44BTDMXreceiver::sequenceReceived(uint8_t aSeq)
 {
+  Source& src = mSources[mSource];
+  uint8_t ahead = aSeq-src.lastSeq;
+  if (!src.seqValid || (ahead>P44DMX_SEQUENCE_MAX_GAP && ahead<=256-P44DMX_SEQUENCE_WINDOW)) {
+    // (re)start sequence
+    if (src.seqValid) {
+      mSeqStats.resyncs++;
+      if (mIsLogger) LOG(LOG_NOTICE, "seq %d: resync, last was %d", aSeq, src.lastSeq);
+    }
+    src.seqValid = true;
+    src.lastSeq = aSeq;
+    src.seqSeen = 1;
+    src.seqLost = 0;
+    mSeqStats.received++;
+    return true;
+  }
+  if (ahead>P44DMX_SEQUENCE_MAX_GAP) {
+    // behind, within the window
+    uint32_t bit = 1ul<<(uint8_t)(src.lastSeq-aSeq);
+    if (src.seqSeen & bit) {
+      mSeqStats.duplicates++;
+      return false;
+    }
+    src.seqSeen |= bit;
+    mSeqStats.received++;
+    mSeqStats.late++;
+    if (src.seqLost & bit) {
+      // was counted as lost
+      src.seqLost &= ~bit;
+      if (mSeqStats.lost>0) mSeqStats.lost--;
+    }
+    if (mIsLogger) LOG(LOG_NOTICE, "seq %d: late, last was %d", aSeq, src.lastSeq);
+    return true;
+  }
+  if (ahead==0) {
+    mSeqStats.duplicates++;
+    return false;
+  }
+  if (ahead>1) {
+    // gap
+    uint32_t gap = ahead-1;
+    mSeqStats.lost += gap;
+    mSeqStats.gaps++;
+    if (gap>mSeqStats.maxGap) mSeqStats.maxGap = gap;
+    if (mIsLogger) LOG(LOG_NOTICE, "seq %d: %d packets lost", aSeq, gap);
+  }
+  else if (mIsLogger) {
+    LOG(LOG_NOTICE, "seq %d", aSeq);
+  }
+  src.seqSeen = ahead>=P44DMX_SEQUENCE_WINDOW ? 1 : (src.seqSeen<<ahead) | 1;
+  // numbers skipped (bits 1..ahead-1) are lost
+  uint32_t skipped = ahead>=P44DMX_SEQUENCE_WINDOW ? 0xFFFFFFFE : ((1ul<<ahead)-1) & ~1ul;
+  src.seqLost = (ahead>=P44DMX_SEQUENCE_WINDOW ? 0 : src.seqLost<<ahead) | skipped;
+  src.lastSeq = aSeq;
+  mSeqStats.received++;
+  return true;
 }
 
 
-void P44BTDMXsender::reset()
+void P44BTDMXreceiver::getSequenceStats(SequenceStats &aStats, bool aReset)
 {
-  for (int i=0; i<cUniverseSize; i++) {
-    mUniverse[i].current = mUniverse[i].pending; // treat as if updated
-    mUniverse[i].age = 128; // force all channels to be sent once initially, but with less priority than new changes
+  aStats = mSeqStats;
+  if (aReset) {
+    memset(&mSeqStats, 0, sizeof(mSeqStats));
   }
 }
 
 
+// MARK: - receiver shared time base
 
-string P44BTDMXsender::encodeP44BTDMXpayload(const string aPlainText)
+// - senders occasionally append their time (in mS) to a packet. Receivers discipline a shared time base to it,
+//   so animations on different receivers can run in phase (see P44DMXLight::runCycles())
+// - each time base received is a sample of the offset between the sender's and the local clock, reduced by the
+//   delay between the sender taking the time and the receiver getting the packet. That delay varies (pipelining,
+//   advertising events, scanning, BT task and mainloop latency), but never is negative. So the offset is
+//   estimated as the upper envelope (least delayed) of the recent cClockSamples samples.
+// - the drift between the clocks is measured from the offset estimates P44DMX_TIMEBASE_DRIFT_PERIOD apart, and
+//   used to project older samples to now, and the time base between samples
+// - a time base deviating too much from the expected one (sender restart) starts over
+// - the 32-bit mS time wraps after ~49 days, and is unwrapped around the expected value
+// - with multiple senders, the time base is taken from the first source sending it, until that source times out
+
+void P44BTDMXreceiver::timeBaseReceived(uint32_t aTimeBaseMs)
 {
-  uint16_t crc = 0;
-  string encoded;
-  int i;
-  for (i=0; i<aPlainText.size(); i++) {
-    uint8_t b = aPlainText[i];
-    crc = crc16(crc, b);
-    encoded.append(1, b ^ systemKeyByte(i));
+  if (mPacketTime==Never) return; // time of reception unknown
+  if (mSource>=0) {
+    // senders have different clocks, stick to one
+    if (mTimeBaseSource>=0 && mTimeBaseSource!=mSource) return;
+    mTimeBaseSource = mSource;
+  }
+  MLMicroSeconds local = mPacketTime;
+  MLMicroSeconds tb = (MLMicroSeconds)aTimeBaseMs*MilliSecond;
+  if (mNumClockSamples>0) {
+    MLMicroSeconds expected = timeBaseAt(local);
+    int64_t expectedMs = expected/MilliSecond;
+    tb = (expectedMs+(int32_t)(aTimeBaseMs-(uint32_t)expectedMs))*MilliSecond;
+    if (tb-expected>P44DMX_TIMEBASE_MAX_JUMP || expected-tb>P44DMX_TIMEBASE_MAX_JUMP) {
+      OLOG(LOG_NOTICE, "time base jumped by %lld mS, restarting clock discipline", (tb-expected)/MilliSecond);
+      mNumClockSamples = 0;
+      tb = (MLMicroSeconds)aTimeBaseMs*MilliSecond;
+    }
+  }
+  if (mNumClockSamples==0) {
+    // (re)start
+    mNextClockSample = 0;
+    mClockDrift = 0;
+    mDriftValid = false;
+    mDriftLocal = Never;
+  }
+  ClockSample& cs = mClockSamples[mNextClockSample];
+  cs.local = local;
+  cs.offset = tb-local;
+  mNextClockSample = (mNextClockSample+1)%cClockSamples;
+  if (mNumClockSamples<cClockSamples) mNumClockSamples++;
+  // offset: upper envelope of the samples projected to now
+  MLMicroSeconds offset = cs.offset;
+  for (int i=0; i<mNumClockSamples; i++) {
+    MLMicroSeconds o = mClockSamples[i].offset+(MLMicroSeconds)(mClockDrift*(local-mClockSamples[i].local));
+    if (o>offset) offset = o;
+  }
+  mClockLocal = local;
+  mClockOffset = offset;
+  // drift
+  if (mDriftLocal==Never) {
+    if (mNumClockSamples==cClockSamples) {
+      // window filled: start measuring
+      mDriftLocal = local;
+      mDriftOffset = offset;
+    }
+  }
+  else if (local-mDriftLocal>=P44DMX_TIMEBASE_DRIFT_PERIOD) {
+    double drift = (double)(offset-mDriftOffset)/(local-mDriftLocal);
+    if (mDriftValid) drift = mClockDrift+(drift-mClockDrift)/4; // smooth
+    if (drift>P44DMX_TIMEBASE_MAX_DRIFT) drift = P44DMX_TIMEBASE_MAX_DRIFT;
+    else if (drift<-P44DMX_TIMEBASE_MAX_DRIFT) drift = -P44DMX_TIMEBASE_MAX_DRIFT;
+    mClockDrift = drift;
+    mDriftValid = true;
+    mDriftLocal = local;
+    mDriftOffset = offset;
+  }
+  FOCUSLOG("time base %u mS: sample offset %lld uS, offset %lld uS, drift %.1f ppm", aTimeBaseMs, cs.offset, mClockOffset, mClockDrift*1E6);
+  if (mIsLogger) {
+    LOG(LOG_NOTICE, "time base %u mS: offset %lld uS (sample %+lld uS), drift %.1f ppm", aTimeBaseMs, mClockOffset, cs.offset-mClockOffset, mClockDrift*1E6);
   }
-  encoded.append(1, ((crc>>8)^systemKeyByte(i)) & 0xFF);
-  encoded.append(1, (crc^systemKeyByte(i+1)) & 0xFF);
-  return encoded;
 }
 
 
-uint8_t P44BTDMXsender::getChannel(uint16_t aDMXChannel)
+MLMicroSeconds P44BTDMXreceiver::timeBaseAt(MLMicroSeconds aLocalTime)
 {
-  if (aDMXChannel>=cUniverseSize) return 0;
-  return mUniverse[aDMXChannel].pending;
+  return aLocalTime+mClockOffset+(MLMicroSeconds)(mClockDrift*(aLocalTime-mClockLocal));
 }
 
 
-void P44BTDMXsender::setChannel(uint16_t aDMXChannel, uint8_t aValue)
+MLMicroSeconds P44BTDMXreceiver::localTimeAt(MLMicroSeconds aTimeBase)
 {
-  if (aDMXChannel>=cUniverseSize) return;
-  if (FOCUSLOGGING) {
-    if (mUniverse[aDMXChannel].pending!=aValue) {
-      FOCUSLOG("DMX #%u pending value changes from %u to %u", aDMXChannel+1, mUniverse[aDMXChannel].pending, aValue);
+  return mClockLocal+(MLMicroSeconds)((aTimeBase-mClockLocal-mClockOffset)/(1+mClockDrift));
+}
+
+
+bool P44BTDMXreceiver::getTimeBaseInfo(MLMicroSeconds &aOffset, double &aDrift)
+{
+  aOffset = mClockOffset;
+  aDrift = mClockDrift;
+  return hasTimeBase();
+}
+
+
+// MARK: - receiver forward error correction
+
+// - the receiver collects the data packets of the current FEC group, and the parity packet when it arrives
+// - with the parity and all but one data packet of a group, the missing packet is rebuilt and applied
+// - a new group number abandons the previous group, rebuilding is possible only within a group
+// - so does a packet from another source, groups of different senders cannot be told apart by number
+
+void P44BTDMXreceiver::startFecGroup(int aGroup)
+{
+  mFecSource = mSource;
+  mFecGroup = aGroup;
+  mFecReceived = 0;
+  mFecCount = 0;
+  mFecParity.clear();
+  for (int i=0; i<cMaxFecGroupSize; i++) mFecData[i].clear();
+}
+
+
+bool P44BTDMXreceiver::fecDataReceived(uint8_t aGroup, uint8_t aIndex, const string aData)
+{
+  if (aGroup!=mFecGroup || mSource!=mFecSource) startFecGroup(aGroup);
+  if (aIndex>=cMaxFecGroupSize || (mFecReceived & (1<<aIndex))) return false; // invalid or duplicate
+  mFecReceived |= 1<<aIndex;
+  mFecData[aIndex] = aData;
+  return rebuildFecPacket();
+}
+
+
+bool P44BTDMXreceiver::fecParityReceived(uint8_t aGroup, uint8_t aCount, const string aParity)
+{
+  if (aGroup!=mFecGroup || mSource!=mFecSource) startFecGroup(aGroup);
+  if (aCount<1 || aCount>cMaxFecGroupSize || mFecCount>0) return false; // invalid or duplicate
+  mFecCount = aCount;
+  mFecParity = aParity;
+  return rebuildFecPacket();
+}
+
+
+bool P44BTDMXreceiver::rebuildFecPacket()
+{
+  if (mFecCount==0) return false; // no parity yet
+  int missing = -1;
+  for (int i=0; i<mFecCount; i++) {
+    if ((mFecReceived & (1<<i))==0) {
+      if (missing>=0) return false; // more than one packet missing, cannot rebuild
+      missing = i;
     }
   }
-  mUniverse[aDMXChannel].pending = aValue;
+  if (missing<0) return false; // nothing missing
+  // XOR of the parity and all other data packets is the missing packet
+  // (shorter packets count as filled up with NOPs)
+  string packet = mFecParity;
+  for (int i=0; i<mFecCount; i++) {
+    if (i==missing) continue;
+    const string& data = mFecData[i];
+    if (data.size()>packet.size()) return false; // inconsistent group
+    for (size_t k=0; k<packet.size(); k++) packet[k] ^= k<data.size() ? data[k] : 0xFF;
+  }
+  mFecReceived |= 1<<missing;
+  FOCUSLOG("FEC group %d: rebuilt missing data packet #%d", mFecGroup, missing);
+  if (mIsLogger) {
+    LOG(LOG_NOTICE, "FEC group %d: rebuilt data packet #%d", mFecGroup, missing);
+  }
+  return processP44DMX(packet);
 }
 
 
-void P44BTDMXsender::setChannels(uint16_t aFromChannel, uint16_t aNumChannels, const uint8_t* aDMXChannelData)
+// MARK: - plan44 DMX Light base class
+
+P44DMXLight::P44DMXLight() :
+  mLocalLightNumber(0),
+  mGlobalLightOffset(0),
+  mFineChannels(0),
+  mReceiver(NULL)
 {
-  for (int i=0; i<aNumChannels; i++) {
-    setChannel(aFromChannel+i, aDMXChannelData[i]);
+  for (int i=0; i<cNumChannels; i++) {
+    channels[i].current = 1; // to trigger an initial update
+    channels[i].pending = 0;
+    mFades[i].duration = 0;
   }
+  #if ESP_PLATFORM
+  mCycleTime = 0;
+  mCycleNo = 0;
+  #endif
 }
 
 
-// DMX-to-BT update strategy
-// - for each DMX channel in the universe (512 channels), we have
-//   - pending value (as recently received from DMX)
-//   - current value to detect changes
-//   - age: number of cycles not sent, 0=just sent
-// - Global param: initialrepeatcount, how many times a change is repeated quickly
-// - for every (BT Advertisement sending) cycle:
-//   - compare all current with previous values, set age to 255 if changed
-//   - find max age
-//   - generate p44DMX delta updates for entries with found max age
-//   - if age>255-initialrepeatcount set age:=age-1
-//   - otherwise, set age to 0 (for all bytes actually sent in p44DMX update packet
-//   - if p44DMX data packet still has room, repeat with finding remaining max age
-//   - increment all ages <255.
-//   - send the p44DMX packet
+P44DMXLight::~P44DMXLight()
+{
+}
 
-// Flaws:
-// - too many recent changes will prevent initial repeating -> badly lagging change in case of packet loss
-// - small changes generated by light desk smoothing -> too many recent changes
-// -> handle larger changes before smaller ones
+
+/// set single light channel
+void P44DMXLight::setChannel(uint8_t aChannelIndex, uint8_t aValue)
+{
+  if (aChannelIndex>=cNumChannels) return;
+  channels[aChannelIndex].pending = aValue;
+  mFades[aChannelIndex].duration = 0; // explicit value ends fade
+}
 
 
-string P44BTDMXsender::generateP44DMXcmds(int aMaxBytes)
+#define FADE_STEP_INTERVAL (20*MilliSecond)
+
+void P44DMXLight::fadeChannel(uint8_t aChannelIndex, uint8_t aTarget, MLMicroSeconds aDuration)
 {
-  string cmds;
-  // detect changes
-  for (int i=0; i<cUniverseSize; i++) {
-    if (mUniverse[i].pending != mUniverse[i].current) {
-      LOG(LOG_INFO, "channel #%d changes from %d to %d", i, mUniverse[i].current, mUniverse[i].pending);
-      mUniverse[i].age = 255;
-      mUniverse[i].current = mUniverse[i].pending;
-    }
+  if (aChannelIndex>=cNumChannels) return;
+  #if ESP_PLATFORM
+  if (aDuration>FADE_STEP_INTERVAL && aTarget!=channels[aChannelIndex].pending) {
+    ChannelFade& f = mFades[aChannelIndex];
+    f.from = channels[aChannelIndex].pending;
+    f.to = aTarget;
+    f.start = MainLoop::now();
+    f.duration = aDuration;
+    mFadeTicket.executeOnce(boost::bind(&P44DMXLight::fadeStep, this), FADE_STEP_INTERVAL);
+    return;
   }
-  int room = aMaxBytes;
-  int lastMaxAge = 9999;
-  int recentChangeMinAge = 255-mInitialRepeatCount;
-  uint8_t doneAge = 0;
-  while (room>=2) {
-    // find highest remaining age not already covered in this packet
-    int maxAge = 0;
-    for (int i=0; i<cUniverseSize; i++) {
-      if (mUniverse[i].age>maxAge && mUniverse[i].age<lastMaxAge) {
-        maxAge = mUniverse[i].age;
-      }
-    }
-    if (maxAge==0) {
-      break; // no more aged values smaller than those already seen in last iteration
-    }
-    else if (maxAge>recentChangeMinAge) {
-      // high ages meaning we are repeating recent changes
-      lastMaxAge = recentChangeMinAge; // prevent repeating recent changes in same cycle
-      doneAge = maxAge-1; // repeat with one priority less than current cycle
+  #endif
+  // too short to fade (or no mainloop for timing fades): just set
+  setChannel(aChannelIndex, aTarget);
+}
+
+
+#if ESP_PLATFORM
+
+void P44DMXLight::fadeStep()
+{
+  MLMicroSeconds now = MainLoop::now();
+  bool fading = false;
+  for (int i=0; i<cNumChannels; i++) {
+    ChannelFade& f = mFades[i];
+    if (f.duration==0) continue;
+    MLMicroSeconds progress = now-f.start;
+    if (progress>=f.duration) {
+      channels[i].pending = f.to;
+      f.duration = 0;
     }
     else {
-      // just repeat oldest values
-      lastMaxAge = maxAge;
-      doneAge = 0;
-    }
-    // generate updates for oldest (=most urgent) lights
-    // Note: check light by light
-    for (int lidx=0; lidx<cNumLights; lidx++) {
-      int loffs = lidx*cLightChannels;
-      // light layout: HSB + n extra channels
-      // - 0: hue
-      // - 1: saturation
-      // - 2: brightness
-      // - 3..n: other channels
-      // p44DMX delta update commands:
-      // - address byte with 3*lightnumber+cmd
-      // - lightnumber: 0..84 (address div 3)
-      // - cmd: 0..2 (address mod 3)
-      //   - 0=brightness (B channel), 1 data byte
-      //   - 1=HSB, 3 data bytes
-      //   - 2=channelindex/value, 2 data bytes
-      if ((mUniverse[loffs+0].age==maxAge || mUniverse[loffs+1].age==maxAge) && room>=4) {
-        // hue or saturation needs update -> need a HSB packet
-        cmds.append(1, 3*lidx + 0x01); // HSB update command
-        cmds.append(1, mUniverse[loffs+0].current); // H
-        cmds.append(1, mUniverse[loffs+1].current); // S
-        cmds.append(1, mUniverse[loffs+2].current); // B
-        room -= 4;
-        // reset age for update sent
-        mUniverse[loffs+0].age = doneAge;
-        mUniverse[loffs+1].age = doneAge;
-        mUniverse[loffs+2].age = doneAge;
-      }
-      else if (mUniverse[loffs+2].age==maxAge) {
-        // brightness changed, has priority over position/mode
-        cmds.append(1, 3*lidx + 0x00); // Brightness update command
-        cmds.append(1, mUniverse[loffs+2].current); // B
-        room -= 2;
-        // reset age for update sent
-        mUniverse[loffs+2].age = doneAge;
-      }
-      // other channels might be sent in addition to brightness or HSB
-      for (int cidx = 3; cidx<cLightChannels; cidx++) {
-        if (mUniverse[loffs+cidx].age==maxAge && room>=3) {
-          // other channel needs update -> need a channelindex/value packet
-          cmds.append(1, 3*lidx + 0x02); // channelindex/value update command
-          cmds.append(1, cidx); // channel index
-          cmds.append(1, mUniverse[loffs+cidx].current); // value
-          room -= 3;
-          // reset age for update sent
-          mUniverse[loffs+cidx].age = doneAge;
-        }
-      }
-      if (room<2) break; // no point in checking further
+      channels[i].pending = f.from + ((int)f.to-(int)f.from)*progress/f.duration;
+      fading = true;
     }
   }
-  // one update created, now age all
-  if (mRefreshUniverse) {
-    for (int i=0; i<cUniverseSize; i++) {
-      if (mUniverse[i].age<recentChangeMinAge) mUniverse[i].age++;
-    }
+  applyChannels();
+  if (fading) {
+    mFadeTicket.executeOnce(boost::bind(&P44DMXLight::fadeStep, this), FADE_STEP_INTERVAL);
+  }
+}
+
+
+// Animation cycles
+// - cycles start at multiples of the cycle time in the time base shared by all receivers of a sender, so
+//   animations started by the same command on different receivers run in phase, regardless of when each
+//   receiver got the command
+// - the animation is restarted at every cycle, so it follows the shared time base instead of drifting away
+//   with the local clock (and with the timing of the animation steps)
+// - without a shared time base, cycles are timed by the local clock
+
+void P44DMXLight::runCycles(MLMicroSeconds aCycleTime, CycleStartCB aCycleStartCB)
+{
+  mCycleTime = aCycleTime;
+  mCycleStartCB = aCycleStartCB;
+  if (mReceiver && mReceiver->hasTimeBase()) {
+    mCycleNo = 0;
+    scheduleNextCycle();
   }
-  // return the commands
-  if (LOGENABLED(LOG_INFO) && !cmds.empty()) {
-    OLOG(LOG_INFO, "p44DMX delta cmds: %s", binaryToHexString(cmds, ' ').c_str());
+  else {
+    startCycle(0);
   }
-  return cmds;
 }
 
 
-string P44BTDMXsender::generateP44BTDMXpayload(int aMaxBytes, int aMinBytes)
+void P44DMXLight::stopCycles()
 {
-  if (aMinBytes==0) aMinBytes = aMaxBytes-2;
-  string cmds = generateP44DMXcmds(aMaxBytes-2);
-  if (cmds.empty()) return ""; // nothing at all
-  int fill = aMinBytes-(int)cmds.size();
-  if (fill>0) {
-    cmds.append(fill,0xFF); // fill up with extended/NOP commands
+  mCycleTicket.cancel();
+  mCycleStartCB = NULL;
+}
+
+
+void P44DMXLight::startCycle(uint32_t aCycleNo)
+{
+  mCycleNo = aCycleNo;
+  if (mCycleStartCB) mCycleStartCB(aCycleNo);
+  scheduleNextCycle();
+}
+
+
+void P44DMXLight::scheduleNextCycle()
+{
+  if (mCycleTime<=0) return;
+  if (mReceiver && mReceiver->hasTimeBase()) {
+    MLMicroSeconds now = MainLoop::now();
+    uint32_t next = (uint32_t)(mReceiver->timeBaseAt(now)/mCycleTime)+1;
+    if (next==mCycleNo) next++; // ticket fired a little early
+    mCycleTicket.executeOnce(boost::bind(&P44DMXLight::startCycle, this, next), mReceiver->localTimeAt((MLMicroSeconds)next*mCycleTime)-now);
+  }
+  else {
+    mCycleTicket.executeOnce(boost::bind(&P44DMXLight::startCycle, this, mCycleNo+1), mCycleTime);
   }
-  return encodeP44BTDMXpayload(cmds);
 }
 
+#endif // ESP_PLATFORM
+
 
-string P44BTDMXsender::generateBTAdvMfgData(int aMaxBytes)
+uint8_t P44DMXLight::getChannel(uint8_t aChannelIndex)
 {
-  string payload = generateP44BTDMXpayload(aMaxBytes-5);
-  if (payload.empty()) return ""; // nothing at all
-  string advData;
-  advData.append(1, payload.size()+4); // length = ADStruct type, 2 byte company identifier, 1 byte subytpe + payload
-  advData.append(1, 0xFF); // ADStruct type: manufacturer specific data
-  advData.append(1, BT_COMPANY_ID_BLUEKITCHEN & 0xFF); // LSB of company ID
-  advData.append(1, (BT_COMPANY_ID_BLUEKITCHEN>>8) & 0xFF); // MSB of company ID
-  advData.append(1, PLAN44_SUBTYPE_P44BTDMX); // subtype
-  advData.append(payload);
-  return advData;
+  if (aChannelIndex>=cNumChannels) return 0;
+  if (mFades[aChannelIndex].duration>0) return mFades[aChannelIndex].to;
+  return channels[aChannelIndex].pending;
+}
+
+
+// Fine channels
+// - DMX consoles send 16-bit values for dimmer or position as pairs of a coarse (high byte) and
+//   a fine (low byte) channel. With a fine channel layout set, a light can use the fine byte from
+//   the channel following the coarse one via channelValue16() or channelValue().
+// - without a fine channel, the 8-bit value is scaled to the full 16-bit range (255 -> 0xFFFF).
+
+bool P44DMXLight::channelChanged(uint8_t aChannelIndex)
+{
+  if (aChannelIndex>=cNumChannels) return false;
+  if (channels[aChannelIndex].pending!=channels[aChannelIndex].current) return true;
+  return
+    aChannelIndex+1<cNumChannels && isFineChannel(aChannelIndex+1) &&
+    channels[aChannelIndex+1].pending!=channels[aChannelIndex+1].current;
+}
+
+
+uint16_t P44DMXLight::channelValue16(uint8_t aChannelIndex)
+{
+  if (aChannelIndex>=cNumChannels) return 0;
+  uint16_t v = channels[aChannelIndex].pending<<8;
+  if (aChannelIndex+1<cNumChannels && isFineChannel(aChannelIndex+1)) return v | channels[aChannelIndex+1].pending;
+  return v | channels[aChannelIndex].pending;
+}
+
+
+bool P44DMXLight::applyChannels()
+{
+  // confirm all channels applied
+  bool anyChanges = false;
+  for (int i=0; i<cNumChannels; i++) {
+    if (channels[i].current!=channels[i].pending) {
+      OLOG(LOG_INFO,"Channel #%d changed from %d to %d", i, channels[i].current, channels[i].pending);
+      channels[i].current = channels[i].pending;
+      anyChanges = true;
+    }
+  }
+  return anyChanges;
+}
+
+
+
+// MARK: - plan44 DMX over Bluetooth sender
+
+// universe is processed in words of 4 channels where possible
+static const int cWordChannels = sizeof(uint32_t);
+
+static inline uint32_t channelWord(const uint8_t* aChannels)
+{
+  uint32_t w;
+  memcpy(&w, aChannels, cWordChannels); // compiles to single load for aligned data
+  return w;
+}
+
+/// @return true if any of the four bytes in aWord is zero
+static inline bool hasZeroByte(uint32_t aWord)
+{
+  return ((aWord-0x01010101ul) & ~aWord & 0x80808080ul)!=0;
+}
+
+
+P44BTDMXsender::P44BTDMXsender() :
+  mRepeatInterval(1),
+  mRefreshInterval(100),
+  mMinRepeats(3),
+  mMaxRepeats(5),
+  mRepeatBacklog(0),
+  mLastPacketBytes(23),
+  mInitialRepeatCount(3),
+  mRefreshUniverse(false),
+  mSchedulingMode(sched_age),
+  mNowMs(0),
+  mDeadband(0),
+  mSuppressedChanges(0),
+  mSuppressedUpdates(0),
+  mRecalledScene(-1),
+  mSceneCmd(0),
+  mSceneCmdScene(0),
+  mSceneCmdFade(0),
+  mSceneCmdRepeats(0),
+  mUsesPriorityClasses(false),
+  mFineChannels(0),
+  mMaxRefreshAge(255-3),
+  mAgeBase(0),
+  mOptimizedPacking(false),
+  mExtendedCommands(false),
+  mFecGroupSize(0),
+  mFecIndex(0),
+  mFecGroupNo(0),
+  mFecParityLen(0),
+  mSequenceNumbers(false),
+  mSequenceNo(0),
+  mSourceId(-1),
+  mTimeBaseInterval(0),
+  mLastTimeBase(Never),
+  mNextPage(0)
+{
+  memset(mPending, 0, cUniverseSize);
+  memset(mCurrent, 0, cUniverseSize);
+  memset(mAnchor, 0, cUniverseSize);
+  memset(mAgeSlot, 0, cUniverseSize); // assume channels all sent out at start
+  memset(mDirty, 0, sizeof(mDirty));
+  memset(mRepeatsLeft, 0, cUniverseSize);
+  memset(mSentInPacket, 0, sizeof(mSentInPacket));
+  memset(mChannelClass, 0, sizeof(mChannelClass));
+  memset(mClassOverrides, 0, sizeof(mClassOverrides));
+  memset(mPriorityClass, 0, cUniverseSize);
+  memset(mFading, 0, sizeof(mFading));
+  memset(mFadeStarted, 0, sizeof(mFadeStarted));
+  memset(mLastSent, 0, cUniverseSize);
+  memset(mLastSentValid, 0, sizeof(mLastSentValid));
+  memset(mDeltaPending, 0, sizeof(mDeltaPending));
+  memset(mDeltaRun, 0, cUniverseSize);
+  memset(mPassedOver, 0, cUniverseSize);
+  memset(mFecHeld, 0, sizeof(mFecHeld));
+  rebuildAgeIndex();
+}
+
+
+P44BTDMXsender::~P44BTDMXsender()
+{
+}
+
+
+void P44BTDMXsender::reset()
+{
+  mAgeBase = 0; // slot==age
+  memcpy(mCurrent, mPending, cUniverseSize); // treat as if updated
+  memcpy(mAnchor, mPending, cUniverseSize);
+  memset(mAgeSlot, 128, cUniverseSize); // force all channels to be sent once initially, but with less priority than new changes
+  memset(mDirty, 0, sizeof(mDirty));
+  memset(mRepeatsLeft, 0, cUniverseSize);
+  mRepeatBacklog = 0;
+  memset(mFading, 0, sizeof(mFading));
+  memset(mFadeStarted, 0, sizeof(mFadeStarted));
+  memset(mLastSentValid, 0, sizeof(mLastSentValid));
+  memset(mDeltaPending, 0, sizeof(mDeltaPending));
+  memset(mDeltaRun, 0, cUniverseSize);
+  memset(mPassedOver, 0, cUniverseSize);
+  memset(mFecHeld, 0, sizeof(mFecHeld));
+  mFecIndex = 0; // open FEC group is abandoned
+  mFecGroupNo++;
+  for (int i=0; i<mRamps.size(); i++) mRamps[i].points = 0;
+  rebuildAgeIndex();
+}
+
+
+void P44BTDMXsender::setInitialRepeatCount(int aInitialRepeatCount)
+{
+  if (aInitialRepeatCount<0) aInitialRepeatCount = 0;
+  if (aInitialRepeatCount!=mInitialRepeatCount) {
+    mInitialRepeatCount = aInitialRepeatCount;
+    updateAgeLayout();
+  }
+  for (PagesVector::iterator pos = mPages.begin(); pos!=mPages.end(); ++pos) (*pos)->setInitialRepeatCount(aInitialRepeatCount);
+}
+
+
+void P44BTDMXsender::setRefreshUniverse(bool aRefreshUniverse)
+{
+  mRefreshUniverse = aRefreshUniverse;
+  for (PagesVector::iterator pos = mPages.begin(); pos!=mPages.end(); ++pos) (*pos)->setRefreshUniverse(aRefreshUniverse);
+}
+
+
+void P44BTDMXsender::setOptimizedPacking(bool aOptimizedPacking)
+{
+  mOptimizedPacking = aOptimizedPacking;
+  for (PagesVector::iterator pos = mPages.begin(); pos!=mPages.end(); ++pos) (*pos)->setOptimizedPacking(aOptimizedPacking);
+}
+
+
+void P44BTDMXsender::setExtendedCommands(bool aExtendedCommands)
+{
+  mExtendedCommands = aExtendedCommands;
+  for (PagesVector::iterator pos = mPages.begin(); pos!=mPages.end(); ++pos) (*pos)->setExtendedCommands(aExtendedCommands);
+}
+
+
+void P44BTDMXsender::setSequenceNumbers(bool aSequenceNumbers)
+{
+  mSequenceNumbers = aSequenceNumbers;
+  // pages need to know for deltas only, sequence numbers are sent here
+  for (PagesVector::iterator pos = mPages.begin(); pos!=mPages.end(); ++pos) (*pos)->mSequenceNumbers = aSequenceNumbers;
+}
+
+
+void P44BTDMXsender::setSchedulingMode(SchedulingMode aSchedulingMode)
+{
+  if (aSchedulingMode!=mSchedulingMode) {
+    mSchedulingMode = aSchedulingMode;
+    updateAgeLayout();
+  }
+  for (PagesVector::iterator pos = mPages.begin(); pos!=mPages.end(); ++pos) (*pos)->setSchedulingMode(aSchedulingMode);
+}
+
+
+void P44BTDMXsender::setDeadlineParams(int aRepeatInterval, int aRefreshInterval, int aMinRepeats, int aMaxRepeats)
+{
+  mRepeatInterval = aRepeatInterval<1 ? 1 : (aRepeatInterval>cMaxRepeatInterval ? cMaxRepeatInterval : aRepeatInterval);
+  mRefreshInterval = aRefreshInterval<1 ? 1 : (aRefreshInterval>cRefreshOverdueAge ? cRefreshOverdueAge : aRefreshInterval);
+  mMinRepeats = aMinRepeats<1 ? 1 : (aMinRepeats>255 ? 255 : aMinRepeats);
+  mMaxRepeats = aMaxRepeats<mMinRepeats ? mMinRepeats : (aMaxRepeats>255 ? 255 : aMaxRepeats);
+  for (PagesVector::iterator pos = mPages.begin(); pos!=mPages.end(); ++pos) {
+    (*pos)->setDeadlineParams(aRepeatInterval, aRefreshInterval, aMinRepeats, aMaxRepeats);
+  }
+}
+
+
+void P44BTDMXsender::setChannelPriorityClass(int aChannelIndex, int aClass)
+{
+  if (aChannelIndex<0 || aChannelIndex>=cLightChannels) return;
+  if (aClass<0) aClass = 0;
+  if (aClass>=cPriorityClasses) aClass = cPriorityClasses-1;
+  mChannelClass[aChannelIndex] = aClass;
+  for (int l=0; l<cNumLights; l++) {
+    if ((mClassOverrides[l] & (1<<aChannelIndex))==0) {
+      mPriorityClass[l*cLightChannels+aChannelIndex] = aClass;
+    }
+  }
+  updatePriorityClasses();
+  for (PagesVector::iterator pos = mPages.begin(); pos!=mPages.end(); ++pos) (*pos)->setChannelPriorityClass(aChannelIndex, aClass);
+}
+
+
+void P44BTDMXsender::setLightPriorityClass(int aLightIndex, int aChannelIndex, int aClass)
+{
+  if (aLightIndex<0 || aLightIndex>=cNumLights || aChannelIndex<0 || aChannelIndex>=cLightChannels) return;
+  if (aClass<0) {
+    // back to class of the channel index
+    mClassOverrides[aLightIndex] &= ~(1<<aChannelIndex);
+    aClass = mChannelClass[aChannelIndex];
+  }
+  else {
+    if (aClass>=cPriorityClasses) aClass = cPriorityClasses-1;
+    mClassOverrides[aLightIndex] |= (1<<aChannelIndex);
+  }
+  mPriorityClass[aLightIndex*cLightChannels+aChannelIndex] = aClass;
+  updatePriorityClasses();
+}
+
+
+int P44BTDMXsender::getPriorityClass(int aLightIndex, int aChannelIndex)
+{
+  if (aChannelIndex<0 || aChannelIndex>=cLightChannels) return -1;
+  if (aLightIndex<0) return mChannelClass[aChannelIndex];
+  if (aLightIndex>=cNumLights || (mClassOverrides[aLightIndex] & (1<<aChannelIndex))==0) return -1;
+  return mPriorityClass[aLightIndex*cLightChannels+aChannelIndex];
+}
+
+
+void P44BTDMXsender::setFineChannels(uint8_t aFineChannels)
+{
+  mFineChannels = aFineChannels & 0xFE; // channel 0 cannot be a fine channel
+  updatePriorityClasses(); // fine-only changes use the lowest priority class
+  for (PagesVector::iterator pos = mPages.begin(); pos!=mPages.end(); ++pos) (*pos)->setFineChannels(aFineChannels);
+}
+
+
+void P44BTDMXsender::updatePriorityClasses()
+{
+  bool uses = mFineChannels!=0;
+  for (int i=0; i<cUniverseSize; i++) {
+    if (mPriorityClass[i]) { uses = true; break; }
+  }
+  if (uses!=mUsesPriorityClasses) {
+    mUsesPriorityClasses = uses;
+    updateAgeLayout(); // number of priority bands changes
+  }
+}
+
+
+void P44BTDMXsender::updateAgeLayout()
+{
+  int levels = mSchedulingMode==sched_magnitude || mUsesPriorityClasses ? cMagnitudeLevels : 1;
+  if (mInitialRepeatCount*levels>255) mInitialRepeatCount = 255/levels;
+  // ring size changes: convert slots back to plain ages (which are valid slots with mAgeBase==0)
+  for (int i=0; i<cUniverseSize; i++) {
+    mAgeSlot[i] = channelAge(i);
+  }
+  if (mSchedulingMode==sched_deadline) {
+    // all ages rotate, except the parked ones
+    mMaxRefreshAge = cOverdueAge;
+  }
+  else {
+    mMaxRefreshAge = 255-mInitialRepeatCount*levels;
+  }
+  mAgeBase = 0;
+  rebuildAgeIndex();
+}
+
+
+// MARK: - sender age index
+
+void P44BTDMXsender::rebuildAgeIndex()
+{
+  memset(mAgeCount, 0, sizeof(mAgeCount));
+  memset(mAgeLights, 0, sizeof(mAgeLights));
+  for (int i=0; i<cUniverseSize; i++) {
+    uint8_t slot = mAgeSlot[i];
+    int lidx = i/cLightChannels;
+    mAgeCount[slot]++;
+    mAgeLights[slot][lidx>>5] |= 1ul<<(lidx & 0x1F);
+  }
+}
+
+
+void P44BTDMXsender::setChannelAge(int aDMXChannel, uint8_t aAge)
+{
+  if (mFecHeld[aDMXChannel>>5] & (1ul<<(aDMXChannel & 0x1F))) {
+    mFecAge[aDMXChannel] = aAge; // takes effect when the FEC group ends
+    return;
+  }
+  uint8_t oldSlot = mAgeSlot[aDMXChannel];
+  uint8_t newSlot = slotForAge(aAge);
+  if (newSlot==oldSlot) return;
+  mAgeSlot[aDMXChannel] = newSlot;
+  int lidx = aDMXChannel/cLightChannels;
+  uint32_t lbit = 1ul<<(lidx & 0x1F);
+  mAgeCount[oldSlot]--;
+  mAgeCount[newSlot]++;
+  mAgeLights[newSlot][lidx>>5] |= lbit;
+  // light leaves the old slot only if none of its other channels is still there
+  const uint8_t* lightSlots = mAgeSlot+lidx*cLightChannels;
+  uint32_t oldSlots = oldSlot*0x01010101ul;
+  for (int i=0; i<cLightChannels; i+=cWordChannels) {
+    if (hasZeroByte(channelWord(lightSlots+i)^oldSlots)) return;
+  }
+  mAgeLights[oldSlot][lidx>>5] &= ~lbit;
+}
+
+
+void P44BTDMXsender::mergeIntoAgeBelow(int aAge)
+{
+  int fromSlot = slotForAge(aAge);
+  int toSlot = slotForAge(aAge-1);
+  if (mAgeCount[fromSlot]==0) return;
+  for (int w=0; w<cLightMaskWords; w++) {
+    uint32_t m = mAgeLights[fromSlot][w];
+    while (m) {
+      int lidx = (w<<5)+__builtin_ctz(m);
+      m &= m-1;
+      int loffs = lidx*cLightChannels;
+      for (int i=loffs; i<loffs+cLightChannels; i++) {
+        if (mAgeSlot[i]==fromSlot) mAgeSlot[i] = toSlot;
+      }
+    }
+    mAgeLights[toSlot][w] |= mAgeLights[fromSlot][w];
+    mAgeLights[fromSlot][w] = 0;
+  }
+  mAgeCount[toSlot] += mAgeCount[fromSlot];
+  mAgeCount[fromSlot] = 0;
+}
+
+
+void P44BTDMXsender::ageUniverse()
+{
+  // all ages below mMaxRefreshAge increment by one, the ones at mMaxRefreshAge stay
+  if (mMaxRefreshAge<1) return; // nothing can age
+  // merge channels already at max age into the slot that will become max age
+  mergeIntoAgeBelow(mMaxRefreshAge);
+  if (mSchedulingMode==sched_deadline) {
+    // refresh deadlines have their own max age below the repeat deadlines
+    mergeIntoAgeBelow(cRefreshOverdueAge);
+  }
+  // rotate the ring: now empty top slot becomes age 0, all others get one older
+  mAgeBase = (mAgeBase+mMaxRefreshAge)%(mMaxRefreshAge+1);
+}
+
+
+void P44BTDMXsender::verifyAgeIndex()
+{
+  uint16_t counts[256];
+  LightMask lights[256];
+  memset(counts, 0, sizeof(counts));
+  memset(lights, 0, sizeof(lights));
+  for (int i=0; i<cUniverseSize; i++) {
+    uint8_t slot = mAgeSlot[i];
+    int lidx = i/cLightChannels;
+    counts[slot]++;
+    lights[slot][lidx>>5] |= 1ul<<(lidx & 0x1F);
+  }
+  if (memcmp(counts, mAgeCount, sizeof(counts))!=0 || memcmp(lights, mAgeLights, sizeof(lights))!=0) {
+    OLOG(LOG_ERR, "age index inconsistent with universe");
+  }
+}
+
+
+
+int P44BTDMXsender::encodeP44BTDMXpayload(uint8_t* aBuffer, int aPlainTextLen)
+{
+  uint16_t crc = 0;
+  int i;
+  for (i=0; i<aPlainTextLen; i++) {
+    crc = crc16(crc, aBuffer[i]);
+    aBuffer[i] ^= systemKeyByte(i);
+  }
+  aBuffer[i] = ((crc>>8)^systemKeyByte(i)) & 0xFF;
+  aBuffer[i+1] = (crc^systemKeyByte(i+1)) & 0xFF;
+  return aPlainTextLen+2;
+}
+
+
+string P44BTDMXsender::encodeP44BTDMXpayload(const string aPlainText)
+{
+  string encoded = aPlainText;
+  encoded.append(2, 0); // room for CRC
+  encodeP44BTDMXpayload((uint8_t*)&encoded[0], (int)aPlainText.size());
+  return encoded;
+}
+
+
+uint8_t P44BTDMXsender::getChannel(uint16_t aDMXChannel)
+{
+  if (aDMXChannel>=cUniverseSize) return 0;
+  return mPending[aDMXChannel];
+}
+
+
+void P44BTDMXsender::setChannel(uint16_t aDMXChannel, uint8_t aValue)
+{
+  if (aDMXChannel>=cUniverseSize) return;
+  if (mPending[aDMXChannel]!=aValue) {
+    FOCUSLOG("DMX #%u pending value changes from %u to %u", aDMXChannel+1, mPending[aDMXChannel], aValue);
+    mPending[aDMXChannel] = aValue;
+    mDirty[aDMXChannel>>5] |= 1ul<<(aDMXChannel & 0x1F);
+    if (mFading[aDMXChannel>>5] & (1ul<<(aDMXChannel & 0x1F))) {
+      endFade(aDMXChannel, fadeValue(aDMXChannel, mNowMs)); // no timestamp, cannot be part of a ramp
+    }
+  }
+}
+
+
+void P44BTDMXsender::setChannels(uint16_t aFromChannel, uint16_t aNumChannels, const uint8_t* aDMXChannelData, MLMicroSeconds aTimestamp)
+{
+  if (aFromChannel>=cUniverseSize) return;
+  bool trackRamps = !mRamps.empty() && aTimestamp!=Never;
+  if (trackRamps) mNowMs = (uint32_t)(aTimestamp/MilliSecond);
+  int endChannel = aFromChannel+aNumChannels;
+  if (endChannel>cUniverseSize) endChannel = cUniverseSize;
+  int i = aFromChannel;
+  const uint8_t* src = aDMXChannelData;
+  while (i<endChannel) {
+    // compare block of channels covered by one dirty bitmap word at once
+    int blockEnd = (i|0x1F)+1;
+    if (blockEnd>endChannel) blockEnd = endChannel;
+    if (memcmp(mPending+i, src, blockEnd-i)==0) {
+      // no changes in this block
+      src += blockEnd-i;
+      i = blockEnd;
+      continue;
+    }
+    uint32_t dirty = 0;
+    for (; i<blockEnd; i++, src++) {
+      if (mPending[i]!=*src) {
+        FOCUSLOG("DMX #%u pending value changes from %u to %u", i+1, mPending[i], *src);
+        uint8_t old = mPending[i];
+        mPending[i] = *src;
+        if (trackRamps) {
+          if (((mFineChannels>>(i%cLightChannels)) & 1)==0) trackRamp(i, old, *src); // fine channels wrap, cannot be faded
+        }
+        else if (mFading[i>>5] & (1ul<<(i & 0x1F))) {
+          endFade(i, fadeValue(i, mNowMs)); // no timestamp, cannot be part of a ramp
+        }
+        dirty |= 1ul<<(i & 0x1F);
+      }
+    }
+    mDirty[(blockEnd-1)>>5] |= dirty;
+  }
+  if (trackRamps) trackFades();
+}
+
+
+// Scenes
+// - the sender keeps a copy of the universe for every scene, the receivers keep the channel values of their lights.
+// - storing a scene sends a store command as soon as all pending changes are delivered, so the receivers
+//   capture the same state as the sender. While the store command is repeated, new changes are held back.
+// - whenever the DMX input changes such that the universe matches a scene, a single recall command
+//   is sent (repeated like a change) instead of all the changes. Receivers which missed the store
+//   command (or the recall) are corrected by the background refresh.
+
+#define SCENE_CMD_REPEATS 8 ///< scene commands are short and rare, but a receiver missing one stays wrong until refreshed
+
+void P44BTDMXsender::loadScenes()
+{
+  string sceneData;
+  for (int sceneNo=0; sceneNo<cMaxScenes; sceneNo++) {
+    loadScene(sceneNo, sceneData);
+  }
+  OLOG(LOG_INFO, "%d scenes loaded", (int)mScenes.size());
+}
+
+
+bool P44BTDMXsender::storeScene(int aSceneNo)
+{
+  if (aSceneNo<0 || aSceneNo>=cMaxScenes) return false;
+  // the scene is only saved when the receivers get the store command, see packSceneCmd()
+  mStoreSceneData.assign((const char*)mPending, cUniverseSize);
+  mSceneCmd = P44DMX_EXTCMD_SCENE_STORE;
+  mSceneCmdScene = aSceneNo;
+  mSceneCmdRepeats = SCENE_CMD_REPEATS;
+  return true;
+}
+
+
+bool P44BTDMXsender::recallScene(int aSceneNo, MLMicroSeconds aFadeTime)
+{
+  string sceneData;
+  if (aSceneNo<0 || aSceneNo>=cMaxScenes || !loadScene(aSceneNo, sceneData) || sceneData.size()!=cUniverseSize) return false;
+  setChannels(0, cUniverseSize, (const uint8_t*)sceneData.c_str());
+  int fadeUnits = (int)(aFadeTime/(P44DMX_FADE_TIME_UNIT_MS*MilliSecond));
+  sceneRecalled(aSceneNo, fadeUnits>255 ? 255 : fadeUnits);
+  return true;
+}
+
+
+/// @return number of the first scene matching the universe, -1 if none
+int P44BTDMXsender::matchingScene()
+{
+  for (SceneMap::iterator pos=mScenes.begin(); pos!=mScenes.end(); ++pos) {
+    if (pos->second.size()==cUniverseSize && memcmp(pos->second.c_str(), mPending, cUniverseSize)==0) return pos->first;
+  }
+  return -1;
+}
+
+
+void P44BTDMXsender::sceneRecalled(uint8_t aSceneNo, uint8_t aFadeUnits)
+{
+  OLOG(LOG_INFO, "universe matches scene %d, sending recall", aSceneNo);
+  mRecalledScene = aSceneNo;
+  mSceneCmd = P44DMX_EXTCMD_SCENE_RECALL;
+  mSceneCmdScene = aSceneNo;
+  mSceneCmdFade = aFadeUnits;
+  mSceneCmdRepeats = SCENE_CMD_REPEATS;
+  mStoreSceneData.clear(); // a store in progress is obsolete
+  // the recall delivers all channels, no pending changes, repeats or fades left
+  memcpy(mCurrent, mPending, cUniverseSize);
+  memcpy(mAnchor, mPending, cUniverseSize);
+  memset(mDirty, 0, sizeof(mDirty));
+  memset(mFading, 0, sizeof(mFading));
+  memset(mFadeStarted, 0, sizeof(mFadeStarted));
+  memcpy(mLastSent, mPending, cUniverseSize);
+  memset(mLastSentValid, 0xFF, sizeof(mLastSentValid));
+  memset(mDeltaPending, 0, sizeof(mDeltaPending));
+  memset(mDeltaRun, 0, cUniverseSize);
+  for (int i=0; i<mRamps.size(); i++) mRamps[i].points = 0;
+  for (int i=0; i<cUniverseSize; i++) {
+    int age = channelAge(i);
+    if (mSchedulingMode==sched_deadline) {
+      if (mRepeatsLeft[i]>0) {
+        mRepeatsLeft[i] = 0;
+        mRepeatBacklog--;
+      }
+      if (age!=cParkedAge && (age>cRefreshOverdueAge || !mRefreshUniverse)) {
+        setChannelAge(i, mRefreshUniverse ? cRefreshOverdueAge-classInterval(mRefreshInterval, mPriorityClass[i], cRefreshOverdueAge) : cParkedAge);
+      }
+    }
+    else if (age>mMaxRefreshAge || (!mRefreshUniverse && age>0)) {
+      setChannelAge(i, 0); // just refreshed
+    }
+  }
+}
+
+
+int P44BTDMXsender::getBacklog()
+{
+  int backlog = 0;
+  for (int w=0; w<cDirtyWords; w++) {
+    backlog += __builtin_popcount(mDirty[w]); // changes not yet detected
+  }
+  if (mSchedulingMode==sched_deadline) {
+    backlog += mRepeatBacklog;
+  }
+  else {
+    for (int age=mMaxRefreshAge+1; age<256; age++) backlog += mAgeCount[slotForAge(age)];
+  }
+  if (mSceneCmd!=0) backlog++;
+  for (PagesVector::iterator pos = mPages.begin(); pos!=mPages.end(); ++pos) {
+    backlog += (*pos)->getBacklog();
+  }
+  return backlog;
+}
+
+
+/// @return true if changes are still being sent with priority
+bool P44BTDMXsender::changesPending()
+{
+  if (mSchedulingMode==sched_deadline) return mRepeatBacklog>0;
+  for (int age=mMaxRefreshAge+1; age<256; age++) {
+    if (mAgeCount[slotForAge(age)]>0) return true;
+  }
+  return false;
+}
+
+
+int P44BTDMXsender::packSceneCmd(uint8_t* aBuffer, int aMaxBytes)
+{
+  if (mSceneCmd==0 || aMaxBytes<4) return 0;
+  if (mSceneCmd==P44DMX_EXTCMD_SCENE_STORE && !mStoreSceneData.empty()) {
+    if (memcmp(mStoreSceneData.c_str(), mPending, cUniverseSize)!=0) {
+      // universe has changed, receivers would not store the scene's state any more
+      OLOG(LOG_WARNING, "universe changed before scene %d could be stored in the receivers", mSceneCmdScene);
+      mStoreSceneData.clear();
+      mSceneCmd = 0;
+      return 0;
+    }
+    if (changesPending()) return 0; // receivers must have the scene's state first
+    // receivers get the store command from now on, so the sender can use the scene as well
+    saveScene(mSceneCmdScene, mStoreSceneData);
+    mStoreSceneData.clear();
+    mRecalledScene = mSceneCmdScene;
+    OLOG(LOG_NOTICE, "stored scene %d", mSceneCmdScene);
+  }
+  uint8_t* cmds = aBuffer;
+  *cmds++ = 0xFF; // extended command
+  *cmds++ = mSceneCmd;
+  *cmds++ = mSceneCmdScene;
+  if (mSceneCmd==P44DMX_EXTCMD_SCENE_RECALL) *cmds++ = mSceneCmdFade;
+  if (--mSceneCmdRepeats<=0) mSceneCmd = 0;
+  return (int)(cmds-aBuffer);
+}
+
+
+// Fades
+// - linear ramps (such as generated by a console running a fade) are detected per channel by checking
+//   if changes lie on the line from the ramp origin through the previous change.
+// - when RAMP_MIN_POINTS changes lie on the ramp, the ramp is extrapolated FADE_LOOKAHEAD_MS into
+//   the future and sent as a single fade command, which the receivers interpolate locally.
+// - as long as the DMX values stay within RAMP_TOLERANCE of the fade, they are not sent at all, and
+//   refreshes and repeats of the channel send the fade command with the remaining fade time.
+// - when the values leave the fade, the fade ends and the actual value is sent as a normal change,
+//   when a fade is complete while the ramp continues, the next fade segment is started.
+
+#define RAMP_MIN_POINTS 4 ///< number of changes on a line needed to detect a ramp
+#define RAMP_TOLERANCE 2 ///< max deviation of a value from the ramp
+#define RAMP_MAX_STEP_MS 1000 ///< changes further apart do not belong to the same ramp
+#define FADE_LOOKAHEAD_MS 2000 ///< how far a ramp is extrapolated for a fade
+#define FADE_MIN_MS 200 ///< shorter fades are not worth sending as a fade
+
+void P44BTDMXsender::setFadeDetection(bool aFadeDetection)
+{
+  if (aFadeDetection) {
+    if (mRamps.empty()) mRamps.resize(cUniverseSize);
+  }
+  else {
+    for (int i=0; i<mRamps.size(); i++) {
+      if (mFading[i>>5] & (1ul<<(i & 0x1F))) endFade(i, fadeValue(i, mNowMs));
+    }
+    mRamps.clear();
+  }
+  for (PagesVector::iterator pos = mPages.begin(); pos!=mPages.end(); ++pos) (*pos)->setFadeDetection(aFadeDetection);
+}
+
+
+void P44BTDMXsender::trackRamp(int aDMXChannel, uint8_t aOldValue, uint8_t aNewValue)
+{
+  ChannelRamp& r = mRamps[aDMXChannel];
+  if (r.points==0 || mNowMs-r.lastMs>RAMP_MAX_STEP_MS) {
+    // first change of a possible ramp
+    r.origin = aNewValue;
+    r.originMs = mNowMs;
+    r.points = 1;
+  }
+  else if (r.points==1) {
+    // second change defines the slope
+    r.points = 2;
+  }
+  else {
+    // check if the new value is on the line from the origin through the previous change
+    int span = r.lastMs-r.originMs;
+    int expected = span>0 ? r.origin+((int)aOldValue-r.origin)*(int)(mNowMs-r.originMs)/span : aOldValue;
+    if (abs((int)aNewValue-expected)<=RAMP_TOLERANCE && ((int)aNewValue-aOldValue)*((int)aOldValue-r.origin)>0) {
+      if (r.points<255) r.points++;
+    }
+    else {
+      // possibly a new ramp, starting at the previous change
+      r.origin = aOldValue;
+      r.originMs = r.lastMs;
+      r.points = 2;
+    }
+  }
+  r.lastMs = mNowMs;
+  if (r.points>=RAMP_MIN_POINTS && (mFading[aDMXChannel>>5] & (1ul<<(aDMXChannel & 0x1F)))==0) {
+    startFade(aDMXChannel);
+  }
+}
+
+
+bool P44BTDMXsender::startFade(int aDMXChannel)
+{
+  ChannelRamp& r = mRamps[aDMXChannel];
+  // extrapolate the line from the origin through the last change
+  int span = r.lastMs-r.originMs;
+  int delta = (int)mPending[aDMXChannel]-r.origin;
+  if (span<=0 || delta==0) return false;
+  int start = r.origin+delta*(int)(mNowMs-r.originMs)/span;
+  if (start<0 || start>255) return false;
+  int duration = FADE_LOOKAHEAD_MS;
+  int target = start+delta*duration/span;
+  if (target>255) {
+    duration = (255-start)*span/delta;
+    target = 255;
+  }
+  else if (target<0) {
+    duration = -start*span/delta;
+    target = 0;
+  }
+  if (duration<FADE_MIN_MS) return false;
+  r.fadeStart = start;
+  r.fadeTarget = target;
+  r.fadeStartMs = mNowMs;
+  r.fadeDuration = duration;
+  uint32_t bit = 1ul<<(aDMXChannel & 0x1F);
+  mFading[aDMXChannel>>5] |= bit;
+  mFadeStarted[aDMXChannel>>5] |= bit;
+  mDirty[aDMXChannel>>5] |= bit;
+  FOCUSLOG("DMX #%u starts fading from %d to %d in %d mS", aDMXChannel+1, start, target, duration);
+  return true;
+}
+
+
+void P44BTDMXsender::endFade(int aDMXChannel, uint8_t aReceiverValue)
+{
+  uint32_t bit = 1ul<<(aDMXChannel & 0x1F);
+  mFading[aDMXChannel>>5] &= ~bit;
+  mFadeStarted[aDMXChannel>>5] &= ~bit;
+  // receivers have (approximately) this value now, send actual value if different
+  mCurrent[aDMXChannel] = aReceiverValue;
+  mAnchor[aDMXChannel] = aReceiverValue;
+  mDirty[aDMXChannel>>5] |= bit;
+}
+
+
+uint8_t P44BTDMXsender::fadeValue(int aDMXChannel, uint32_t aAtMs)
+{
+  const ChannelRamp& r = mRamps[aDMXChannel];
+  uint32_t elapsed = aAtMs-r.fadeStartMs;
+  if (elapsed>=r.fadeDuration) return r.fadeTarget;
+  return r.fadeStart+((int)r.fadeTarget-r.fadeStart)*(int)elapsed/r.fadeDuration;
+}
+
+
+void P44BTDMXsender::trackFades()
+{
+  for (int w=0; w<cDirtyWords; w++) {
+    uint32_t fading = mFading[w];
+    while (fading) {
+      int i = (w<<5)+__builtin_ctz(fading);
+      fading &= fading-1;
+      const ChannelRamp& r = mRamps[i];
+      if (r.fadeStartMs==mNowMs) continue; // just started
+      uint8_t expected = fadeValue(i, mNowMs);
+      if (abs((int)mPending[i]-expected)>RAMP_TOLERANCE) {
+        // left the fade
+        FOCUSLOG("DMX #%u leaves fade at %d (expected %d)", i+1, mPending[i], expected);
+        endFade(i, expected);
+      }
+      else if (mNowMs-r.fadeStartMs>=r.fadeDuration) {
+        // fade complete, continue with next segment if still on the ramp
+        if (mNowMs-r.lastMs>RAMP_MAX_STEP_MS || !startFade(i)) {
+          endFade(i, r.fadeTarget);
+        }
+      }
+    }
+  }
+}
+
+
+uint8_t* P44BTDMXsender::encodeFade(uint8_t* aCmds, int aDMXChannel)
+{
+  const ChannelRamp& r = mRamps[aDMXChannel];
+  uint32_t elapsed = mNowMs-r.fadeStartMs;
+  int remaining = elapsed<r.fadeDuration ? r.fadeDuration-elapsed : 0;
+  *aCmds++ = 0xFF; // extended command
+  *aCmds++ = P44DMX_EXTCMD_FADE;
+  *aCmds++ = aDMXChannel/cLightChannels; // light number
+  *aCmds++ = aDMXChannel%cLightChannels; // channel index
+  *aCmds++ = r.fadeTarget;
+  *aCmds++ = (remaining+P44DMX_FADE_TIME_UNIT_MS/2)/P44DMX_FADE_TIME_UNIT_MS;
+  return aCmds;
+}
+
+
+// DMX-to-BT update strategy
+// - for each DMX channel in the universe (512 channels), we have
+//   - pending value (as recently received from DMX)
+//   - current value to detect changes
+//   - age: number of cycles not sent, 0=just sent
+// - Global param: initialrepeatcount, how many times a change is repeated quickly
+// - for every (BT Advertisement sending) cycle:
+//   - compare all current with previous values (only those marked dirty by setChannel(s)), set age to 255 if changed
+//   - find max age
+//   - generate p44DMX delta updates for entries with found max age
+//   - if age>255-initialrepeatcount set age:=age-1
+//   - otherwise, set age to 0 (for all bytes actually sent in p44DMX update packet
+//   - if p44DMX data packet still has room, repeat with finding remaining max age
+//   - increment all ages <255.
+//   - send the p44DMX packet
+// - the age index (channel count and set of lights per age) makes finding the max age and
+//   the lights having channels of that age independent of the universe size. Ageing the
+//   universe just rotates the index (see ageUniverse()).
+
+// Flaws:
+// - too many recent changes will prevent initial repeating -> badly lagging change in case of packet loss
+// - small changes generated by light desk smoothing -> too many recent changes
+// -> handle larger changes before smaller ones: sched_magnitude
+//    - the ages above the max refresh age are divided into cMagnitudeLevels bands of initialrepeatcount ages
+//    - changes start at the top of the band corresponding to their weighted size (see changeLevel())
+//    - every band gets at most one pass per packet, so the repeats of a large change are not delayed
+//      by small ones, but each small change is still repeated initialrepeatcount times.
+// -> bounded worst case delivery time: sched_deadline
+//    - the age of a channel represents its deadline: age = overdue age-(number of packets until due)
+//      so the ageing of the universe (ring rotation) is the passing of time, and the max age
+//      passes naturally select the earliest deadlines first.
+//    - changes are due immediately, are then repeated every mRepeatInterval packets, and after the
+//      last repeat are refreshed every mRefreshInterval packets (or parked when not refreshing)
+//    - repeat deadlines use ages above cRefreshOverdueAge, refresh deadlines ages up to cRefreshOverdueAge,
+//      each with its own max age, so repeats always have priority over (even overdue) refreshes.
+//    - the number of repeats adapts to the load: mMaxRepeats when idle, down to mMinRepeats when
+//      the backlog of repeats exceeds what can be sent within mRepeatInterval packets.
+//    - as long as the backlog can be handled, a change is sent N times within N*mRepeatInterval packets.
+// -> channels differ in how quickly changes become visible: priority classes
+//    - every channel has a priority class (per channel index, optionally overridden per light)
+//    - in sched_age and sched_magnitude modes, the class is the minimal priority band a change starts in
+//    - in sched_deadline mode, lower classes get proportionally longer repeat and refresh intervals
+// -> noisy DMX sources jitter on idle channels: deadband
+//    - changes within mDeadband of the last change sent with priority (the anchor) are not scheduled
+//      as changes, but the new value is delivered by the background refresh (or a single low
+//      priority send when not refreshing), so receivers still converge to the exact value.
+//    - slow drifts do not get lost: once the value leaves the deadband around the anchor,
+//      it is a normal change again.
+
+
+/// @return priority level of a change, 0=most important..cMagnitudeLevels-1
+int P44BTDMXsender::changeLevel(int aChannelIndex, uint8_t aOldValue, uint8_t aNewValue)
+{
+  int delta = abs((int)aNewValue-(int)aOldValue);
+  switch (aChannelIndex % cLightChannels) {
+    case 0: // hue: is circular
+      if (delta>128) delta = 256-delta;
+      // fall through
+    case 1: // saturation
+      delta *= 2;
+      break;
+    case 2: // brightness
+      delta *= 4;
+      break;
+    default: // position, size, speed, gradient, mode
+      break;
+  }
+  if (delta>=128) return 0;
+  if (delta>=32) return 1;
+  if (delta>=8) return 2;
+  return 3;
+}
+
+
+string P44BTDMXsender::generateP44DMXcmds(int aMaxBytes)
+{
+  string cmds;
+  if (aMaxBytes>0) {
+    cmds.resize(aMaxBytes);
+    cmds.resize(generateP44DMXcmds((uint8_t*)&cmds[0], aMaxBytes));
+  }
+  return cmds;
+}
+
+
+void P44BTDMXsender::detectChanges()
+{
+  if (!mScenes.empty()) {
+    bool anyDirty = false;
+    for (int w=0; w<cDirtyWords && !anyDirty; w++) anyDirty = mDirty[w]!=0;
+    if (anyDirty) {
+      // the universe has changed, check if it matches a scene now
+      int sceneNo = matchingScene();
+      if (sceneNo>=0 && sceneNo!=mRecalledScene) {
+        sceneRecalled(sceneNo, 0); // sends a recall instead of the changes
+      }
+      mRecalledScene = sceneNo;
+    }
+  }
+  int repeats = mSchedulingMode==sched_deadline ? adaptiveRepeatCount() : 0;
+  // only check channels that were set to a different value since last time
+  for (int w=0; w<cDirtyWords; w++) {
+    uint32_t dirty = mDirty[w];
+    uint32_t changed = 0; // channels with a change scheduled in this word
+    mDirty[w] = 0;
+    while (dirty) {
+      int i = (w<<5)+__builtin_ctz(dirty);
+      dirty &= dirty-1;
+      uint32_t bit = 1ul<<(i & 0x1F);
+      uint8_t newValue = mPending[i];
+      if (mFading[w] & bit) {
+        if ((mFadeStarted[w] & bit)==0) {
+          // change is covered by a fade already scheduled
+          mCurrent[i] = mPending[i];
+          continue;
+        }
+        // new fade: schedule like a change to the fade target
+        mFadeStarted[w] &= ~bit;
+        newValue = mRamps[i].fadeTarget;
+      }
+      else if (mPending[i]==mCurrent[i]) {
+        continue; // no actual change
+      }
+      else if (mDeadband>0 && abs((int)mPending[i]-mAnchor[i])<=mDeadband) {
+        // within deadband: no priority update, the refresh delivers the exact value
+        mSuppressedChanges++;
+        mSuppressedUpdates += mSchedulingMode==sched_deadline ? repeats : mInitialRepeatCount;
+        mCurrent[i] = mPending[i];
+        scheduleRefresh(i);
+        continue;
+      }
+      mAnchor[i] = mPending[i];
+      int delta = (int)newValue-mLastSent[i];
+      if (
+        mExtendedCommands && mRefreshUniverse && mSequenceNumbers && mFecGroupSize==0 &&
+        (mFading[w] & bit)==0 && (mLastSentValid[w] & bit) &&
+        delta>=P44DMX_DELTA_MIN && delta<=P44DMX_DELTA_MAX &&
+        ((mDeltaPending[w] & bit) || !(mSchedulingMode==sched_deadline ? mRepeatsLeft[i]>0 : scheduledAge(i)>mMaxRefreshAge)) &&
+        mDeltaRun[i]<P44DMX_MAX_DELTA_RUN
+      ) {
+        // small change of a channel the receivers are up to date with (no change still being repeated): can be sent as a delta
+        mDeltaPending[w] |= bit;
+      }
+      else {
+        mDeltaPending[w] &= ~bit;
+      }
+      changed |= bit;
+      // fine channel changing together with its coarse channel (always in the same word) goes along with it,
+      // fine-only changes have the lowest priority
+      bool fine = (mFineChannels>>(i%cLightChannels)) & 1;
+      bool withCoarse = fine && (changed & (bit>>1));
+      if (mSchedulingMode==sched_deadline) {
+        // due now (or later for lower priority classes), to be sent repeats times
+        if (mRepeatsLeft[i]==0) mRepeatBacklog++;
+        mRepeatsLeft[i] = repeats;
+        LOG(LOG_INFO, "channel #%d changes from %d to %d (%d repeats)", i, mCurrent[i], mPending[i], repeats);
+        if (withCoarse) {
+          setChannelAge(i, scheduledAge(i-1));
+        }
+        else {
+          int delay = (fine ? cPriorityClasses-1 : mPriorityClass[i])*mRepeatInterval;
+          setChannelAge(i, cOverdueAge-(delay>cMaxRepeatInterval ? cMaxRepeatInterval : delay));
+        }
+      }
+      else if (withCoarse) {
+        LOG(LOG_INFO, "channel #%d changes from %d to %d (fine channel, along with coarse)", i, mCurrent[i], mPending[i]);
+        setChannelAge(i, scheduledAge(i-1));
+      }
+      else {
+        int level = fine ? cPriorityClasses-1 : mPriorityClass[i];
+        if (mSchedulingMode==sched_magnitude) {
+          int magnitudeLevel = changeLevel(i, mCurrent[i], newValue);
+          if (magnitudeLevel>level) level = magnitudeLevel;
+        }
+        LOG(LOG_INFO, "channel #%d changes from %d to %d (priority level %d)", i, mCurrent[i], mPending[i], level);
+        // start at the top of the band for the priority level
+        setChannelAge(i, 255-level*mInitialRepeatCount);
+      }
+      mCurrent[i] = mPending[i];
+    }
+  }
+}
+
+
+void P44BTDMXsender::scheduleRefresh(int aDMXChannel)
+{
+  // make sure the channel gets sent eventually, even when the universe is not refreshed
+  if (mSchedulingMode==sched_deadline) {
+    if (channelAge(aDMXChannel)==cParkedAge) {
+      setChannelAge(aDMXChannel, cRefreshOverdueAge-classInterval(mRefreshInterval, mPriorityClass[aDMXChannel], cRefreshOverdueAge));
+    }
+  }
+  else if (!mRefreshUniverse && channelAge(aDMXChannel)<mInitialRepeatCount) {
+    setChannelAge(aDMXChannel, mInitialRepeatCount); // lowest priority, but still repeated (see sentAge())
+  }
+}
+
+
+void P44BTDMXsender::setDeadband(int aDeadband)
+{
+  mDeadband = aDeadband<0 ? 0 : aDeadband;
+  for (PagesVector::iterator pos = mPages.begin(); pos!=mPages.end(); ++pos) (*pos)->setDeadband(aDeadband);
+}
+
+
+void P44BTDMXsender::getDeadbandStats(uint32_t &aSuppressedChanges, uint32_t &aSuppressedUpdates, bool aReset)
+{
+  aSuppressedChanges = mSuppressedChanges;
+  aSuppressedUpdates = mSuppressedUpdates;
+  if (aReset) {
+    mSuppressedChanges = 0;
+    mSuppressedUpdates = 0;
+  }
+  for (PagesVector::iterator pos = mPages.begin(); pos!=mPages.end(); ++pos) {
+    uint32_t changes, updates;
+    (*pos)->getDeadbandStats(changes, updates, aReset);
+    aSuppressedChanges += changes;
+    aSuppressedUpdates += updates;
+  }
+}
+
+
+uint8_t P44BTDMXsender::sentAge(int aAge)
+{
+  if (aAge>mMaxRefreshAge) {
+    // repeating recent change: repeat with one priority less, or end up as oldest refresh when done repeating
+    int rank = aAge-mMaxRefreshAge-1;
+    return rank%mInitialRepeatCount==0 ? mMaxRefreshAge : aAge-1;
+  }
+  if (!mRefreshUniverse && aAge<=mInitialRepeatCount) {
+    return aAge-1; // low priority repeats of changes suppressed by the deadband
+  }
+  return 0; // just refreshed
+}
+
+
+int P44BTDMXsender::nextPassAge(int &aLastMaxAge, int &aRefreshMaxAge)
+{
+  // find highest remaining age not already covered in this packet
+  int maxAge = aLastMaxAge-1;
+  if (maxAge>aRefreshMaxAge && maxAge<=mMaxRefreshAge) maxAge = aRefreshMaxAge;
+  if (mSchedulingMode==sched_deadline && maxAge>cOverdueAge) maxAge = cOverdueAge; // parked channels are never due
+  while (maxAge>0 && mAgeCount[slotForAge(maxAge)]==0) maxAge--;
+  if (maxAge>mMaxRefreshAge) {
+    // high ages meaning we are repeating recent changes
+    int rank = maxAge-mMaxRefreshAge-1;
+    aLastMaxAge = maxAge-rank%mInitialRepeatCount; // prevent repeating recent changes of same priority in same cycle
+    aRefreshMaxAge = mMaxRefreshAge-1; // prevent changes just done repeating to get refreshed in same cycle
+  }
+  else {
+    // just repeat oldest values
+    aLastMaxAge = maxAge;
+  }
+  return maxAge; // 0 if no more aged values smaller than those already seen in last iteration
+}
+
+
+void P44BTDMXsender::channelSent(int aDMXChannel, uint8_t aDoneAge)
+{
+  // remember what the receivers have now
+  uint32_t bit = 1ul<<(aDMXChannel & 0x1F);
+  mLastSent[aDMXChannel] = mCurrent[aDMXChannel];
+  if (mFading[aDMXChannel>>5] & bit) mLastSentValid[aDMXChannel>>5] &= ~bit; // receivers have a fade in progress
+  else mLastSentValid[aDMXChannel>>5] |= bit;
+  mDeltaPending[aDMXChannel>>5] &= ~bit;
+  mDeltaRun[aDMXChannel] = 0;
+  mPassedOver[aDMXChannel] = 0;
+  if (mSchedulingMode==sched_deadline) {
+    // park at age 0 (never selected) for the rest of this packet, new deadline is set in scheduleSentChannels()
+    setChannelAge(aDMXChannel, 0);
+    mSentInPacket[aDMXChannel>>5] |= 1ul<<(aDMXChannel & 0x1F);
+  }
+  else {
+    setChannelAge(aDMXChannel, aDoneAge);
+  }
+  if (mFecGroupSize>0) holdChannel(aDMXChannel);
+}
+
+
+void P44BTDMXsender::scheduleSentChannels()
+{
+  for (int w=0; w<cDirtyWords; w++) {
+    uint32_t sent = mSentInPacket[w];
+    mSentInPacket[w] = 0;
+    while (sent) {
+      int i = (w<<5)+__builtin_ctz(sent);
+      sent &= sent-1;
+      if (mRepeatsLeft[i]>0) {
+        mRepeatsLeft[i]--;
+        if (mRepeatsLeft[i]==0) mRepeatBacklog--;
+      }
+      if (mRepeatsLeft[i]>0) {
+        setChannelAge(i, cOverdueAge-classInterval(mRepeatInterval, mPriorityClass[i], cMaxRepeatInterval)); // next repeat
+      }
+      else if (mRefreshUniverse) {
+        setChannelAge(i, cRefreshOverdueAge-classInterval(mRefreshInterval, mPriorityClass[i], cRefreshOverdueAge)); // background refresh
+      }
+      else {
+        setChannelAge(i, cParkedAge); // no refresh
+      }
+    }
+  }
+}
+
+
+/// @return interval scaled for the priority class: class 0 uses the interval as is, lower priority classes multiples of it
+int P44BTDMXsender::classInterval(int aInterval, int aClass, int aMaxInterval)
+{
+  int interval = aInterval*(aClass+1);
+  return interval>aMaxInterval ? aMaxInterval : interval;
+}
+
+
+int P44BTDMXsender::adaptiveRepeatCount()
+{
+  // updates deliverable within one repeat interval, assuming an average of 3 bytes per update
+  int capacity = mRepeatInterval*(mLastPacketBytes/3);
+  if (capacity<1) capacity = 1;
+  if (mRepeatBacklog>=capacity) return mMinRepeats; // overloaded
+  // reduce repeats proportionally with the load
+  return mMaxRepeats-(mMaxRepeats-mMinRepeats)*mRepeatBacklog/capacity;
+}
+
+
+int P44BTDMXsender::generateP44DMXcmds(uint8_t* aBuffer, int aMaxBytes, int aDataReserve)
+{
+  if (mFecGroupSize>0) return generateFecCmds(aBuffer, aMaxBytes, aDataReserve);
+  return generateDataCmds(aBuffer, aMaxBytes-aDataReserve);
+}
+
+
+int P44BTDMXsender::generateDataCmds(uint8_t* aBuffer, int aMaxBytes)
+{
+  if (!mPages.empty()) return generatePagesCmds(aBuffer, aMaxBytes);
+  return generatePageCmds(aBuffer, aMaxBytes);
+}
+
+
+int P44BTDMXsender::generatePageCmds(uint8_t* aBuffer, int aMaxBytes)
+{
+  mLastPacketBytes = aMaxBytes;
+  if (mSceneCmd!=P44DMX_EXTCMD_SCENE_STORE || !mStoreSceneData.empty()) {
+    detectChanges(); // but not while the receivers store a scene, they must all store the same state
+  }
+  int numBytes = packSceneCmd(aBuffer, aMaxBytes);
+  if (mOptimizedPacking && aMaxBytes-numBytes<=cMaxPackBytes) {
+    numBytes += packOptimized(aBuffer+numBytes, aMaxBytes-numBytes);
+  }
+  else if (mOptimizedPacking && mSchedulingMode==sched_deadline) {
+    // large (extended advertisement) packet: pack in chunks, channels sent are parked for the rest of the packet
+    // Note: in the other modes, repeated changes would be selected again in the next chunk, so these use greedy packing
+    while (numBytes<aMaxBytes) {
+      int chunk = aMaxBytes-numBytes;
+      if (chunk>cMaxPackBytes) chunk = cMaxPackBytes;
+      int n = packOptimized(aBuffer+numBytes, chunk);
+      if (n==0) break; // nothing more to send
+      numBytes += n;
+    }
+  }
+  else {
+    numBytes += packGreedy(aBuffer+numBytes, aMaxBytes-numBytes);
+  }
+  // one update created, now age all
+  if (mSchedulingMode==sched_deadline) {
+    scheduleSentChannels();
+    ageUniverse(); // time passes for deadlines
+  }
+  else if (mRefreshUniverse) {
+    ageUniverse();
+  }
+  if (mFecGroupSize>0) ageHeldChannels();
+  #if VERIFY_AGE_INDEX
+  verifyAgeIndex();
+  #endif
+  if (LOGENABLED(LOG_INFO) && numBytes>0) {
+    OLOG(LOG_INFO, "p44DMX delta cmds: %s", binaryToHexString(string((char*)aBuffer, numBytes), ' ').c_str());
+  }
+  return numBytes;
+}
+
+
+// Multiple pages
+// - the address/command byte limits a universe to cNumLights lights. For more lights, the sender
+//   can have multiple pages, each being a universe of cNumLights lights of its own.
+// - this sender is page 0, the additional pages are separate sender objects with the same settings,
+//   each with its own channel state and scheduling (which only advances in packets the page takes part in).
+//   Settings changed on this sender later are passed on to the pages, except light specific priority
+//   classes, as the light indices are per page.
+// - receivers start every packet at page 0, a P44DMX_EXTCMD_PAGE command selects the page for the
+//   commands following it. Receivers not supporting pages skip the page command, but then apply the
+//   commands for the other pages to their own (page 0) lights, so all receivers must support it.
+// - each additional page holds the channel state and age index of its universe (about 11kB, another 11kB
+//   with fade detection), the buffers only needed while packing a packet are shared.
+// - pages with changes pending get the packet first, in round robin order so every busy page gets its
+//   share when multiple are busy. Room left over goes to the next pages, so refreshing idle pages only
+//   uses room not needed for changes.
+
+void P44BTDMXsender::setNumPages(int aNumPages)
+{
+  if (aNumPages<1) aNumPages = 1;
+  if (aNumPages>cMaxPages) aNumPages = cMaxPages;
+  while (mPages.size()<aNumPages-1) {
+    // new page with same settings as this one
+    P44BTDMXsenderPtr page = P44BTDMXsenderPtr(new P44BTDMXsender);
+    page->setInitialRepeatCount(mInitialRepeatCount);
+    page->setRefreshUniverse(mRefreshUniverse);
+    page->setSchedulingMode(mSchedulingMode);
+    page->setDeadlineParams(mRepeatInterval, mRefreshInterval, mMinRepeats, mMaxRepeats);
+    for (int c=0; c<cLightChannels; c++) {
+      page->setChannelPriorityClass(c, mChannelClass[c]);
+    }
+    page->setDeadband(mDeadband);
+    page->setFadeDetection(!mRamps.empty());
+    page->setOptimizedPacking(mOptimizedPacking);
+    page->setExtendedCommands(mExtendedCommands);
+    page->setFineChannels(mFineChannels);
+    page->mFecGroupSize = mFecGroupSize; // pages only hold channels, FEC packets are generated here
+    page->mSequenceNumbers = mSequenceNumbers; // for deltas only, sequence numbers are sent here
+    mPages.push_back(page);
+  }
+  mPages.resize(aNumPages-1);
+  mNextPage = 0;
+}
+
+
+P44BTDMXsenderPtr P44BTDMXsender::getPage(int aPage)
+{
+  if (aPage==0) return P44BTDMXsenderPtr(this);
+  if (aPage<0 || aPage>(int)mPages.size()) return P44BTDMXsenderPtr();
+  return mPages[aPage-1];
+}
+
+
+bool P44BTDMXsender::pageBusy()
+{
+  for (int w=0; w<cDirtyWords; w++) {
+    if (mDirty[w]) return true; // possibly changes not yet detected
+  }
+  return changesPending() || mSceneCmd!=0;
+}
+
+
+int P44BTDMXsender::generatePagesCmds(uint8_t* aBuffer, int aMaxBytes)
+{
+  int numPages = (int)mPages.size()+1;
+  // busy pages first, each group in round robin order
+  uint8_t order[cMaxPages];
+  int n = 0;
+  for (int busy=1; busy>=0; busy--) {
+    for (int k=0; k<numPages; k++) {
+      int p = (mNextPage+k)%numPages;
+      P44BTDMXsender* page = p==0 ? this : mPages[p-1].get();
+      if (page->pageBusy()==(busy!=0)) order[n++] = p;
+    }
+  }
+  mNextPage = (order[0]+1)%numPages;
+  uint8_t* cmds = aBuffer;
+  int room = aMaxBytes;
+  int currentPage = 0; // receivers start every packet at page 0
+  for (int k=0; k<numPages && room>=2; k++) {
+    int p = order[k];
+    P44BTDMXsender* page = p==0 ? this : mPages[p-1].get();
+    int selectBytes = 0;
+    if (p!=currentPage) {
+      if (room<5) break; // page select plus at least one command
+      *cmds++ = 0xFF; // extended command
+      *cmds++ = P44DMX_EXTCMD_PAGE;
+      *cmds++ = p;
+      selectBytes = 3;
+      room -= selectBytes;
+    }
+    int numBytes = page->generatePageCmds(cmds, room);
+    if (numBytes==0) {
+      // nothing for this page, no page select needed
+      cmds -= selectBytes;
+      room += selectBytes;
+      continue;
+    }
+    currentPage = p;
+    cmds += numBytes;
+    room -= numBytes;
+  }
+  return (int)(cmds-aBuffer);
+}
+
+
+// Forward error correction (FEC)
+// - instead of repeating changes, each group of up to mFecGroupSize data packets is followed by a
+//   parity packet carrying the XOR of the data packets' command bytes. A receiver can rebuild any single
+//   lost data packet of a group from the other data packets and the parity, without waiting for a repeat.
+// - data packets end with a P44DMX_EXTCMD_FEC_DATA trailer identifying the packet within its group.
+//   For the parity, shorter packets count as filled up with NOPs to the length of the longest one.
+//   The fill of a parity packet itself must rebuild to NOPs as well, see generateP44BTDMXpayload().
+//   Receivers not supporting FEC would apply the trailer bytes, and the XOR bytes of parity packets, as light
+//   commands, so all receivers must support FEC before it is enabled.
+// - a rebuilt packet is applied only when the parity arrives, i.e. after the later packets of its group.
+//   Therefore, a channel is sent at most once per group: channels sent are held at age 0 (never selected)
+//   until the group ends, changes and deadlines meanwhile only update the age they continue with.
+// - when there is nothing more to send, the parity follows right away, closing a shorter group.
+
+void P44BTDMXsender::setFecGroupSize(int aFecGroupSize)
+{
+  if (aFecGroupSize<0) aFecGroupSize = 0;
+  if (aFecGroupSize>cMaxFecGroupSize) aFecGroupSize = cMaxFecGroupSize;
+  if (aFecGroupSize==mFecGroupSize) return;
+  // open group is abandoned
+  mFecIndex = 0;
+  releaseHeldChannels();
+  mFecGroupSize = aFecGroupSize;
+  for (PagesVector::iterator pos = mPages.begin(); pos!=mPages.end(); ++pos) {
+    (*pos)->releaseHeldChannels();
+    (*pos)->mFecGroupSize = aFecGroupSize;
+  }
+}
+
+
+void P44BTDMXsender::holdChannel(int aDMXChannel)
+{
+  uint32_t bit = 1ul<<(aDMXChannel & 0x1F);
+  if (mFecHeld[aDMXChannel>>5] & bit) return; // already held
+  uint8_t age = channelAge(aDMXChannel);
+  setChannelAge(aDMXChannel, 0);
+  mFecHeld[aDMXChannel>>5] |= bit;
+  mFecAge[aDMXChannel] = age;
+}
+
+
+void P44BTDMXsender::ageHeldChannels()
+{
+  if (mSchedulingMode!=sched_deadline && !mRefreshUniverse) return; // universe does not age
+  if (mMaxRefreshAge<1) return; // nothing can age
+  for (int w=0; w<cDirtyWords; w++) {
+    uint32_t held = mFecHeld[w];
+    while (held) {
+      int i = (w<<5)+__builtin_ctz(held);
+      uint32_t bit = held & -held;
+      held &= held-1;
+      // back to age 0, but the age to continue with ages like in ageUniverse()
+      mFecHeld[w] &= ~bit;
+      setChannelAge(i, 0);
+      mFecHeld[w] |= bit;
+      uint8_t age = mFecAge[i];
+      if (age<mMaxRefreshAge && !(mSchedulingMode==sched_deadline && age==cRefreshOverdueAge)) mFecAge[i] = age+1;
+    }
+  }
+}
+
+
+void P44BTDMXsender::releaseHeldChannels()
+{
+  for (int w=0; w<cDirtyWords; w++) {
+    uint32_t held = mFecHeld[w];
+    mFecHeld[w] = 0;
+    while (held) {
+      int i = (w<<5)+__builtin_ctz(held);
+      held &= held-1;
+      setChannelAge(i, mFecAge[i]);
+    }
+  }
+}
+
+
+int P44BTDMXsender::generateFecCmds(uint8_t* aBuffer, int aMaxBytes, int aDataReserve)
+{
+  // the reserve is taken from data packets only, a parity packet may use the full size
+  int room = aMaxBytes-aDataReserve-P44DMX_FEC_HEADER_BYTES; // for the data packet's commands
+  if (room>cMaxExtAdvDataBytes) room = cMaxExtAdvDataBytes;
+  if (mFecIndex>0 && mFecParityLen+P44DMX_FEC_HEADER_BYTES>aMaxBytes) {
+    // packets got smaller, parity does not fit: abandon the group
+    mFecIndex = 0;
+    mFecGroupNo++;
+    releaseHeldChannels();
+    for (PagesVector::iterator pos = mPages.begin(); pos!=mPages.end(); ++pos) (*pos)->releaseHeldChannels();
+  }
+  if (room<1) return 0;
+  if (mFecIndex<mFecGroupSize) {
+    int numBytes = generateDataCmds(aBuffer, room);
+    if (numBytes>0) {
+      // data packet: add to parity (as if filled up with NOPs), and identify it with the trailer
+      if (mFecIndex==0) mFecParityLen = 0;
+      if (numBytes>mFecParityLen) {
+        // parity so far must be extended by what XOR with NOPs of all previous packets results in
+        uint8_t fill = (mFecIndex & 1) ? 0xFF : 0x00;
+        memset(mFecParity+mFecParityLen, fill, numBytes-mFecParityLen);
+        mFecParityLen = numBytes;
+      }
+      for (int i=0; i<mFecParityLen; i++) mFecParity[i] ^= i<numBytes ? aBuffer[i] : 0xFF;
+      uint8_t* trailer = aBuffer+numBytes;
+      *trailer++ = 0xFF;
+      *trailer++ = P44DMX_EXTCMD_FEC_DATA;
+      *trailer++ = mFecGroupNo;
+      *trailer++ = mFecIndex++;
+      return numBytes+P44DMX_FEC_HEADER_BYTES;
+    }
+    if (mFecIndex==0) return 0; // nothing to send, and no group to close
+  }
+  // parity packet, closing the group
+  aBuffer[0] = 0xFF;
+  aBuffer[1] = P44DMX_EXTCMD_FEC_PARITY;
+  aBuffer[2] = mFecGroupNo;
+  aBuffer[3] = mFecIndex; // number of data packets in the group
+  memcpy(aBuffer+P44DMX_FEC_HEADER_BYTES, mFecParity, mFecParityLen);
+  OLOG(LOG_INFO, "p44DMX FEC parity for group %d with %d data packets", mFecGroupNo, mFecIndex);
+  mFecIndex = 0;
+  mFecGroupNo++;
+  releaseHeldChannels();
+  for (PagesVector::iterator pos = mPages.begin(); pos!=mPages.end(); ++pos) (*pos)->releaseHeldChannels();
+  return mFecParityLen+P44DMX_FEC_HEADER_BYTES;
+}
+
+
+// light layout: HSB + n extra channels
+// - 0: hue
+// - 1: saturation
+// - 2: brightness
+// - 3..n: other channels
+// p44DMX delta update commands:
+// - address byte with 3*lightnumber+cmd
+// - lightnumber: 0..84 (address div 3)
+// - cmd: 0..2 (address mod 3)
+//   - 0=brightness (B channel), 1 data byte
+//   - 1=HSB, 3 data bytes
+//   - 2=channelindex/value, 2 data bytes
+
+// Extended multi-light commands
+// - changes of the same channel (or the same HSB color) to the same value on multiple lights
+//   (blackouts, washes, color changes of a group) are sent as a single command, when this is
+//   shorter than the single light commands:
+//   - consecutive lights as a range command
+//   - scattered lights as a group command with a light bitmask
+// - lights with many channels changing at once (e.g. a mode change) are sent as a keyframe command
+//   carrying all their changed channels, when this is shorter than the single light commands.
+// - small changes (such as in slow fades) of channels the receivers are up to date with are sent as
+//   4-bit deltas for adjacent lights. As deltas must not be applied twice, they are sent only once,
+//   without repeats, and the background refresh delivers the absolute value later (so deltas are
+//   only used when the universe is refreshed).
+// - receivers see the same packet more than once (duplicate scan reports, multiple advertising sets),
+//   so deltas also need sequence numbers for the receivers to skip duplicates. They are not used with
+//   FEC, where a rebuilt packet may still arrive later.
+// - deltas are only used for channels with no change still being repeated. After a few deltas in a
+//   row, an absolute value is sent again, so the error of a receiver that missed deltas stays bounded
+//   even when a long fade leaves no time for refreshing.
+// - candidates are all pending changes regardless of their priority (different lights changing
+//   to the same value often get different magnitude levels), but not refreshes.
+// - these commands go first into the packet, the single light commands use the remaining room.
+
+uint8_t* P44BTDMXsender::packRange(uint8_t* aCmds, int &aRoom, uint32_t* aPending, int aChannelIndex, int aFirstLight, int aNumLights)
+{
+  // single light commands: at least 2 bytes for B, 3 for channelindex/value, H and S are usually part of a 4 byte HSB
+  int minLights = aChannelIndex<2 ? 6 : 4;
+  if (aNumLights<minLights || aRoom<6) return aCmds;
+  *aCmds++ = 0xFF; // extended command
+  *aCmds++ = P44DMX_EXTCMD_RANGE;
+  *aCmds++ = aFirstLight;
+  *aCmds++ = aFirstLight+aNumLights-1;
+  *aCmds++ = aChannelIndex;
+  *aCmds++ = mCurrent[aFirstLight*cLightChannels+aChannelIndex];
+  aRoom -= 6;
+  for (int l=aFirstLight; l<aFirstLight+aNumLights; l++) {
+    int i = l*cLightChannels+aChannelIndex;
+    channelSent(i, sentAge(channelAge(i)));
+    aPending[i>>5] &= ~(1ul<<(i & 0x1F));
+  }
+  return aCmds;
+}
+
+
+uint8_t* P44BTDMXsender::packRanges(uint8_t* aCmds, int &aRoom, uint32_t* aPending)
+{
+  for (int cidx=0; cidx<cLightChannels && aRoom>=6; cidx++) {
+    int runStart = 0;
+    int runLen = 0;
+    uint8_t runValue = 0;
+    for (int lidx=0; lidx<cNumLights; lidx++) {
+      int i = lidx*cLightChannels+cidx;
+      if ((aPending[i>>5] & (1ul<<(i & 0x1F)))==0) continue;
+      if (runLen>0 && lidx==runStart+runLen && mCurrent[i]==runValue) {
+        runLen++; // run continues
+        continue;
+      }
+      aCmds = packRange(aCmds, aRoom, aPending, cidx, runStart, runLen);
+      runStart = lidx;
+      runLen = 1;
+      runValue = mCurrent[i];
+    }
+    aCmds = packRange(aCmds, aRoom, aPending, cidx, runStart, runLen);
+  }
+  return aCmds;
+}
+
+
+uint8_t* P44BTDMXsender::packGroup(uint8_t* aCmds, int &aRoom, uint32_t* aPending, int aChannelIndex, const uint8_t* aLights, int aNumLights)
+{
+  bool color = aChannelIndex==cColorGroup;
+  int headerBytes = color ? 7 : 6; // lead-in, command, first light, mask size, values (without the mask)
+  int singleBytes = color ? 4 : (aChannelIndex<3 ? 2 : 3); // H and S are usually part of a 4 byte HSB
+  int s = 0;
+  while (s<aNumLights) {
+    // collect as many lights as the mask can hold from the first one
+    int maxMaskBytes = aRoom-headerBytes;
+    if (maxMaskBytes>P44DMX_GROUP_MAX_MASK_BYTES) maxMaskBytes = P44DMX_GROUP_MAX_MASK_BYTES;
+    if (maxMaskBytes<1) break;
+    int e = s;
+    while (e+1<aNumLights && ((aLights[e+1]-aLights[s])>>3)<maxMaskBytes) e++;
+    int maskBytes = ((aLights[e]-aLights[s])>>3)+1;
+    int n = e-s+1;
+    if (n*singleBytes<=headerBytes+maskBytes) {
+      s++; // not worth it, try from next light
+      continue;
+    }
+    *aCmds++ = 0xFF; // extended command
+    *aCmds++ = color ? P44DMX_EXTCMD_GROUP_HSB : P44DMX_EXTCMD_GROUP;
+    *aCmds++ = aLights[s];
+    *aCmds++ = maskBytes;
+    memset(aCmds, 0, maskBytes);
+    for (int l=s; l<=e; l++) {
+      int bit = aLights[l]-aLights[s];
+      aCmds[bit>>3] |= 1<<(bit & 0x07);
+    }
+    aCmds += maskBytes;
+    int loffs = aLights[s]*cLightChannels;
+    if (color) {
+      *aCmds++ = mCurrent[loffs+0]; // H
+      *aCmds++ = mCurrent[loffs+1]; // S
+      *aCmds++ = mCurrent[loffs+2]; // B
+    }
+    else {
+      *aCmds++ = aChannelIndex;
+      *aCmds++ = mCurrent[loffs+aChannelIndex];
+    }
+    aRoom -= headerBytes+maskBytes;
+    for (int l=s; l<=e; l++) {
+      for (int cidx=0; cidx<cLightChannels; cidx++) {
+        if (color ? cidx<3 : cidx==aChannelIndex) {
+          int i = aLights[l]*cLightChannels+cidx;
+          channelSent(i, sentAge(channelAge(i)));
+          aPending[i>>5] &= ~(1ul<<(i & 0x1F));
+        }
+      }
+    }
+    s = e+1;
+  }
+  return aCmds;
+}
+
+
+uint8_t* P44BTDMXsender::packGroups(uint8_t* aCmds, int &aRoom, uint32_t* aPending, int aChannelIndex)
+{
+  // collect the lights with a pending change for the channel (or all color channels)
+  bool color = aChannelIndex==cColorGroup;
+  uint8_t mask = color ? 0x07 : 1<<aChannelIndex;
+  uint8_t lights[cNumLights];
+  int numLights = 0;
+  for (int lidx=0; lidx<cNumLights; lidx++) {
+    int loffs = lidx*cLightChannels;
+    if (((aPending[loffs>>5]>>(loffs & 0x1F)) & mask)==mask) lights[numLights++] = lidx;
+  }
+  // group the lights with identical values
+  uint8_t members[cNumLights];
+  for (int c=0; c<numLights; c++) {
+    if (lights[c]==0xFF) continue; // already in a group
+    const uint8_t* v = &mCurrent[lights[c]*cLightChannels];
+    int numMembers = 0;
+    for (int m=c; m<numLights; m++) {
+      if (lights[m]==0xFF) continue;
+      const uint8_t* mv = &mCurrent[lights[m]*cLightChannels];
+      if (color ? (mv[0]==v[0] && mv[1]==v[1] && mv[2]==v[2]) : mv[aChannelIndex]==v[aChannelIndex]) {
+        members[numMembers++] = lights[m];
+        lights[m] = 0xFF;
+      }
+    }
+    if (numMembers>1) aCmds = packGroup(aCmds, aRoom, aPending, aChannelIndex, members, numMembers);
+  }
+  return aCmds;
+}
+
+
+/// @return number of bytes needed to send the channels in aChannels with single light commands
+static int singleCommandBytes(uint8_t aChannels)
+{
+  uint8_t color = aChannels & 0x07;
+  int bytes = color==0x04 ? 2 : (color==0x01 || color==0x02 ? 3 : (color ? 4 : 0)); // B, H or S alone, or HSB
+  return bytes+3*__builtin_popcount(aChannels & ~0x07);
+}
+
+
+uint8_t* P44BTDMXsender::packKeyframes(uint8_t* aCmds, int &aRoom, uint32_t* aPending)
+{
+  // collect the lights where a keyframe is shorter than the single light commands
+  uint8_t lights[cNumLights];
+  uint8_t urgency[cNumLights];
+  int numLights = 0;
+  for (int lidx=0; lidx<cNumLights; lidx++) {
+    int loffs = lidx*cLightChannels;
+    uint8_t channels = (aPending[loffs>>5]>>(loffs & 0x1F)) & 0xFF;
+    if (channels==0 || 4+__builtin_popcount(channels)>=singleCommandBytes(channels)) continue;
+    uint8_t maxAge = 0;
+    for (int cidx=0; cidx<cLightChannels; cidx++) {
+      if ((channels & (1<<cidx)) && channelAge(loffs+cidx)>maxAge) maxAge = channelAge(loffs+cidx);
+    }
+    lights[numLights] = lidx;
+    urgency[numLights] = maxAge;
+    numLights++;
+  }
+  // send them, most urgent first
+  while (numLights>0 && aRoom>=5) {
+    int c = 0;
+    for (int k=1; k<numLights; k++) if (urgency[k]>urgency[c]) c = k;
+    int lidx = lights[c];
+    lights[c] = lights[--numLights];
+    urgency[c] = urgency[numLights];
+    int loffs = lidx*cLightChannels;
+    uint8_t channels = (aPending[loffs>>5]>>(loffs & 0x1F)) & 0xFF;
+    int bytes = 4+__builtin_popcount(channels);
+    if (bytes>aRoom) continue;
+    *aCmds++ = 0xFF; // extended command
+    *aCmds++ = P44DMX_EXTCMD_KEYFRAME;
+    *aCmds++ = lidx;
+    *aCmds++ = channels;
+    for (int cidx=0; cidx<cLightChannels; cidx++) {
+      if (channels & (1<<cidx)) {
+        *aCmds++ = mCurrent[loffs+cidx];
+        channelSent(loffs+cidx, sentAge(channelAge(loffs+cidx)));
+      }
+    }
+    aPending[loffs>>5] &= ~((uint32_t)channels<<(loffs & 0x1F));
+    aRoom -= bytes;
+  }
+  return aCmds;
+}
+
+
+uint8_t* P44BTDMXsender::packDeltas(uint8_t* aCmds, int &aRoom, uint32_t* aPending, const uint32_t* aDeltas)
+{
+  int lidx = 0;
+  while (lidx<cNumLights && aRoom>=6) {
+    int loffs = lidx*cLightChannels;
+    uint8_t channels = (aDeltas[loffs>>5]>>(loffs & 0x1F)) & 0xFF;
+    if (channels==0) {
+      lidx++;
+      continue;
+    }
+    // extend over adjacent lights with deltas, as long as the command fits
+    uint8_t mask = channels;
+    int numLights = 1;
+    int singleBytes = singleCommandBytes(channels);
+    while (lidx+numLights<cNumLights) {
+      int noffs = (lidx+numLights)*cLightChannels;
+      uint8_t next = (aDeltas[noffs>>5]>>(noffs & 0x1F)) & 0xFF;
+      if (next==0 || 5+((numLights+1)*__builtin_popcount(mask|next)+1)/2>aRoom) break;
+      mask |= next;
+      numLights++;
+      singleBytes += singleCommandBytes(next);
+    }
+    int numDeltas = numLights*__builtin_popcount(mask);
+    int bytes = 5+(numDeltas+1)/2;
+    if (bytes<singleBytes && bytes<=aRoom) {
+      *aCmds++ = 0xFF; // extended command
+      *aCmds++ = P44DMX_EXTCMD_DELTA;
+      *aCmds++ = lidx;
+      *aCmds++ = numLights;
+      *aCmds++ = mask;
+      memset(aCmds, 0, (numDeltas+1)/2);
+      int d = 0;
+      for (int l=lidx; l<lidx+numLights; l++) {
+        for (int cidx=0; cidx<cLightChannels; cidx++) {
+          if ((mask & (1<<cidx))==0) continue;
+          int i = l*cLightChannels+cidx;
+          if (aDeltas[i>>5] & (1ul<<(i & 0x1F))) {
+            int delta = (int)mCurrent[i]-mLastSent[i];
+            aCmds[d>>1] |= (d & 1) ? (delta & 0x0F) : (delta & 0x0F)<<4;
+            // sent once only, the refresh delivers the absolute value
+            if (mSchedulingMode==sched_deadline && mRepeatsLeft[i]>1) mRepeatsLeft[i] = 1;
+            uint8_t run = mDeltaRun[i];
+            channelSent(i, 0); // resets the run
+            mDeltaRun[i] = run+1;
+            aPending[i>>5] &= ~(1ul<<(i & 0x1F));
+          }
+          d++;
+        }
+      }
+      aCmds += (numDeltas+1)/2;
+      aRoom -= bytes;
+    }
+    lidx += numLights;
+  }
+  return aCmds;
+}
+
+
+int P44BTDMXsender::packExtended(uint8_t* aBuffer, int aMaxBytes)
+{
+  // all ages above the refresh region are pending changes (or their repeats)
+  int minChangeAge = (mSchedulingMode==sched_deadline ? cRefreshOverdueAge : mMaxRefreshAge)+1;
+  int maxChangeAge = mSchedulingMode==sched_deadline ? cOverdueAge : 255;
+  LightMask lights;
+  memset(lights, 0, sizeof(lights));
+  bool any = false;
+  for (int age=minChangeAge; age<=maxChangeAge; age++) {
+    int slot = slotForAge(age);
+    if (mAgeCount[slot]==0) continue;
+    for (int w=0; w<cLightMaskWords; w++) lights[w] |= mAgeLights[slot][w];
+    any = true;
+  }
+  if (!any) return 0;
+  // bitmap of the channels that can be sent with extended commands (fades cannot)
+  uint32_t pending[cDirtyWords];
+  memset(pending, 0, sizeof(pending));
+  for (int w=0; w<cLightMaskWords; w++) {
+    uint32_t m = lights[w];
+    while (m) {
+      int lidx = (w<<5)+__builtin_ctz(m);
+      m &= m-1;
+      uint8_t fading = fadingChannels(lidx);
+      for (int cidx=0; cidx<cLightChannels; cidx++) {
+        int i = lidx*cLightChannels+cidx;
+        int age = channelAge(i);
+        if (age>=minChangeAge && age<=maxChangeAge && (fading & (1<<cidx))==0) pending[i>>5] |= 1ul<<(i & 0x1F);
+      }
+    }
+  }
+  // small changes that can be sent as deltas
+  uint32_t deltas[cDirtyWords];
+  bool anyDeltas = false;
+  for (int w=0; w<cDirtyWords; w++) {
+    deltas[w] = pending[w] & mDeltaPending[w];
+    if (deltas[w]) anyDeltas = true;
+  }
+  uint8_t* cmds = aBuffer;
+  int room = aMaxBytes;
+  if (anyDeltas) cmds = packDeltas(cmds, room, pending, deltas);
+  cmds = packRanges(cmds, room, pending);
+  cmds = packGroups(cmds, room, pending, cColorGroup);
+  for (int cidx=0; cidx<cLightChannels && room>=7; cidx++) {
+    cmds = packGroups(cmds, room, pending, cidx);
+  }
+  cmds = packKeyframes(cmds, room, pending);
+  return (int)(cmds-aBuffer);
+}
+
+
+int P44BTDMXsender::packGreedy(uint8_t* aBuffer, int aMaxBytes)
+{
+  uint8_t* cmds = aBuffer;
+  int room = aMaxBytes;
+  if (mExtendedCommands) {
+    int n = packExtended(cmds, room);
+    cmds += n;
+    room -= n;
+  }
+  int lastMaxAge = 256;
+  int refreshMaxAge = mMaxRefreshAge;
+  while (room>=2) {
+    int maxAge = nextPassAge(lastMaxAge, refreshMaxAge);
+    if (maxAge==0) break;
+    uint8_t doneAge = sentAge(maxAge);
+    // generate updates for oldest (=most urgent) lights
+    // Note: only lights having at least one channel with maxAge need to be checked,
+    //   snapshot them because sending updates moves channels out of the maxAge slot
+    LightMask lights;
+    memcpy(lights, mAgeLights[slotForAge(maxAge)], sizeof(lights));
+    for (int w=0; w<cLightMaskWords && room>=2; w++) {
+      while (lights[w]) {
+        int lidx = (w<<5)+__builtin_ctz(lights[w]);
+        lights[w] &= lights[w]-1;
+        int loffs = lidx*cLightChannels;
+        uint8_t fading = fadingChannels(lidx);
+        if (fading & 0x07) {
+          // color channels cannot be combined with a fading one, brightness alone can
+          if (channelAge(loffs+2)==maxAge && (fading & 0x04)==0) {
+            *cmds++ = 3*lidx + 0x00; // Brightness update command
+            *cmds++ = mCurrent[loffs+2]; // B
+            room -= 2;
+            channelSent(loffs+2, doneAge);
+          }
+        }
+        else if ((channelAge(loffs+0)==maxAge || channelAge(loffs+1)==maxAge) && room>=4) {
+          // hue or saturation needs update -> need a HSB packet
+          *cmds++ = 3*lidx + 0x01; // HSB update command
+          *cmds++ = mCurrent[loffs+0]; // H
+          *cmds++ = mCurrent[loffs+1]; // S
+          *cmds++ = mCurrent[loffs+2]; // B
+          room -= 4;
+          // reset age for update sent
+          channelSent(loffs+0, doneAge);
+          channelSent(loffs+1, doneAge);
+          channelSent(loffs+2, doneAge);
+        }
+        else if (channelAge(loffs+2)==maxAge) {
+          // brightness changed, has priority over position/mode
+          *cmds++ = 3*lidx + 0x00; // Brightness update command
+          *cmds++ = mCurrent[loffs+2]; // B
+          room -= 2;
+          // reset age for update sent
+          channelSent(loffs+2, doneAge);
+        }
+        // other channels (and hue/saturation not combinable with a fading channel) might be sent in addition to brightness or HSB
+        for (int cidx = (fading & 0x07) ? 0 : 3; cidx<cLightChannels; cidx++) {
+          if (channelAge(loffs+cidx)!=maxAge) continue;
+          if (fading & (1<<cidx)) {
+            if (room>=6) {
+              // fading channel needs update -> need a fade command
+              cmds = encodeFade(cmds, loffs+cidx);
+              room -= 6;
+              channelSent(loffs+cidx, doneAge);
+            }
+          }
+          else if (cidx!=2 && room>=3) {
+            // other channel needs update -> need a channelindex/value packet
+            *cmds++ = 3*lidx + 0x02; // channelindex/value update command
+            *cmds++ = cidx; // channel index
+            *cmds++ = mCurrent[loffs+cidx]; // value
+            room -= 3;
+            // reset age for update sent
+            channelSent(loffs+cidx, doneAge);
+          }
+        }
+        if (room<2) break; // no point in checking further
+      }
+    }
+  }
+  return (int)(cmds-aBuffer);
+}
+
+
+// Optimized packing
+// - collect the lights with channels due in this packet using the same passes as packGreedy()
+//   (but more than fit into the packet), without sending anything yet
+// - every candidate light has a group of alternative commands for its color channels
+//   (B, HSB, or H/S as single channel commands, alone or combined with B), and each due
+//   other channel is a group with just its channelindex/value command
+// - choose at most one alternative per group maximizing the sum of update weights that fit
+//   into the packet (multiple choice knapsack, dynamic programming over the packet bytes)
+// - update weights are spaced such that no number of updates of a lower priority fitting into
+//   a packet outweighs a single update of a higher priority, so the priority order is kept,
+//   but the bytes are used for as many updates as possible.
+// - within a priority, cheap updates win. So a channel command (3 bytes, 1 update) would never get
+//   a chance against a stream of color changes (HSB: 4 bytes, 3 updates) of the same priority.
+//   Channels passed over cMaxPassedOver times therefore count as one priority higher.
+// - an HSB command also refreshes the color channels that are not due, which counts with their refresh
+//   weight. Otherwise a hue change would always be sent as a cheaper channel command, and brightness
+//   missed by a receiver would wait for its own refresh.
+
+typedef struct {
+  uint8_t channels; ///< bitmask of color channels covered (0=H, 1=S, 2=B)
+  uint8_t cost; ///< number of bytes
+} ColorCmdOption;
+
+static const ColorCmdOption colorCmdOptions[] = {
+  { 0x0, 0 }, // nothing
+  { 0x4, 2 }, // B
+  { 0x7, 4 }, // HSB
+  { 0x1, 3 }, // H as channel command
+  { 0x2, 3 }, // S as channel command
+  { 0x5, 5 }, // H as channel command plus B
+  { 0x6, 5 }, // S as channel command plus B
+};
+static const int numColorCmdOptions = sizeof(colorCmdOptions)/sizeof(ColorCmdOption);
+
+P44BTDMXsender::PackCandidate P44BTDMXsender::mPackCandidates[cMaxPackLights];
+P44BTDMXsender::PackGroup P44BTDMXsender::mPackGroups[cMaxPackGroups];
+uint8_t P44BTDMXsender::mPackChoice[cMaxPackGroups][cMaxPackBytes+1];
+
+
+uint64_t P44BTDMXsender::updateWeight(int aAge, uint8_t aPassedOver)
+{
+  // Note: at most 13 updates fit into a packet, each <=31 within its class -> 9 bits per class,
+  //   at most cMagnitudeLevels+2 classes
+  int cls = aPassedOver>=cMaxPassedOver ? 1 : 0;
+  int sub;
+  if (aAge>mMaxRefreshAge) {
+    int rank = aAge-mMaxRefreshAge-1;
+    cls += 1+rank/mInitialRepeatCount;
+    sub = (rank%mInitialRepeatCount)*30/mInitialRepeatCount;
+  }
+  else {
+    sub = aAge*30/(mMaxRefreshAge+1);
+  }
+  return (uint64_t)(1+sub)<<(9*cls);
+}
+
+
+int P44BTDMXsender::packOptimized(uint8_t* aBuffer, int aMaxBytes)
+{
+  // collect candidates
+  int8_t candidateOf[cNumLights];
+  memset(candidateOf, -1, sizeof(candidateOf));
+  int numCandidates = 0;
+  int numGroups = 0;
+  int minBytes = 0;
+  int lastMaxAge = 256;
+  int refreshMaxAge = mMaxRefreshAge;
+  bool full = false;
+  // extended commands are placed directly, before the knapsack optimized commands
+  int extBytes = mExtendedCommands ? packExtended(aBuffer, aMaxBytes) : 0;
+  while (!full && minBytes<2*(aMaxBytes-extBytes)) {
+    int maxAge = nextPassAge(lastMaxAge, refreshMaxAge);
+    if (maxAge==0) break;
+    const LightMask& lights = mAgeLights[slotForAge(maxAge)];
+    for (int w=0; w<cLightMaskWords && !full; w++) {
+      uint32_t m = lights[w];
+      while (m) {
+        int lidx = (w<<5)+__builtin_ctz(m);
+        m &= m-1;
+        int loffs = lidx*cLightChannels;
+        uint8_t due = 0;
+        for (int cidx=0; cidx<cLightChannels; cidx++) {
+          if (channelAge(loffs+cidx)==maxAge) due |= 1<<cidx;
+        }
+        int c = candidateOf[lidx];
+        if (c<0) {
+          if (numCandidates>=cMaxPackLights || numGroups+cMaxPackGroupsPerLight>cMaxPackGroups) {
+            full = true;
+            break;
+          }
+          c = numCandidates++;
+          candidateOf[lidx] = c;
+          mPackCandidates[c].light = lidx;
+          mPackCandidates[c].due = 0;
+          numGroups += cMaxPackGroupsPerLight; // max number of groups per candidate
+        }
+        uint8_t newDue = due & ~mPackCandidates[c].due;
+        mPackCandidates[c].due |= newDue;
+        uint8_t fading = fadingChannels(lidx);
+        if (newDue & ~fading & 0x07) minBytes += (newDue & ~fading & 0x04) ? 2 : 3;
+        for (int cidx=0; cidx<cLightChannels; cidx++) {
+          if (newDue & (1<<cidx)) {
+            if (fading & (1<<cidx)) minBytes += 6;
+            else if (cidx>=3) minBytes += 3;
+          }
+        }
+      }
+    }
+  }
+  if (numCandidates==0) return extBytes;
+  uint8_t* buffer = aBuffer+extBytes;
+  int maxBytes = aMaxBytes-extBytes;
+  // build groups in candidate (=priority) order
+  int g = 0;
+  for (int c=0; c<numCandidates; c++) {
+    mPackGroups[g].candidate = c;
+    mPackGroups[g++].channel = cColorGroup;
+    // other channels, and fading color channels that need a fade command of their own
+    uint8_t single = 0xF8 | fadingChannels(mPackCandidates[c].light);
+    for (int cidx=0; cidx<cLightChannels; cidx++) {
+      if (mPackCandidates[c].due & single & (1<<cidx)) {
+        mPackGroups[g].candidate = c;
+        mPackGroups[g++].channel = cidx;
+      }
+    }
+  }
+  numGroups = g;
+  // knapsack over the packet bytes
+  uint64_t best[cMaxPackBytes+1];
+  uint64_t prev[cMaxPackBytes+1];
+  memset(best, 0, sizeof(best));
+  for (g=0; g<numGroups; g++) {
+    const PackCandidate& cand = mPackCandidates[mPackGroups[g].candidate];
+    int loffs = cand.light*cLightChannels;
+    memcpy(prev, best, sizeof(prev));
+    for (int c=0; c<=maxBytes; c++) mPackChoice[g][c] = 0;
+    uint8_t fading = fadingChannels(cand.light);
+    if (mPackGroups[g].channel==cColorGroup) {
+      // color channels: alternative commands
+      uint64_t w[3];
+      for (int cidx=0; cidx<3; cidx++) {
+        w[cidx] = updateWeight(channelAge(loffs+cidx), (cand.due & (1<<cidx)) ? mPassedOver[loffs+cidx] : 0);
+      }
+      for (int o=1; o<numColorCmdOptions; o++) {
+        const ColorCmdOption& opt = colorCmdOptions[o];
+        if (opt.channels & fading) continue; // fading channels must be sent as fade commands
+        if ((opt.channels & cand.due)==0) continue; // option does not carry any due update
+        uint64_t v = 0;
+        for (int cidx=0; cidx<3; cidx++) {
+          if (opt.channels & (1<<cidx)) v += w[cidx];
+        }
+        for (int c=opt.cost; c<=maxBytes; c++) {
+          if (prev[c-opt.cost]+v>best[c]) {
+            best[c] = prev[c-opt.cost]+v;
+            mPackChoice[g][c] = o;
+          }
+        }
+      }
+    }
+    else {
+      // other channel: single channelindex/value or fade command
+      int cost = (fading & (1<<mPackGroups[g].channel)) ? 6 : 3;
+      uint64_t v = updateWeight(channelAge(loffs+mPackGroups[g].channel), mPassedOver[loffs+mPackGroups[g].channel]);
+      for (int c=cost; c<=maxBytes; c++) {
+        if (prev[c-cost]+v>best[c]) {
+          best[c] = prev[c-cost]+v;
+          mPackChoice[g][c] = 1;
+        }
+      }
+    }
+  }
+  // backtrack choices into per-candidate command selection
+  for (int c=0; c<numCandidates; c++) {
+    mPackCandidates[c].color = 0;
+    mPackCandidates[c].others = 0;
+  }
+  int room = maxBytes;
+  for (g=numGroups-1; g>=0; g--) {
+    uint8_t o = mPackChoice[g][room];
+    if (o==0) continue;
+    PackCandidate& cand = mPackCandidates[mPackGroups[g].candidate];
+    if (mPackGroups[g].channel==cColorGroup) {
+      cand.color = o;
+      room -= colorCmdOptions[o].cost;
+    }
+    else {
+      cand.others |= 1<<mPackGroups[g].channel;
+      room -= (fadingChannels(cand.light) & (1<<mPackGroups[g].channel)) ? 6 : 3;
+    }
+  }
+  // generate the commands
+  uint8_t* cmds = buffer;
+  for (int c=0; c<numCandidates; c++) {
+    const PackCandidate& cand = mPackCandidates[c];
+    int lidx = cand.light;
+    int loffs = lidx*cLightChannels;
+    uint8_t sent = cand.others;
+    uint8_t color = colorCmdOptions[cand.color].channels;
+    if (color==0x7) {
+      *cmds++ = 3*lidx + 0x01; // HSB update command
+      *cmds++ = mCurrent[loffs+0]; // H
+      *cmds++ = mCurrent[loffs+1]; // S
+      *cmds++ = mCurrent[loffs+2]; // B
+    }
+    else {
+      if (color & 0x4) {
+        *cmds++ = 3*lidx + 0x00; // Brightness update command
+        *cmds++ = mCurrent[loffs+2]; // B
+      }
+      // H or S alone are sent as channel commands
+      sent |= color & 0x3;
+    }
+    uint8_t fading = fadingChannels(lidx);
+    for (int cidx=0; cidx<cLightChannels; cidx++) {
+      if (sent & fading & (1<<cidx)) {
+        cmds = encodeFade(cmds, loffs+cidx);
+      }
+      else if (sent & (1<<cidx)) {
+        *cmds++ = 3*lidx + 0x02; // channelindex/value update command
+        *cmds++ = cidx; // channel index
+        *cmds++ = mCurrent[loffs+cidx]; // value
+      }
+    }
+    // reset ages for all channels sent, count the others that were due
+    sent |= color;
+    for (int cidx=0; cidx<cLightChannels; cidx++) {
+      if (sent & (1<<cidx)) channelSent(loffs+cidx, sentAge(channelAge(loffs+cidx)));
+      else if ((cand.due & (1<<cidx)) && mPassedOver[loffs+cidx]<cMaxPassedOver) mPassedOver[loffs+cidx]++;
+    }
+  }
+  return extBytes+(int)(cmds-buffer);
+}
+
+
+// Time base
+// - the sender's time is appended to a packet every mTimeBaseInterval, for the receivers to derive a shared
+//   time base from (see P44BTDMXreceiver::timeBaseReceived())
+// - it is the last command of the packet, after the FEC data trailer, so rebuilt FEC packets never carry
+//   a (stale) time. Parity packets do not carry it, the next packet will. The room for it is only reserved
+//   in data packets, so the parity closing a group of full size data packets still fits.
+// - receivers not supporting it would apply the time bytes as light commands, so it is off by default
+
+bool P44BTDMXsender::timeBaseDue()
+{
+  #if ESP_PLATFORM
+  return mTimeBaseInterval>0 && MainLoop::now()-mLastTimeBase>=mTimeBaseInterval;
+  #else
+  return false; // no mainloop time
+  #endif
+}
+
+
+int P44BTDMXsender::generateP44BTDMXpayload(uint8_t* aBuffer, int aMaxBytes, int aMinBytes)
+{
+  if (aMinBytes==0) aMinBytes = aMaxBytes-2;
+  int srcBytes = mSourceId>=0 ? P44DMX_SOURCE_BYTES : 0;
+  int seqBytes = srcBytes + (mSequenceNumbers ? P44DMX_SEQUENCE_BYTES : 0);
+  int tbBytes = timeBaseDue() ? P44DMX_TIMEBASE_BYTES : 0;
+  int numBytes = generateP44DMXcmds(aBuffer+seqBytes, aMaxBytes-2-seqBytes, tbBytes);
+  if (numBytes==0) return 0; // nothing at all
+  uint8_t fill = 0xFF;
+  bool parity = aBuffer[seqBytes]==0xFF && aBuffer[seqBytes+1]==P44DMX_EXTCMD_FEC_PARITY;
+  if (parity && (aBuffer[seqBytes+3] & 1)==0) {
+    // receivers rebuild from the parity including the fill, XORed with the NOP fill of the
+    // other (odd number of) data packets. So the parity's fill must be 0x00 to rebuild NOPs.
+    fill = 0x00;
+  }
+  #if ESP_PLATFORM
+  if (tbBytes>0 && !parity) {
+    mLastTimeBase = MainLoop::now();
+    uint32_t ms = (uint32_t)(mLastTimeBase/MilliSecond);
+    uint8_t* tb = aBuffer+seqBytes+numBytes;
+    *tb++ = 0xFF;
+    *tb++ = P44DMX_EXTCMD_TIMEBASE;
+    *tb++ = (ms>>24) & 0xFF;
+    *tb++ = (ms>>16) & 0xFF;
+    *tb++ = (ms>>8) & 0xFF;
+    *tb++ = ms & 0xFF;
+    numBytes += P44DMX_TIMEBASE_BYTES;
+  }
+  #endif
+  if (srcBytes>0) {
+    aBuffer[0] = 0xFF;
+    aBuffer[1] = P44DMX_EXTCMD_SOURCE;
+    aBuffer[2] = mSourceId;
+  }
+  if (mSequenceNumbers) {
+    aBuffer[srcBytes] = 0xFF;
+    aBuffer[srcBytes+1] = P44DMX_EXTCMD_SEQUENCE;
+    aBuffer[srcBytes+2] = mSequenceNo++;
+  }
+  numBytes += seqBytes;
+  if (aMinBytes>numBytes) {
+    memset(aBuffer+numBytes, fill, aMinBytes-numBytes); // fill up with extended/NOP commands
+    numBytes = aMinBytes;
+  }
+  return encodeP44BTDMXpayload(aBuffer, numBytes);
+}
+
+
+string P44BTDMXsender::generateP44BTDMXpayload(int aMaxBytes, int aMinBytes)
+{
+  string payload;
+  if (aMaxBytes>2) {
+    payload.resize(aMaxBytes);
+    payload.resize(generateP44BTDMXpayload((uint8_t*)&payload[0], aMaxBytes, aMinBytes));
+  }
+  return payload;
+}
+
+
+int P44BTDMXsender::generateBTAdvMfgData(uint8_t* aBuffer, int aMaxBytes, bool aExtended)
+{
+  const int hdrSz = 5;
+  if (aExtended && aMaxBytes>cMaxExtAdvDataBytes) aMaxBytes = cMaxExtAdvDataBytes;
+  // extended advertisements are not filled up, airtime grows with the data size
+  int payloadSz = generateP44BTDMXpayload(aBuffer+hdrSz, aMaxBytes-hdrSz, aExtended ? 1 : 0);
+  if (payloadSz==0) return 0; // nothing at all
+  aBuffer[0] = payloadSz+4; // length = ADStruct type, 2 byte company identifier, 1 byte subytpe + payload
+  aBuffer[1] = 0xFF; // ADStruct type: manufacturer specific data
+  aBuffer[2] = BT_COMPANY_ID_BLUEKITCHEN & 0xFF; // LSB of company ID
+  aBuffer[3] = (BT_COMPANY_ID_BLUEKITCHEN>>8) & 0xFF; // MSB of company ID
+  aBuffer[4] = aExtended ? PLAN44_SUBTYPE_P44BTDMX_EXT : PLAN44_SUBTYPE_P44BTDMX; // subtype
+  return payloadSz+hdrSz;
+}
+
+
+string P44BTDMXsender::generateBTAdvMfgData(int aMaxBytes, bool aExtended)
+{
+  string advData;
+  if (aMaxBytes>0) {
+    advData.resize(aMaxBytes);
+    advData.resize(generateBTAdvMfgData((uint8_t*)&advData[0], aMaxBytes, aExtended));
+  }
+  return advData;
+}
+
+
+// Multiple advertising sets
+// - each update of the advertisement data stops the advertising set, sets the new data and restarts it
+//   (at moderate update rates, data of sets that were on air for a full interval is replaced in place,
+//   which the model ignores). With a single set, a packet is only on air from its start until the next
+//   update, which is often just the first advertising event.
+// - with multiple concurrent sets updated round robin, every packet stays on air until its set gets the
+//   next update, i.e. for numSets update intervals (less the restart time), while the update rate stays
+//   the same.
+// - a receiver gets a packet if it is scanning during at least one of the packet's advertising events
+//   (every event sends the packet on all three advertising channels, the receiver listens on one at a time)
+// - so: events = 1 + onAirTime/advInterval, received = 1-(1-scanDuty)^events, rate = received/updateInterval
+// - the model ignores collisions and controller scheduling limits, which set in with many sets at short intervals.
+
+double P44BTDMXsender::receivedPacketRate(int aNumSets, MLMicroSeconds aUpdateInterval, MLMicroSeconds aRestartTime, MLMicroSeconds aAdvInterval, double aScanDuty)
+{
+  if (aNumSets<1 || aUpdateInterval<=0 || aAdvInterval<=0) return 0;
+  MLMicroSeconds onAir = aNumSets*aUpdateInterval-aRestartTime;
+  if (onAir<0) onAir = 0;
+  double events = 1+(double)onAir/aAdvInterval; // first event right at start
+  double received = 1-pow(1-aScanDuty, events);
+  return received*Second/aUpdateInterval;
+}
+
+
+// Adaptive advertising interval
+// - while there is a backlog of changes, advertising at the shortest interval gets them to the receivers fastest
+// - without a backlog, only the background refresh (if any) is sent, so the interval relaxes exponentially
+//   towards the idle interval, leaving more of the channel to other BLE traffic (and other senders)
+// - a new backlog switches back to the shortest interval at once, latency of changes matters more than
+//   smooth transitions
+
+MLMicroSeconds P44BTDMXsender::adaptedAdvInterval(MLMicroSeconds aAdvInterval, int aBacklog, MLMicroSeconds aBusyInterval, MLMicroSeconds aIdleInterval)
+{
+  if (aBacklog>0 || aIdleInterval<=aBusyInterval) return aBusyInterval;
+  if (aAdvInterval<aBusyInterval) aAdvInterval = aBusyInterval;
+  MLMicroSeconds step = (aIdleInterval-aAdvInterval)/8;
+  if (step<MilliSecond) return aIdleInterval; // close enough
+  return aAdvInterval+step;
 }
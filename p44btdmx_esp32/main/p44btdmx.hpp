@@ -25,6 +25,8 @@
 
 #include "p44utils_common.hpp"
 
+#include <map>
+
 using namespace std;
 
 namespace p44 {
@@ -48,11 +50,35 @@ namespace p44 {
     uint8_t systemKeyByte(int aIndex);
     static uint16_t crc16(uint16_t aCRC16, uint8_t aByteToAdd);
 
+    // scenes
+    typedef std::map<uint8_t, string> SceneMap;
+    SceneMap mScenes; ///< scenes loaded from or saved to the persistent scene store
+
+    /// @return prefix for the keys of the scenes in the persistent scene store
+    virtual const char* sceneKeyPrefix() = 0;
+
+    /// get a scene
+    /// @param aSceneNo the scene number
+    /// @param aSceneData will be set to the scene data
+    /// @return false if there is no such scene
+    bool loadScene(uint8_t aSceneNo, string &aSceneData);
+
+    /// save a scene (in memory and in the persistent scene store, where available)
+    /// @param aSceneNo the scene number
+    /// @param aSceneData the scene data
+    void saveScene(uint8_t aSceneNo, const string &aSceneData);
+
   public:
 
     /// number of channels per light
     static const uint16_t cLightChannels = 8;
 
+    /// number of scenes that can be stored
+    static const int cMaxScenes = 32;
+
+    /// max number of data packets per FEC parity packet
+    static const int cMaxFecGroupSize = 8;
+
     /// set the system data obfuscation key
     /// @param aSystemKeyUserInput user-provided system key input
     /// - empty string means using the default key
@@ -73,9 +99,92 @@ namespace p44 {
     typedef std::vector<P44DMXLightPtr> LightsVector;
 
     uint16_t mFirstLightNumber; ///< the first light ID we listen to (=DMX address / cLightBytes)
+    uint8_t mPage; ///< the page our lights are on
+    static const int cOtherPage = 0x10000; ///< first light number used for commands on other pages (matches no light)
     LightsVector mLights;
     MLMicroSeconds mlastNativeData;
     bool mIsLogger; ///< only log p44BTDMX traffic, no light
+    uint8_t mFineChannels; ///< fine channel layout for all lights, see setFineChannels()
+
+    // multiple senders
+    static const int cMaxSources = 4; ///< max number of senders merged at the same time
+    static const int cNoSourceId = -1; ///< source ID for payloads not carrying one
+    typedef struct {
+      bool used; ///< set when the slot is in use
+      int id; ///< source ID, cNoSourceId for payloads without source ID
+      MLMicroSeconds lastSeen; ///< last time a valid payload from this source arrived
+      MLMicroSeconds lastExtended; ///< last time data from this source arrived via the extended advertisement carrier
+      bool seqValid; ///< set when lastSeq is valid
+      uint8_t lastSeq; ///< highest sequence number received
+      uint32_t seqSeen; ///< bit n is set when sequence number lastSeq-n has been received
+      uint32_t seqLost; ///< bit n is set when sequence number lastSeq-n has been counted as lost
+      std::vector<int16_t> values; ///< value per channel of our lights as last set by this source, -1 if never set
+    } Source;
+    Source mSources[cMaxSources];
+    int mSource; ///< index of the source of the payload being processed, -1 if none (no merging)
+    std::vector<uint8_t> mOwner; ///< per channel of our lights: index of the source that changed it last
+    uint8_t mHtpChannels; ///< bitmask of channel indices merged highest-takes-precedence
+    int sourceFor(int aSourceId, MLMicroSeconds aNow, bool &aReleased);
+    void releaseSource(int aSource);
+    int mergedSource(int aLightIndex, uint8_t aChannelIndex);
+    void mergeChannel(int aLightIndex, uint8_t aChannelIndex, int aWriter, MLMicroSeconds aFadeTime);
+    bool mergeAll();
+    void setLightChannel(int aLightIndex, uint8_t aChannelIndex, uint8_t aValue, MLMicroSeconds aFadeTime = 0);
+    uint8_t getLightChannel(int aLightIndex, uint8_t aChannelIndex);
+
+    // forward error correction
+    int mFecSource; ///< source of the current FEC group
+    int mFecGroup; ///< number of the current FEC group, -1 if none
+    uint8_t mFecReceived; ///< bitmask of the data packets of the current FEC group received (or rebuilt)
+    int mFecCount; ///< number of data packets in the current FEC group, 0 as long as its parity packet is not received
+    string mFecData[cMaxFecGroupSize]; ///< command bytes of the data packets of the current FEC group
+    string mFecParity; ///< parity of the current FEC group
+    void startFecGroup(int aGroup);
+    bool fecDataReceived(uint8_t aGroup, uint8_t aIndex, const string aData);
+    bool fecParityReceived(uint8_t aGroup, uint8_t aCount, const string aParity);
+    bool rebuildFecPacket();
+
+  public:
+
+    /// packet sequence statistics, see getSequenceStats()
+    typedef struct {
+      uint32_t received; ///< number of distinct packets received
+      uint32_t duplicates; ///< number of packets received again (not processed again)
+      uint32_t lost; ///< number of packets missing in the sequence (late packets are not counted as lost)
+      uint32_t late; ///< number of packets received out of order, after a later one
+      uint32_t gaps; ///< number of runs of one or more consecutive lost packets
+      uint32_t maxGap; ///< number of packets lost in the longest gap
+      uint32_t resyncs; ///< number of jumps in the sequence too large for losses (sender restart, carrier switch)
+    } SequenceStats;
+
+  private:
+
+    // sequence numbers (state per source, see Source)
+    SequenceStats mSeqStats;
+    bool sequenceReceived(uint8_t aSeq);
+
+    // shared time base
+    static const int cClockSamples = 8; ///< number of recent time base samples the clock discipline looks at
+    typedef struct {
+      MLMicroSeconds local; ///< local time the sample was received
+      MLMicroSeconds offset; ///< time base minus local time, reduced by the (unknown) transmission delay
+    } ClockSample;
+    ClockSample mClockSamples[cClockSamples];
+    int mNumClockSamples; ///< number of valid samples, 0 = no time base
+    int mNextClockSample; ///< index of the sample to replace next
+    MLMicroSeconds mClockLocal; ///< local time mClockOffset was estimated for
+    MLMicroSeconds mClockOffset; ///< time base minus local time at mClockLocal
+    double mClockDrift; ///< rate the time base runs faster than the local clock, e.g. 20E-6 for 20ppm
+    bool mDriftValid; ///< set once the drift has been measured
+    MLMicroSeconds mDriftLocal; ///< local time of the start of the current drift measurement, Never if none
+    MLMicroSeconds mDriftOffset; ///< offset estimated at mDriftLocal
+    MLMicroSeconds mPacketTime; ///< local time the packet being processed was received, Never if unknown
+    int mTimeBaseSource; ///< source the time base is taken from, -1 if none
+    void timeBaseReceived(uint32_t aTimeBaseMs);
+
+    virtual const char* sceneKeyPrefix() P44_OVERRIDE { return "rxscene"; };
+    void storeScene(uint8_t aSceneNo);
+    bool recallScene(uint8_t aSceneNo, MLMicroSeconds aFadeTime);
 
   public:
 
@@ -89,24 +198,69 @@ namespace p44 {
 
     /// set the addressing info
     /// @param aFirstLightNumber the first light number handled by this receiver
-    void setAddressingInfo(int aFirstLightNumber);
+    /// @param aPage the page (universe of cNumLights lights) the lights are on, 0 for senders without pages
+    void setAddressingInfo(int aFirstLightNumber, int aPage = 0);
 
     /// add a light to this controller
     /// @param aLight the light to add
     void addLight(P44DMXLightPtr aLight);
 
+    /// set the fine channel layout for all lights (including those added later)
+    /// @param aFineChannels bitmask of channel indices carrying the fine (low) byte of the channel index below
+    /// @note must match the layout used by the sender
+    void setFineChannels(uint8_t aFineChannels);
+
+    /// set how channels from multiple senders are merged
+    /// @param aHtpChannels bitmask of channel indices merged highest-takes-precedence (HTP), all others are
+    ///   merged latest-takes-precedence (LTP), i.e. the sender that changed the channel last wins.
+    ///   Default is 0x04 (brightness HTP). Fine channels follow their coarse channel.
+    /// @note senders are told apart by their source ID, see P44BTDMXsender::setSourceId()
+    void setHtpChannels(uint8_t aHtpChannels) { mHtpChannels = aHtpChannels; };
+
+    /// get packet sequence statistics
+    /// @param aStats will be set to the statistics collected from packets carrying a sequence number
+    /// @param aReset if set, the statistics are reset after reading
+    /// @note loss rate is lost/(received+lost), duplicate rate is duplicates/(received+duplicates),
+    ///   mean gap length is lost/gaps
+    void getSequenceStats(SequenceStats &aStats, bool aReset = false);
+
+    /// @return true if the receiver has a time base shared with the sender (and all other receivers of that sender)
+    bool hasTimeBase() { return mNumClockSamples>0; };
+
+    /// @param aLocalTime a local time (MainLoop::now() timeline)
+    /// @return time in the shared time base at aLocalTime
+    /// @note only meaningful when hasTimeBase() is true
+    MLMicroSeconds timeBaseAt(MLMicroSeconds aLocalTime);
+
+    /// @param aTimeBase a time in the shared time base
+    /// @return local time (MainLoop::now() timeline) when the shared time base reaches aTimeBase
+    /// @note only meaningful when hasTimeBase() is true
+    MLMicroSeconds localTimeAt(MLMicroSeconds aTimeBase);
+
+    /// get the state of the clock discipline
+    /// @param aOffset will be set to the current offset of the shared time base relative to the local time
+    /// @param aDrift will be set to the estimated rate the shared time base runs faster than the local clock
+    /// @return false if there is no shared time base (yet)
+    bool getTimeBaseInfo(MLMicroSeconds &aOffset, double &aDrift);
+
     /// process manufacturer specific advertisement data (which might contain p44BTDMX data
     /// @param aAdvMfgData data bytes from a AD Struct of type "manufacturer specific data"
-    /// @note p44BTDMX recognizes Apple iBeacons as well as native plan44 and bluekitchen manufacturer data as carriers
+    /// @param aReceivedAt time the advertisement was received, Never for now
+    /// @note p44BTDMX recognizes Apple iBeacons as well as native plan44 and bluekitchen manufacturer data as carriers,
+    ///   the latter in legacy and (larger) BLE 5 extended advertisements
     /// @return tru if any p44DMX channels have changed
-    bool processBTAdvMfgData(const string aAdvMfgData);
+    bool processBTAdvMfgData(const string aAdvMfgData, MLMicroSeconds aReceivedAt = Never);
 
     /// process p44BTDMX payload data, coming from one of the possible carriers, encrypted/obfuscated by the system key
     /// @param aP44BTDMXData raw p44BTDMX data
     /// @param aNative if set, the payload is considered "native", i.e. coming from a dedicated P44BTDMX sender,
     ///   not from a iBeacon sent by an iOS device.
+    /// @param aExtended if set, the payload comes from an extended advertisement (which is preferred over legacy
+    ///   advertisements from the same sender)
+    /// @param aReceivedAt time the payload was received, Never for now. Only needed for the shared time base,
+    ///   passing the time of reception rather than that of processing gives a more precise time base.
     /// @return tru if any p44DMX channels have changed
-    bool processP44BTDMXpayload(const string aP44BTDMXData, bool aNative);
+    bool processP44BTDMXpayload(const string aP44BTDMXData, bool aNative, bool aExtended = false, MLMicroSeconds aReceivedAt = Never);
 
     /// process p44DMX decrypted delta update commands
     /// @param aP44DMXCmds plain text p44DMX delta commands
@@ -134,6 +288,61 @@ namespace p44 {
 
     LightChannel channels[cNumChannels];
 
+    uint8_t mFineChannels; ///< bitmask of channel indices carrying the fine (low) byte of the channel index below
+
+    /// @param aChannelIndex the channel index
+    /// @return true if the pending value of the channel (or of its fine channel) differs from the current value
+    bool channelChanged(uint8_t aChannelIndex);
+
+    /// @param aChannelIndex the channel index
+    /// @return pending value of the channel as 16-bit value, with the fine channel as the low byte if there is one
+    uint16_t channelValue16(uint8_t aChannelIndex);
+
+    /// @param aChannelIndex the channel index
+    /// @return pending value of the channel in 0..255 (same as the 8-bit value without a fine channel),
+    ///   with the resolution of the fine channel if there is one
+    double channelValue(uint8_t aChannelIndex) { return (double)channelValue16(aChannelIndex)/257; };
+
+    #if ESP_PLATFORM
+    /// callback to (re)start an animation for a cycle
+    /// @param aCycleNo the number of the cycle. Animations alternating their direction run odd cycles backwards.
+    typedef boost::function<void (uint32_t aCycleNo)> CycleStartCB;
+
+    /// run an animation in cycles aligned to the time base shared by the sender and all receivers
+    /// @param aCycleTime duration of one cycle
+    /// @param aCycleStartCB called at the start of every cycle, to (re)start the animation for that cycle
+    /// @note cycles start at multiples of aCycleTime in the shared time base, so the same animation runs in phase
+    ///   on all receivers. Without a shared time base (yet), cycles run on the local clock, starting right away.
+    void runCycles(MLMicroSeconds aCycleTime, CycleStartCB aCycleStartCB);
+
+    /// stop running cycles (the animation itself is not stopped)
+    void stopCycles();
+    #endif
+
+  private:
+
+    P44BTDMXreceiver* mReceiver; ///< the receiver this light was added to, providing the shared time base
+
+    typedef struct {
+      uint8_t from; ///< value at start of fade
+      uint8_t to; ///< target value
+      MLMicroSeconds start; ///< time when fade started
+      MLMicroSeconds duration; ///< duration of the fade, 0 if not fading
+    } ChannelFade;
+
+    ChannelFade mFades[cNumChannels];
+    #if ESP_PLATFORM
+    MLTicket mFadeTicket;
+    void fadeStep();
+
+    MLTicket mCycleTicket;
+    MLMicroSeconds mCycleTime; ///< duration of a cycle
+    uint32_t mCycleNo; ///< number of the current cycle
+    CycleStartCB mCycleStartCB;
+    void startCycle(uint32_t aCycleNo);
+    void scheduleNextCycle();
+    #endif
+
   public:
     P44DMXLight();
     virtual ~P44DMXLight();
@@ -141,9 +350,30 @@ namespace p44 {
     /// @return prefix for log messages
     virtual string logContextPrefix() P44_OVERRIDE { return string_format("Light #%d", mGlobalLightOffset+mLocalLightNumber); };
 
+    /// set fine channel layout
+    /// @param aFineChannels bitmask of channel indices carrying the fine (low) byte of the channel index below,
+    ///   e.g. 0x08 for a 16-bit brightness in channels 2 (coarse) and 3 (fine). 0 = all channels are 8-bit.
+    void setFineChannels(uint8_t aFineChannels) { mFineChannels = aFineChannels & 0xFE; };
+
+    /// @param aChannelIndex the channel index
+    /// @return true if the channel carries the fine byte of the channel index below
+    bool isFineChannel(uint8_t aChannelIndex) { return (mFineChannels>>aChannelIndex) & 1; };
+
     /// set single light channel
+    /// @note stops a fade in progress on that channel
     void setChannel(uint8_t aChannelIndex, uint8_t aValue);
 
+    /// fade single light channel from its current value to a new value
+    /// @param aChannelIndex the channel to fade
+    /// @param aTarget the value to reach at the end of the fade
+    /// @param aDuration duration of the fade
+    /// @note the fade steps are applied via applyChannels() like any other channel change
+    void fadeChannel(uint8_t aChannelIndex, uint8_t aTarget, MLMicroSeconds aDuration);
+
+    /// @param aChannelIndex the channel index
+    /// @return value of the channel, or the target value when the channel is fading
+    uint8_t getChannel(uint8_t aChannelIndex);
+
     /// apply channel values
     /// @note base class just confirms apply by updating "current" field from "pending" in internal channel data
     /// @return true if any change has happened
@@ -161,18 +391,201 @@ namespace p44 {
 
     static const uint16_t cNumLights = (255-2)/3; // limited not by DMX channels, but addr/command byte (3 cmds per light)
     static const int cUniverseSize = cLightChannels*cNumLights; // important to be NOT larger than actually monitored lights
+    static_assert(cUniverseSize%4==0, "universe is processed in words of 4 channels");
 
-  private:
+    typedef enum {
+      sched_age, ///< all changes have the same priority, oldest first
+      sched_magnitude, ///< changes are prioritized by their size and the type of channel
+      sched_deadline, ///< earliest deadline first, with load adaptive repeat count
+    } SchedulingMode;
 
-    typedef struct {
-      uint8_t pending;
-      uint8_t current;
-      uint8_t age;
-    } DMXChannel;
+    static const int cMagnitudeLevels = 4; ///< number of priority levels in sched_magnitude mode
+    static const int cPriorityClasses = cMagnitudeLevels; ///< number of channel priority classes, 0=most important
+    static const int cMaxExtAdvDataBytes = 251; ///< max advertisement data size for BLE 5 extended advertisements (single PDU)
+
+  private:
 
-    DMXChannel mUniverse[cUniverseSize];
+    // universe state, as separate arrays to allow comparing/updating multiple channels at once
+    uint8_t mPending[cUniverseSize] __attribute__((aligned(4))); ///< value as recently received from DMX
+    uint8_t mCurrent[cUniverseSize] __attribute__((aligned(4))); ///< value as last scheduled for sending, to detect changes
+    uint8_t mAgeSlot[cUniverseSize]; ///< slot in the age index, use channelAge() to get actual age
+    static const int cDirtyWords = (cUniverseSize+31)/32;
+    uint32_t mDirty[cDirtyWords]; ///< bitmap of channels where mPending might differ from mCurrent
+
+    // deadline scheduling
+    static const int cOverdueAge = 254; ///< channels at this age are due (or overdue) for a repeat
+    static const int cRefreshOverdueAge = 127; ///< channels at this age are due (or overdue) for a refresh
+    static const int cParkedAge = 255; ///< channels at this age do not need to be sent at all
+    static const int cMaxRepeatInterval = cOverdueAge-cRefreshOverdueAge-1; ///< repeat deadlines must stay above refresh deadlines
+    uint8_t mRepeatsLeft[cUniverseSize]; ///< number of repeats still to send
+    uint32_t mSentInPacket[cDirtyWords]; ///< channels sent in the current packet
+    int mRepeatInterval; ///< max packets between repeats of a change
+    int mRefreshInterval; ///< max packets between background refreshes
+    int mMinRepeats; ///< repeats under heavy load
+    int mMaxRepeats; ///< repeats when idle
+    int mRepeatBacklog; ///< number of channels with repeats left
+    int mLastPacketBytes; ///< packet size, for estimating capacity
     int mInitialRepeatCount;
     bool mRefreshUniverse; ///< if set, the entire universe is refreshed regularily.
+    SchedulingMode mSchedulingMode;
+
+    // fades
+    typedef struct {
+      uint32_t originMs; ///< time of the origin of the ramp
+      uint32_t lastMs; ///< time of the last change on the ramp
+      uint32_t fadeStartMs; ///< time when the current fade started
+      uint16_t fadeDuration; ///< duration of the current fade in milliseconds
+      uint8_t origin; ///< value at the origin of the ramp
+      uint8_t points; ///< number of changes consistent with the ramp
+      uint8_t fadeStart; ///< value at the start of the current fade
+      uint8_t fadeTarget; ///< target value of the current fade
+    } ChannelRamp;
+    std::vector<ChannelRamp> mRamps; ///< per channel ramp state, only allocated when fade detection is enabled
+    uint32_t mFading[cDirtyWords]; ///< bitmap of channels sent as fades
+    uint32_t mFadeStarted[cDirtyWords]; ///< bitmap of channels with a new fade not yet scheduled for sending
+    uint32_t mNowMs; ///< timestamp of the most recent DMX frame
+
+    // deadband
+    int mDeadband; ///< changes within this distance from the last prioritized value are only refreshed
+    uint8_t mAnchor[cUniverseSize]; ///< value of the last change sent with priority
+    uint32_t mSuppressedChanges; ///< number of changes suppressed by the deadband
+    uint32_t mSuppressedUpdates; ///< number of priority updates (including repeats) saved by the deadband
+
+    // scenes
+    int mRecalledScene; ///< scene the universe has been matching since it was stored or recalled, -1 if none
+    uint8_t mSceneCmd; ///< scene extended command to send, 0 if none
+    uint8_t mSceneCmdScene; ///< scene number for mSceneCmd
+    uint8_t mSceneCmdFade; ///< fade time for mSceneCmd in fade time units
+    int mSceneCmdRepeats; ///< number of times mSceneCmd still needs to be sent
+    string mStoreSceneData; ///< universe to be stored as a scene once all changes are delivered
+
+    // priority classes
+    uint8_t mChannelClass[cLightChannels]; ///< priority class per channel index
+    uint8_t mClassOverrides[cNumLights]; ///< bitmask of channel indices with a light specific priority class
+    uint8_t mPriorityClass[cUniverseSize]; ///< effective priority class per channel
+    bool mUsesPriorityClasses; ///< set when any channel has a priority class other than 0 (or fine channels are used)
+    uint8_t mFineChannels; ///< bitmask of channel indices carrying the fine (low) byte of the channel index below
+
+    // age index
+    // - ages 0..mMaxRefreshAge are kept in a ring of slots rotating with mAgeBase, so ageing
+    //   the entire universe does not need to touch every channel
+    // - ages above mMaxRefreshAge (recent changes being repeated) have fixed slots (slot==age)
+    static const int cLightMaskWords = (cNumLights+31)/32;
+    typedef uint32_t LightMask[cLightMaskWords];
+    int mMaxRefreshAge; ///< 255-mInitialRepeatCount*levels, highest age reached by ageing
+    int mAgeBase; ///< ring offset for slots of ages 0..mMaxRefreshAge
+    uint16_t mAgeCount[256]; ///< number of channels per age slot
+    LightMask mAgeLights[256]; ///< lights having at least one channel in the age slot
+
+    inline int slotForAge(int aAge) { return aAge>mMaxRefreshAge ? aAge : (aAge+mAgeBase)%(mMaxRefreshAge+1); };
+    inline int ageForSlot(int aSlot) { return aSlot>mMaxRefreshAge ? aSlot : (aSlot+mMaxRefreshAge+1-mAgeBase)%(mMaxRefreshAge+1); };
+    inline uint8_t channelAge(int aDMXChannel) { return ageForSlot(mAgeSlot[aDMXChannel]); };
+    void setChannelAge(int aDMXChannel, uint8_t aAge);
+    void ageUniverse();
+    void mergeIntoAgeBelow(int aAge);
+    void updateAgeLayout();
+    int changeLevel(int aChannelIndex, uint8_t aOldValue, uint8_t aNewValue);
+    void updatePriorityClasses();
+    void trackRamp(int aDMXChannel, uint8_t aOldValue, uint8_t aNewValue);
+    void trackFades();
+    bool startFade(int aDMXChannel);
+    void endFade(int aDMXChannel, uint8_t aReceiverValue);
+    uint8_t fadeValue(int aDMXChannel, uint32_t aAtMs);
+    inline uint8_t fadingChannels(int aLightIndex) { int loffs = aLightIndex*cLightChannels; return (mFading[loffs>>5]>>(loffs & 0x1F)) & 0xFF; };
+    uint8_t* encodeFade(uint8_t* aCmds, int aDMXChannel);
+    void rebuildAgeIndex();
+    void verifyAgeIndex();
+
+    // packet generation
+    bool mOptimizedPacking; ///< if set, commands are chosen to carry as many updates as possible per packet
+    bool mExtendedCommands; ///< if set, extended p44DMX commands (range, group, keyframe, delta) are used where they save space
+    uint8_t mLastSent[cUniverseSize]; ///< value last sent, i.e. the value the receivers should have now
+    uint32_t mLastSentValid[cDirtyWords]; ///< channels where the receivers should have mLastSent (not fading)
+    uint32_t mDeltaPending[cDirtyWords]; ///< channels with a change small enough to be sent as a delta
+    uint8_t mDeltaRun[cUniverseSize]; ///< number of deltas sent since the channel was last sent as an absolute value
+
+    // forward error correction
+    int mFecGroupSize; ///< max number of data packets per parity packet, 0=no FEC
+    int mFecIndex; ///< index of the next data packet in the current FEC group
+    uint8_t mFecGroupNo; ///< rolling number of the current FEC group
+    int mFecParityLen; ///< size of the parity (= command bytes of the longest data packet) of the current FEC group
+    uint8_t mFecParity[cMaxExtAdvDataBytes]; ///< XOR of the data packets of the current FEC group so far
+    uint32_t mFecHeld[cDirtyWords]; ///< channels sent in the current FEC group, held at age 0 until the group ends
+    uint8_t mFecAge[cUniverseSize]; ///< age held channels continue with when the FEC group ends
+
+    // sequence numbers
+    bool mSequenceNumbers; ///< if set, every payload starts with a sequence number
+    uint8_t mSequenceNo; ///< sequence number of the next payload
+
+    // source identification
+    int mSourceId; ///< source ID sent with every payload, -1 if none
+
+    // time base
+    MLMicroSeconds mTimeBaseInterval; ///< interval for sending the time base, 0 = never
+    MLMicroSeconds mLastTimeBase; ///< when the time base was last sent
+    bool timeBaseDue();
+
+    static const int cMaxPackBytes = 32; ///< max packet size for optimized packing, larger packets are packed in chunks of this size
+    static const int cMaxPackLights = 16; ///< max number of lights considered for one packet
+    static const uint8_t cColorGroup = 0xFF; ///< PackGroup channel for the color channels group
+    static const int cMaxPackGroupsPerLight = cLightChannels+1; ///< color group plus one group per channel (all channels might be fading)
+    static const int cMaxPackGroups = cMaxPackLights*cMaxPackGroupsPerLight; ///< max number of command alternative groups
+    typedef struct {
+      uint8_t light; ///< light index
+      uint8_t due; ///< bitmask of channels due in this packet
+      uint8_t color; ///< chosen color command option
+      uint8_t others; ///< bitmask of chosen other channel commands
+    } PackCandidate;
+    typedef struct {
+      uint8_t candidate; ///< index into mPackCandidates
+      uint8_t channel; ///< cColorGroup for the color channels group, channel index for single channel commands
+    } PackGroup;
+    // only used while packing a packet, so shared by all senders and their pages (packets are generated from the mainloop)
+    static PackCandidate mPackCandidates[cMaxPackLights];
+    static PackGroup mPackGroups[cMaxPackGroups];
+    static uint8_t mPackChoice[cMaxPackGroups][cMaxPackBytes+1]; ///< knapsack choices per group and packet size
+    static const uint8_t cMaxPassedOver = 8; ///< packets a due channel can be passed over by the optimized packer before it takes precedence over its priority
+    uint8_t mPassedOver[cUniverseSize]; ///< number of packets the optimized packer has passed over the channel while it was due
+
+    virtual const char* sceneKeyPrefix() P44_OVERRIDE { return "txscene"; };
+    int matchingScene();
+    void sceneRecalled(uint8_t aSceneNo, uint8_t aFadeUnits);
+    bool changesPending();
+    int packSceneCmd(uint8_t* aBuffer, int aMaxBytes);
+
+    void detectChanges();
+    inline uint8_t scheduledAge(int aDMXChannel) { return (mFecHeld[aDMXChannel>>5]>>(aDMXChannel & 0x1F)) & 1 ? mFecAge[aDMXChannel] : channelAge(aDMXChannel); };
+    void holdChannel(int aDMXChannel);
+    void ageHeldChannels();
+    void releaseHeldChannels();
+    int generateFecCmds(uint8_t* aBuffer, int aMaxBytes, int aDataReserve);
+    int generateDataCmds(uint8_t* aBuffer, int aMaxBytes);
+    void scheduleRefresh(int aDMXChannel);
+    void channelSent(int aDMXChannel, uint8_t aDoneAge);
+    void scheduleSentChannels();
+    int classInterval(int aInterval, int aClass, int aMaxInterval);
+    int adaptiveRepeatCount();
+    uint8_t sentAge(int aAge);
+    int nextPassAge(int &aLastMaxAge, int &aRefreshMaxAge);
+    uint64_t updateWeight(int aAge, uint8_t aPassedOver);
+    int packExtended(uint8_t* aBuffer, int aMaxBytes);
+    uint8_t* packRanges(uint8_t* aCmds, int &aRoom, uint32_t* aPending);
+    uint8_t* packRange(uint8_t* aCmds, int &aRoom, uint32_t* aPending, int aChannelIndex, int aFirstLight, int aNumLights);
+    uint8_t* packGroups(uint8_t* aCmds, int &aRoom, uint32_t* aPending, int aChannelIndex);
+    uint8_t* packGroup(uint8_t* aCmds, int &aRoom, uint32_t* aPending, int aChannelIndex, const uint8_t* aLights, int aNumLights);
+    uint8_t* packKeyframes(uint8_t* aCmds, int &aRoom, uint32_t* aPending);
+    uint8_t* packDeltas(uint8_t* aCmds, int &aRoom, uint32_t* aPending, const uint32_t* aDeltas);
+    int packGreedy(uint8_t* aBuffer, int aMaxBytes);
+    int packOptimized(uint8_t* aBuffer, int aMaxBytes);
+
+    // pages
+    static const int cMaxPages = 8; ///< max number of pages
+    typedef std::vector<P44BTDMXsenderPtr> PagesVector;
+    PagesVector mPages; ///< senders for the additional pages 1..n, this sender is page 0
+    int mNextPage; ///< page to get the next packet first
+    bool pageBusy();
+    int generatePageCmds(uint8_t* aBuffer, int aMaxBytes);
+    int generatePagesCmds(uint8_t* aBuffer, int aMaxBytes);
 
   public:
 
@@ -187,17 +600,167 @@ namespace p44 {
 
     /// @param aInitialRepeatCount how many times a change is broadcast with priority before only
     ///   being re-broadcast occasionally (or not at all when mRefreshUniverse is not set)
-    void setInitialRepeatCount(int aInitialRepeatCount) { mInitialRepeatCount = aInitialRepeatCount; };
+    void setInitialRepeatCount(int aInitialRepeatCount);
 
     /// @param aRefreshUniverse if set, all values in the p44BTDMX universe (=420 channels, not 512!)
     ///   will be regularily refreshed by re-broadcasting them. Note that this is the mode a central
     ///   DMX sender should operate in, but apps for occasionally testing may not want to use
     ///   refresh to allow multiple app instances being active.
-    void setRefreshUniverse(bool aRefreshUniverse) { mRefreshUniverse = aRefreshUniverse; }
+    void setRefreshUniverse(bool aRefreshUniverse);
+
+    /// @param aSchedulingMode how changes are prioritized among each other:
+    ///   - sched_age: all changes are equal, repeated in the order they occur
+    ///   - sched_magnitude: large changes and brightness changes are repeated first, so they are not
+    ///     delayed by many small changes (e.g. generated by light desk smoothing)
+    ///   - sched_deadline: every channel has a deadline, packets are filled earliest deadline first,
+    ///     see setDeadlineParams()
+    void setSchedulingMode(SchedulingMode aSchedulingMode);
+
+    /// set the parameters for sched_deadline mode
+    /// @param aRepeatInterval max number of packets between repeats of a change (1..126)
+    /// @param aRefreshInterval max number of packets between background refreshes of unchanged channels (1..127),
+    ///   refreshes only use the capacity not needed for repeating changes
+    /// @param aMinRepeats number of times a change is sent under heavy load
+    /// @param aMaxRepeats number of times a change is sent when the universe is idle
+    /// @note as long as the load allows, a change is sent N times within N*aRepeatInterval packets,
+    ///   with N adapting between aMinRepeats and aMaxRepeats
+    void setDeadlineParams(int aRepeatInterval, int aRefreshInterval, int aMinRepeats, int aMaxRepeats);
+
+    /// set the priority class for a channel index in all lights (except those having a light specific class)
+    /// @param aChannelIndex channel index within a light, 0..cLightChannels-1
+    /// @param aClass priority class, 0=most important..cPriorityClasses-1
+    /// @note changes of channels in lower priority classes are only repeated after those of higher classes,
+    ///   in sched_deadline mode they also get proportionally longer repeat and refresh intervals
+    void setChannelPriorityClass(int aChannelIndex, int aClass);
+
+    /// set a light specific priority class for a channel
+    /// @param aLightIndex light index, 0..cNumLights-1
+    /// @param aChannelIndex channel index within the light, 0..cLightChannels-1
+    /// @param aClass priority class, 0=most important..cPriorityClasses-1, or -1 to use the
+    ///   class set by setChannelPriorityClass() again
+    void setLightPriorityClass(int aLightIndex, int aChannelIndex, int aClass);
+
+    /// @param aLightIndex light index, 0..cNumLights-1, or -1 for the class set by setChannelPriorityClass()
+    /// @param aChannelIndex channel index within the light, 0..cLightChannels-1
+    /// @return priority class, or -1 if no light specific class is set
+    int getPriorityClass(int aLightIndex, int aChannelIndex);
+
+    /// set fine channel layout
+    /// @param aFineChannels bitmask of channel indices carrying the fine (low) byte of the channel index below,
+    ///   e.g. 0x08 for a 16-bit brightness in channels 2 (coarse) and 3 (fine). 0 = all channels are 8-bit.
+    /// @note fine channel changes accompanying a change of their coarse channel are sent along with it,
+    ///   fine-only changes are sent with the lowest priority. Fine channels are not sent as fades.
+    void setFineChannels(uint8_t aFineChannels);
+
+    /// @return current fine channel layout
+    uint8_t getFineChannels() { return mFineChannels; };
+
+    /// @param aDeadband changes of a channel by no more than this (relative to the last change sent with priority)
+    ///   are not sent as changes with repeats, but only delivered by the background refresh. 0 = no deadband
+    /// @note this suppresses the jitter of noisy DMX sources, while still converging to the exact values
+    void setDeadband(int aDeadband);
+
+    /// @return current deadband
+    int getDeadband() { return mDeadband; };
+
+    /// get deadband statistics
+    /// @param aSuppressedChanges will be set to the number of changes suppressed by the deadband
+    /// @param aSuppressedUpdates will be set to the number of priority updates (including repeats) saved by the deadband
+    /// @param aReset if set, the counters are reset after reading
+    void getDeadbandStats(uint32_t &aSuppressedChanges, uint32_t &aSuppressedUpdates, bool aReset = false);
+
+    /// @return number of channels (of all pages) with changes not yet sent or repeats still pending,
+    ///   0 when only the background refresh (if any) is being sent
+    int getBacklog();
+
+    /// @param aFadeDetection if set, linear ramps in the DMX channel values are detected and sent as
+    ///   fade commands to be interpolated by the receivers, rather than as a series of value changes.
+    /// @note requires timestamps being passed to setChannels(), and all receivers must support the fade command
+    void setFadeDetection(bool aFadeDetection);
+
+    /// @param aOptimizedPacking if set, the commands for each packet are chosen to carry as many
+    ///   (priority weighted) updates as possible, rather than packing lights greedily in priority order
+    void setOptimizedPacking(bool aOptimizedPacking);
+
+    /// @param aExtendedCommands if set, changes of the same channel (or HSB color) to the same value on
+    ///   multiple lights are sent as a single range (consecutive lights) or group (light bitmask) command,
+    ///   and many channels of the same light changing at once as a keyframe command. With the universe being
+    ///   refreshed, small changes are sent once as deltas, leaving the absolute value to the refresh.
+    /// @note all receivers must support the extended commands
+    /// @note deltas are only sent with sequence numbers enabled (see setSequenceNumbers()), so receivers skip
+    ///   duplicate packets instead of applying deltas twice, and not with FEC (see setFecGroupSize())
+    void setExtendedCommands(bool aExtendedCommands);
+
+    /// set the number of pages (universes of cNumLights lights each)
+    /// @param aNumPages number of pages, 1..cMaxPages. Additional pages get the settings of this sender (page 0),
+    ///   settings changed later on this sender are passed on to them. Light specific priority classes
+    ///   (setLightPriorityClass()) are per page, set them via getPage().
+    /// @note all receivers must support the page select command, including those on page 0: older receivers
+    ///   would apply the commands for other pages to their page 0 lights
+    /// @note each additional page needs about 11kB of RAM, 22kB with fade detection
+    /// @note scenes only cover page 0
+    void setNumPages(int aNumPages);
+
+    /// @return number of pages
+    int getNumPages() { return (int)mPages.size()+1; };
+
+    /// get the sender for a page, to set its channels
+    /// @param aPage the page number, 0..getNumPages()-1
+    /// @return the sender for the page (this sender for page 0), NULL if there is no such page
+    /// @note only page 0 (this sender) generates packets, covering all pages
+    P44BTDMXsenderPtr getPage(int aPage);
+
+    /// set forward error correction
+    /// @param aFecGroupSize max number of data packets followed by a parity packet, 0 for no FEC
+    /// @note all receivers must support FEC (older receivers apply trailers and parity bytes as light commands).
+    ///   FEC replaces repeats, so the repeat count should be reduced accordingly.
+    void setFecGroupSize(int aFecGroupSize);
+
+    /// @return number of data packets per parity packet, 0 if FEC is not used
+    int getFecGroupSize() { return mFecGroupSize; };
+
+    /// @param aSequenceNumbers if set, every payload starts with a rolling 1-byte sequence number, which
+    ///   lets receivers detect lost and duplicate packets, and skip processing duplicates
+    /// @note all receivers must support the sequence command
+    void setSequenceNumbers(bool aSequenceNumbers);
+
+    /// @param aTimeBaseInterval interval for appending the sender's time to a packet, from which the receivers
+    ///   derive a shared time base to run animations in phase. 0 = no time base
+    /// @note all receivers must support the time base command
+    void setTimeBaseInterval(MLMicroSeconds aTimeBaseInterval) { mTimeBaseInterval = aTimeBaseInterval; };
+
+    /// @param aSourceId ID (0..255) identifying this sender to receivers merging multiple senders, -1 for none
+    /// @note every payload starts with the source ID, all receivers must support source IDs
+    void setSourceId(int aSourceId) { mSourceId = aSourceId<0 ? -1 : aSourceId & 0xFF; };
+
+    /// load all scenes from the persistent scene store
+    /// @note must be called before scenes can be recognized in the DMX input after startup
+    void loadScenes();
+
+    /// store the current universe as a scene, and let the receivers store the state of their lights as that scene
+    /// @param aSceneNo the scene number, 0..cMaxScenes-1
+    /// @return false if aSceneNo is out of range
+    /// @note the store command is only sent to the receivers when all pending changes are delivered, and
+    ///   not at all when the universe changes before that.
+    /// @note once a scene is stored, the sender sends a scene recall instead of the changes whenever the
+    ///   universe changes to match that scene.
+    bool storeScene(int aSceneNo);
+
+    /// recall a scene, i.e. set the universe to the scene's values and let the receivers recall it
+    /// @param aSceneNo the scene number
+    /// @param aFadeTime time for the receivers to fade to the scene
+    /// @return false if there is no such scene
+    bool recallScene(int aSceneNo, MLMicroSeconds aFadeTime = 0);
 
     /// encode plaintext (e.g. p44DMX command) string as p44BTDMX payload
     string encodeP44BTDMXpayload(const string aPlainText);
 
+    /// encode plaintext (e.g. p44DMX command) in place as p44BTDMX payload
+    /// @param aBuffer buffer containing the plaintext, must have room for 2 more bytes (CRC)
+    /// @param aPlainTextLen number of plaintext bytes in aBuffer
+    /// @return size of the payload (aPlainTextLen+2)
+    int encodeP44BTDMXpayload(uint8_t* aBuffer, int aPlainTextLen);
+
     /// get a DMX channel value
     /// @param aDMXChannel the DMX channel index (0..511)
     /// @return the current value of the channel
@@ -208,17 +771,27 @@ namespace p44 {
     /// @param aValue the new value
     void setChannel(uint16_t aDMXChannel, uint8_t aValue);
 
-    /// set a DMX channel value
+    /// set a range of DMX channel values
     /// @param aFromChannel the first channel to update
     /// @param aNumChannels number of channels to update
     /// @param aDMXChannelData array of DMX channel values
-    void setChannels(uint16_t aFromChannel, uint16_t aNumChannels, const uint8_t* aDMXChannelData);
+    /// @param aTimestamp time when the DMX data was received, needed for fade detection
+    /// @note this is optimized for being called with entire DMX frames at the DMX frame rate,
+    ///   unchanged blocks of channels are detected with a block compare and cost almost nothing
+    void setChannels(uint16_t aFromChannel, uint16_t aNumChannels, const uint8_t* aDMXChannelData, MLMicroSeconds aTimestamp = Never);
 
     /// generate next round of p44DMX delta commands to send out
     /// @param aMaxBytes maximum size of p44DMX command bytes
     /// @return string of p44DMX commands to send
     string generateP44DMXcmds(int aMaxBytes);
 
+    /// generate next round of p44DMX delta commands into a buffer
+    /// @param aBuffer buffer to write the commands to
+    /// @param aMaxBytes maximum size of p44DMX command bytes (size of aBuffer)
+    /// @param aDataReserve bytes to leave free in packets carrying data (not in FEC parity packets)
+    /// @return number of bytes written to aBuffer
+    int generateP44DMXcmds(uint8_t* aBuffer, int aMaxBytes, int aDataReserve = 0);
+
     /// generate p44BTDMX payload (with CRC and encrypted/obfuscated by the system key)
     /// @param aMaxBytes maximum size of payload
     /// @param aMinBytes minimum size of payload
@@ -226,11 +799,44 @@ namespace p44 {
     ///   a manufacturer specific advertisement structure
     string generateP44BTDMXpayload(int aMaxBytes, int aMinBytes = 0);
 
+    /// generate p44BTDMX payload into a buffer
+    /// @param aBuffer buffer to write the payload to
+    /// @param aMaxBytes maximum size of payload (size of aBuffer)
+    /// @param aMinBytes minimum size of payload
+    /// @return number of bytes written to aBuffer, 0 if nothing to send
+    int generateP44BTDMXpayload(uint8_t* aBuffer, int aMaxBytes, int aMinBytes = 0);
+
     /// generate BT advertisement raw data containing P44BTDMX packaged in
     /// a manufacturer specific advertisement structure (AD struct)
     /// @param aMaxBytes maximum size of generated advertisement data
+    /// @param aExtended if set, generate data for a BLE 5 extended advertisement (aMaxBytes up to cMaxExtAdvDataBytes)
     /// @return raw advertisement data that can be passed to BT for sending
-    string generateBTAdvMfgData(int aMaxBytes = 31);
+    string generateBTAdvMfgData(int aMaxBytes = 31, bool aExtended = false);
+
+    /// generate BT advertisement raw data into a buffer, without any heap allocation
+    /// @param aBuffer buffer to write the advertisement data to
+    /// @param aMaxBytes maximum size of generated advertisement data (size of aBuffer)
+    /// @param aExtended if set, generate data for a BLE 5 extended advertisement (aMaxBytes up to cMaxExtAdvDataBytes)
+    /// @return number of bytes written to aBuffer, 0 if nothing to send
+    int generateBTAdvMfgData(uint8_t* aBuffer, int aMaxBytes = 31, bool aExtended = false);
+
+    /// model of the rate of distinct packets a receiver gets when packets are advertised in multiple concurrent
+    /// advertising sets, one set getting the next packet per update (round robin)
+    /// @param aNumSets number of concurrent advertising sets
+    /// @param aUpdateInterval time between two updates (new packets)
+    /// @param aRestartTime time a set is off air while being updated (stop, set data, start)
+    /// @param aAdvInterval mean advertising interval of the sets (including the random advDelay)
+    /// @param aScanDuty fraction of the time receivers are scanning (scan window/scan interval)
+    /// @return average number of distinct packets per second a receiver gets
+    static double receivedPacketRate(int aNumSets, MLMicroSeconds aUpdateInterval, MLMicroSeconds aRestartTime, MLMicroSeconds aAdvInterval, double aScanDuty);
+
+    /// rate control for the advertising interval
+    /// @param aAdvInterval current advertising interval
+    /// @param aBacklog current backlog, see getBacklog()
+    /// @param aBusyInterval advertising interval to use while there is a backlog
+    /// @param aIdleInterval advertising interval to relax to while there is no backlog
+    /// @return new advertising interval, to be applied for the next update
+    static MLMicroSeconds adaptedAdvInterval(MLMicroSeconds aAdvInterval, int aBacklog, MLMicroSeconds aBusyInterval, MLMicroSeconds aIdleInterval);
 
   };
 
@@ -23,6 +23,7 @@
 #ifdef ESP_PLATFORM
 #include "esp_heap_caps.h"
 #include "driver/gpio.h"
+#include "nvs_flash.h"
 #endif
 
 
@@ -137,6 +138,62 @@
 #ifndef CONFIG_P44BTDMX_REFRESH_UNIVERSE
   #define CONFIG_P44BTDMX_REFRESH_UNIVERSE true
 #endif
+#ifndef CONFIG_P44BTDMX_MAGNITUDE_PRIORITY
+  #define CONFIG_P44BTDMX_MAGNITUDE_PRIORITY 0
+#endif
+#ifndef CONFIG_P44BTDMX_OPTIMIZED_PACKING
+  #define CONFIG_P44BTDMX_OPTIMIZED_PACKING 0
+#endif
+#ifndef CONFIG_P44BTDMX_DEADLINE_SCHEDULING
+  #define CONFIG_P44BTDMX_DEADLINE_SCHEDULING 0
+#endif
+#ifndef CONFIG_P44BTDMX_FADE_DETECTION
+  #define CONFIG_P44BTDMX_FADE_DETECTION 0
+#endif
+#ifndef CONFIG_P44BTDMX_DEADBAND
+  #define CONFIG_P44BTDMX_DEADBAND 0
+#endif
+#ifndef CONFIG_P44BTDMX_EXTENDED_COMMANDS
+  #define CONFIG_P44BTDMX_EXTENDED_COMMANDS 0
+#endif
+#ifndef CONFIG_P44BTDMX_FINE_CHANNELS
+  #define CONFIG_P44BTDMX_FINE_CHANNELS 0 // all channels 8-bit
+#endif
+#ifndef CONFIG_P44BTDMX_PAGES
+  #define CONFIG_P44BTDMX_PAGES 1 // sender: single page of 84 lights
+#endif
+#ifndef CONFIG_P44BTDMX_PAGE
+  #define CONFIG_P44BTDMX_PAGE 0 // receiver: lights are on page 0
+#endif
+#ifndef CONFIG_P44BTDMX_EXTENDED_ADVERTISING
+  #define CONFIG_P44BTDMX_EXTENDED_ADVERTISING 0 // legacy advertisements only
+#endif
+#ifndef CONFIG_P44BTDMX_EXT_ADV_DATA_LEN
+  #define CONFIG_P44BTDMX_EXT_ADV_DATA_LEN 200 // extended advertisement data size
+#endif
+#ifndef CONFIG_P44BTDMX_ADV_SETS
+  #define CONFIG_P44BTDMX_ADV_SETS 1 // single advertisement at a time
+#endif
+#ifndef CONFIG_P44BTDMX_SEQUENCE_NUMBERS
+  #define CONFIG_P44BTDMX_SEQUENCE_NUMBERS 0 // no sequence numbers in payloads
+#endif
+#ifndef CONFIG_P44BTDMX_IDLE_ADV_INTERVAL
+  #define CONFIG_P44BTDMX_IDLE_ADV_INTERVAL 20 // fixed advertising interval
+#endif
+#ifndef CONFIG_P44BTDMX_FEC_GROUP_SIZE
+  #define CONFIG_P44BTDMX_FEC_GROUP_SIZE 0 // no forward error correction, changes are repeated
+#endif
+#ifndef CONFIG_P44BTDMX_TIMEBASE_INTERVAL
+  #define CONFIG_P44BTDMX_TIMEBASE_INTERVAL 0 // no time base, receivers run animations on their local clock
+#endif
+#ifndef CONFIG_P44BTDMX_SOURCE_ID
+  #define CONFIG_P44BTDMX_SOURCE_ID -1 // no source ID in payloads, single sender
+#endif
+#ifndef CONFIG_P44BTDMX_HTP_CHANNELS
+  #define CONFIG_P44BTDMX_HTP_CHANNELS 0x04 // receiver: brightness highest-takes-precedence, others latest-takes-precedence
+#endif
+
+#define SEQUENCE_STATS_INTERVAL (10*Second) // monitor: interval for logging packet sequence statistics
 
 #if CONFIG_P44_WIFI_SUPPORT
   #define JSONAPI 1 // JSON socket API
@@ -234,16 +291,41 @@ class P44BTDMXController : public Application
 
   #if CONFIG_P44_BTDMX_RECEIVER
   P44BTDMXreceiverPtr dmxReceiver; ///< p44 BT DMX receiver
+  #if CONFIG_P44_BTDMX_MONITOR
+  MLTicket sequenceStatsTicket;
+  #endif
   #endif
 
   #if CONFIG_P44_BTDMX_SENDER
   P44BTDMXsenderPtr dmxSender; ///< p44 BT DMX sender
   MLTicket advertisingTicket;
+  uint8_t advData[31]; ///< advertisement data buffer, reused for every advertisement
+  MLMicroSeconds advUpdateStarted; ///< when the last advertisement update was started
+  MLMicroSeconds advRestartTime; ///< average time the BT stack takes for updating an advertising set
+  MLMicroSeconds advUpdateInterval; ///< average time between advertisement updates
+  MLMicroSeconds advInterval; ///< current advertising interval, adapted to the backlog
+  bool advWaiting; ///< set while waiting for the next update with no data queued in the advertising pipeline
+  #if CONFIG_P44BTDMX_EXTENDED_ADVERTISING
+  P44BTDMXsenderPtr dmxExtSender; ///< p44 BT DMX sender for the extended advertisements, scheduled independently
+  MLTicket extAdvertisingTicket;
+  uint8_t extAdvData[CONFIG_P44BTDMX_EXT_ADV_DATA_LEN]; ///< extended advertisement data buffer
+  bool extAdvWaiting; ///< set while waiting for the next extended advertisement update
+  #endif
   #endif
 
 public:
 
   P44BTDMXController()
+    #if CONFIG_P44_BTDMX_SENDER
+    : advUpdateStarted(Never)
+    , advRestartTime(0)
+    , advUpdateInterval(0)
+    , advInterval(0) // set with the first update
+    , advWaiting(false)
+    #if CONFIG_P44BTDMX_EXTENDED_ADVERTISING
+    , extAdvWaiting(false)
+    #endif
+    #endif
   {
   }
 
@@ -281,17 +363,18 @@ public:
     ErrorPtr err = apiServer->startServer(boost::bind(&P44BTDMXController::apiConnectionHandler, this, _1), 10);
     #endif // JSONAPI
     #if CONFIG_P44_BTDMX_SENDER
-    // P44BTDMX sender object
-    dmxSender = P44BTDMXsenderPtr(new P44BTDMXsender);
-    dmxSender->setRefreshUniverse(CONFIG_P44BTDMX_REFRESH_UNIVERSE);
-    dmxSender->setInitialRepeatCount(3);
-    #ifdef CONFIG_P44BTDMX_SYSTEMKEY
-    string systemkey = CONFIG_P44BTDMX_SYSTEMKEY;
-    dmxSender->setSystemKey(systemkey);
+    // P44BTDMX sender object(s)
+    nvs_flash_init(); // scenes are stored in NVS (BLE init would initialize it only later)
+    dmxSender = newDMXSender();
+    #if CONFIG_P44BTDMX_EXTENDED_ADVERTISING
+    // same universe, but separately scheduled for the larger packets of the extended advertisements
+    dmxExtSender = newDMXSender();
     #endif
     #endif // CONFIG_P44_BTDMX_SENDER
     #if CONFIG_P44_BTDMX_RECEIVER
     dmxReceiver = P44BTDMXreceiverPtr(new P44BTDMXreceiver);
+    dmxReceiver->setFineChannels(CONFIG_P44BTDMX_FINE_CHANNELS);
+    dmxReceiver->setHtpChannels(CONFIG_P44BTDMX_HTP_CHANNELS);
     #ifdef CONFIG_P44BTDMX_SYSTEMKEY
     string systemkey = CONFIG_P44BTDMX_SYSTEMKEY;
     dmxReceiver->setSystemKey(systemkey);
@@ -308,7 +391,7 @@ public:
     bool fourLightsController = (dispswitch & 0x18)==0x18;
     if (fourLightsController) dispswitch &= 0xFE; // ignore bit 0
     #endif
-    dmxReceiver->setAddressingInfo((dispswitch & 0x1F)*2); // 64 lights max, in steps of 2
+    dmxReceiver->setAddressingInfo((dispswitch & 0x1F)*2, CONFIG_P44BTDMX_PAGE); // 64 lights max per page, in steps of 2
     // Real lights initialisation
     const char *firstChainConfig = (dispswitch&0x20) ? CONFIG_P44BTDMX_FIRSTCHAIN_CFG_VARIANT1 : CONFIG_P44BTDMX_FIRSTCHAIN_CFG_VARIANT0;
     #if CONFIG_P44BTDMX_PWMLIGHT
@@ -380,7 +463,10 @@ public:
     #endif // CONFIG_P44_BTDMX_LIGHTS
     #if CONFIG_P44_BTDMX_RECEIVER
     // start scanning BLE advertisements
-    BtAdvertisements::sharedInstance().startScanning(boost::bind(&P44BTDMXController::gotAdvertisement, this, _1, _2));
+    BtAdvertisements::sharedInstance().startScanning(boost::bind(&P44BTDMXController::gotAdvertisement, this, _1, _2, _3));
+    #if CONFIG_P44_BTDMX_MONITOR
+    sequenceStatsTicket.executeOnce(boost::bind(&P44BTDMXController::logSequenceStats, this), SEQUENCE_STATS_INTERVAL);
+    #endif
     #endif // CONFIG_P44_BTDMX_RECEIVER
     #if CONFIG_P44_DMX_RX
     // start receiving DMX packets
@@ -392,12 +478,59 @@ public:
     DMXReceiver::sharedReceiver().start(UART_NUM_2, GPIO_NUM_13, GPIO_NUM_4, boost::bind(&P44BTDMXController::gotDMXPacket, this, _1));
     #endif // CONFIG_P44_BTDMX_RECEIVER
     #if CONFIG_P44_BTDMX_SENDER
-    // start sending P44DMX advertisements
+    // start sending P44DMX advertisements, updating the advertising sets round robin
+    ErrorPtr err = BtAdvertisements::sharedInstance().startPipeline(boost::bind(&P44BTDMXController::advertisementReady, this, _1), false, CONFIG_P44BTDMX_ADV_SETS);
+    if (Error::notOK(err)) LOG(LOG_ERR, "cannot start advertising: %s", err->text());
     sendNextP44BTDMXAdvertisement();
+    #if CONFIG_P44BTDMX_EXTENDED_ADVERTISING
+    err = BtAdvertisements::sharedInstance().startPipeline(boost::bind(&P44BTDMXController::extAdvertisementReady, this, _1), true);
+    if (Error::notOK(err)) LOG(LOG_ERR, "cannot start extended advertising: %s", err->text());
+    sendNextP44BTDMXExtAdvertisement();
+    #endif
     #endif // CONFIG_P44_BTDMX_SENDER
   }
 
 
+  #if CONFIG_P44_BTDMX_SENDER
+
+  P44BTDMXsenderPtr newDMXSender()
+  {
+    P44BTDMXsenderPtr sender = P44BTDMXsenderPtr(new P44BTDMXsender);
+    sender->setRefreshUniverse(CONFIG_P44BTDMX_REFRESH_UNIVERSE);
+    #if CONFIG_P44BTDMX_FEC_GROUP_SIZE>0
+    sender->setFecGroupSize(CONFIG_P44BTDMX_FEC_GROUP_SIZE);
+    sender->setInitialRepeatCount(1); // parity packets recover losses instead of repeats
+    #else
+    sender->setInitialRepeatCount(3);
+    #endif
+    #if CONFIG_P44BTDMX_DEADLINE_SCHEDULING
+    sender->setSchedulingMode(P44BTDMXsender::sched_deadline);
+    #if CONFIG_P44BTDMX_FEC_GROUP_SIZE>0
+    sender->setDeadlineParams(1, 100, 1, 1); // no repeats, parity packets recover losses
+    #endif
+    #elif CONFIG_P44BTDMX_MAGNITUDE_PRIORITY
+    sender->setSchedulingMode(P44BTDMXsender::sched_magnitude);
+    #endif
+    sender->setOptimizedPacking(CONFIG_P44BTDMX_OPTIMIZED_PACKING);
+    sender->setFadeDetection(CONFIG_P44BTDMX_FADE_DETECTION);
+    sender->setDeadband(CONFIG_P44BTDMX_DEADBAND);
+    sender->setExtendedCommands(CONFIG_P44BTDMX_EXTENDED_COMMANDS);
+    sender->setFineChannels(CONFIG_P44BTDMX_FINE_CHANNELS);
+    sender->setSequenceNumbers(CONFIG_P44BTDMX_SEQUENCE_NUMBERS);
+    sender->setTimeBaseInterval(CONFIG_P44BTDMX_TIMEBASE_INTERVAL*MilliSecond);
+    sender->setSourceId(CONFIG_P44BTDMX_SOURCE_ID);
+    sender->setNumPages(CONFIG_P44BTDMX_PAGES); // after all other settings, additional pages copy them
+    sender->loadScenes();
+    #ifdef CONFIG_P44BTDMX_SYSTEMKEY
+    string systemkey = CONFIG_P44BTDMX_SYSTEMKEY;
+    sender->setSystemKey(systemkey);
+    #endif
+    return sender;
+  }
+
+  #endif // CONFIG_P44_BTDMX_SENDER
+
+
   #if CONFIG_P44_DMX_RX
 
   void gotDMXPacket(const uint8_t* aDMXData)
@@ -407,7 +540,11 @@ public:
     #endif
     #if CONFIG_P44_BTDMX_SENDER
     // update DMX channels in sender
-    dmxSender->setChannels(0, 512, aDMXData+1); // byte 1 is first actual channel (byte 0 is 0x00)
+    dmxSender->setChannels(0, 512, aDMXData+1, MainLoop::now()); // byte 1 is first actual channel (byte 0 is 0x00)
+    #if CONFIG_P44BTDMX_EXTENDED_ADVERTISING
+    dmxExtSender->setChannels(0, 512, aDMXData+1, MainLoop::now());
+    #endif
+    wakeAdvertising();
     #endif
   }
 
@@ -416,7 +553,7 @@ public:
 
   #if CONFIG_P44_BTDMX_RECEIVER
 
-  void gotAdvertisement(ErrorPtr aError, const string aAdvData)
+  void gotAdvertisement(ErrorPtr aError, const string aAdvData, MLMicroSeconds aReceivedAt)
   {
     if (!Error::isOK(aError)) {
       LOG(LOG_ERR, "Error: %s", Error::text(aError));
@@ -426,9 +563,9 @@ public:
       // fetch possible manufacturer specific data from advertisement
       const uint8_t* adMfgData;
       uint8_t adMfgDataSz;
-      if (BtAdvertisements::findADStruct((uint8_t *)aAdvData.c_str(), 0xFF, adMfgData, adMfgDataSz)) {
+      if (BtAdvertisements::findADStruct((uint8_t *)aAdvData.c_str(), aAdvData.size(), 0xFF, adMfgData, adMfgDataSz)) {
         // let dmxreceiver handle it
-        if (dmxReceiver->processBTAdvMfgData(string((const char*)adMfgData, adMfgDataSz))) {
+        if (dmxReceiver->processBTAdvMfgData(string((const char*)adMfgData, adMfgDataSz), aReceivedAt)) {
           #if CONFIG_P44_BTDMX_LIGHTS
           // has caused changes in some of our channels -> recalculate power limit
           #if CONFIG_P44BTDMX_MAXMILLIWATTS>0
@@ -450,42 +587,175 @@ public:
     }
   }
 
+
+  #if CONFIG_P44_BTDMX_MONITOR
+
+  void logSequenceStats()
+  {
+    P44BTDMXreceiver::SequenceStats stats;
+    dmxReceiver->getSequenceStats(stats, true);
+    if (stats.received>0) {
+      LOG(LOG_NOTICE,
+        "packets received: %u, lost: %u (%.1f%%), duplicates: %u (%.1f%%), late: %u, gaps: %u (mean %.1f, max %u), resyncs: %u",
+        stats.received,
+        stats.lost, 100.0*stats.lost/(stats.received+stats.lost),
+        stats.duplicates, 100.0*stats.duplicates/(stats.received+stats.duplicates),
+        stats.late,
+        stats.gaps, stats.gaps>0 ? (double)stats.lost/stats.gaps : 0.0, stats.maxGap,
+        stats.resyncs
+      );
+    }
+    MLMicroSeconds offset;
+    double drift;
+    if (dmxReceiver->getTimeBaseInfo(offset, drift)) {
+      LOG(LOG_NOTICE, "time base offset: %lld mS, drift: %.1f ppm", offset/MilliSecond, drift*1E6);
+    }
+    sequenceStatsTicket.executeOnce(boost::bind(&P44BTDMXController::logSequenceStats, this), SEQUENCE_STATS_INTERVAL);
+  }
+
+  #endif // CONFIG_P44_BTDMX_MONITOR
+
   #endif // CONFIG_P44_BTDMX_RECEIVER
 
 
   #if CONFIG_P44_BTDMX_SENDER
 
-  #define ADVERTISING_START_INTERVAL (100*MilliSecond)
-  #define ADVERTISING_START_TO_UPDATE (5*MilliSecond)
+  #define ADVERTISING_IDLE_POLL_INTERVAL (1*Second) // new changes wake up advertising, see wakeAdvertising()
+  #define ADVERTISING_BUSY_INTERVAL (20*MilliSecond) // min advertising interval, used while there is a backlog
+  #define ADVERTISING_IDLE_INTERVAL (CONFIG_P44BTDMX_IDLE_ADV_INTERVAL*MilliSecond) // advertising interval to relax to without a backlog
   #define ADVERTISING_ERROR_TO_RESTART (5*Second)
+  #define ADVERTISING_MEAN_INTERVAL (35*MilliSecond) // esp_bt adv interval 20..40mS, plus 0..10mS advDelay
+  #define RECEIVER_SCAN_DUTY 0.75 // esp_bt scan window/scan interval
+
+  int backlog()
+  {
+    int backlog = dmxSender->getBacklog();
+    #if CONFIG_P44BTDMX_EXTENDED_ADVERTISING
+    backlog += dmxExtSender->getBacklog();
+    #endif
+    return backlog;
+  }
+
+
+  /// @return delay from the advertising pipeline having room for the next data to generating it
+  MLMicroSeconds advertisingUpdateDelay()
+  {
+    // while busy, the next packet is generated right away, so it is ready when the update in progress completes.
+    // While relaxed, updates slow down with the advertising interval, so sets stay on air long enough
+    // to get their data replaced in place rather than being restarted.
+    return advInterval-ADVERTISING_BUSY_INTERVAL;
+  }
+
+
+  /// restart waiting advertising updates at once when there is new backlog
+  void wakeAdvertising()
+  {
+    if (advWaiting && dmxSender->getBacklog()>0) {
+      sendNextP44BTDMXAdvertisement();
+    }
+    #if CONFIG_P44BTDMX_EXTENDED_ADVERTISING
+    if (extAdvWaiting && dmxExtSender->getBacklog()>0) {
+      sendNextP44BTDMXExtAdvertisement();
+    }
+    #endif
+  }
+
 
   void sendNextP44BTDMXAdvertisement()
   {
     advertisingTicket.cancel();
-    string advData = dmxSender->generateBTAdvMfgData();
-    if (advData.empty()) {
-      // try again shortly
-      advertisingTicket.executeOnce(boost::bind(&P44BTDMXController::sendNextP44BTDMXAdvertisement, this), ADVERTISING_START_INTERVAL);
+    advWaiting = false;
+    int advDataLen = dmxSender->generateBTAdvMfgData(advData, sizeof(advData));
+    // adapt the advertising interval to the backlog of changes (in both senders, the interval applies to all sets)
+    MLMicroSeconds interval = P44BTDMXsender::adaptedAdvInterval(advInterval, backlog(), ADVERTISING_BUSY_INTERVAL, ADVERTISING_IDLE_INTERVAL);
+    if (interval!=advInterval) {
+      advInterval = interval;
+      BtAdvertisements::sharedInstance().setAdvertisingInterval((int)(advInterval/MilliSecond));
+    }
+    if (advDataLen==0) {
+      // nothing to send, wait for changes
+      advWaiting = true;
+      advertisingTicket.executeOnce(boost::bind(&P44BTDMXController::sendNextP44BTDMXAdvertisement, this), ADVERTISING_IDLE_POLL_INTERVAL);
       return;
     }
-    // advertise the new data
-    LOG(LOG_DEBUG, "Sending advertisement: (%d bytes) %s", advData.size(), binaryToHexString(advData, ' ').c_str());
-    BtAdvertisements::sharedInstance().startAdvertising(boost::bind(&P44BTDMXController::advertisementStarted, this, _1), advData);
+    // queue the new data, the advertising pipeline puts it into the next (oldest) advertising set
+    LOG(LOG_DEBUG, "Queuing advertisement: (%d bytes) %s", advDataLen, binaryToHexString(string((char*)advData, advDataLen), ' ').c_str());
+    MLMicroSeconds now = MainLoop::now();
+    if (advUpdateStarted!=Never) advUpdateInterval += (now-advUpdateStarted-advUpdateInterval)/16;
+    advUpdateStarted = now;
+    ErrorPtr err = BtAdvertisements::sharedInstance().queueAdvertisement(advData, advDataLen);
+    if (Error::notOK(err)) {
+      LOG(LOG_ERR, "error queuing advertisement: %s", err->text());
+      advertisingTicket.executeOnce(boost::bind(&P44BTDMXController::sendNextP44BTDMXAdvertisement, this), ADVERTISING_ERROR_TO_RESTART);
+    }
   }
 
 
-  void advertisementStarted(ErrorPtr aError)
+  void advertisementReady(ErrorPtr aError)
   {
-    LOG(LOG_DEBUG, "advertisementStarted");
+    LOG(LOG_DEBUG, "advertisementReady");
     if (Error::notOK(aError)) {
-      LOG(LOG_ERR, "error starting adverisement: %s", aError->text());
+      LOG(LOG_ERR, "error updating adverisement: %s", aError->text());
       advertisingTicket.executeOnce(boost::bind(&P44BTDMXController::sendNextP44BTDMXAdvertisement, this), ADVERTISING_ERROR_TO_RESTART);
+      return;
+    }
+    // pipeline has room for the next data
+    advRestartTime = BtAdvertisements::sharedInstance().pipelineUpdateTime();
+    MLMicroSeconds delay = advertisingUpdateDelay();
+    if (delay<=0) {
+      sendNextP44BTDMXAdvertisement();
+    }
+    else {
+      advWaiting = true; // new changes need not wait for the relaxed update
+      advertisingTicket.executeOnce(boost::bind(&P44BTDMXController::sendNextP44BTDMXAdvertisement, this), delay);
+    }
+  }
+
+
+  #if CONFIG_P44BTDMX_EXTENDED_ADVERTISING
+
+  void sendNextP44BTDMXExtAdvertisement()
+  {
+    extAdvertisingTicket.cancel();
+    extAdvWaiting = false;
+    int advDataLen = dmxExtSender->generateBTAdvMfgData(extAdvData, sizeof(extAdvData), true);
+    if (advDataLen==0) {
+      // nothing to send, wait for changes
+      extAdvWaiting = true;
+      extAdvertisingTicket.executeOnce(boost::bind(&P44BTDMXController::sendNextP44BTDMXExtAdvertisement, this), ADVERTISING_IDLE_POLL_INTERVAL);
+      return;
+    }
+    // advertise the new data in parallel to the legacy advertisement
+    LOG(LOG_DEBUG, "Queuing extended advertisement: (%d bytes) %s", advDataLen, binaryToHexString(string((char*)extAdvData, advDataLen), ' ').c_str());
+    ErrorPtr err = BtAdvertisements::sharedInstance().queueAdvertisement(extAdvData, advDataLen, true);
+    if (Error::notOK(err)) {
+      LOG(LOG_ERR, "error queuing extended advertisement: %s", err->text());
+      extAdvertisingTicket.executeOnce(boost::bind(&P44BTDMXController::sendNextP44BTDMXExtAdvertisement, this), ADVERTISING_ERROR_TO_RESTART);
+    }
+  }
+
+
+  void extAdvertisementReady(ErrorPtr aError)
+  {
+    LOG(LOG_DEBUG, "extAdvertisementReady");
+    if (Error::notOK(aError)) {
+      LOG(LOG_ERR, "error updating extended adverisement: %s", aError->text());
+      extAdvertisingTicket.executeOnce(boost::bind(&P44BTDMXController::sendNextP44BTDMXExtAdvertisement, this), ADVERTISING_ERROR_TO_RESTART);
+      return;
+    }
+    // interval is adapted by the legacy advertisement updates
+    MLMicroSeconds delay = advertisingUpdateDelay();
+    if (delay<=0) {
+      sendNextP44BTDMXExtAdvertisement();
     }
     else {
-      advertisingTicket.executeOnce(boost::bind(&P44BTDMXController::sendNextP44BTDMXAdvertisement, this), ADVERTISING_START_TO_UPDATE);
+      extAdvWaiting = true;
+      extAdvertisingTicket.executeOnce(boost::bind(&P44BTDMXController::sendNextP44BTDMXExtAdvertisement, this), delay);
     }
   }
 
+  #endif // CONFIG_P44BTDMX_EXTENDED_ADVERTISING
+
 
   #endif // CONFIG_P44_BTDMX_SENDER
 
@@ -495,7 +765,7 @@ public:
   SocketCommPtr apiConnectionHandler(SocketCommPtr aServerSocketCommP)
   {
     JsonCommPtr conn = JsonCommPtr(new JsonComm(MainLoop::currentMainLoop()));
-    conn->setMessageHandler(boost::bind(&P44BTDMXController::gotMessage, this, _1, _2));
+    conn->setMessageHandler(boost::bind(&P44BTDMXController::gotMessage, this, conn.get(), _1, _2));
     return conn;
   }
 
@@ -512,7 +782,7 @@ public:
   }
 
 
-  void gotMessage(ErrorPtr aError, JsonObjectPtr aJsonObject)
+  void gotMessage(JsonComm* aConn, ErrorPtr aError, JsonObjectPtr aJsonObject)
   {
     if (!Error::isOK(aError)) {
       LOG(LOG_ERR, "Error: %s", Error::text(aError));
@@ -526,10 +796,167 @@ public:
         if (aJsonObject->stringValue()=="quit") {
           terminateAppWith(TextError::err("received quit command via JSON"));
         }
+        #if CONFIG_P44_BTDMX_SENDER
+        else if (aJsonObject->isType(json_type_object)) {
+          JsonObjectPtr o;
+          if (aJsonObject->get("cmd", o) && o->stringValue()=="priority") {
+            // set priority class:
+            // - {"cmd":"priority", "channel":<channelindex>, "class":<class>} for the channel index in all lights
+            // - {"cmd":"priority", ["page":<page>,] "light":<lightindex>, "channel":<channelindex>, "class":<class>}
+            //   for a single light, without "class" to use the class of the channel index again
+            // without "channel" just returns the current priority classes
+            JsonObjectPtr ch;
+            if (aJsonObject->get("channel", ch)) {
+              int cls = aJsonObject->get("class", o) ? o->int32Value() : -1;
+              if (aJsonObject->get("light", o)) {
+                int pageNo = 0;
+                JsonObjectPtr pg;
+                if (aJsonObject->get("page", pg)) pageNo = pg->int32Value();
+                P44BTDMXsenderPtr page = dmxSender->getPage(pageNo);
+                if (page) page->setLightPriorityClass(o->int32Value(), ch->int32Value(), cls);
+                #if CONFIG_P44BTDMX_EXTENDED_ADVERTISING
+                P44BTDMXsenderPtr extPage = dmxExtSender->getPage(pageNo);
+                if (extPage) extPage->setLightPriorityClass(o->int32Value(), ch->int32Value(), cls);
+                #endif
+              }
+              else if (cls>=0) {
+                dmxSender->setChannelPriorityClass(ch->int32Value(), cls);
+                #if CONFIG_P44BTDMX_EXTENDED_ADVERTISING
+                dmxExtSender->setChannelPriorityClass(ch->int32Value(), cls);
+                #endif
+              }
+            }
+            aConn->sendMessage(priorityClassesJson());
+          }
+          else if (aJsonObject->get("cmd", o) && o->stringValue()=="deadband") {
+            // deadband: {"cmd":"deadband", ["deadband":<deadband>,] ["reset":true]}
+            // returns current deadband and number of changes and updates it has suppressed
+            if (aJsonObject->get("deadband", o)) {
+              dmxSender->setDeadband(o->int32Value());
+              #if CONFIG_P44BTDMX_EXTENDED_ADVERTISING
+              dmxExtSender->setDeadband(o->int32Value());
+              #endif
+            }
+            bool reset = aJsonObject->get("reset", o) && o->boolValue();
+            uint32_t changes, updates;
+            dmxSender->getDeadbandStats(changes, updates, reset);
+            JsonObjectPtr ans = JsonObject::newObj();
+            ans->add("deadband", JsonObject::newInt32(dmxSender->getDeadband()));
+            ans->add("suppressedchanges", JsonObject::newInt64(changes));
+            ans->add("suppressedupdates", JsonObject::newInt64(updates));
+            aConn->sendMessage(ans);
+          }
+          else if (aJsonObject->get("cmd", o) && o->stringValue()=="scene") {
+            // scenes:
+            // - {"cmd":"scene", "store":<sceneno>} stores the current universe as a scene, in the sender and the receivers
+            // - {"cmd":"scene", "recall":<sceneno>, ["fade":<milliseconds>]} recalls a scene
+            bool ok = false;
+            if (aJsonObject->get("store", o)) {
+              ok = dmxSender->storeScene(o->int32Value());
+              #if CONFIG_P44BTDMX_EXTENDED_ADVERTISING
+              dmxExtSender->storeScene(o->int32Value());
+              #endif
+            }
+            else if (aJsonObject->get("recall", o)) {
+              int sceneNo = o->int32Value();
+              MLMicroSeconds fadeTime = aJsonObject->get("fade", o) ? o->int32Value()*MilliSecond : 0;
+              ok = dmxSender->recallScene(sceneNo, fadeTime);
+              #if CONFIG_P44BTDMX_EXTENDED_ADVERTISING
+              dmxExtSender->recallScene(sceneNo, fadeTime);
+              #endif
+            }
+            wakeAdvertising();
+            JsonObjectPtr ans = JsonObject::newObj();
+            ans->add("ok", JsonObject::newBool(ok));
+            aConn->sendMessage(ans);
+          }
+          else if (aJsonObject->get("cmd", o) && o->stringValue()=="advsets") {
+            // advertising sets: {"cmd":"advsets"}
+            // returns measured update timing, and the modelled packet rate receivers get for each possible number of sets
+            JsonObjectPtr ans = JsonObject::newObj();
+            ans->add("sets", JsonObject::newInt32(CONFIG_P44BTDMX_ADV_SETS));
+            ans->add("updateinterval", JsonObject::newDouble((double)advUpdateInterval/MilliSecond));
+            ans->add("restarttime", JsonObject::newDouble((double)advRestartTime/MilliSecond));
+            JsonObjectPtr rates = JsonObject::newArray();
+            for (int n=1; n<=BtAdvertisements::cMaxAdvSets; n++) {
+              rates->arrayAppend(JsonObject::newDouble(P44BTDMXsender::receivedPacketRate(n, advUpdateInterval, advRestartTime, ADVERTISING_MEAN_INTERVAL, RECEIVER_SCAN_DUTY)));
+            }
+            ans->add("packetrates", rates);
+            aConn->sendMessage(ans);
+          }
+          else if (aJsonObject->get("cmd", o) && o->stringValue()=="channels") {
+            // set channels: {"cmd":"channels", ["page":<page>,] "channel":<first channel>, "values":[<value>,...]}
+            // e.g. for feeding a second DMX universe as page 1
+            int pageNo = aJsonObject->get("page", o) ? o->int32Value() : 0;
+            P44BTDMXsenderPtr page = dmxSender->getPage(pageNo);
+            #if CONFIG_P44BTDMX_EXTENDED_ADVERTISING
+            P44BTDMXsenderPtr extPage = dmxExtSender->getPage(pageNo);
+            #endif
+            JsonObjectPtr vals;
+            bool ok = false;
+            if (page && aJsonObject->get("channel", o) && aJsonObject->get("values", vals)) {
+              int ch = o->int32Value();
+              for (int i=0; i<vals->arrayLength(); i++) {
+                page->setChannel(ch+i, vals->arrayGet(i)->int32Value());
+                #if CONFIG_P44BTDMX_EXTENDED_ADVERTISING
+                extPage->setChannel(ch+i, vals->arrayGet(i)->int32Value());
+                #endif
+              }
+              ok = true;
+              wakeAdvertising();
+            }
+            JsonObjectPtr ans = JsonObject::newObj();
+            ans->add("ok", JsonObject::newBool(ok));
+            aConn->sendMessage(ans);
+          }
+          else if (aJsonObject->get("cmd", o) && o->stringValue()=="advrate") {
+            // advertising rate: {"cmd":"advrate"}
+            // returns the current backlog of changes and the advertising interval adapted to it
+            JsonObjectPtr ans = JsonObject::newObj();
+            ans->add("backlog", JsonObject::newInt32(backlog()));
+            ans->add("interval", JsonObject::newDouble((double)advInterval/MilliSecond));
+            ans->add("busyinterval", JsonObject::newDouble((double)ADVERTISING_BUSY_INTERVAL/MilliSecond));
+            ans->add("idleinterval", JsonObject::newDouble((double)ADVERTISING_IDLE_INTERVAL/MilliSecond));
+            ans->add("updateinterval", JsonObject::newDouble((double)advUpdateInterval/MilliSecond));
+            aConn->sendMessage(ans);
+          }
+        }
+        #endif // CONFIG_P44_BTDMX_SENDER
+      }
+    }
+  }
+
+  #if CONFIG_P44_BTDMX_SENDER
+
+  JsonObjectPtr priorityClassesJson()
+  {
+    JsonObjectPtr ans = JsonObject::newObj();
+    JsonObjectPtr channels = JsonObject::newArray();
+    JsonObjectPtr lights = JsonObject::newArray();
+    for (int c=0; c<P44BTDMXbase::cLightChannels; c++) {
+      channels->arrayAppend(JsonObject::newInt32(dmxSender->getPriorityClass(-1, c)));
+      for (int p=0; p<dmxSender->getNumPages(); p++) {
+        P44BTDMXsenderPtr page = dmxSender->getPage(p);
+        for (int l=0; l<P44BTDMXsender::cNumLights; l++) {
+          int cls = page->getPriorityClass(l, c);
+          if (cls>=0) {
+            JsonObjectPtr lc = JsonObject::newObj();
+            if (p>0) lc->add("page", JsonObject::newInt32(p));
+            lc->add("light", JsonObject::newInt32(l));
+            lc->add("channel", JsonObject::newInt32(c));
+            lc->add("class", JsonObject::newInt32(cls));
+            lights->arrayAppend(lc);
+          }
+        }
       }
     }
+    ans->add("channels", channels);
+    ans->add("lights", lights);
+    return ans;
   }
 
+  #endif // CONFIG_P44_BTDMX_SENDER
+
   #endif // JSONAPI
 
 };
@@ -66,6 +66,15 @@ P44lrgLight::~P44lrgLight()
 // 5: channel effect specific: speed?
 // 6: channel effect specific: gradient?
 // 7: channel mode
+// fine channel layout: position can be 16-bit with channel 4 as its fine channel (no size control then),
+// and brightness with channel 3 as its fine channel (no position control then)
+
+double P44lrgLight::relativeSize()
+{
+  if (isFineChannel(4)) return 1; // channel 4 is the fine position channel, no size control
+  return (double)channels[4].pending/255;
+}
+
 
 bool P44lrgLight::applyChannels()
 {
@@ -73,16 +82,16 @@ bool P44lrgLight::applyChannels()
   bool animationChanged = false;
   // - convert HSV to Pixel
   PixelColor col = hsbToPixel(
-    (double)channels[0].pending/255*360,
-    (double)channels[1].pending/255,
-    (double)channels[2].pending/255,
+    channelValue(0)/255*360,
+    channelValue(1)/255,
+    channelValue(2)/255,
     true // brightness as alpha, full RGB value
   );
   // check what to update
   if (
-    (channels[0].pending!=channels[0].current) || // H
-    (channels[1].pending!=channels[1].current) || // S
-    (channels[2].pending!=channels[2].current) || // V
+    channelChanged(0) || // H
+    channelChanged(1) || // S
+    channelChanged(2) || // V
     (channels[7].pending!=channels[7].current)    // mode
   ) {
     // need updating RGB outputs
@@ -97,6 +106,7 @@ bool P44lrgLight::applyChannels()
       sz.y = f.dy;
       mLightView->setContentSize(sz);
       // - stop animation, reset alpha
+      stopCycles();
       mLightView->stopAnimations();
       mAnimation.reset();
       mLightView->setAlpha(255);
@@ -114,28 +124,28 @@ bool P44lrgLight::applyChannels()
           // sizable light with hard edges
           mLightView->setColoringParameters(col, 0, gradient_none, 0, gradient_none, 0, gradient_none, false);
           mLightView->setWrapMode(P44View::clipXY);
-          mLightView->setRelativeExtent((double)channels[4].pending/255);
+          mLightView->setRelativeExtent(relativeSize());
           break;
         }
         case 2: {
           // sizable with tunable soft edge
           mLightView->setColoringParameters(col, (double)channels[6].pending/64-2, gradient_curve_lin, 0, gradient_none, 0, gradient_none, false);
           mLightView->setWrapMode(P44View::clipXY);
-          mLightView->setRelativeExtent((double)channels[4].pending/255);
+          mLightView->setRelativeExtent(relativeSize());
           break;
         }
         case 3: {
           // sizable with tunable color gradient
           mLightView->setColoringParameters(col, 0, gradient_none, (double)channels[6].pending/64-2, gradient_curve_lin+gradient_repeat_oscillating, 0, gradient_none, false);
           mLightView->setWrapMode(P44View::clipXY);
-          mLightView->setRelativeExtent((double)channels[4].pending/255);
+          mLightView->setRelativeExtent(relativeSize());
           break;
         }
         case 4: {
           // pulsing with fixed soft edge, gradient and speed determine amplitude and interval
           mLightView->setColoringParameters(col, -0.9, gradient_curve_lin, 0, gradient_none, 0, gradient_none, false);
           mLightView->setWrapMode(P44View::clipXY);
-          mLightView->setRelativeExtent((double)channels[4].pending/255);
+          mLightView->setRelativeExtent(relativeSize());
           // install new animation
           mAnimation = mLightView->animatorFor("alpha");
           mAnimation->function("easeinout");
@@ -155,7 +165,7 @@ bool P44lrgLight::applyChannels()
           mLightView->setColoringParameters(col, 0, gradient_none, 0, gradient_none, 0, gradient_none, false);
         mover: {
           mLightView->setWrapMode(P44View::clipXY);
-          mLightView->setRelativeExtent((double)channels[4].pending/255);
+          mLightView->setRelativeExtent(relativeSize());
           // install new animation
           mAnimation = mLightView->animatorFor("content_x");
           animationChanged = true;
@@ -173,10 +183,10 @@ bool P44lrgLight::applyChannels()
   }
   // Position
   if (
-    (channels[3].pending!=channels[3].current)
+    !isFineChannel(3) && channelChanged(3)
   ) {
     OLOG(LOG_INFO,"Position change");
-    mLightView->setRelativeContentOrigin((double)channels[3].pending/128-1, 0, true);
+    mLightView->setRelativeContentOrigin(channelValue(3)/128-1, 0, true);
     if (mode>=5 && mode<=10) {
       // change of position needs restart of (positional) animation
       animationChanged = true;
@@ -184,12 +194,12 @@ bool P44lrgLight::applyChannels()
   }
   // Size
   if (
-    (channels[4].pending!=channels[4].current)
+    !isFineChannel(4) && (channels[4].pending!=channels[4].current)
   ) {
     // to make sure light works out of the box, mode 0 actively suppresses size changes!
     if (mode!=0) {
       OLOG(LOG_INFO,"Size change");
-      mLightView->setRelativeExtent((double)channels[4].pending/255);
+      mLightView->setRelativeExtent(relativeSize());
     }
   }
   // Speed
@@ -220,12 +230,13 @@ bool P44lrgLight::applyChannels()
         break;
     }
   }
-  // (re)start animation
+  // (re)start animation, in cycles aligned with the other receivers
   if (mAnimation && animationChanged) {
+    MLMicroSeconds duration = (MLMicroSeconds)(255-channels[5].pending)*4900*MilliSecond/255 + 100*MilliSecond; // 5..0.1 seconds
     switch (mode) {
       case 4: {
         // intensity 0..255, changing from current value to currentvalue +/- gradient channel value
-        mAnimation->repeat(true, 0)->from(channels[2].pending)->animate(channels[2].pending+channels[6].pending*2-255, (MLMicroSeconds)(255-channels[5].pending)*4900*MilliSecond/255 + 100*MilliSecond); // 5..0.1 seconds
+        runCycles(duration, boost::bind(&P44lrgLight::animationCycle, this, _1, (double)channels[2].pending, (double)(channels[2].pending+channels[6].pending*2-255), duration, true));
         break;
       }
       case 5:
@@ -237,25 +248,26 @@ bool P44lrgLight::applyChannels()
       {
         // position 0..255, changing from current x to x +/- frame.x size scaled by gradient channel value
         // - set start poition
-        mLightView->setRelativeContentOrigin((double)channels[3].pending/128-1, 0, true);
+        mLightView->setRelativeContentOrigin(channelValue(3)/128-1, 0, true);
         PixelRect content = mLightView->getContent();
         PixelRect frame = mLightView->getFrame();
         OLOG(LOG_INFO, "mLightView: %s", mLightView->viewStatus()->json_c_str());
         // - animate from there +/- the frame size
+        double to = content.x+channels[6].pending*frame.dx*2/255-frame.dx;
         if (mode==7 || mode==8) {
           // accelerating shoot
           mAnimation->function("easein");
-          mAnimation->repeat(false, 0)->from(content.x)->animate(content.x+channels[6].pending*frame.dx*2/255-frame.dx, (MLMicroSeconds)(255-channels[5].pending)*4900*MilliSecond/255 + 100*MilliSecond); // 5..0.1 seconds
+          runCycles(duration, boost::bind(&P44lrgLight::animationCycle, this, _1, (double)content.x, to, duration, false));
         }
         else if (mode==9 || mode==10) {
           // wandering
           mAnimation->function("linear");
-          mAnimation->repeat(false, 0)->from(content.x)->animate(content.x+channels[6].pending*frame.dx*2/255-frame.dx, (MLMicroSeconds)(255-channels[5].pending)*4900*MilliSecond/255 + 100*MilliSecond); // 5..0.1 seconds
+          runCycles(duration, boost::bind(&P44lrgLight::animationCycle, this, _1, (double)content.x, to, duration, false));
         }
         else {
           // swing forth and back
           mAnimation->function("easeinout");
-          mAnimation->repeat(true, 0)->from(content.x)->animate(content.x+channels[6].pending*frame.dx*2/255-frame.dx, (MLMicroSeconds)(255-channels[5].pending)*4900*MilliSecond/255 + 100*MilliSecond); // 5..0.1 seconds
+          runCycles(duration, boost::bind(&P44lrgLight::animationCycle, this, _1, (double)content.x, to, duration, true));
         }
         break;
       }
@@ -270,3 +282,13 @@ bool P44lrgLight::applyChannels()
   // confirm apply
   return inherited::applyChannels();
 }
+
+
+void P44lrgLight::animationCycle(uint32_t aCycleNo, double aFrom, double aTo, MLMicroSeconds aDuration, bool aCycling)
+{
+  if (!mAnimation) return;
+  // cycling animations run odd cycles backwards, so every cycle continues where the previous one ended
+  if (aCycling && (aCycleNo & 1)) swap(aFrom, aTo);
+  mAnimation->repeat(aCycling, 0)->from(aFrom)->animate(aTo, aDuration);
+  mLightView->requestUpdateIfNeeded();
+}
@@ -40,6 +40,12 @@ namespace p44 {
     ValueAnimatorPtr mAnimation;
     PixelRect mOrigFrame;
 
+    /// @return size (relative extent) as set by the size channel
+    double relativeSize();
+
+    /// (re)start the animation for a cycle
+    void animationCycle(uint32_t aCycleNo, double aFrom, double aTo, MLMicroSeconds aDuration, bool aCycling);
+
   public:
     P44lrgLight(P44ViewPtr aRootView, PixelRect aFrame);
     virtual ~P44lrgLight();
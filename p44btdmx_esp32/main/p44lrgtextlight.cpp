@@ -93,16 +93,16 @@ bool P44lrgTextLight::applyChannels()
   uint8_t mode = channels[7].pending;
   // - convert HSV to Pixel
   PixelColor col = hsbToPixel(
-    (double)channels[0].pending/255*360,
-    (double)channels[1].pending/255,
-    (double)channels[2].pending/255,
+    channelValue(0)/255*360,
+    channelValue(1)/255,
+    channelValue(2)/255,
     true // brightness as alpha, full RGB value
   );
   // check what to update
   if (
-    (channels[0].pending!=channels[0].current) || // H
-    (channels[1].pending!=channels[1].current) || // S
-    (channels[2].pending!=channels[2].current) || // V
+    channelChanged(0) || // H
+    channelChanged(1) || // S
+    channelChanged(2) || // V
     (channels[7].pending!=channels[7].current)    // mode
   ) {
     // need updating RGB outputs
@@ -132,9 +132,9 @@ bool P44lrgTextLight::applyChannels()
       mLightView->setForegroundColor(col);
     }
   }
-  // Position selects the text
+  // Position selects the text (unless channel 3 is the fine brightness channel)
   if (
-    (channels[3].pending!=channels[3].current)
+    !isFineChannel(3) && (channels[3].pending!=channels[3].current)
   ) {
     const char *text = " ... ";
     if (channels[3].pending>=1 && channels[3].pending<=numTexts) {
@@ -81,7 +81,7 @@ void PWMLight::setChannelPowers(int aRedMilliWatts, int aGreenMilliWatts, int aB
 // 0: channel hue
 // 1: channel saturation
 // 2: channel brightness
-// 3,4: unused
+// 3,4: unused (3 can be the fine channel for a 16-bit brightness)
 // 5: speed
 // 6: pulse amplitude
 // 7: mode (4=pulsing, all others steady)
@@ -92,17 +92,17 @@ bool PWMLight::applyChannels()
   uint8_t mode = channels[7].pending;
   bool animationChanged = false;
   if (
-    (channels[0].pending!=channels[0].current) ||
-    (channels[1].pending!=channels[1].current) ||
-    (channels[2].pending!=channels[2].current)
+    channelChanged(0) ||
+    channelChanged(1) ||
+    channelChanged(2)
   ) {
     // need updating RGB outputs
     // - convert to RGB
-    FOCUSLOG("Setting PWM light to H=%d, S=%d, V=%d", channels[0].pending, channels[1].pending, channels[2].pending);
+    FOCUSLOG("Setting PWM light to H=%d, S=%d, V=%.2f", channels[0].pending, channels[1].pending, channelValue(2));
     Row3 HSV;
-    HSV[0] = (double)channels[0].pending/255*360;
-    HSV[1] = (double)channels[1].pending/255;
-    HSV[2] = (double)channels[2].pending/255;
+    HSV[0] = channelValue(0)/255*360;
+    HSV[1] = channelValue(1)/255;
+    HSV[2] = channelValue(2)/255;
     colorOutput.setHSV(HSV);
     animationChanged = true; // base color change also changes animator
   }
@@ -116,6 +116,7 @@ bool PWMLight::applyChannels()
   }
   // mode
   if (mode!=channels[7].current) {
+    stopCycles();
     if (mAnimator) {
       mAnimator->stop(false);
       mAnimator.reset();
@@ -147,19 +148,20 @@ bool PWMLight::applyChannels()
         break;
     }
   }
-  // (re)start animation
+  // (re)start animation, in cycles aligned with the other receivers
   if (mAnimator && animationChanged) {
+    MLMicroSeconds duration = (MLMicroSeconds)(255-channels[5].pending)*4900*MilliSecond/255 + 100*MilliSecond; // 5..0.1 seconds
     switch (mode) {
       case 4: {
         // brightness changing from current value to currentvalue +/- gradient channel value
-        double current = (double)channels[2].pending/255; // 0..1
-        mAnimator->repeat(true, 0)->from(current)->animate(current+(double)channels[6].pending/128-1, (MLMicroSeconds)(255-channels[5].pending)*4900*MilliSecond/255 + 100*MilliSecond); // 5..0.1 seconds
+        double current = channelValue(2)/255; // 0..1
+        runCycles(duration, boost::bind(&PWMLight::animationCycle, this, _1, current, current+(double)channels[6].pending/128-1, duration));
         break;
       }
       case 7: {
         // hue changing from current value to currentvalue +/- gradient channel value
-        double current = (double)channels[0].pending/255*360; // 0..360
-        mAnimator->repeat(true, 0)->from(current)->animate(current+(double)channels[6].pending/128*360-360, (MLMicroSeconds)(255-channels[5].pending)*4900*MilliSecond/255 + 100*MilliSecond); // 5..0.1 seconds
+        double current = channelValue(0)/255*360; // 0..360
+        runCycles(duration, boost::bind(&PWMLight::animationCycle, this, _1, current, current+(double)channels[6].pending/128*360-360, duration));
         break;
       }
       default:
@@ -170,3 +172,12 @@ bool PWMLight::applyChannels()
   return inherited::applyChannels();
 }
 
+
+void PWMLight::animationCycle(uint32_t aCycleNo, double aFrom, double aTo, MLMicroSeconds aDuration)
+{
+  if (!mAnimator) return;
+  // odd cycles run backwards, so every cycle continues where the previous one ended
+  if (aCycleNo & 1) swap(aFrom, aTo);
+  mAnimator->repeat(true, 0)->from(aFrom)->animate(aTo, aDuration);
+}
+
@@ -41,6 +41,9 @@ namespace p44 {
 
     ValueAnimatorPtr mAnimator;
 
+    /// (re)start the animation for a cycle
+    void animationCycle(uint32_t aCycleNo, double aFrom, double aTo, MLMicroSeconds aDuration);
+
   public:
     PWMLight(AnalogIoPtr aRedOut, AnalogIoPtr aGreenOut, AnalogIoPtr aBlueOut);
     virtual ~PWMLight();
@@ -0,0 +1,105 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+
+// Advertising sets model
+// - tabulates P44BTDMXsender::receivedPacketRate() for 1..BtAdvertisements::cMaxAdvSets concurrent
+//   advertising sets over receiver scan duty cycles, set restart times and advertising intervals,
+//   to choose CONFIG_P44BTDMX_ADV_SETS
+// - updates follow each other as fast as the restarts allow (update interval = restart time + 5mS to set
+//   the data), like the advertising pipeline does with a backlog
+// - next to the model, a Monte Carlo simulation of the same situation: advertising events at the
+//   controller's interval (min..max) plus the random advDelay, update times jittering with the command latency,
+//   a receiver scanning one window per scan interval.
+//   Unlike the model, it does not assume the events of a packet to hit scan windows independently, and counts
+//   whole events only: the model overestimates when packets are on air for less than the advertising interval
+//   (fractional events), the simulation shows that a second set only pays off once the on air time reaches it.
+// - "best" is the smallest number of sets getting within 5% of the highest simulated rate
+
+#include "p44btdmx.hpp"
+
+#include <vector>
+
+using namespace p44;
+
+static const int cMaxAdvSets = 4; // BtAdvertisements::cMaxAdvSets
+static const double cScanDuties[] = { 0.75, 0.5, 0.25 };
+static const MLMicroSeconds cRestartTimes[] = { 5*MilliSecond, 10*MilliSecond, 20*MilliSecond };
+static const struct {
+  MLMicroSeconds min; ///< advertising interval as configured in the controller
+  MLMicroSeconds max;
+} cAdvIntervals[] = {
+  { 20*MilliSecond, 40*MilliSecond }, // esp_bt default
+  { 50*MilliSecond, 100*MilliSecond },
+};
+static const MLMicroSeconds cMaxAdvDelay = 10*MilliSecond; // random advDelay added by the controller to every interval
+static const MLMicroSeconds cDataSetTime = 5*MilliSecond;
+static const MLMicroSeconds cScanInterval = 20*MilliSecond; // esp_bt scan interval
+static const MLMicroSeconds cUpdateJitter = 2*MilliSecond;
+static const MLMicroSeconds cSimTime = 600*Second;
+
+
+static MLMicroSeconds randomTime(unsigned& aSeed, MLMicroSeconds aMin, MLMicroSeconds aMax)
+{
+  return aMin+(MLMicroSeconds)((double)rand_r(&aSeed)/RAND_MAX*(aMax-aMin));
+}
+
+
+/// simulated number of distinct packets per second a receiver gets
+static double simulatedPacketRate(int aNumSets, MLMicroSeconds aUpdateInterval, MLMicroSeconds aRestartTime, MLMicroSeconds aAdvMin, MLMicroSeconds aAdvMax, double aScanDuty)
+{
+  unsigned seed = 42;
+  MLMicroSeconds window = (MLMicroSeconds)(aScanDuty*cScanInterval);
+  MLMicroSeconds scanPhase = randomTime(seed, 0, cScanInterval);
+  // the update times jitter with the latency of the controller commands
+  std::vector<MLMicroSeconds> updates;
+  for (MLMicroSeconds t=0; t<cSimTime; t+=aUpdateInterval+randomTime(seed, -cUpdateJitter, cUpdateJitter)) updates.push_back(t);
+  long received = 0;
+  for (size_t k=0; k+aNumSets<updates.size(); k++) {
+    // packet k goes to set k%aNumSets, which is on air from its restart until it gets the next packet
+    MLMicroSeconds start = updates[k]+aRestartTime; // first event right at the start
+    MLMicroSeconds end = updates[k+aNumSets];
+    for (MLMicroSeconds t=start; t<end; t+=randomTime(seed, aAdvMin, aAdvMax)+randomTime(seed, 0, cMaxAdvDelay)) {
+      if ((t+scanPhase)%cScanInterval<window) {
+        received++;
+        break;
+      }
+    }
+  }
+  return (double)received*Second/updates[updates.size()-1-aNumSets];
+}
+
+
+int main(int argc, char **argv)
+{
+  printf("distinct packets per second a receiver gets, modelled (receivedPacketRate) / simulated\n");
+  printf("%-5s %-7s %-6s %-9s |", "duty", "restart", "update", "adv int");
+  for (int n=1; n<=cMaxAdvSets; n++) printf("      %d set%s  ", n, n>1 ? "s" : " ");
+  printf("| best\n");
+  for (auto ai : cAdvIntervals) {
+    MLMicroSeconds meanAdvInterval = (ai.min+ai.max)/2+cMaxAdvDelay/2;
+    for (double duty : cScanDuties) {
+      for (MLMicroSeconds restart : cRestartTimes) {
+        MLMicroSeconds update = restart+cDataSetTime;
+        printf("%4.0f%% %5lldmS %4lldmS %3lld-%3lldmS |",
+          duty*100, (long long)(restart/MilliSecond), (long long)(update/MilliSecond),
+          (long long)(ai.min/MilliSecond), (long long)(ai.max/MilliSecond)
+        );
+        double simulated[cMaxAdvSets+1];
+        double bestRate = 0;
+        for (int n=1; n<=cMaxAdvSets; n++) {
+          double modelled = P44BTDMXsender::receivedPacketRate(n, update, restart, meanAdvInterval, duty);
+          simulated[n] = simulatedPacketRate(n, update, restart, ai.min, ai.max, duty);
+          if (simulated[n]>bestRate) bestRate = simulated[n];
+          printf(" %5.1f/%5.1f ", modelled, simulated[n]);
+        }
+        int best = 1;
+        while (best<cMaxAdvSets && simulated[best]<0.95*bestRate) best++;
+        printf("| %d\n", best);
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,22 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+
+// compiled with -Dp44=p44baseline, see Makefile
+
+#include "baseline/p44btdmx.hpp"
+#include "baseline_sender.hpp"
+#include "sender_scenarios.hpp"
+
+size_t BaselineSender::run(int aScenario, uint32_t aSeed, int aNumPackets, std::vector<std::string>* aPackets)
+{
+  p44::P44BTDMXsenderPtr sender = new p44::P44BTDMXsender;
+  size_t bytes = 0;
+  SenderScenarios::run(*sender, aScenario, aSeed, aNumPackets, [&](const std::string& aPacket) {
+    bytes += aPacket.size();
+    if (aPackets) aPackets->push_back(aPacket);
+  });
+  return bytes;
+}
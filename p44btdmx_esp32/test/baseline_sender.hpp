@@ -0,0 +1,30 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+
+// Access to the baseline sender (baseline/p44btdmx.cpp, the sender before the scheduler rework),
+// which is compiled with its namespace renamed to p44baseline and therefore can be linked
+// into the same test binary as the current sender.
+
+#ifndef __p44btdmx_test__baseline_sender__
+#define __p44btdmx_test__baseline_sender__
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace BaselineSender {
+
+  /// run a SenderScenarios scenario on a fresh baseline sender
+  /// @param aScenario the scenario
+  /// @param aSeed random seed
+  /// @param aNumPackets number of packets to generate
+  /// @param aPackets if not NULL, the generated packets are appended here
+  /// @return total number of bytes generated
+  size_t run(int aScenario, uint32_t aSeed, int aNumPackets, std::vector<std::string>* aPackets);
+
+} // namespace BaselineSender
+
+#endif // __p44btdmx_test__baseline_sender__
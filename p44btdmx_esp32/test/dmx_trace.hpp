@@ -0,0 +1,82 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+
+// DMX trace files (traces/*.trace)
+// - text, one line per DMX frame with changes: "<time in mS> <channel>:<value> ..."
+// - channels are DMX addresses 1..512, only channels that changed since the previous frame are listed
+// - lines starting with # are comments, frames without changes are omitted
+
+#ifndef __p44btdmx_test__dmx_trace__
+#define __p44btdmx_test__dmx_trace__
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+class DMXTrace
+{
+public:
+
+  typedef struct {
+    uint32_t timeMs; ///< time of the frame, relative to the start of the trace
+    std::vector<std::pair<uint16_t, uint8_t> > changes; ///< channel index (0..511) and new value
+  } Frame;
+
+  std::string name;
+  std::string description; ///< first comment line
+  std::vector<Frame> frames;
+
+  /// load a trace file
+  /// @param aPath path of the trace file
+  /// @return false if the file could not be read or has syntax errors
+  bool load(const std::string aPath)
+  {
+    FILE* f = fopen(aPath.c_str(), "r");
+    if (!f) return false;
+    name = aPath.substr(aPath.find_last_of('/')+1);
+    frames.clear();
+    char line[8192];
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f)) {
+      if (line[0]=='#') {
+        if (description.empty()) description = std::string(line+1+strspn(line+1, " "), strcspn(line+1+strspn(line+1, " "), "\r\n"));
+        continue;
+      }
+      char* p = line;
+      char* e;
+      Frame frame;
+      frame.timeMs = (uint32_t)strtoul(p, &e, 10);
+      if (e==p) continue; // empty line
+      p = e;
+      while (true) {
+        unsigned long ch = strtoul(p, &e, 10);
+        if (e==p) break;
+        if (*e!=':' || ch<1 || ch>512) { ok = false; break; }
+        p = e+1;
+        unsigned long v = strtoul(p, &e, 10);
+        if (e==p || v>255) { ok = false; break; }
+        p = e;
+        frame.changes.push_back(std::make_pair((uint16_t)(ch-1), (uint8_t)v));
+      }
+      if (ok && !frames.empty() && frame.timeMs<frames.back().timeMs) ok = false;
+      frames.push_back(frame);
+    }
+    fclose(f);
+    return ok && !frames.empty();
+  }
+
+  /// @return duration of the trace in mS
+  uint32_t durationMs() const { return frames.empty() ? 0 : frames.back().timeMs; }
+
+  /// @return total number of channel changes in the trace
+  size_t numChanges() const { size_t n = 0; for (size_t i=0; i<frames.size(); i++) n += frames[i].changes.size(); return n; }
+
+};
+
+#endif // __p44btdmx_test__dmx_trace__
@@ -0,0 +1,218 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+
+// Extended carrier test
+// - round trip of random universe contents through extended advertisements of different sizes,
+//   checking the AD structure, the size limit, and that the receiver converges in fewer packets
+//   than with legacy advertisements
+// - payloads of any length between the legacy and the extended maximum decode, the length is a runtime parameter
+// - a legacy sender and an extended sender serve the same universe in parallel: a legacy only receiver
+//   and a receiver getting both must converge, legacy data within NOT_EXTENDED_LOCKOUT_PERIOD after
+//   extended data must be ignored, and accepted again after it
+// - packets with any single bit flipped, truncated packets and packets encoded with another system key
+//   must not change any channel
+
+#include "p44btdmx.hpp"
+#include "test_receiver.hpp"
+
+#include <stdarg.h>
+
+using namespace p44;
+
+static const int cExtSizes[] = { 31, 100, 200, P44BTDMXsender::cMaxExtAdvDataBytes };
+static const int cMaxPackets = 2000;
+static const MLMicroSeconds cPacketInterval = 20*MilliSecond;
+
+static int failures = 0;
+
+static void check(bool aOk, const char* aFmt, ...)
+{
+  va_list args;
+  va_start(args, aFmt);
+  printf("%s ", aOk ? "ok  " : "FAIL");
+  vprintf(aFmt, args);
+  printf("\n");
+  va_end(args);
+  if (!aOk) failures++;
+}
+
+
+static void randomUniverse(uint8_t* aUniverse, unsigned &aSeed)
+{
+  for (int i=0; i<P44BTDMXsender::cUniverseSize; i++) aUniverse[i] = rand_r(&aSeed)%256;
+}
+
+
+static P44BTDMXsenderPtr newSender(const uint8_t* aUniverse)
+{
+  P44BTDMXsenderPtr sender = new P44BTDMXsender;
+  sender->setRefreshUniverse(true);
+  sender->setChannels(0, P44BTDMXsender::cUniverseSize, aUniverse);
+  return sender;
+}
+
+
+/// send until the receiver has the universe
+/// @return number of packets needed, -1 if the receiver did not converge
+static int converge(P44BTDMXsender& aSender, TestReceiver& aReceiver, const uint8_t* aUniverse, int aMaxBytes, bool aExtended, bool& aFormatOk)
+{
+  aFormatOk = true;
+  for (int n=1; n<=cMaxPackets; n++) {
+    string adv = aSender.generateBTAdvMfgData(aMaxBytes, aExtended);
+    int limit = aExtended && aMaxBytes>P44BTDMXsender::cMaxExtAdvDataBytes ? P44BTDMXsender::cMaxExtAdvDataBytes : aMaxBytes;
+    if (
+      adv.size()<6 || adv.size()>limit ||
+      (uint8_t)adv[0]!=adv.size()-1 || (uint8_t)adv[1]!=0xFF ||
+      (uint8_t)adv[4]!=(aExtended ? 0x45 : 0x44) ||
+      (!aExtended && adv.size()!=aMaxBytes) // legacy advertisements are always filled up
+    ) {
+      aFormatOk = false;
+    }
+    aReceiver.deliver(adv);
+    HostSim::advance(cPacketInterval);
+    if (aReceiver.differences(aUniverse, P44BTDMXsender::cUniverseSize)==0) return n;
+  }
+  return -1;
+}
+
+
+static void testRoundTrip()
+{
+  unsigned seed = 1;
+  uint8_t universe[P44BTDMXsender::cUniverseSize];
+  randomUniverse(universe, seed);
+  P44BTDMXsenderPtr legacySender = newSender(universe);
+  TestReceiver legacyRx;
+  bool formatOk;
+  int legacyPackets = converge(*legacySender, legacyRx, universe, 31, false, formatOk);
+  check(legacyPackets>0 && formatOk, "legacy 31 bytes: %d packets to converge", legacyPackets);
+  for (int sz : cExtSizes) {
+    P44BTDMXsenderPtr sender = newSender(universe);
+    TestReceiver rx;
+    int packets = converge(*sender, rx, universe, sz, true, formatOk);
+    check(
+      packets>0 && formatOk && (sz<=31 || packets<legacyPackets),
+      "extended %3d bytes: %d packets to converge", sz, packets
+    );
+  }
+}
+
+
+static void testPayloadLengths()
+{
+  unsigned seed = 2;
+  int bad = 0;
+  for (int sz=19; sz<=P44BTDMXsender::cMaxExtAdvDataBytes-5; sz++) {
+    uint8_t universe[P44BTDMXsender::cUniverseSize];
+    randomUniverse(universe, seed);
+    P44BTDMXsenderPtr sender = newSender(universe);
+    TestReceiver legacyRx;
+    TestReceiver extRx;
+    // filled up to sz as in legacy advertisements, and unfilled as in extended advertisements
+    string filled = sender->generateP44BTDMXpayload(sz);
+    string unfilled = sender->generateP44BTDMXpayload(sz, 1);
+    if (filled.size()!=sz || unfilled.size()>sz || unfilled.size()<3) bad++;
+    else if (
+      !legacyRx.mReceiver->processP44BTDMXpayload(filled, true) ||
+      !extRx.mReceiver->processP44BTDMXpayload(unfilled, true, true)
+    ) bad++;
+  }
+  check(bad==0, "payloads of %d..%d bytes: %d not decoded", 19, P44BTDMXsender::cMaxExtAdvDataBytes-5, bad);
+}
+
+
+static void testParallelLegacy()
+{
+  unsigned seed = 3;
+  uint8_t universe[P44BTDMXsender::cUniverseSize];
+  randomUniverse(universe, seed);
+  // same universe, separately scheduled, like in the firmware
+  P44BTDMXsenderPtr legacySender = newSender(universe);
+  P44BTDMXsenderPtr extSender = newSender(universe);
+  TestReceiver legacyRx;
+  TestReceiver bothRx;
+  int n;
+  for (n=1; n<=cMaxPackets; n++) {
+    string adv = legacySender->generateBTAdvMfgData(31);
+    legacyRx.deliver(adv);
+    bothRx.deliver(adv);
+    bothRx.deliver(extSender->generateBTAdvMfgData(200, true));
+    HostSim::advance(cPacketInterval);
+    if (
+      legacyRx.differences(universe, P44BTDMXsender::cUniverseSize)==0 &&
+      bothRx.differences(universe, P44BTDMXsender::cUniverseSize)==0
+    ) break;
+  }
+  check(n<=cMaxPackets, "legacy and extended in parallel: both receivers converge after %d packets", n);
+  // legacy data shortly after extended data is ignored
+  TestReceiver rx;
+  rx.deliver(extSender->generateBTAdvMfgData(200, true));
+  legacySender->setChannel(0, universe[0]^0x55);
+  HostSim::advance(500*MilliSecond); // well within the lockout
+  bool changed = rx.deliver(legacySender->generateBTAdvMfgData(31));
+  check(!changed && rx.channel(0)!=(universe[0]^0x55), "legacy data ignored within lockout period after extended data");
+  HostSim::advance(3*Second);
+  changed = rx.deliver(legacySender->generateBTAdvMfgData(31));
+  check(changed && rx.channel(0)==(universe[0]^0x55), "legacy data accepted again after lockout period");
+}
+
+
+static void testCorruption()
+{
+  unsigned seed = 4;
+  uint8_t universe[P44BTDMXsender::cUniverseSize];
+  randomUniverse(universe, seed);
+  uint8_t zero[P44BTDMXsender::cUniverseSize];
+  memset(zero, 0, sizeof(zero));
+  for (int sz : cExtSizes) {
+    P44BTDMXsenderPtr sender = newSender(universe);
+    string adv = sender->generateBTAdvMfgData(sz, true);
+    // reference: the intact packet must change channels
+    TestReceiver ref;
+    bool intactOk = ref.deliver(adv);
+    int accepted = 0;
+    int tries = 0;
+    // any single bit flipped in the payload (after the 5 byte AD structure header)
+    for (size_t i=5; i<adv.size(); i++) {
+      for (int b=0; b<8; b++) {
+        string bad = adv;
+        bad[i] ^= 1<<b;
+        TestReceiver rx;
+        rx.deliver(bad);
+        tries++;
+        if (rx.differences(zero, P44BTDMXsender::cUniverseSize)>0) accepted++;
+      }
+    }
+    // truncated
+    for (size_t l=0; l<adv.size(); l++) {
+      string bad = adv.substr(0, l);
+      if (bad.size()>0) bad[0] = bad.size()-1; // consistent AD structure length
+      TestReceiver rx;
+      rx.deliver(bad);
+      tries++;
+      if (rx.differences(zero, P44BTDMXsender::cUniverseSize)>0) accepted++;
+    }
+    // other system key
+    P44BTDMXsenderPtr other = new P44BTDMXsender;
+    other->setSystemKey("another system key");
+    other->setChannels(0, P44BTDMXsender::cUniverseSize, universe);
+    TestReceiver rx;
+    rx.deliver(other->generateBTAdvMfgData(sz, true));
+    tries++;
+    if (rx.differences(zero, P44BTDMXsender::cUniverseSize)>0) accepted++;
+    check(intactOk && accepted==0, "extended %3d bytes: %d of %d corrupted, truncated or foreign packets accepted", sz, accepted, tries);
+  }
+}
+
+
+int main(int argc, char **argv)
+{
+  testRoundTrip();
+  testPayloadLengths();
+  testParallelLegacy();
+  testCorruption();
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,175 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+
+// FEC simulation
+// - compares protecting changes by repeating them (setInitialRepeatCount()) with FEC groups
+//   (setFecGroupSize(), changes sent once) under packet loss
+// - a stream of single channel changes at random channels goes through a sender without universe refresh,
+//   one packet every 20mS, to a receiver. Without refresh, a change whose packets all get lost is never delivered.
+// - loss models: independent losses, and bursts (Gilbert-Elliott: bad periods of 3 packets on average
+//   losing 80% of the packets, as when a receiver's scanner is busy or on another channel)
+// - latency is from the change until the receiver has the new value (mean and 95th percentile),
+//   airtime is advertisement bytes per change, residual is the share of changes not delivered within 2 seconds
+// - at light load, repeats protect best. With fresh changes in every packet, repeats hardly get sent at all:
+//   the age scheduler sends only one repeat priority per packet, after the fresh changes, to spread repeats
+//   over time (see nextPassAge()), so repeating does not protect against loss then, while FEC still does.
+
+#include "p44btdmx.hpp"
+#include "test_receiver.hpp"
+
+#include <vector>
+#include <algorithm>
+
+using namespace p44;
+
+static const MLMicroSeconds cPacketInterval = 20*MilliSecond;
+static const int cPackets = 20000;
+static const MLMicroSeconds cMaxLatency = 2*Second; ///< changes not delivered within this time count as lost
+static const int cChannels = 512;
+
+static const struct {
+  const char* name;
+  int repeats;
+  int fecGroupSize;
+} cStrategies[] = {
+  { "no protection", 1, 0 },
+  { "repeat 2", 2, 0 },
+  { "repeat 3", 3, 0 }, // default
+  { "FEC 2+1", 1, 2 },
+  { "FEC 4+1", 1, 4 },
+  { "FEC 8+1", 1, 8 },
+};
+
+static const struct {
+  bool extended;
+  int maxBytes;
+  double changesPerPacket;
+} cCarriers[] = {
+  { false, 31, 0.3 },
+  { false, 31, 1.5 },
+  { true, 100, 6 },
+};
+
+static const int cLossPercent[] = { 0, 10, 20, 30 };
+
+
+class LossModel
+{
+  unsigned mSeed;
+  bool mBursty;
+  bool mBad;
+  double mLoss;
+
+public:
+
+  LossModel(double aLoss, bool aBursty) : mSeed(4711), mBursty(aBursty), mBad(false), mLoss(aLoss) {};
+
+  bool lost()
+  {
+    if (!mBursty) return rnd()<mLoss;
+    // Gilbert-Elliott: bad state loses 80%, good state nothing, mean bad period 3 packets,
+    // bad state share chosen for the mean loss rate
+    const double badLoss = 0.8;
+    const double toGood = 1.0/3;
+    double badShare = mLoss/badLoss;
+    double toBad = badShare>=1 ? 1 : toGood*badShare/(1-badShare);
+    mBad = mBad ? rnd()>=toGood : rnd()<toBad;
+    return mBad && rnd()<badLoss;
+  }
+
+private:
+
+  double rnd() { return (double)rand_r(&mSeed)/((double)RAND_MAX+1); }
+};
+
+
+typedef struct {
+  double meanLatency; ///< mS
+  double p95Latency; ///< mS
+  double bytesPerChange;
+  double residual; ///< share of changes not delivered
+} Result;
+
+
+static Result simulate(int aRepeats, int aFecGroupSize, bool aExtended, int aMaxBytes, double aChangesPerPacket, int aLossPercent, bool aBursty)
+{
+  P44BTDMXsenderPtr sender = new P44BTDMXsender;
+  sender->setInitialRepeatCount(aRepeats);
+  sender->setFecGroupSize(aFecGroupSize);
+  TestReceiver rx;
+  LossModel loss(aLossPercent/100.0, aBursty);
+  unsigned seed = 1;
+  uint8_t dmx[cChannels];
+  memset(dmx, 0, sizeof(dmx));
+  MLMicroSeconds changedAt[cChannels];
+  for (int i=0; i<cChannels; i++) changedAt[i] = Never;
+  std::vector<MLMicroSeconds> latencies;
+  long changes = 0;
+  long lost = 0;
+  size_t bytes = 0;
+  double due = 0;
+  for (int p=0; p<cPackets; p++) {
+    MLMicroSeconds now = MainLoop::now();
+    if (p<cPackets-cMaxLatency/cPacketInterval) {
+      for (due += aChangesPerPacket; due>=1; due--) {
+        int c = rand_r(&seed)%cChannels;
+        if (changedAt[c]!=Never) continue; // previous change still in flight
+        uint8_t v;
+        do { v = rand_r(&seed); } while (v==dmx[c]);
+        dmx[c] = v;
+        changedAt[c] = now;
+        changes++;
+      }
+      sender->setChannels(0, cChannels, dmx);
+    }
+    string adv = sender->generateBTAdvMfgData(aMaxBytes, aExtended);
+    bytes += adv.size();
+    if (!adv.empty() && !loss.lost()) rx.deliver(adv);
+    HostSim::advance(cPacketInterval);
+    for (int c=0; c<cChannels; c++) {
+      if (changedAt[c]==Never) continue;
+      if (rx.channel(c)==dmx[c]) {
+        latencies.push_back(now+cPacketInterval-changedAt[c]);
+        changedAt[c] = Never;
+      }
+      else if (now-changedAt[c]>=cMaxLatency) {
+        lost++;
+        changedAt[c] = Never;
+      }
+    }
+  }
+  Result res = { 0, 0, 0, 0 };
+  if (!latencies.empty()) {
+    double sum = 0;
+    for (size_t i=0; i<latencies.size(); i++) sum += latencies[i];
+    res.meanLatency = sum/latencies.size()/MilliSecond;
+    std::sort(latencies.begin(), latencies.end());
+    res.p95Latency = (double)latencies[latencies.size()*95/100]/MilliSecond;
+  }
+  res.bytesPerChange = changes ? (double)bytes/changes : 0;
+  res.residual = changes ? (double)lost/changes : 0;
+  return res;
+}
+
+
+int main(int argc, char **argv)
+{
+  for (auto carrier : cCarriers) {
+    for (int bursty=0; bursty<2; bursty++) {
+      printf("\n%s advertisements, %d bytes, %.1f changes per packet, %s losses\n",
+        carrier.extended ? "extended" : "legacy", carrier.maxBytes, carrier.changesPerPacket, bursty ? "bursty" : "independent"
+      );
+      printf("%-14s %4s | %8s %8s %8s %9s\n", "strategy", "loss", "mean mS", "95% mS", "B/change", "residual");
+      for (int loss : cLossPercent) {
+        for (auto st : cStrategies) {
+          Result r = simulate(st.repeats, st.fecGroupSize, carrier.extended, carrier.maxBytes, carrier.changesPerPacket, loss, bursty);
+          printf("%-14s %3d%% | %8.1f %8.0f %8.1f %8.2f%%\n", st.name, loss, r.meanLatency, r.p95Latency, r.bytesPerChange, r.residual*100);
+        }
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,25 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+
+// Host stand-in for the p44utils application, running on the simulated mainloop
+
+#ifndef __p44btdmx_test__application__
+#define __p44btdmx_test__application__
+
+#include "p44utils_common.hpp"
+
+namespace p44 {
+
+  class Application
+  {
+  public:
+    static Application* sharedApplication() { static Application a; return &a; }
+    MainLoop& mainLoop() { return MainLoop::currentMainLoop(); }
+  };
+
+} // namespace p44
+
+#endif // __p44btdmx_test__application__
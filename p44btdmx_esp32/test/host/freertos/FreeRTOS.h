@@ -0,0 +1,3 @@
+// host stand-in, see gap_mock.h
+#pragma once
+#include "../gap_mock.h"
@@ -0,0 +1,158 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+
+// Host mock of the GAP API: a controller model with HCI command latency and advertising events,
+// running on the simulated mainloop
+
+#include "gap_mock.h"
+#include "p44utils_common.hpp"
+
+#include <cstdlib>
+#include <cassert>
+
+using namespace p44;
+
+GapMock::Params& GapMock::params() { static Params p; return p; }
+GapMock::Stats& GapMock::stats() { static Stats s; return s; }
+
+static int gMutexTaken = 0;
+
+static esp_gap_ble_cb_t gCB = NULL;
+static MLMicroSeconds gCmdFree = 0; // when the command pipe is free again
+static void command(boost::function<void()> aExec)
+{
+  MLMicroSeconds t = gCmdFree>HostSim::now() ? gCmdFree : HostSim::now();
+  gCmdFree = t+GapMock::params().cmdLatency;
+  HostSim::at(gCmdFree, aExec);
+}
+
+struct AdvInstance { bool enabled; uint32_t dataId; bool hasData; uint32_t imin, imax; long gen; }; ///< controller state of an advertising instance
+static std::map<int, AdvInstance> gInst;
+static unsigned gRndSeed = 1;
+static double rnd() { return (double)rand_r(&gRndSeed)/RAND_MAX; } // own sequence, independent of the test's rand()
+
+static void advEvent(int aInst, long aGen)
+{
+  AdvInstance& a = gInst[aInst];
+  if (!a.enabled || a.gen!=aGen) return;
+  GapMock::PacketStat& p = GapMock::stats().packets[a.dataId];
+  p.events++;
+  if (rnd()<GapMock::params().scanDuty) p.received = true;
+  MLMicroSeconds next = (MLMicroSeconds)((a.imin+rnd()*(a.imax-a.imin))*625)+(MLMicroSeconds)(rnd()*10000);
+  HostSim::at(HostSim::now()+next, boost::bind(&advEvent, aInst, aGen));
+}
+static void enable(int aInst, bool aEnable)
+{
+  AdvInstance& a = gInst[aInst];
+  a.gen++;
+  a.enabled = aEnable;
+  if (aEnable) HostSim::at(HostSim::now()+GapMock::params().firstEvent, boost::bind(&advEvent, aInst, a.gen));
+}
+static uint32_t idOf(const uint8_t* d, size_t l) { uint32_t id=0; if (l>=4) memcpy(&id, d, 4); return id; }
+static void fire(esp_gap_ble_cb_event_t e, esp_ble_gap_cb_param_t p) { if (gCB) gCB(e, &p); }
+
+esp_err_t esp_ble_gap_register_callback(esp_gap_ble_cb_t aCB) { gCB = aCB; return ESP_OK; }
+
+// BLE 5
+esp_err_t esp_ble_gap_ext_adv_set_params(uint8_t aInst, const esp_ble_gap_ext_adv_params_t* aP)
+{
+  uint32_t mn = aP->interval_min, mx = aP->interval_max;
+  command([=]() {
+    AdvInstance& a = gInst[aInst]; esp_ble_gap_cb_param_t p = {};
+    if (a.enabled) { GapMock::stats().protocolErrors++; p.ext_adv_set_params.status = 12; } // command disallowed while enabled
+    else { a.imin = mn; a.imax = mx; }
+    fire(ESP_GAP_BLE_EXT_ADV_SET_PARAMS_COMPLETE_EVT, p);
+  });
+  return ESP_OK;
+}
+esp_err_t esp_ble_gap_config_ext_adv_data_raw(uint8_t aInst, uint16_t aLen, const uint8_t* aData)
+{
+  uint32_t id = idOf(aData, aLen);
+  command([=]() {
+    AdvInstance& a = gInst[aInst]; a.dataId = id; a.hasData = true;
+    if (a.enabled) { GapMock::stats().inPlace++; GapMock::stats().packets[id].inPlace = true; }
+    GapMock::stats().dataSetOrder.push_back(id);
+    esp_ble_gap_cb_param_t p = {}; p.ext_adv_data_set.instance = aInst;
+    fire(ESP_GAP_BLE_EXT_ADV_DATA_SET_COMPLETE_EVT, p);
+  });
+  return ESP_OK;
+}
+esp_err_t esp_ble_gap_ext_adv_start(uint8_t aNum, const esp_ble_gap_ext_adv_t* aAdv)
+{
+  std::vector<uint8_t> insts; for (int i=0;i<aNum;i++) insts.push_back(aAdv[i].instance);
+  command([=]() {
+    esp_ble_gap_cb_param_t p = {}; p.ext_adv_start.instance_num = insts.size();
+    for (size_t i=0;i<insts.size();i++) {
+      p.ext_adv_start.instance[i] = insts[i];
+      if (gInst[insts[i]].imin==0) { GapMock::stats().protocolErrors++; p.ext_adv_start.status = 12; continue; } // params never set
+      GapMock::stats().starts++; enable(insts[i], true);
+    }
+    fire(ESP_GAP_BLE_EXT_ADV_START_COMPLETE_EVT, p);
+  });
+  return ESP_OK;
+}
+esp_err_t esp_ble_gap_ext_adv_stop(uint8_t aNum, const uint8_t* aInsts)
+{
+  std::vector<uint8_t> insts(aInsts, aInsts+aNum);
+  command([=]() { for (auto i : insts) { if (gInst[i].enabled) GapMock::stats().stops++; enable(i, false); } fire(ESP_GAP_BLE_EXT_ADV_STOP_COMPLETE_EVT, esp_ble_gap_cb_param_t()); });
+  return ESP_OK;
+}
+esp_err_t esp_ble_gap_ext_adv_stop_all() { command([=]() { for (auto& i : gInst) enable(i.first, false); }); return ESP_OK; }
+esp_err_t esp_ble_gap_set_ext_scan_params(const esp_ble_ext_scan_params_t*) { return ESP_OK; }
+esp_err_t esp_ble_gap_start_ext_scan(uint32_t, uint16_t) { return ESP_OK; }
+esp_err_t esp_ble_gap_stop_ext_scan() { return ESP_OK; }
+
+// BLE 4.2 legacy, instance 0
+esp_err_t esp_ble_gap_config_adv_data_raw(uint8_t* aData, uint32_t aLen)
+{
+  uint32_t id = idOf(aData, aLen);
+  command([=]() {
+    AdvInstance& a = gInst[0]; a.dataId = id; a.hasData = true;
+    if (a.enabled) { GapMock::stats().inPlace++; GapMock::stats().packets[id].inPlace = true; }
+    GapMock::stats().dataSetOrder.push_back(id);
+    fire(ESP_GAP_BLE_ADV_DATA_RAW_SET_COMPLETE_EVT, esp_ble_gap_cb_param_t());
+  });
+  return ESP_OK;
+}
+esp_err_t esp_ble_gap_start_advertising(esp_ble_adv_params_t* aP)
+{
+  uint32_t mn = aP->adv_int_min, mx = aP->adv_int_max;
+  command([=]() {
+    AdvInstance& a = gInst[0]; esp_ble_gap_cb_param_t p = {};
+    if (a.enabled) { GapMock::stats().protocolErrors++; p.adv_start_cmpl.status = 12; }
+    else { a.imin = mn; a.imax = mx; GapMock::stats().starts++; enable(0, true); }
+    fire(ESP_GAP_BLE_ADV_START_COMPLETE_EVT, p);
+  });
+  return ESP_OK;
+}
+esp_err_t esp_ble_gap_stop_advertising() { command([=]() { if (gInst[0].enabled) GapMock::stats().stops++; enable(0, false); fire(ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT, esp_ble_gap_cb_param_t()); }); return ESP_OK; }
+esp_err_t esp_ble_gap_set_scan_params(esp_ble_scan_params_t*) { return ESP_OK; }
+esp_err_t esp_ble_gap_start_scanning(uint32_t) { return ESP_OK; }
+esp_err_t esp_ble_gap_stop_scanning() { return ESP_OK; }
+
+// FreeRTOS mutex (non recursive) and esp_timer
+SemaphoreHandle_t xSemaphoreCreateMutex() { return &gMutexTaken; }
+int xSemaphoreTake(SemaphoreHandle_t, uint32_t) { assert(gMutexTaken==0); gMutexTaken++; return 1; }
+int xSemaphoreGive(SemaphoreHandle_t) { assert(gMutexTaken==1); gMutexTaken--; return 1; }
+struct esp_timer { esp_timer_create_args_t args; long gen; };
+esp_err_t esp_timer_create(const esp_timer_create_args_t* aArgs, esp_timer_handle_t* aH) { *aH = new esp_timer{*aArgs, 0}; return ESP_OK; }
+static void timerFire(esp_timer_handle_t aT, long aGen) { if (aT->gen==aGen) aT->args.callback(aT->args.arg); }
+esp_err_t esp_timer_start_once(esp_timer_handle_t aT, uint64_t aUs) { aT->gen++; HostSim::at(HostSim::now()+aUs, boost::bind(&timerFire, aT, aT->gen)); return ESP_OK; }
+esp_err_t esp_timer_stop(esp_timer_handle_t aT) { aT->gen++; return ESP_OK; }
+
+
+void GapMock::reset()
+{
+  HostSim::clear();
+  // like the real controller, stopped sets keep their parameters
+  for (std::map<int, AdvInstance>::iterator pos = gInst.begin(); pos!=gInst.end(); ++pos) {
+    pos->second.enabled = false;
+    pos->second.gen++;
+  }
+  gCmdFree = 0;
+  gRndSeed = 1;
+  stats() = Stats();
+}
@@ -0,0 +1,139 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+
+// Host mock of the ESP-IDF GAP, esp_timer and FreeRTOS mutex APIs used by esp_bt.cpp.
+// - only the types, fields and constants esp_bt.cpp uses are declared
+// - GAP calls are modelled as HCI commands executed one after the other by the controller,
+//   each taking GapMock::params().cmdLatency, with the completion event delivered after that
+// - enabled advertising instances produce advertising events at their interval, each received
+//   by a scanner with probability GapMock::params().scanDuty
+// - misuse the real controller would reject (e.g. changing parameters of an enabled set)
+//   is counted in GapMock::stats().protocolErrors
+
+#ifndef __p44btdmx_test__gap_mock__
+#define __p44btdmx_test__gap_mock__
+
+#include <cstdint>
+#include <cstddef>
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+// FreeRTOS
+typedef void* SemaphoreHandle_t;
+#define portMAX_DELAY 0xFFFFFFFF
+SemaphoreHandle_t xSemaphoreCreateMutex();
+int xSemaphoreTake(SemaphoreHandle_t, uint32_t);
+int xSemaphoreGive(SemaphoreHandle_t);
+// esp_timer
+typedef void (*esp_timer_cb_t)(void* arg);
+typedef enum { ESP_TIMER_TASK } esp_timer_dispatch_t;
+typedef struct { esp_timer_cb_t callback; void* arg; esp_timer_dispatch_t dispatch_method; const char* name; bool skip_unhandled_events; } esp_timer_create_args_t;
+typedef struct esp_timer* esp_timer_handle_t;
+esp_err_t esp_timer_create(const esp_timer_create_args_t*, esp_timer_handle_t*);
+esp_err_t esp_timer_start_once(esp_timer_handle_t, uint64_t);
+esp_err_t esp_timer_stop(esp_timer_handle_t);
+// controller/bluedroid init
+typedef int esp_bt_controller_config_t;
+#define BT_CONTROLLER_INIT_CONFIG_DEFAULT() 0
+#define ESP_BT_MODE_CLASSIC_BT 1
+#define ESP_BT_MODE_BLE 2
+#define ESP_BLE_PWR_TYPE_ADV 0
+#define ESP_PWR_LVL_P9 7
+inline esp_err_t nvs_flash_init() { return ESP_OK; }
+inline esp_err_t esp_bt_controller_mem_release(int) { return ESP_OK; }
+inline esp_err_t esp_bt_controller_init(esp_bt_controller_config_t*) { return ESP_OK; }
+inline esp_err_t esp_bt_controller_enable(int) { return ESP_OK; }
+inline esp_err_t esp_bluedroid_init() { return ESP_OK; }
+inline esp_err_t esp_bluedroid_enable() { return ESP_OK; }
+inline esp_err_t esp_ble_tx_power_set(int, int) { return ESP_OK; }
+// GAP
+typedef enum {
+  ESP_GAP_BLE_ADV_DATA_RAW_SET_COMPLETE_EVT, ESP_GAP_BLE_SCAN_PARAM_SET_COMPLETE_EVT, ESP_GAP_BLE_SCAN_START_COMPLETE_EVT,
+  ESP_GAP_BLE_ADV_START_COMPLETE_EVT, ESP_GAP_BLE_SCAN_STOP_COMPLETE_EVT, ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT, ESP_GAP_BLE_SCAN_RESULT_EVT,
+  ESP_GAP_BLE_EXT_ADV_SET_PARAMS_COMPLETE_EVT, ESP_GAP_BLE_EXT_ADV_DATA_SET_COMPLETE_EVT, ESP_GAP_BLE_EXT_ADV_START_COMPLETE_EVT,
+  ESP_GAP_BLE_EXT_ADV_STOP_COMPLETE_EVT, ESP_GAP_BLE_SET_EXT_SCAN_PARAMS_COMPLETE_EVT, ESP_GAP_BLE_EXT_SCAN_START_COMPLETE_EVT,
+  ESP_GAP_BLE_EXT_SCAN_STOP_COMPLETE_EVT, ESP_GAP_BLE_EXT_ADV_REPORT_EVT
+} esp_gap_ble_cb_event_t;
+enum { ESP_GAP_SEARCH_INQ_RES_EVT };
+enum { ESP_BLE_GAP_EXT_ADV_DATA_COMPLETE };
+typedef struct { int status; } st_t;
+typedef struct { int status; uint8_t instance; } inst_st_t;
+typedef struct { int status; uint8_t instance_num; uint8_t instance[10]; } start_t;
+typedef union {
+  st_t ext_adv_set_params; inst_st_t ext_adv_data_set; start_t ext_adv_start; start_t ext_adv_stop;
+  st_t ext_scan_start; st_t ext_scan_stop; st_t adv_data_raw_cmpl; st_t scan_start_cmpl; st_t adv_start_cmpl; st_t scan_stop_cmpl; st_t adv_stop_cmpl;
+  struct { struct { int data_status; uint8_t* adv_data; uint8_t adv_data_len; } params; } ext_adv_report;
+  struct { int search_evt; uint8_t* ble_adv; uint8_t adv_data_len; } scan_rst;
+} esp_ble_gap_cb_param_t;
+typedef void (*esp_gap_ble_cb_t)(esp_gap_ble_cb_event_t, esp_ble_gap_cb_param_t*);
+enum { BLE_ADDR_TYPE_PUBLIC, BLE_SCAN_FILTER_ALLOW_ALL, BLE_SCAN_DUPLICATE_DISABLE, ESP_BLE_GAP_EXT_SCAN_CFG_UNCODE_MASK, BLE_SCAN_TYPE_PASSIVE,
+  ESP_BLE_GAP_SET_EXT_ADV_PROP_LEGACY_NONCONN, ESP_BLE_GAP_SET_EXT_ADV_PROP_NONCONN_NONSCANNABLE_UNDIRECTED, ADV_CHNL_ALL,
+  ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY, EXT_ADV_TX_PWR_NO_PREFERENCE, ESP_BLE_GAP_PHY_1M, ADV_TYPE_NONCONN_IND };
+typedef struct { int scan_type; uint16_t scan_interval; uint16_t scan_window; } esp_ble_ext_scan_cfg_t;
+typedef struct { int own_addr_type; int filter_policy; int scan_duplicate; int cfg_mask; esp_ble_ext_scan_cfg_t uncoded_cfg; esp_ble_ext_scan_cfg_t coded_cfg; } esp_ble_ext_scan_params_t;
+typedef struct { int type; uint32_t interval_min; uint32_t interval_max; int channel_map; int own_addr_type; int peer_addr_type; uint8_t peer_addr[6];
+  int filter_policy; int tx_power; int primary_phy; int max_skip; int secondary_phy; uint8_t sid; bool scan_req_notif; } esp_ble_gap_ext_adv_params_t;
+typedef struct { int scan_type; int own_addr_type; int scan_filter_policy; uint16_t scan_interval; uint16_t scan_window; int scan_duplicate; } esp_ble_scan_params_t;
+typedef struct { uint16_t adv_int_min; uint16_t adv_int_max; int adv_type; int own_addr_type; int channel_map; int adv_filter_policy; } esp_ble_adv_params_t;
+typedef struct { uint8_t instance; int duration; int max_events; } esp_ble_gap_ext_adv_t;
+esp_err_t esp_ble_gap_register_callback(esp_gap_ble_cb_t);
+esp_err_t esp_ble_gap_ext_adv_set_params(uint8_t, const esp_ble_gap_ext_adv_params_t*);
+esp_err_t esp_ble_gap_config_ext_adv_data_raw(uint8_t, uint16_t, const uint8_t*);
+esp_err_t esp_ble_gap_ext_adv_start(uint8_t, const esp_ble_gap_ext_adv_t*);
+esp_err_t esp_ble_gap_ext_adv_stop(uint8_t, const uint8_t*);
+esp_err_t esp_ble_gap_ext_adv_stop_all();
+esp_err_t esp_ble_gap_set_ext_scan_params(const esp_ble_ext_scan_params_t*);
+esp_err_t esp_ble_gap_start_ext_scan(uint32_t, uint16_t);
+esp_err_t esp_ble_gap_stop_ext_scan();
+esp_err_t esp_ble_gap_config_adv_data_raw(uint8_t*, uint32_t);
+esp_err_t esp_ble_gap_start_advertising(esp_ble_adv_params_t*);
+esp_err_t esp_ble_gap_stop_advertising();
+esp_err_t esp_ble_gap_set_scan_params(esp_ble_scan_params_t*);
+esp_err_t esp_ble_gap_start_scanning(uint32_t);
+esp_err_t esp_ble_gap_stop_scanning();
+
+
+// MARK: - mock parameters and statistics
+
+#include <map>
+#include <vector>
+
+typedef long long GapMockTime; ///< microseconds, same as MLMicroSeconds
+
+class GapMock
+{
+public:
+
+  typedef struct {
+    GapMockTime cmdLatency = 1500; ///< BTC task + HCI command round trip per GAP call
+    GapMockTime firstEvent = 500; ///< from enabling a set to its first advertising event
+    double scanDuty = 0.75; ///< probability a scanner receives an advertising event
+  } Params;
+
+  typedef struct {
+    int events = 0; ///< number of advertising events the packet was on air for
+    bool received = false; ///< set if at least one event was received
+    bool inPlace = false; ///< set if the packet replaced the data of an enabled set
+  } PacketStat;
+
+  typedef struct {
+    long starts = 0; ///< advertising set starts
+    long stops = 0; ///< advertising set stops
+    long inPlace = 0; ///< data updates of enabled sets
+    long protocolErrors = 0; ///< commands the controller would reject
+    std::map<uint32_t, PacketStat> packets; ///< per packet statistics, packet id = first 4 data bytes
+    std::vector<uint32_t> dataSetOrder; ///< packet ids in the order their data reached the controller
+  } Stats;
+
+  static Params& params();
+  static Stats& stats();
+
+  /// reset the controller model and statistics (not the parameters)
+  static void reset();
+
+};
+
+#endif // __p44btdmx_test__gap_mock__
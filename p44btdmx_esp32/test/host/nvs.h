@@ -0,0 +1,60 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+
+// Host stand-in for the ESP-IDF NVS API, keeping blobs in memory
+
+#ifndef __p44btdmx_test__nvs__
+#define __p44btdmx_test__nvs__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <string>
+#include <map>
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NVS_NOT_FOUND 0x1102
+
+typedef uint32_t nvs_handle_t;
+typedef enum { NVS_READONLY, NVS_READWRITE } nvs_open_mode_t;
+
+/// the simulated flash, keyed by namespace and key
+inline std::map<std::string, std::string>& nvsHostStore() { static std::map<std::string, std::string> s; return s; }
+inline std::map<nvs_handle_t, std::string>& nvsHostHandles() { static std::map<nvs_handle_t, std::string> h; return h; }
+
+inline esp_err_t nvs_open(const char* aNamespace, nvs_open_mode_t, nvs_handle_t* aHandle)
+{
+  static nvs_handle_t next = 0;
+  *aHandle = ++next;
+  nvsHostHandles()[*aHandle] = std::string(aNamespace)+":";
+  return ESP_OK;
+}
+
+inline void nvs_close(nvs_handle_t aHandle) { nvsHostHandles().erase(aHandle); }
+
+inline esp_err_t nvs_commit(nvs_handle_t) { return ESP_OK; }
+
+inline esp_err_t nvs_get_blob(nvs_handle_t aHandle, const char* aKey, void* aData, size_t* aSize)
+{
+  std::map<std::string, std::string>::iterator pos = nvsHostStore().find(nvsHostHandles()[aHandle]+aKey);
+  if (pos==nvsHostStore().end()) return ESP_ERR_NVS_NOT_FOUND;
+  if (aData) {
+    if (*aSize<pos->second.size()) return ESP_FAIL;
+    memcpy(aData, pos->second.data(), pos->second.size());
+  }
+  *aSize = pos->second.size();
+  return ESP_OK;
+}
+
+inline esp_err_t nvs_set_blob(nvs_handle_t aHandle, const char* aKey, const void* aData, size_t aSize)
+{
+  nvsHostStore()[nvsHostHandles()[aHandle]+aKey] = std::string((const char*)aData, aSize);
+  return ESP_OK;
+}
+
+#endif // __p44btdmx_test__nvs__
@@ -0,0 +1,271 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+
+// Host stand-in for the parts of p44utils used by p44btdmx.cpp and esp_bt.cpp.
+// - the mainloop is a discrete event simulation (HostSim), so tests run in simulated time
+//   and are fully deterministic
+// - logging goes to stderr, filtered by HostSim::logLevel()
+
+#ifndef __p44btdmx_test__p44utils_common__
+#define __p44btdmx_test__p44utils_common__
+
+#include <string>
+#include <map>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include <boost/intrusive_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/bind/bind.hpp>
+
+using namespace boost::placeholders;
+
+#define P44_OVERRIDE override
+
+#define LOG_EMERG 0
+#define LOG_ALERT 1
+#define LOG_CRIT 2
+#define LOG_ERR 3
+#define LOG_WARNING 4
+#define LOG_NOTICE 5
+#define LOG_INFO 6
+#define LOG_DEBUG 7
+
+namespace p44 {
+
+  using std::string;
+
+  typedef long long MLMicroSeconds;
+  const MLMicroSeconds Never = 0;
+  const MLMicroSeconds Infinite = -2;
+  const MLMicroSeconds MilliSecond = 1000;
+  const MLMicroSeconds Second = 1000*MilliSecond;
+  const MLMicroSeconds Minute = 60*Second;
+
+  typedef boost::function<void ()> SimpleCB;
+
+
+  // MARK: - simulated mainloop
+
+  /// discrete event simulation standing in for the p44utils mainloop
+  class HostSim
+  {
+    typedef std::map<std::pair<MLMicroSeconds, long>, SimpleCB> EventQueue;
+
+    static MLMicroSeconds& nowRef() { static MLMicroSeconds t = Second; return t; } // not Never at start
+    static EventQueue& queue() { static EventQueue q; return q; }
+    static long& seqRef() { static long s = 0; return s; }
+
+  public:
+
+    /// @return current simulated time
+    static MLMicroSeconds now() { return nowRef(); }
+
+    /// advance the simulated time without running events (for tests not using the event queue)
+    static void advance(MLMicroSeconds aTime) { nowRef() += aTime; }
+
+    /// schedule a callback
+    /// @param aTime when to call it, times in the past run at the current time
+    /// @param aCB the callback
+    /// @return event id, can be used to cancel()
+    static long at(MLMicroSeconds aTime, SimpleCB aCB)
+    {
+      if (aTime<now()) aTime = now();
+      long id = ++seqRef();
+      queue()[std::make_pair(aTime, id)] = aCB;
+      return id;
+    }
+
+    /// cancel a scheduled callback
+    /// @param aId the event id as returned by at()
+    static void cancel(long aId)
+    {
+      for (EventQueue::iterator pos = queue().begin(); pos!=queue().end(); ++pos) {
+        if (pos->first.second==aId) { queue().erase(pos); return; }
+      }
+    }
+
+    /// run all events up to the given time, then set the time to it
+    /// @param aUntil end of the run
+    static void run(MLMicroSeconds aUntil)
+    {
+      while (!queue().empty() && queue().begin()->first.first<=aUntil) {
+        EventQueue::iterator pos = queue().begin();
+        nowRef() = pos->first.first;
+        SimpleCB cb = pos->second;
+        queue().erase(pos);
+        cb();
+      }
+      nowRef() = aUntil;
+    }
+
+    /// discard all pending events
+    static void clear() { queue().clear(); }
+
+    /// @return log level, messages above it are suppressed
+    static int& logLevel() { static int l = LOG_WARNING; return l; }
+
+  };
+
+
+  class MainLoop
+  {
+  public:
+    static MLMicroSeconds now() { return HostSim::now(); }
+    static MainLoop& currentMainLoop() { static MainLoop m; return m; }
+    /// the callback runs as the next mainloop event, like from a foreign task
+    void executeNowFromForeignTask(SimpleCB aCB) { HostSim::at(HostSim::now()+mForeignTaskLatency, aCB); }
+    /// time it takes the mainloop to pick up a callback from a foreign task
+    MLMicroSeconds mForeignTaskLatency = MilliSecond;
+  };
+
+
+  class MLTicket
+  {
+    long mId = 0;
+    void fire(SimpleCB aCB) { mId = 0; aCB(); }
+  public:
+    ~MLTicket() { cancel(); }
+    void executeOnce(SimpleCB aCB, MLMicroSeconds aDelay)
+    {
+      cancel();
+      mId = HostSim::at(HostSim::now()+aDelay, boost::bind(&MLTicket::fire, this, aCB));
+    }
+    bool cancel() { if (!mId) return false; HostSim::cancel(mId); mId = 0; return true; }
+    operator bool() const { return mId!=0; }
+  };
+
+
+  // MARK: - objects and errors
+
+  class P44Obj
+  {
+    int mRefCount = 0;
+    friend void intrusive_ptr_add_ref(P44Obj* aObj) { aObj->mRefCount++; }
+    friend void intrusive_ptr_release(P44Obj* aObj) { if (--aObj->mRefCount==0) delete aObj; }
+  public:
+    virtual ~P44Obj() {}
+  };
+
+
+  class P44LoggingObj : public P44Obj
+  {
+  public:
+    virtual string logContextPrefix() { return ""; }
+    int logLevelOffset() { return 0; }
+  };
+
+
+  class Error;
+  typedef boost::intrusive_ptr<Error> ErrorPtr;
+
+  class Error : public P44Obj
+  {
+    string mText;
+  public:
+    Error(const string aText) : mText(aText) {}
+    const char* text() { return mText.c_str(); }
+    static bool isOK(ErrorPtr aError) { return !aError; }
+    static bool notOK(ErrorPtr aError) { return !!aError; }
+  };
+
+  typedef boost::function<void (ErrorPtr aError)> StatusCB;
+
+  inline string string_format(const char* aFormat, ...) __attribute__((format(printf,1,2)));
+  inline string string_format(const char* aFormat, ...)
+  {
+    char buf[1024];
+    va_list args;
+    va_start(args, aFormat);
+    vsnprintf(buf, sizeof(buf), aFormat, args);
+    va_end(args);
+    return buf;
+  }
+
+  inline void string_format_append(string &aString, const char* aFormat, ...) __attribute__((format(printf,2,3)));
+  inline void string_format_append(string &aString, const char* aFormat, ...)
+  {
+    char buf[1024];
+    va_list args;
+    va_start(args, aFormat);
+    vsnprintf(buf, sizeof(buf), aFormat, args);
+    va_end(args);
+    aString += buf;
+  }
+
+  class EspError
+  {
+  public:
+    static ErrorPtr err(int aEspErr, const char* aContext) { if (aEspErr==0) return ErrorPtr(); return ErrorPtr(new Error(string_format("%s%d", aContext, aEspErr))); }
+  };
+
+  class TextError
+  {
+  public:
+    static ErrorPtr err(const char* aFormat, ...) __attribute__((format(printf,1,2)))
+    {
+      char buf[256];
+      va_list args;
+      va_start(args, aFormat);
+      vsnprintf(buf, sizeof(buf), aFormat, args);
+      va_end(args);
+      return ErrorPtr(new Error(buf));
+    }
+  };
+
+
+  // MARK: - utilities
+
+  inline string binaryToHexString(const string &aBinaryString, char aSeparator = 0)
+  {
+    string s;
+    for (size_t i=0; i<aBinaryString.size(); i++) {
+      if (i>0 && aSeparator) s += aSeparator;
+      string_format_append(s, "%02X", (uint8_t)aBinaryString[i]);
+    }
+    return s;
+  }
+
+  inline string hexToBinaryString(const char* aHexString, bool aSpacesAllowed = false, size_t aMaxBytes = 0)
+  {
+    string bin;
+    while (aHexString[0] && aHexString[1] && (aMaxBytes==0 || bin.size()<aMaxBytes)) {
+      if (aSpacesAllowed && (aHexString[0]==' ' || aHexString[0]==':' || aHexString[0]=='-')) { aHexString++; continue; }
+      unsigned b;
+      if (sscanf(aHexString, "%2x", &b)!=1) break;
+      bin += (char)b;
+      aHexString += 2;
+    }
+    return bin;
+  }
+
+  inline void hostLog(int aLevel, const char* aFormat, ...) __attribute__((format(printf,2,3)));
+  inline void hostLog(int aLevel, const char* aFormat, ...)
+  {
+    va_list args;
+    va_start(args, aFormat);
+    fprintf(stderr, "[%d] ", aLevel);
+    vfprintf(stderr, aFormat, args);
+    fputc('\n', stderr);
+    va_end(args);
+  }
+
+} // namespace p44
+
+#define LOGENABLED(lvl) ((lvl)<=p44::HostSim::logLevel())
+#define LOGLEVEL (p44::HostSim::logLevel())
+#define LOG(lvl, ...) do { if (LOGENABLED(lvl)) p44::hostLog(lvl, __VA_ARGS__); } while(0)
+#define OLOG(lvl, ...) LOG(lvl, __VA_ARGS__)
+#define DBGLOG(lvl, ...) LOG(lvl, __VA_ARGS__)
+#ifndef FOCUSLOGLEVEL
+  #define FOCUSLOGLEVEL 0
+#endif
+#define FOCUSLOGGING (FOCUSLOGLEVEL && LOGENABLED(FOCUSLOGLEVEL))
+#define FOCUSLOG(...) { if (FOCUSLOGGING) p44::hostLog(FOCUSLOGLEVEL, __VA_ARGS__); }
+
+#endif // __p44btdmx_test__p44utils_common__
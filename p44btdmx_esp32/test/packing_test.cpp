@@ -0,0 +1,141 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+
+// Packing test
+// - replays the DMX traces in traces/ into a sender configured like the DMX forwarder
+//   (universe refresh, 3 initial repeats), one legacy packet every 20mS, with the greedy packer
+//   and with the optimized packer (setOptimizedPacking())
+// - a receiver gets the packets, with and without packet loss. A useful update is a receiver
+//   channel changing its value, bytes are the advertisement bytes on air while the trace runs.
+//   With loss, results are averaged over several loss patterns (single runs vary by +/-10%).
+// - stale is the average number of receiver channels differing from the sender's DMX input
+// - the optimized packer must leave at least 10% fewer channels stale, with and without loss. On traces
+//   saturating the link, it must also need fewer bytes per useful update. On the others, all packets are
+//   full (refresh) either way, so it must be within 1% (which intermediate values of a fade happen to
+//   get delivered varies). Both packers must converge to the final frame after the trace.
+
+#include "p44btdmx.hpp"
+#include "dmx_trace.hpp"
+#include "test_receiver.hpp"
+
+using namespace p44;
+
+static const MLMicroSeconds cPacketInterval = 20*MilliSecond;
+static const MLMicroSeconds cSettleTime = 10*Second;
+static const struct {
+  const char* name;
+  bool saturating; ///< set if the trace has more changes than the link can carry
+} cTraces[] = {
+  { "chase.trace", false },
+  { "colorwash.trace", true },
+  { "busy.trace", true },
+};
+static const int cLossPercent[] = { 0, 20 };
+static const int cLossPatterns = 8;
+static const double cMinStaleImprovement = 0.1;
+
+
+typedef struct {
+  size_t bytes; ///< advertisement bytes sent while the trace runs
+  size_t useful; ///< receiver channel value changes while the trace runs
+  double meanStale; ///< average number of receiver channels differing from the sender's DMX input
+  int finalDiffs; ///< channels differing after the settle time
+} Result;
+
+
+static Result replay(const DMXTrace& aTrace, bool aOptimized, int aLossPercent, unsigned aLossSeed)
+{
+  Result res = { 0, 0, 0, 0 };
+  P44BTDMXsenderPtr sender = new P44BTDMXsender;
+  sender->setRefreshUniverse(true);
+  sender->setInitialRepeatCount(3);
+  sender->setOptimizedPacking(aOptimized);
+  TestReceiver rx;
+  unsigned lossSeed = aLossSeed; // same losses for both packers
+  uint8_t dmx[512];
+  memset(dmx, 0, sizeof(dmx));
+  size_t nextFrame = 0;
+  MLMicroSeconds start = MainLoop::now();
+  MLMicroSeconds end = start+aTrace.durationMs()*MilliSecond+cSettleTime;
+  long packets = 0;
+  double stale = 0;
+  while (MainLoop::now()<end) {
+    MLMicroSeconds t = MainLoop::now()-start;
+    while (nextFrame<aTrace.frames.size() && aTrace.frames[nextFrame].timeMs*MilliSecond<=t) {
+      const DMXTrace::Frame& f = aTrace.frames[nextFrame++];
+      for (size_t i=0; i<f.changes.size(); i++) dmx[f.changes[i].first] = f.changes[i].second;
+      sender->setChannels(0, 512, dmx);
+    }
+    bool running = t<=(MLMicroSeconds)aTrace.durationMs()*MilliSecond;
+    string adv = sender->generateBTAdvMfgData(31);
+    if (running) res.bytes += adv.size();
+    if ((int)(rand_r(&lossSeed)%100)>=aLossPercent) {
+      uint8_t before[512];
+      for (int i=0; i<512; i++) before[i] = rx.channel(i);
+      rx.deliver(adv);
+      if (running) res.useful += rx.differences(before, 512); // channels changed by this packet
+    }
+    if (running) {
+      stale += rx.differences(dmx, 512);
+      packets++;
+    }
+    HostSim::advance(cPacketInterval);
+  }
+  res.meanStale = packets ? stale/packets : 0;
+  res.finalDiffs = rx.differences(dmx, 512);
+  return res;
+}
+
+
+/// replay with several loss patterns
+/// @return sums of bytes, useful updates and final differences, mean stale channels
+static Result replayAveraged(const DMXTrace& aTrace, bool aOptimized, int aLossPercent)
+{
+  Result sum = { 0, 0, 0, 0 };
+  int n = aLossPercent>0 ? cLossPatterns : 1;
+  for (int k=0; k<n; k++) {
+    Result r = replay(aTrace, aOptimized, aLossPercent, 4711+k);
+    sum.bytes += r.bytes;
+    sum.useful += r.useful;
+    sum.meanStale += r.meanStale/n;
+    sum.finalDiffs += r.finalDiffs;
+  }
+  return sum;
+}
+
+
+int main(int argc, char **argv)
+{
+  string traceDir = argc>1 ? argv[1] : "traces";
+  int failures = 0;
+  printf("%-16s %4s | %-9s %8s %8s %8s %8s | %s\n", "trace", "loss", "packer", "bytes", "updates", "B/update", "stale", "result");
+  for (auto tr : cTraces) {
+    const char* name = tr.name;
+    DMXTrace trace;
+    if (!trace.load(traceDir+"/"+name)) {
+      printf("FAIL cannot load %s/%s\n", traceDir.c_str(), name);
+      failures++;
+      continue;
+    }
+    for (int loss : cLossPercent) {
+      Result greedy = replayAveraged(trace, false, loss);
+      Result optimized = replayAveraged(trace, true, loss);
+      double gb = (double)greedy.bytes/greedy.useful;
+      double ob = (double)optimized.bytes/optimized.useful;
+      bool ok = greedy.finalDiffs==0 && optimized.finalDiffs==0;
+      // must be a real improvement
+      if (optimized.meanStale>greedy.meanStale*(1-cMinStaleImprovement)) ok = false;
+      if (tr.saturating ? ob>=gb : ob>gb*1.01) ok = false;
+      if (!ok) failures++;
+      printf("%-16s %3d%% | %-9s %8zu %8zu %8.2f %8.1f |\n", name, loss, "greedy", greedy.bytes, greedy.useful, gb, greedy.meanStale);
+      printf("%-16s %3d%% | %-9s %8zu %8zu %8.2f %8.1f | %s (%+.1f%% bytes/update, %+.0f%% stale, %d/%d channels off at end)\n",
+        name, loss, "optimized", optimized.bytes, optimized.useful, ob, optimized.meanStale,
+        ok ? "ok" : "FAIL", (ob/gb-1)*100, (optimized.meanStale/greedy.meanStale-1)*100, greedy.finalDiffs, optimized.finalDiffs
+      );
+    }
+  }
+  return failures ? 1 : 0;
+}
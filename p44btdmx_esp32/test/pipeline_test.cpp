@@ -0,0 +1,272 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+
+// Advertising pipeline test
+// - runs esp_bt.cpp (BLE 5 stack configuration) against the GAP mock in host/gap_mock.h, driving it like
+//   p44btdmx_main.cpp does: the next packet is generated and queued from the pipeline's ready callback
+// - for comparison, the former way: startAdvertising() for each packet, generating the next one from the
+//   started callback after ADVERTISING_START_TO_UPDATE
+// - checks the pipeline state machine (claimPipeline(), pipelineUpdate(), pipelineUpdateDone() and the
+//   hold off timer):
+//   - no command the controller would reject (e.g. setting parameters of an enabled set)
+//   - packet data reaches the controller in the order queued, none dropped
+//   - every packet that got replaced was on air for at least one advertising event, even with a controller
+//     taking almost PIPELINE_MIN_ON_AIR for the first event (which needs the hold off timer)
+//   - more packets per second than the former way
+//   - without a backlog, data is replaced in place instead of restarting the sets, and the measured
+//     pipelineUpdateTime() matches the number of HCI commands per update. At the busy interval, this
+//     needs all sets updated round robin at a moderate rate (a backlog always restarts the sets)
+//   - switching from the relaxed to the busy interval restarts the sets right away, which may drop data
+//     replaced in place that did not get its first event yet, but no other packets
+
+#include "esp_bt.hpp"
+#include "application.hpp"
+
+#include <stdarg.h>
+
+using namespace p44;
+
+static const MLMicroSeconds cRunTime = 20*Second;
+static const MLMicroSeconds cGenerateTime = 200; ///< mainloop time to generate a packet
+static const MLMicroSeconds cStartToUpdate = 5*MilliSecond; ///< former ADVERTISING_START_TO_UPDATE
+static const MLMicroSeconds cSlowFirstEvent = 4*MilliSecond; ///< slow controller, first event just before PIPELINE_MIN_ON_AIR
+
+static int failures = 0;
+
+static void check(bool aOk, const char* aFmt, ...)
+{
+  va_list args;
+  va_start(args, aFmt);
+  printf("%s ", aOk ? "ok  " : "FAIL");
+  vprintf(aFmt, args);
+  printf("\n");
+  va_end(args);
+  if (!aOk) failures++;
+}
+
+
+class Driver
+{
+public:
+
+  bool mPipelined;
+  bool mExtended;
+  int mNumSets;
+  MLMicroSeconds mRelaxDelay; ///< delay before generating the next packet, as with a relaxed advertising interval
+  uint32_t mNextId;
+  long mErrors;
+  int mNextSet;
+
+  Driver(bool aPipelined, bool aExtended, int aNumSets, MLMicroSeconds aRelaxDelay) :
+    mPipelined(aPipelined), mExtended(aExtended), mNumSets(aNumSets), mRelaxDelay(aRelaxDelay),
+    mNextId(1), mErrors(0), mNextSet(0)
+  {
+  }
+
+  void start()
+  {
+    if (mPipelined) {
+      ErrorPtr err = BtAdvertisements::sharedInstance().startPipeline(boost::bind(&Driver::ready, this, _1), mExtended, mNumSets);
+      if (Error::notOK(err)) mErrors++;
+    }
+    HostSim::at(HostSim::now(), boost::bind(&Driver::queueNext, this));
+  }
+
+  /// @return number of packets issued so far
+  long issued() { return mNextId-1; }
+
+private:
+
+  void packet(uint8_t* aData)
+  {
+    uint32_t id = mNextId++;
+    memset(aData, 0, 31);
+    memcpy(aData, &id, 4);
+  }
+
+  void ready(ErrorPtr aError)
+  {
+    if (Error::notOK(aError)) mErrors++;
+    HostSim::at(HostSim::now()+mRelaxDelay+cGenerateTime, boost::bind(&Driver::queueNext, this));
+  }
+
+  void started(ErrorPtr aError)
+  {
+    if (Error::notOK(aError)) mErrors++;
+    mNextSet = (mNextSet+1)%mNumSets;
+    HostSim::at(HostSim::now()+cStartToUpdate+mRelaxDelay+cGenerateTime, boost::bind(&Driver::queueNext, this));
+  }
+
+  void queueNext()
+  {
+    uint8_t data[31];
+    packet(data);
+    size_t len = sizeof(data);
+    ErrorPtr err;
+    if (mPipelined) {
+      err = BtAdvertisements::sharedInstance().queueAdvertisement(data, len, mExtended);
+    }
+    else {
+      err = BtAdvertisements::sharedInstance().startAdvertising(boost::bind(&Driver::started, this, _1), data, len, mExtended, mNextSet);
+    }
+    if (Error::notOK(err)) {
+      mErrors++;
+      mNextId--;
+    }
+  }
+
+};
+
+
+typedef struct {
+  double rate; ///< packets issued per second
+  long errors; ///< errors reported to the driver
+  long protocolErrors; ///< commands the controller would reject
+  bool ordered; ///< all issued packets reached the controller, in order
+  long notAired; ///< replaced packets that did not get a single advertising event
+  long notAiredInPlace; ///< of these, packets that had replaced data in place
+  long switches; ///< changes from relaxed to busy advertising interval
+  long starts;
+  long inPlace;
+  MLMicroSeconds updateTime; ///< pipelineUpdateTime() at the end
+} Result;
+
+
+static Result run(bool aPipelined, bool aExtended, int aNumSets, MLMicroSeconds aRelaxDelay, MLMicroSeconds aFirstEvent, bool aIntervalChanges = false)
+{
+  BtAdvertisements& bt = BtAdvertisements::sharedInstance();
+  bt.stopAdvertising();
+  GapMock::reset();
+  GapMock::params().firstEvent = aFirstEvent;
+  bt.setAdvertisingInterval(20);
+  Driver driver(aPipelined, aExtended, aNumSets, aRelaxDelay);
+  MLMicroSeconds start = HostSim::now();
+  driver.start();
+  if (aIntervalChanges) {
+    // switch between busy and relaxed interval, like the adaptive advertising interval does
+    for (MLMicroSeconds t=700*MilliSecond; t<cRunTime; t+=700*MilliSecond) {
+      bool relaxed = (t/(700*MilliSecond))%2;
+      HostSim::at(start+t, [relaxed, &driver]() {
+        BtAdvertisements::sharedInstance().setAdvertisingInterval(relaxed ? 200 : 20);
+        driver.mRelaxDelay = relaxed ? 180*MilliSecond : 0;
+      });
+    }
+  }
+  HostSim::run(start+cRunTime);
+  Result res;
+  GapMock::Stats& st = GapMock::stats();
+  res.rate = (double)driver.issued()*Second/cRunTime;
+  res.errors = driver.mErrors;
+  res.protocolErrors = st.protocolErrors;
+  res.starts = st.starts;
+  res.inPlace = st.inPlace;
+  res.updateTime = aPipelined ? bt.pipelineUpdateTime(aExtended) : 0;
+  // the last packets queued may still be in the pipeline
+  res.ordered = st.dataSetOrder.size()+2>=(size_t)driver.issued();
+  for (size_t i=0; i<st.dataSetOrder.size(); i++) {
+    if (st.dataSetOrder[i]!=i+1) res.ordered = false;
+  }
+  // packets still on air at the end are not counted
+  res.notAired = 0;
+  res.notAiredInPlace = 0;
+  for (size_t i=0; i+aNumSets<st.dataSetOrder.size(); i++) {
+    GapMock::PacketStat& ps = st.packets[st.dataSetOrder[i]];
+    if (ps.events==0) {
+      res.notAired++;
+      if (ps.inPlace) res.notAiredInPlace++;
+    }
+  }
+  res.switches = aIntervalChanges ? cRunTime/(1400*MilliSecond) : 0;
+  return res;
+}
+
+
+static void report(const char* aWhat, const Result& aRes)
+{
+  printf("     %-28s %6.1f packets/s, starts %ld, in place %ld, update time %.1fmS, errors %ld/%ld, not aired %ld%s\n",
+    aWhat, aRes.rate, aRes.starts, aRes.inPlace, (double)aRes.updateTime/MilliSecond,
+    aRes.errors, aRes.protocolErrors, aRes.notAired, aRes.ordered ? "" : ", OUT OF ORDER/LOST"
+  );
+}
+
+
+int main(int argc, char **argv)
+{
+  GapMock::Params defaults = GapMock::params();
+  MLMicroSeconds cmd = defaults.cmdLatency;
+  // with a backlog (next packet ready right away)
+  for (int ext=0; ext<2; ext++) {
+    for (int n=1; n<=BtAdvertisements::cMaxAdvSets; n++) {
+      Result former = run(false, ext, n, 0, defaults.firstEvent);
+      Result piped = run(true, ext, n, 0, defaults.firstEvent);
+      Result slow = run(true, ext, n, 0, cSlowFirstEvent);
+      report("former startAdvertising()", former);
+      report("pipeline", piped);
+      report("pipeline, slow first event", slow);
+      check(
+        piped.errors==0 && piped.protocolErrors==0 && piped.ordered &&
+        slow.errors==0 && slow.protocolErrors==0 && slow.ordered,
+        "%s, %d set%s: no errors, packets in order", ext ? "extended" : "legacy", n, n>1 ? "s" : ""
+      );
+      check(
+        piped.notAired==0 && slow.notAired==0,
+        "%s, %d set%s: every packet on air for at least one event", ext ? "extended" : "legacy", n, n>1 ? "s" : ""
+      );
+      check(
+        piped.rate>former.rate,
+        "%s, %d set%s: pipeline %.0f packets/s vs. %.0f with startAdvertising()", ext ? "extended" : "legacy", n, n>1 ? "s" : "", piped.rate, former.rate
+      );
+      // restart = stop, data, start (parameters are set once)
+      check(
+        piped.updateTime>=2*cmd && piped.updateTime<=4*cmd,
+        "%s, %d set%s: restart update time %.1fmS for 3 commands of %.1fmS", ext ? "extended" : "legacy", n, n>1 ? "s" : "",
+        (double)piped.updateTime/MilliSecond, (double)cmd/MilliSecond
+      );
+    }
+  }
+  // with a backlog, every set is updated again after numSets update times (below 20mS), which is always less
+  // than the full interval of a set at the busy interval (2*20mS+advDelay), so the backlog runs above only
+  // restart. Queuing a bit slower, round robin over all sets gets them past a full interval at the busy interval.
+  for (int ext=0; ext<2; ext++) {
+    int n = BtAdvertisements::cMaxAdvSets;
+    Result moderate = run(true, ext, n, 20*MilliSecond, defaults.firstEvent);
+    report("pipeline, busy, moderate load", moderate);
+    check(
+      moderate.errors==0 && moderate.protocolErrors==0 && moderate.ordered && moderate.notAired==0 &&
+      moderate.inPlace>0 && moderate.starts<=n && moderate.updateTime<=2*cmd,
+      "%s, %d sets, busy interval, moderate load: %ld in place updates, %ld starts, update time %.1fmS, every packet aired",
+      ext ? "extended" : "legacy", n, moderate.inPlace, moderate.starts, (double)moderate.updateTime/MilliSecond
+    );
+  }
+  // without a backlog: sets on air for a full interval get their data replaced in place
+  for (int n=1; n<=BtAdvertisements::cMaxAdvSets; n++) {
+    Result relaxed = run(true, false, n, 60*MilliSecond, defaults.firstEvent);
+    report("pipeline, relaxed", relaxed);
+    check(
+      relaxed.errors==0 && relaxed.protocolErrors==0 && relaxed.ordered && relaxed.starts<=n && relaxed.inPlace>0 &&
+      relaxed.updateTime<=2*cmd,
+      "legacy, %d set%s, relaxed: %ld in place updates, %ld starts, update time %.1fmS", n, n>1 ? "s" : "",
+      relaxed.inPlace, relaxed.starts, (double)relaxed.updateTime/MilliSecond
+    );
+  }
+  // interval changes restart the sets with the new parameters
+  for (int n=1; n<=BtAdvertisements::cMaxAdvSets; n++) {
+    Result changing = run(true, false, n, 0, defaults.firstEvent, true);
+    report("pipeline, interval changes", changing);
+    check(
+      changing.errors==0 && changing.protocolErrors==0 && changing.ordered,
+      "legacy, %d set%s, changing interval: no errors, packets in order", n, n>1 ? "s" : ""
+    );
+    // a set restarted for the busy interval drops data it got in place at the relaxed interval, before its
+    // next advertising event (at most once per set and switch). Packets sent at the busy interval are never lost.
+    check(
+      changing.notAired==changing.notAiredInPlace && changing.notAired<=changing.switches*n,
+      "legacy, %d set%s, changing interval: %ld relaxed packets replaced before their first event, %d switches to busy",
+      n, n>1 ? "s" : "", changing.notAired, (int)changing.switches
+    );
+  }
+  return failures ? 1 : 0;
+}
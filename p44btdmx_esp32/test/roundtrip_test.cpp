@@ -0,0 +1,264 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+
+// Round trip test
+// - random, drifting (delta friendly) and grouped (range/group friendly) changes go through
+//   senders with different feature sets to receivers, with packet loss
+// - one receiver gets every packet once, another one gets every packet three times, like when the
+//   scanner reports an advertisement more than once. Both must have identical channel values after
+//   every packet (deltas must not be applied twice).
+// - after the changes stop, all receivers must converge to the sender's universe
+// - FEC with the time base: changes sent once, no refresh, one packet of every group of 4 data packets plus
+//   parity lost. Every change must still arrive, also when the time base falls due on a parity slot.
+// - settings changed after setNumPages() must reach the additional pages
+// - sequence statistics: late packets only reduce the lost count when their number was counted as lost,
+//   not after a resync, and not for another source
+// - fade detection: a channel changed without timestamp (setChannels() without one, e.g. a scene recall)
+//   while it is being sent as a fade must end the fade and deliver the new value
+
+#include "p44btdmx.hpp"
+#include "test_receiver.hpp"
+
+#include <vector>
+
+using namespace p44;
+
+static const int cSteps = 600;
+static const int cSettlePackets = 3000;
+static const MLMicroSeconds cPacketInterval = 20*MilliSecond;
+
+enum { random_changes, drifting_changes, grouped_changes, numWorkloads };
+static const char* cWorkloadNames[numWorkloads] = { "random", "drifting", "grouped" };
+
+typedef struct {
+  const char* name;
+  bool extended;
+  bool sequenceNumbers;
+  int fecGroupSize;
+  bool optimized;
+  P44BTDMXsender::SchedulingMode scheduling;
+} SenderConfig;
+
+static const SenderConfig cConfigs[] = {
+  { "default", false, false, 0, false, P44BTDMXsender::sched_age },
+  { "extended", true, false, 0, true, P44BTDMXsender::sched_age },
+  { "extended+seq (deltas)", true, true, 0, true, P44BTDMXsender::sched_age },
+  { "extended+seq magnitude", true, true, 0, true, P44BTDMXsender::sched_magnitude },
+  { "extended+seq deadline", true, true, 0, false, P44BTDMXsender::sched_deadline },
+  { "extended+FEC4", true, true, 4, true, P44BTDMXsender::sched_age },
+};
+
+
+static int run(const SenderConfig& aConfig, int aWorkload, int aLossPercent)
+{
+  unsigned seed = 1+aWorkload;
+  P44BTDMXsenderPtr sender = new P44BTDMXsender;
+  sender->setRefreshUniverse(true);
+  sender->setInitialRepeatCount(aConfig.fecGroupSize>0 ? 1 : 3);
+  sender->setExtendedCommands(aConfig.extended);
+  sender->setSequenceNumbers(aConfig.sequenceNumbers);
+  sender->setFecGroupSize(aConfig.fecGroupSize);
+  sender->setOptimizedPacking(aConfig.optimized);
+  sender->setSchedulingMode(aConfig.scheduling);
+  TestReceiver once;
+  TestReceiver thrice;
+  uint8_t universe[P44BTDMXsender::cUniverseSize];
+  memset(universe, 0, sizeof(universe));
+  const int n = P44BTDMXsender::cUniverseSize;
+  int packetDiffs = 0;
+  int firstDiff = -1;
+  for (int step=0; step<cSteps+cSettlePackets; step++) {
+    if (step<cSteps) {
+      switch (aWorkload) {
+        case random_changes: {
+          if (rand_r(&seed)%10<3) {
+            int k = rand_r(&seed)%20;
+            while (k-->0) universe[rand_r(&seed)%n] = rand_r(&seed)%256;
+          }
+          break;
+        }
+        case drifting_changes: {
+          for (int k=0; k<10; k++) {
+            int c = rand_r(&seed)%n;
+            int v = universe[c]+(int)(rand_r(&seed)%9)-4;
+            universe[c] = v<0 ? 0 : (v>255 ? 255 : v);
+          }
+          break;
+        }
+        case grouped_changes: {
+          int ch = rand_r(&seed)%8;
+          uint8_t v = rand_r(&seed)%256;
+          int l0 = rand_r(&seed)%P44BTDMXsender::cNumLights;
+          int nl = rand_r(&seed)%20;
+          for (int l=l0; l<l0+nl && l<P44BTDMXsender::cNumLights; l++) universe[l*8+ch] = v;
+          break;
+        }
+      }
+      for (int c=0; c<n; c++) sender->setChannel(c, universe[c]);
+    }
+    string adv = sender->generateBTAdvMfgData(31);
+    HostSim::advance(cPacketInterval);
+    if ((int)(rand_r(&seed)%100)<aLossPercent) continue;
+    once.deliver(adv);
+    for (int d=0; d<3; d++) thrice.deliver(adv);
+    for (int c=0; c<n; c++) {
+      if (once.channel(c)!=thrice.channel(c)) {
+        packetDiffs++;
+        if (firstDiff<0) firstDiff = step;
+        break;
+      }
+    }
+  }
+  int mismatches = once.differences(universe, n);
+  int dupMismatches = thrice.differences(universe, n);
+  bool ok = packetDiffs==0 && mismatches==0 && dupMismatches==0;
+  printf("%s %-24s %-9s loss %2d%%: %d/%d channels off at end, duplicates differ after %d packets",
+    ok ? "ok  " : "FAIL", aConfig.name, cWorkloadNames[aWorkload], aLossPercent, mismatches, dupMismatches, packetDiffs
+  );
+  if (firstDiff>=0) printf(" (first at #%d)", firstDiff);
+  printf("\n");
+  return ok ? 0 : 1;
+}
+
+
+static int fecTimeBase(MLMicroSeconds aTimeBaseInterval)
+{
+  unsigned seed = 7;
+  P44BTDMXsenderPtr sender = new P44BTDMXsender;
+  sender->setInitialRepeatCount(1);
+  sender->setExtendedCommands(true);
+  sender->setFecGroupSize(4);
+  sender->setTimeBaseInterval(aTimeBaseInterval);
+  TestReceiver rx;
+  uint8_t universe[P44BTDMXsender::cUniverseSize];
+  memset(universe, 0, sizeof(universe));
+  const int n = P44BTDMXsender::cUniverseSize;
+  for (int step=0; step<cSteps+1000; step++) {
+    // enough changes to fill every packet while they last
+    if (step<cSteps) {
+      for (int k=0; k<10; k++) universe[rand_r(&seed)%n] = rand_r(&seed)%256;
+      sender->setChannels(0, n, universe);
+    }
+    string adv = sender->generateBTAdvMfgData(31);
+    HostSim::advance(cPacketInterval);
+    if (step%5==1) continue; // the second packet of every group (including its parity)
+    rx.deliver(adv);
+  }
+  int mismatches = rx.differences(universe, n);
+  printf("%s FEC4, time base every %3lldmS, 1 of 5 lost: %d channels off at end\n",
+    mismatches==0 ? "ok  " : "FAIL", (long long)(aTimeBaseInterval/MilliSecond), mismatches
+  );
+  return mismatches==0 ? 0 : 1;
+}
+
+
+static int pageSettings()
+{
+  P44BTDMXsenderPtr sender = new P44BTDMXsender;
+  sender->setNumPages(3);
+  sender->setDeadband(2);
+  sender->setChannelPriorityClass(4, 2);
+  sender->setFineChannels(0x08);
+  sender->setLightPriorityClass(5, 1, 3);
+  int bad = 0;
+  for (int p=1; p<sender->getNumPages(); p++) {
+    P44BTDMXsenderPtr page = sender->getPage(p);
+    if (page->getDeadband()!=2 || page->getPriorityClass(-1, 4)!=2 || page->getFineChannels()!=0x08) bad++;
+    if (page->getPriorityClass(5, 1)>=0) bad++; // light specific classes are per page
+  }
+  printf("%s settings changed after setNumPages(): %d of %d pages not updated\n", bad==0 ? "ok  " : "FAIL", bad, sender->getNumPages()-1);
+  return bad==0 ? 0 : 1;
+}
+
+
+static int sequenceStats()
+{
+  uint8_t universe[P44BTDMXsender::cUniverseSize];
+  memset(universe, 0, sizeof(universe));
+  P44BTDMXsenderPtr a = new P44BTDMXsender;
+  P44BTDMXsenderPtr b = new P44BTDMXsender;
+  a->setSourceId(1);
+  b->setSourceId(2);
+  for (P44BTDMXsenderPtr s : { a, b }) {
+    s->setRefreshUniverse(true);
+    s->setSequenceNumbers(true);
+    s->setChannels(0, P44BTDMXsender::cUniverseSize, universe);
+  }
+  TestReceiver rx;
+  std::vector<string> pa, pb;
+  while (pa.size()<80) {
+    // (only packets actually sent get a sequence number)
+    string adv = a->generateBTAdvMfgData(31);
+    if (!adv.empty()) pa.push_back(adv);
+    adv = b->generateBTAdvMfgData(31);
+    if (!adv.empty()) pb.push_back(adv);
+  }
+  int bad = 0;
+  P44BTDMXreceiver::SequenceStats st;
+  // source 1: #1 lost, #3 late (counted as lost first)
+  rx.deliver(pa[0]); rx.deliver(pa[2]); rx.deliver(pa[4]); rx.deliver(pa[3]);
+  rx.mReceiver->getSequenceStats(st);
+  if (st.lost!=1 || st.late!=1) bad++;
+  // source 1: jump too large for losses (resync), then the number before it arrives late
+  rx.deliver(pa[75]); rx.deliver(pa[74]);
+  rx.mReceiver->getSequenceStats(st);
+  if (st.lost!=1 || st.late!=2 || st.resyncs!=1) bad++;
+  // source 2: late right after its first packet, never counted as lost
+  rx.deliver(pb[1]); rx.deliver(pb[0]);
+  rx.mReceiver->getSequenceStats(st);
+  if (st.lost!=1 || st.late!=3) bad++;
+  printf("%s sequence statistics: %d of 3 steps with wrong lost/late counts (lost %d, late %d)\n",
+    bad==0 ? "ok  " : "FAIL", bad, (int)st.lost, (int)st.late
+  );
+  return bad==0 ? 0 : 1;
+}
+
+
+static int fadeWithoutTimestamp()
+{
+  P44BTDMXsenderPtr sender = new P44BTDMXsender;
+  sender->setRefreshUniverse(true);
+  sender->setFadeDetection(true);
+  TestReceiver rx;
+  uint8_t universe[P44BTDMXsender::cUniverseSize];
+  memset(universe, 0, sizeof(universe));
+  const int ch = 2; // brightness of light 0
+  // linear ramp, detected as a fade
+  for (int step=0; step<25; step++) {
+    universe[ch] = step*8;
+    sender->setChannels(0, P44BTDMXsender::cUniverseSize, universe, MainLoop::now());
+    rx.deliver(sender->generateBTAdvMfgData(31));
+    HostSim::advance(cPacketInterval);
+  }
+  // jump without timestamp, then no more input
+  universe[ch] = 10;
+  sender->setChannels(0, P44BTDMXsender::cUniverseSize, universe);
+  for (int step=0; step<100; step++) {
+    rx.deliver(sender->generateBTAdvMfgData(31));
+    HostSim::advance(cPacketInterval);
+  }
+  bool ok = rx.channel(ch)==10;
+  printf("%s fade ended by setChannels() without timestamp: receiver at %d, expected 10\n", ok ? "ok  " : "FAIL", rx.channel(ch));
+  return ok ? 0 : 1;
+}
+
+
+int main(int argc, char **argv)
+{
+  int failures = 0;
+  failures += fadeWithoutTimestamp();
+  failures += sequenceStats();
+  failures += pageSettings();
+  failures += fecTimeBase(0);
+  failures += fecTimeBase(70*MilliSecond); // falls due on every packet of a group in turn, including the parity
+  for (const SenderConfig& cfg : cConfigs) {
+    for (int w=0; w<numWorkloads; w++) {
+      failures += run(cfg, w, 0);
+      failures += run(cfg, w, 20);
+    }
+  }
+  return failures ? 1 : 0;
+}
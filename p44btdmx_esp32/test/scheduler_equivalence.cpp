@@ -0,0 +1,51 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+
+// Scheduler equivalence test
+// - runs the SenderScenarios workloads on the baseline sender and on the current sender
+//   with its default settings (age scheduling, age index, no extended features)
+// - the generated advertisement packets must be byte-identical, packet by packet
+
+#include "p44btdmx.hpp"
+#include "baseline_sender.hpp"
+#include "sender_scenarios.hpp"
+
+using namespace p44;
+
+static const int cPackets = 5000;
+static const uint32_t cSeeds[] = { 1, 2, 3, 42 };
+
+
+int main(int argc, char **argv)
+{
+  int failures = 0;
+  for (int sc=0; sc<SenderScenarios::numScenarios; sc++) {
+    for (uint32_t seed : cSeeds) {
+      std::vector<string> expected;
+      BaselineSender::run(sc, seed, cPackets, &expected);
+      std::vector<string> actual;
+      P44BTDMXsenderPtr sender = new P44BTDMXsender;
+      SenderScenarios::run(*sender, sc, seed, cPackets, [&](const string& aPacket) { actual.push_back(aPacket); });
+      size_t sent = 0;
+      size_t first = 0;
+      for (first=0; first<expected.size(); first++) {
+        if (expected[first]!=actual[first]) break;
+        if (!expected[first].empty()) sent++;
+      }
+      if (first<expected.size()) {
+        failures++;
+        printf("FAIL %-16s seed %2u: packet #%zu differs\n  baseline: %s\n  current:  %s\n",
+          SenderScenarios::name(sc), seed, first,
+          binaryToHexString(expected[first], ' ').c_str(), binaryToHexString(actual[first], ' ').c_str()
+        );
+      }
+      else {
+        printf("ok   %-16s seed %2u: %zu packets identical (%zu non-empty)\n", SenderScenarios::name(sc), seed, expected.size(), sent);
+      }
+    }
+  }
+  return failures ? 1 : 0;
+}
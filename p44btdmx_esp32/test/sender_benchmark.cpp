@@ -0,0 +1,75 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+
+// Sender benchmark
+// - runs the SenderScenarios workloads on the baseline sender and on the current sender
+//   with default settings (which generate identical packets, see scheduler_equivalence)
+// - reports host time and, on x86, TSC cycles per generated packet, best of several runs
+// - absolute numbers are host numbers, only the ratio carries over to the ESP32
+
+#include "p44btdmx.hpp"
+#include "baseline_sender.hpp"
+#include "sender_scenarios.hpp"
+
+#include <chrono>
+#if defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h>
+  #define HAS_TSC 1
+#else
+  #define HAS_TSC 0
+#endif
+
+using namespace p44;
+
+static const int cPackets = 20000;
+static const int cRuns = 5;
+
+
+typedef struct {
+  double ns; ///< nanoseconds per packet
+  double cycles; ///< TSC cycles per packet, 0 if not available
+} Cost;
+
+
+template<class Fn> static Cost measure(Fn aFn)
+{
+  Cost best = { 1e99, 1e99 };
+  for (int r=0; r<cRuns; r++) {
+    #if HAS_TSC
+    uint64_t c0 = __rdtsc();
+    #endif
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    aFn();
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now()-t0).count();
+    #if HAS_TSC
+    double cycles = (double)(__rdtsc()-c0);
+    #else
+    double cycles = 0;
+    #endif
+    if (ns/cPackets<best.ns) best.ns = ns/cPackets;
+    if (cycles/cPackets<best.cycles) best.cycles = cycles/cPackets;
+  }
+  return best;
+}
+
+
+int main(int argc, char **argv)
+{
+  printf("%d packets per run, best of %d runs, per packet:\n", cPackets, cRuns);
+  printf("%-16s | %10s %10s | %10s %10s | %7s\n", "scenario", "base ns", "base cyc", "curr ns", "curr cyc", "speedup");
+  for (int sc=0; sc<SenderScenarios::numScenarios; sc++) {
+    volatile size_t sink = 0; // keep the compiler from dropping the work
+    Cost base = measure([&]() { sink += BaselineSender::run(sc, 1, cPackets, NULL); });
+    Cost curr = measure([&]() {
+      P44BTDMXsenderPtr sender = new P44BTDMXsender;
+      size_t bytes = 0;
+      SenderScenarios::run(*sender, sc, 1, cPackets, [&](const string& aPacket) { bytes += aPacket.size(); });
+      sink += bytes;
+    });
+    printf("%-16s | %10.0f %10.0f | %10.0f %10.0f | %6.2fx\n", SenderScenarios::name(sc), base.ns, base.cycles, curr.ns, curr.cycles, base.ns/curr.ns);
+  }
+  return 0;
+}
@@ -0,0 +1,111 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+
+// Deterministic DMX workloads for the sender, shared by the equivalence test and the benchmark.
+// The scenarios only use the sender API the baseline already had, so the same template
+// can drive the baseline sender (namespace p44baseline) and the current one (namespace p44).
+
+#ifndef __p44btdmx_test__sender_scenarios__
+#define __p44btdmx_test__sender_scenarios__
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <string.h>
+
+namespace SenderScenarios {
+
+  enum {
+    sparse_refresh, ///< a few random channels change now and then, universe refresh on
+    sparse_norefresh, ///< same, without universe refresh
+    mixed, ///< sparse changes, bursts, brightness fades, resets, repeat count changes, varying packet sizes
+    frames, ///< full DMX frames via setChannels, random changes, reset halfway
+    fades, ///< many brightness channels fading continuously
+    overload, ///< every channel changes every packet
+    idle, ///< one initial look, then nothing changes any more
+    numScenarios
+  };
+
+  inline const char* name(int aScenario)
+  {
+    static const char* names[numScenarios] = { "sparse_refresh", "sparse_norefresh", "mixed", "frames", "fades", "overload", "idle" };
+    return aScenario>=0 && aScenario<numScenarios ? names[aScenario] : "?";
+  }
+
+  /// small deterministic PRNG, so results do not depend on the platform's rand()
+  class Rnd
+  {
+    uint32_t mState;
+  public:
+    Rnd(uint32_t aSeed) : mState(aSeed*2654435761u+1) {}
+    uint32_t operator()(uint32_t aRange) { mState = mState*1664525u+1013904223u; return (mState>>8)%aRange; }
+  };
+
+  /// run a scenario
+  /// @param aSender the sender (baseline or current)
+  /// @param aScenario the scenario
+  /// @param aSeed random seed
+  /// @param aPackets number of packets to generate
+  /// @param aSink called with every generated advertisement packet (empty when there was nothing to send)
+  template<class Sender, class Sink> void run(Sender& aSender, int aScenario, uint32_t aSeed, int aPackets, Sink aSink)
+  {
+    Rnd rnd(aSeed);
+    const int universe = Sender::cUniverseSize;
+    uint8_t dmx[512]; // a DMX frame, the p44BTDMX universe (cUniverseSize) is larger
+    memset(dmx, 0, sizeof(dmx));
+    aSender.setRefreshUniverse(aScenario!=sparse_norefresh);
+    if (aScenario==idle) {
+      for (int i=0; i<512; i++) dmx[i] = rnd(256);
+      aSender.setChannels(0, 512, dmx);
+    }
+    for (int p=0; p<aPackets; p++) {
+      int maxBytes = 31;
+      switch (aScenario) {
+        case sparse_refresh:
+        case sparse_norefresh: {
+          uint32_t r = rnd(10);
+          int n = r<3 ? rnd(40) : (r<5 ? 1 : 0);
+          for (int k=0; k<n; k++) aSender.setChannel(rnd(universe), rnd(256));
+          break;
+        }
+        case mixed: {
+          uint32_t r = rnd(100);
+          if (r<30) { dmx[rnd(512)] = rnd(256); }
+          else if (r<35) { int b = rnd(400); int n = rnd(100); for (int i=0; i<n; i++) dmx[(b+i)%512] = rnd(256); }
+          else if (r<50) { for (int i=0; i<40; i++) dmx[(i*8+2)%512]++; }
+          else if (r==51 && rnd(10)==0) { aSender.reset(); }
+          else if (r==52 && rnd(20)==0) { aSender.setInitialRepeatCount(rnd(6)); }
+          aSender.setChannels(0, 512, dmx);
+          if (rnd(4)==0) maxBytes = 24+rnd(8);
+          break;
+        }
+        case frames: {
+          int n = rnd(10)<4 ? rnd(30) : 0;
+          for (int k=0; k<n; k++) dmx[rnd(512)] = rnd(256);
+          aSender.setChannels(0, 512, dmx);
+          if (p==aPackets/2) aSender.reset();
+          break;
+        }
+        case fades: {
+          for (int i=2; i<512; i+=8) dmx[i] = (uint8_t)(p+i);
+          aSender.setChannels(0, 512, dmx);
+          break;
+        }
+        case overload: {
+          for (int i=0; i<512; i++) dmx[i] = rnd(256);
+          aSender.setChannels(0, 512, dmx);
+          break;
+        }
+        default:
+          break;
+      }
+      aSink(aSender.generateBTAdvMfgData(maxBytes));
+    }
+  }
+
+} // namespace SenderScenarios
+
+#endif // __p44btdmx_test__sender_scenarios__
@@ -0,0 +1,63 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+
+// A receiver with lights for the entire p44BTDMX universe, to check what the sender's packets deliver
+
+#ifndef __p44btdmx_test__test_receiver__
+#define __p44btdmx_test__test_receiver__
+
+#include "p44btdmx.hpp"
+
+#include <vector>
+
+namespace p44 {
+
+  class TestReceiver
+  {
+  public:
+
+    P44BTDMXreceiverPtr mReceiver;
+    std::vector<P44DMXLightPtr> mLights;
+
+    TestReceiver(int aNumLights = P44BTDMXsender::cNumLights)
+    {
+      mReceiver = new P44BTDMXreceiver;
+      for (int i=0; i<aNumLights; i++) {
+        P44DMXLightPtr light = new P44DMXLight;
+        mLights.push_back(light);
+        mReceiver->addLight(light);
+      }
+    }
+
+    /// deliver an advertisement as generated by P44BTDMXsender::generateBTAdvMfgData()
+    /// @param aAdvData the raw advertisement data, starting with the AD structure's length and type
+    /// @return true if the receiver accepted the packet
+    bool deliver(const string aAdvData)
+    {
+      if (aAdvData.size()<2) return false;
+      return mReceiver->processBTAdvMfgData(aAdvData.substr(2), MainLoop::now()); // scan reports start with the company ID
+    }
+
+    /// @param aDMXChannel universe channel index
+    /// @return value of the channel at the receiver
+    uint8_t channel(int aDMXChannel)
+    {
+      return mLights[aDMXChannel/P44BTDMXbase::cLightChannels]->getChannel(aDMXChannel%P44BTDMXbase::cLightChannels);
+    }
+
+    /// @return number of universe channels that differ from aExpected
+    int differences(const uint8_t* aExpected, int aNumChannels)
+    {
+      int n = 0;
+      for (int i=0; i<aNumChannels; i++) if (channel(i)!=aExpected[i]) n++;
+      return n;
+    }
+
+  };
+
+} // namespace p44
+
+#endif // __p44btdmx_test__test_receiver__
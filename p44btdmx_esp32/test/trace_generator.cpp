@@ -0,0 +1,121 @@
+//
+//  Copyright (c) 2020 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+
+// Generates the DMX trace fixtures in traces/ (make traces)
+// - the shows are synthesized, modelled after typical light desk programs for p44BTDMX
+//   receivers (8 channels per light: H, S, B, position, size, speed, gradient, mode)
+// - frames at the DMX rate of 44Hz, 10 seconds each
+// - traces captured from a real DMX desk in the same format can be dropped into traces/ as well
+
+#include "dmx_trace.hpp"
+
+#include <math.h>
+
+static const int cFrameMs = 23; // ~44Hz DMX frame rate
+static const int cFrames = 10000/cFrameMs;
+
+enum { hue, sat, bri, pos, size, speed, gradient, mode };
+
+typedef void (*ShowFn)(int aFrame, uint8_t* aDMX);
+
+
+/// brightness chase over 24 lights, a new light every 250mS, decaying over 400mS.
+/// Hues step to the next color every 4 seconds.
+static void chase(int aFrame, uint8_t* aDMX)
+{
+  int t = aFrame*cFrameMs;
+  for (int l=0; l<24; l++) {
+    uint8_t* light = aDMX+l*8;
+    int sinceHit = (t-((l*250)%(24*250))+24*250*10)%(24*250); // mS since this light was hit
+    light[bri] = sinceHit<400 ? (uint8_t)(255-sinceHit*255/400) : 0;
+    light[hue] = (uint8_t)((t/4000)*42+l*3);
+    light[sat] = 255;
+    light[mode] = 2;
+    light[size] = 128;
+  }
+}
+
+
+/// slow color wash over 16 lights, hues rotating with an offset per light, breathing brightness
+static void colorwash(int aFrame, uint8_t* aDMX)
+{
+  double t = aFrame*cFrameMs/1000.0;
+  for (int l=0; l<16; l++) {
+    uint8_t* light = aDMX+l*8;
+    light[hue] = (uint8_t)((int)(t*20)+l*16);
+    light[sat] = (uint8_t)(200+55*sin(t*0.7+l));
+    light[bri] = (uint8_t)(128+100*sin(t*1.5+l*0.4));
+    light[mode] = 3;
+    light[size] = 200;
+    light[gradient] = 160;
+  }
+}
+
+
+/// busy show over all 64 lights: beat flashes, position sweeps, size and mode changes
+static void busy(int aFrame, uint8_t* aDMX)
+{
+  int t = aFrame*cFrameMs;
+  int beat = t/500;
+  for (int l=0; l<64; l++) {
+    uint8_t* light = aDMX+l*8;
+    // flash on every beat for one group of lights, fading out in 200mS
+    int sinceBeat = t%500;
+    bool hit = (beat+l)%4==0;
+    light[bri] = hit && sinceBeat<200 ? (uint8_t)(255-sinceBeat) : 40;
+    light[hue] = (uint8_t)((beat/8)*64+(l/16)*32);
+    light[sat] = l%2 ? 255 : 128;
+    if (l<16) {
+      // moving lights: position sweeps back and forth over 3 seconds
+      int ph = (t+l*100)%3000;
+      light[pos] = (uint8_t)(ph<1500 ? ph*255/1500 : (3000-ph)*255/1500);
+      light[size] = 64;
+      light[mode] = 1;
+    }
+    else {
+      light[size] = (uint8_t)(((beat/2)%4)*64+32);
+      light[speed] = 100;
+      light[mode] = (uint8_t)(4+(beat/16+l)%3);
+    }
+  }
+}
+
+
+static void generate(const char* aPath, const char* aDescription, ShowFn aShow)
+{
+  FILE* f = fopen(aPath, "w");
+  if (!f) { fprintf(stderr, "cannot write %s\n", aPath); exit(1); }
+  fprintf(f, "# %s\n", aDescription);
+  fprintf(f, "# synthesized by trace_generator.cpp, format see dmx_trace.hpp\n");
+  uint8_t prev[512];
+  uint8_t dmx[512];
+  memset(prev, 0, sizeof(prev));
+  memset(dmx, 0, sizeof(dmx));
+  for (int fr=0; fr<cFrames; fr++) {
+    aShow(fr, dmx);
+    std::string line;
+    for (int i=0; i<512; i++) {
+      if (dmx[i]!=prev[i]) {
+        char buf[16];
+        snprintf(buf, sizeof(buf), " %d:%d", i+1, dmx[i]);
+        line += buf;
+        prev[i] = dmx[i];
+      }
+    }
+    if (!line.empty()) fprintf(f, "%d%s\n", fr*cFrameMs, line.c_str());
+  }
+  fclose(f);
+}
+
+
+int main(int argc, char **argv)
+{
+  std::string dir = argc>1 ? argv[1] : "traces";
+  generate((dir+"/chase.trace").c_str(), "brightness chase over 24 lights, hue steps every 4 seconds", chase);
+  generate((dir+"/colorwash.trace").c_str(), "slow color wash over 16 lights with breathing brightness", colorwash);
+  generate((dir+"/busy.trace").c_str(), "busy show over 64 lights: beat flashes, position sweeps, size and mode changes", busy);
+  return 0;
+}